@@ -0,0 +1,240 @@
+/**
+ * codec_bench.c
+ *
+ * Microbenchmark for src/codec.c against the byte-at-a-time code it
+ * replaced: Variable Byte Integer decode and encode over a mix of
+ * remaining lengths like a broker sees (mostly one and two bytes), and
+ * topic validation over ASCII and UTF-8 topics of several lengths with
+ * the scalar and the SIMD paths. Each case runs on the same inputs and
+ * prints nanoseconds per operation.
+ *
+ * Usage: codec_bench [-n rounds]
+ */
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "codec.h"
+
+#define VARINTS 4096
+#define TOPICS 256
+#define TOPIC_MAX 512
+
+static volatile uint64_t sink;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// ---------------------------------------------------------------------
+// The previous implementations
+// ---------------------------------------------------------------------
+
+__attribute__((noinline))
+static int legacy_decode(const unsigned char *buf, int *len) {
+    int multiplier = 1;
+    int value = 0;
+    int i = 0;
+    unsigned char encoded;
+
+    do {
+        encoded = buf[i];
+        value += (encoded & 127) * multiplier;
+        multiplier *= 128;
+        i++;
+        if (i > 4) return -1;
+    } while ((encoded & 128) != 0);
+
+    *len = value;
+    return i;
+}
+
+__attribute__((noinline))
+static int legacy_encode(unsigned char *buf, int len) {
+    int i = 0;
+    do {
+        unsigned char encoded = len % 128;
+        len /= 128;
+        if (len > 0) encoded |= 128;
+        buf[i++] = encoded;
+    } while (len > 0);
+    return i;
+}
+
+/* Wildcards and NUL only: the old check did not validate UTF-8 at all. */
+__attribute__((noinline))
+static bool legacy_topic_valid(const char *name, size_t len) {
+    if (len == 0) return false;
+    for (size_t i = 0; i < len; i++) {
+        if (name[i] == '+' || name[i] == '#' || name[i] == '\0') return false;
+    }
+    return true;
+}
+
+// ---------------------------------------------------------------------
+// Inputs
+// ---------------------------------------------------------------------
+
+static uint32_t rng_state = 2463534242u;
+
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+/* 70% one byte, 25% two, 5% three or four. */
+static uint32_t pick_length(void) {
+    uint32_t r = rng() % 100;
+    if (r < 70) return rng() % 128;
+    if (r < 95) return 128 + rng() % (16384 - 128);
+    return 16384 + rng() % (CODEC_VARINT_MAX - 16384);
+}
+
+typedef struct {
+    uint8_t data[TOPIC_MAX];
+    size_t len;
+} TopicInput;
+
+static void make_topic(TopicInput *t, size_t len, bool utf8) {
+    static const char *words[] = {"sensors", "building-12", "floor", "room", "temperature", "status", "device"};
+    static const char *wide[] = {"température", "温度", "датчик", "😀"};
+    t->len = 0;
+    while (t->len < len) {
+        const char *w = utf8 && rng() % 3 == 0 ? wide[rng() % 4] : words[rng() % 7];
+        size_t n = strlen(w);
+        if (t->len + n + 1 > len) break;
+        if (t->len) t->data[t->len++] = '/';
+        memcpy(&t->data[t->len], w, n);
+        t->len += n;
+    }
+}
+
+// ---------------------------------------------------------------------
+// Cases
+// ---------------------------------------------------------------------
+
+static void report(const char *name, uint64_t ns, uint64_t ops, double baseline) {
+    double per = (double)ns / (double)ops;
+    if (baseline > 0) printf("  %-28s %8.2f ns/op  %5.2fx\n", name, per, baseline / per);
+    else printf("  %-28s %8.2f ns/op\n", name, per);
+}
+
+static void bench_varint(int rounds) {
+    static uint32_t values[VARINTS];
+    static uint8_t encoded[VARINTS * 4];
+    static size_t offsets[VARINTS];
+    uint8_t out[4 * VARINTS];
+    size_t pos = 0;
+
+    for (int i = 0; i < VARINTS; i++) {
+        values[i] = pick_length();
+        offsets[i] = pos;
+        pos += codec_varint_encode(&encoded[pos], values[i]);
+    }
+    uint64_t ops = (uint64_t)rounds * VARINTS;
+    uint64_t acc = 0;
+
+    printf("Variable Byte Integer (%d values, 70/25/5%% one/two/more bytes)\n", VARINTS);
+
+    uint64_t t0 = now_ns();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < VARINTS; i++) {
+            int v;
+            acc += (uint64_t)legacy_decode(&encoded[offsets[i]], &v) + (uint64_t)v;
+        }
+    }
+    uint64_t legacy = now_ns() - t0;
+    report("decode, byte loop", legacy, ops, 0);
+
+    t0 = now_ns();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < VARINTS; i++) {
+            uint32_t v;
+            acc += (uint64_t)codec_varint_decode(&encoded[offsets[i]], sizeof(encoded) - offsets[i], &v) + v;
+        }
+    }
+    report("decode, codec", now_ns() - t0, ops, (double)legacy / (double)ops);
+
+    t0 = now_ns();
+    for (int r = 0; r < rounds; r++) {
+        size_t p = 0;
+        for (int i = 0; i < VARINTS; i++) p += (size_t)legacy_encode(&out[p], (int)values[i]);
+        acc += p + out[r % p];
+    }
+    legacy = now_ns() - t0;
+    report("encode, byte loop", legacy, ops, 0);
+
+    t0 = now_ns();
+    for (int r = 0; r < rounds; r++) {
+        size_t p = 0;
+        for (int i = 0; i < VARINTS; i++) p += codec_varint_encode(&out[p], values[i]);
+        acc += p + out[r % p];
+    }
+    report("encode, codec", now_ns() - t0, ops, (double)legacy / (double)ops);
+
+    sink = acc;
+}
+
+static void bench_topics(int rounds, size_t len, bool utf8) {
+    static TopicInput topics[TOPICS];
+    for (int i = 0; i < TOPICS; i++) make_topic(&topics[i], len, utf8);
+
+    int iters = rounds / 4 > 0 ? rounds / 4 : 1;
+    uint64_t ops = (uint64_t)iters * TOPICS;
+    uint64_t acc = 0;
+
+    printf("Topic validation (~%zu bytes, %s)\n", len, utf8 ? "UTF-8" : "ASCII");
+
+    uint64_t t0 = now_ns();
+    for (int r = 0; r < iters; r++) {
+        for (int i = 0; i < TOPICS; i++) acc += legacy_topic_valid((const char *)topics[i].data, topics[i].len);
+    }
+    report("wildcard scan only (old)", now_ns() - t0, ops, 0);
+
+    t0 = now_ns();
+    for (int r = 0; r < iters; r++) {
+        for (int i = 0; i < TOPICS; i++) acc += codec_topic_valid_scalar(topics[i].data, topics[i].len);
+    }
+    uint64_t scalar = now_ns() - t0;
+    report("UTF-8 + wildcards, scalar", scalar, ops, 0);
+
+    t0 = now_ns();
+    for (int r = 0; r < iters; r++) {
+        for (int i = 0; i < TOPICS; i++) acc += codec_topic_valid(topics[i].data, topics[i].len);
+    }
+    report("UTF-8 + wildcards, SIMD", now_ns() - t0, ops, (double)scalar / (double)ops);
+
+    if (acc != 3 * ops) fprintf(stderr, "warning: a generated topic was rejected\n");
+    sink = acc;
+}
+
+int main(int argc, char **argv) {
+    int rounds = 2000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+            case 'n': rounds = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-n rounds]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (rounds <= 0) rounds = 1;
+
+    bench_varint(rounds);
+    bench_topics(rounds, 24, false);
+    bench_topics(rounds, 64, false);
+    bench_topics(rounds, 256, false);
+    bench_topics(rounds, 64, true);
+    return 0;
+}
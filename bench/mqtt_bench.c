@@ -0,0 +1,835 @@
+/**
+ * mqtt_bench.c
+ *
+ * Load generator and end-to-end latency benchmark for the broker.
+ *
+ * Opens `topics x fanout` subscribers and `publishers` publishers over
+ * TCP, spread across worker threads that each run their own epoll loop,
+ * then publishes at a fixed rate per publisher (or as fast as the
+ * sockets take it) for a warmup period and a measured period. Every
+ * message carries the CLOCK_MONOTONIC time it was due to be sent, so
+ * the latency of a delivery includes any time the publisher spent
+ * stalled behind the broker (no coordinated omission). Latencies go into
+ * per-thread log-linear histograms with three significant digits, merged
+ * at the end.
+ *
+ * Subscribers can connect to another port than publishers (-S), which
+ * measures delivery across two nodes of a broker cluster.
+ *
+ * Usage: mqtt_bench [-h host] [-p port] [-S port] [-T threads] [-P publishers]
+ *                   [-t topics] [-f fanout] [-r rate] [-s payload]
+ *                   [-q qos] [-V version] [-w warmup] [-d duration]
+ *                   [-o percentiles_file]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <math.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 256
+#define READ_CHUNK 65536
+#define OUT_LIMIT 65536             /* a publisher stops generating while this much is unsent */
+#define MAX_BURST 64                /* messages a late publisher catches up on per loop iteration */
+#define READY_TIMEOUT_NS 30000000000ull
+#define DRAIN_NS 1000000000ull      /* how long deliveries are awaited after the last publish */
+#define TIMESTAMP_LEN 8
+
+/* Histogram: 2^(HIST_PRECISION - 1) linear sub-buckets per power of two, values in ns up to 2^40. */
+#define HIST_PRECISION 11
+#define HIST_HALF (1 << (HIST_PRECISION - 1))
+#define HIST_MAX_SHIFT 30
+#define HIST_BUCKETS ((HIST_MAX_SHIFT + 2) * HIST_HALF)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+} Histogram;
+
+typedef struct {
+    const char *host;
+    const char *port;
+    const char *sub_port;       /* subscribers' port, NULL for `port` */
+    int threads;
+    int publishers;
+    int topics;
+    int fanout;
+    double rate;                /* messages per second per publisher, 0 for unthrottled */
+    int payload;
+    int qos;
+    int version;
+    double warmup;
+    double duration;
+    const char *percentiles;
+} Options;
+
+typedef struct {
+    uint8_t *data;
+    size_t off;
+    size_t len;
+    size_t cap;
+} Buffer;
+
+enum { CONN_CONNECTING, CONN_SUBSCRIBING, CONN_READY, CONN_CLOSED };
+
+typedef struct {
+    int fd;
+    int state;
+    bool publisher;
+    int index;                  /* among publishers or subscribers */
+    int topic;                  /* subscriber: its topic; publisher: the next one it publishes to */
+    uint16_t packet_id;
+    uint64_t next_due;
+    Buffer in;
+    Buffer out;
+} Conn;
+
+typedef struct {
+    pthread_t thread;
+    int epfd;
+    int timerfd;                /* wakes the loop when the next publish is due */
+    Conn *conns;
+    int count;
+    int ready;
+    Histogram hist;
+    uint64_t published;
+    uint64_t delivered;
+    uint64_t acked;
+    uint64_t errors;
+} Worker;
+
+static Options opt = {
+    .host = "127.0.0.1",
+    .port = "8000",
+    .threads = 4,
+    .publishers = 10,
+    .topics = 10,
+    .fanout = 1,
+    .rate = 1000,
+    .payload = 64,
+    .qos = 0,
+    .version = 4,
+    .warmup = 2,
+    .duration = 10,
+};
+
+static struct addrinfo *broker_addr;
+static struct addrinfo *sub_addr;       /* where subscribers connect */
+static char **topic_names;
+static atomic_int ready_conns;
+static atomic_int failed_conns;
+static atomic_bool stopping;
+static _Atomic uint64_t start_ns;       /* 0 until every connection is ready */
+static uint64_t measure_from;
+static uint64_t measure_to;
+static uint64_t interval_ns;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void handle_sigint(int sig) {
+    (void)sig;
+    atomic_store(&stopping, true);
+}
+
+// ---------------------------------------------------------------------
+// Histogram
+// ---------------------------------------------------------------------
+
+static int hist_index(uint64_t v) {
+    int msb = 63 - __builtin_clzll(v | 1);
+    int shift = msb < HIST_PRECISION ? 0 : msb - HIST_PRECISION + 1;
+    if (shift > HIST_MAX_SHIFT) {
+        shift = HIST_MAX_SHIFT;
+        v = ((1ull << HIST_PRECISION) - 1) << shift;
+    }
+    return shift * HIST_HALF + (int)(v >> shift);
+}
+
+/* The highest value that lands in bucket `i`. */
+static uint64_t hist_value(int i) {
+    int shift = i < 2 * HIST_HALF ? 0 : i / HIST_HALF - 1;
+    uint64_t low = (uint64_t)(i - shift * HIST_HALF) << shift;
+    return low + (1ull << shift) - 1;
+}
+
+static void hist_record(Histogram *h, uint64_t v) {
+    h->counts[hist_index(v)]++;
+    if (h->total == 0 || v < h->min) h->min = v;
+    if (v > h->max) h->max = v;
+    h->total++;
+    h->sum += (double)v;
+}
+
+static void hist_merge(Histogram *to, const Histogram *from) {
+    if (from->total == 0) return;
+    for (int i = 0; i < HIST_BUCKETS; i++) to->counts[i] += from->counts[i];
+    if (to->total == 0 || from->min < to->min) to->min = from->min;
+    if (from->max > to->max) to->max = from->max;
+    to->total += from->total;
+    to->sum += from->sum;
+}
+
+static uint64_t hist_percentile(const Histogram *h, double p) {
+    if (h->total == 0) return 0;
+    if (p >= 100.0) return h->max;
+    uint64_t target = (uint64_t)(p / 100.0 * (double)h->total + 0.5);
+    if (target == 0) target = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= target) {
+            uint64_t v = hist_value(i);
+            return v < h->max ? v : h->max;
+        }
+    }
+    return h->max;
+}
+
+/*
+ * The percentile distribution in HdrHistogram's text format (values in
+ * microseconds), so it can go straight into the usual plotting tools.
+ */
+static int hist_write_percentiles(const Histogram *h, const char *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) return -1;
+
+    fprintf(f, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+    const int ticks = 5;
+    for (int level = 0; h->total > 0; level++) {
+        double from = 100.0 - 100.0 / (double)(1ull << level);
+        double step = 100.0 / (double)(1ull << (level + 1)) / ticks;
+        for (int t = 0; t < ticks; t++) {
+            double p = from + step * t;
+            uint64_t v = hist_percentile(h, p);
+            uint64_t count = 0;
+            for (int i = 0; i < HIST_BUCKETS && hist_value(i) <= v; i++) count += h->counts[i];
+            fprintf(f, "%12.3f %2.12f %10llu %14.2f\n", (double)v / 1000.0, p / 100.0, (unsigned long long)count,
+                    100.0 / (100.0 - p));
+        }
+        if ((double)(1ull << level) > (double)h->total || level == 62) break;
+    }
+    fprintf(f, "%12.3f %2.12f %10llu\n", (double)h->max / 1000.0, 1.0, (unsigned long long)h->total);
+
+    double mean = h->total ? h->sum / (double)h->total : 0.0, variance = 0.0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        double d = (double)hist_value(i) - mean;
+        variance += (double)h->counts[i] * d * d;
+    }
+    if (h->total) variance /= (double)h->total;
+    fprintf(f, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", mean / 1000.0, sqrt(variance) / 1000.0);
+    fprintf(f, "#[Max     = %12.3f, Total count    = %12llu]\n", (double)h->max / 1000.0,
+            (unsigned long long)h->total);
+    return fclose(f);
+}
+
+// ---------------------------------------------------------------------
+// Packets
+// ---------------------------------------------------------------------
+
+static uint8_t *buffer_reserve(Buffer *b, size_t n) {
+    if (b->off > 0 && b->off == b->len) b->off = b->len = 0;
+    if (b->len + n > b->cap) {
+        size_t cap = b->cap ? b->cap : 1024;
+        while (cap < b->len + n) cap *= 2;
+        uint8_t *data = realloc(b->data, cap);
+        if (!data) return NULL;
+        b->data = data;
+        b->cap = cap;
+    }
+    uint8_t *p = b->data + b->len;
+    b->len += n;
+    return p;
+}
+
+static size_t put_varint(uint8_t *p, size_t v) {
+    size_t n = 0;
+    do {
+        uint8_t byte = v % 128;
+        v /= 128;
+        p[n++] = byte | (v > 0 ? 0x80 : 0);
+    } while (v > 0);
+    return n;
+}
+
+static size_t varint_len(size_t v) {
+    return v < 128 ? 1 : v < 16384 ? 2 : v < 2097152 ? 3 : 4;
+}
+
+static uint8_t *put_string(uint8_t *p, const char *s, size_t len) {
+    *p++ = (uint8_t)(len >> 8);
+    *p++ = (uint8_t)len;
+    memcpy(p, s, len);
+    return p + len;
+}
+
+/* Starts a packet of `remaining` bytes after its fixed header; NULL when out of memory. */
+static uint8_t *begin_packet(Conn *c, uint8_t type, size_t remaining) {
+    uint8_t *p = buffer_reserve(&c->out, 1 + varint_len(remaining) + remaining);
+    if (!p) return NULL;
+    *p++ = type;
+    return p + put_varint(p, remaining);
+}
+
+static void queue_connect(Conn *c, const char *client_id) {
+    size_t id_len = strlen(client_id);
+    bool v5 = opt.version == 5;
+    uint8_t *p = begin_packet(c, 0x10, 10 + v5 + 2 + id_len);
+    if (!p) return;
+    p = put_string(p, "MQTT", 4);
+    *p++ = (uint8_t)opt.version;
+    *p++ = 0x02;                /* clean session */
+    *p++ = 0;                   /* no keep alive */
+    *p++ = 0;
+    if (v5) *p++ = 0;           /* no properties */
+    put_string(p, client_id, id_len);
+}
+
+static void queue_subscribe(Conn *c) {
+    const char *topic = topic_names[c->topic];
+    size_t len = strlen(topic);
+    bool v5 = opt.version == 5;
+    uint8_t *p = begin_packet(c, 0x82, 2 + v5 + 2 + len + 1);
+    if (!p) return;
+    *p++ = 0;
+    *p++ = 1;
+    if (v5) *p++ = 0;
+    p = put_string(p, topic, len);
+    *p = (uint8_t)opt.qos;
+}
+
+static void queue_puback(Conn *c, uint16_t packet_id) {
+    uint8_t *p = begin_packet(c, 0x40, 2);
+    if (!p) return;
+    p[0] = (uint8_t)(packet_id >> 8);
+    p[1] = (uint8_t)packet_id;
+}
+
+/* A PUBLISH stamped with `due`, the time it should have gone out. */
+static bool queue_publish(Conn *c, uint64_t due) {
+    const char *topic = topic_names[c->topic];
+    size_t len = strlen(topic);
+    bool v5 = opt.version == 5;
+    size_t remaining = 2 + len + (opt.qos ? 2 : 0) + v5 + (size_t)opt.payload;
+    uint8_t *p = begin_packet(c, (uint8_t)(0x30 | opt.qos << 1), remaining);
+    if (!p) return false;
+
+    p = put_string(p, topic, len);
+    if (opt.qos) {
+        if (++c->packet_id == 0) c->packet_id = 1;
+        *p++ = (uint8_t)(c->packet_id >> 8);
+        *p++ = (uint8_t)c->packet_id;
+    }
+    if (v5) *p++ = 0;
+    memcpy(p, &due, TIMESTAMP_LEN);
+    memset(p + TIMESTAMP_LEN, 'x', (size_t)opt.payload - TIMESTAMP_LEN);
+
+    c->topic = (c->topic + 1) % opt.topics;
+    return true;
+}
+
+// ---------------------------------------------------------------------
+// Connections
+// ---------------------------------------------------------------------
+
+static void conn_close(Worker *w, Conn *c, const char *why) {
+    if (c->state == CONN_CLOSED) return;
+    if (c->state != CONN_READY) atomic_fetch_add(&failed_conns, 1);
+    fprintf(stderr, "mqtt_bench: %s %d: %s\n", c->publisher ? "publisher" : "subscriber", c->index, why);
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->state = CONN_CLOSED;
+    w->errors++;
+}
+
+static void conn_flush(Worker *w, Conn *c) {
+    while (c->state != CONN_CLOSED && c->out.off < c->out.len) {
+        ssize_t n = send(c->fd, c->out.data + c->out.off, c->out.len - c->out.off, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) conn_close(w, c, strerror(errno));
+            return;
+        }
+        c->out.off += (size_t)n;
+    }
+    if (c->out.off == c->out.len) c->out.off = c->out.len = 0;
+}
+
+static void conn_ready(Worker *w, Conn *c) {
+    c->state = CONN_READY;
+    w->ready++;
+    atomic_fetch_add(&ready_conns, 1);
+}
+
+static void handle_packet(Worker *w, Conn *c, uint8_t type, const uint8_t *p, size_t len, uint64_t now) {
+    switch (type >> 4) {
+    case 2:     /* CONNACK */
+        if (len < 2 || p[1] != 0) {
+            conn_close(w, c, "connection refused");
+        } else if (c->publisher) {
+            conn_ready(w, c);
+        } else {
+            c->state = CONN_SUBSCRIBING;
+            queue_subscribe(c);
+        }
+        break;
+    case 9:     /* SUBACK */
+        if (len < 3 || p[len - 1] >= 0x80) {
+            conn_close(w, c, "subscription refused");
+        } else {
+            conn_ready(w, c);
+        }
+        break;
+    case 4:     /* PUBACK */
+        w->acked++;
+        break;
+    case 3: {   /* PUBLISH */
+        uint8_t qos = (type >> 1) & 0x03;
+        if (len < 2) break;
+        size_t pos = 2 + ((size_t)p[0] << 8 | p[1]);
+        if (qos > 0) {
+            if (pos + 2 > len) break;
+            queue_puback(c, (uint16_t)(p[pos] << 8 | p[pos + 1]));
+            pos += 2;
+        }
+        if (opt.version == 5) {
+            size_t props = 0;
+            int shift = 0;
+            while (pos < len && shift < 28) {
+                uint8_t byte = p[pos++];
+                props |= (size_t)(byte & 0x7F) << shift;
+                shift += 7;
+                if (!(byte & 0x80)) break;
+            }
+            pos += props;
+        }
+        if (pos + TIMESTAMP_LEN > len) break;
+
+        uint64_t due;
+        memcpy(&due, p + pos, TIMESTAMP_LEN);
+        if (due >= measure_from && due < measure_to) {
+            hist_record(&w->hist, now > due ? now - due : 0);
+            w->delivered++;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+static void conn_read(Worker *w, Conn *c) {
+    uint64_t now;
+
+    for (;;) {
+        uint8_t *chunk = buffer_reserve(&c->in, READ_CHUNK);
+        if (!chunk) {
+            conn_close(w, c, "out of memory");
+            return;
+        }
+        ssize_t n = recv(c->fd, chunk, READ_CHUNK, 0);
+        c->in.len -= READ_CHUNK - (n > 0 ? (size_t)n : 0);
+        if (n == 0) {
+            conn_close(w, c, "closed by the broker");
+            return;
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            conn_close(w, c, strerror(errno));
+            return;
+        }
+    }
+
+    now = now_ns();
+    while (c->state != CONN_CLOSED) {
+        const uint8_t *p = c->in.data + c->in.off;
+        size_t avail = c->in.len - c->in.off;
+        size_t remaining = 0, header = 1;
+        int shift = 0;
+
+        while (header < avail && header <= 4) {
+            uint8_t byte = p[header++];
+            remaining |= (size_t)(byte & 0x7F) << shift;
+            shift += 7;
+            if (!(byte & 0x80)) {
+                shift = -1;
+                break;
+            }
+        }
+        if (shift != -1 || avail < header + remaining) break;
+
+        handle_packet(w, c, p[0], p + header, remaining, now);
+        c->in.off += header + remaining;
+    }
+
+    if (c->in.off == c->in.len) {
+        c->in.off = c->in.len = 0;
+    } else if (c->in.off > 0) {
+        memmove(c->in.data, c->in.data + c->in.off, c->in.len - c->in.off);
+        c->in.len -= c->in.off;
+        c->in.off = 0;
+    }
+    conn_flush(w, c);
+}
+
+static int conn_open(Worker *w, Conn *c) {
+    char client_id[64];
+    const struct addrinfo *addr = c->publisher ? broker_addr : sub_addr;
+
+    c->fd = socket(addr->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (c->fd < 0) return -1;
+    /* blocking connect: one pending handshake per thread stays well inside the broker's listen backlog */
+    if (connect(c->fd, addr->ai_addr, addr->ai_addrlen) < 0) {
+        close(c->fd);
+        return -1;
+    }
+
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK) < 0) {
+        close(c->fd);
+        return -1;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = c };
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+        close(c->fd);
+        return -1;
+    }
+
+    snprintf(client_id, sizeof(client_id), "bench-%d-%c%d", (int)getpid(), c->publisher ? 'p' : 's', c->index);
+    c->state = CONN_CONNECTING;
+    queue_connect(c, client_id);
+    conn_flush(w, c);
+    return 0;
+}
+
+// ---------------------------------------------------------------------
+// Workers
+// ---------------------------------------------------------------------
+
+/* Queues every message that is due; returns when the next one will be, UINT64_MAX for none. */
+static uint64_t publish_due(Worker *w, uint64_t start, uint64_t now) {
+    uint64_t next = UINT64_MAX;
+
+    for (int i = 0; i < w->count; i++) {
+        Conn *c = &w->conns[i];
+        if (!c->publisher || c->state != CONN_READY) continue;
+
+        if (opt.rate <= 0) {
+            /* until the socket pushes back; EPOLLOUT then brings the loop round again */
+            while (c->state == CONN_READY && c->out.len == c->out.off && now < measure_to) {
+                while (c->out.len - c->out.off < OUT_LIMIT && queue_publish(c, now)) {
+                    w->published += now >= measure_from;
+                }
+                conn_flush(w, c);
+            }
+            continue;
+        } else {
+            if (c->next_due == 0) c->next_due = start + interval_ns * (uint64_t)c->index / (uint64_t)opt.publishers;
+            for (int burst = 0; burst < MAX_BURST && c->next_due <= now && c->next_due < measure_to; burst++) {
+                if (c->out.len - c->out.off >= OUT_LIMIT || !queue_publish(c, c->next_due)) break;
+                w->published += c->next_due >= measure_from;
+                c->next_due += interval_ns;
+            }
+            if (c->next_due < measure_to && c->next_due < next) next = c->next_due;
+        }
+        conn_flush(w, c);
+    }
+    return next;
+}
+
+static void *worker_run(void *arg) {
+    Worker *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    for (int i = 0; i < w->count; i++) {
+        if (conn_open(w, &w->conns[i]) < 0) {
+            fprintf(stderr, "mqtt_bench: connect: %s\n", strerror(errno));
+            w->conns[i].state = CONN_CLOSED;
+            w->errors++;
+            atomic_fetch_add(&failed_conns, 1);
+        }
+    }
+
+    while (!atomic_load(&stopping)) {
+        uint64_t start = atomic_load_explicit(&start_ns, memory_order_acquire);
+        uint64_t now = now_ns();
+        int timeout = 100;
+
+        if (start && now >= measure_to + DRAIN_NS) break;
+        if (start && now >= start) {
+            uint64_t next = publish_due(w, start, now);
+            if (next <= now_ns()) {
+                timeout = 0;
+            } else if (next != UINT64_MAX) {
+                struct itimerspec due = { .it_value = { (time_t)(next / 1000000000ull), (long)(next % 1000000000ull) } };
+                timerfd_settime(w->timerfd, TFD_TIMER_ABSTIME, &due, NULL);
+            }
+        }
+
+        int n = epoll_wait(w->epfd, events, MAX_EVENTS, timeout);
+        for (int i = 0; i < n; i++) {
+            Conn *c = events[i].data.ptr;
+            if (!c) {
+                uint64_t expirations;
+                ssize_t rc = read(w->timerfd, &expirations, sizeof(expirations));
+                (void)rc;       /* only clears the timer; publish_due() runs on every iteration */
+                continue;
+            }
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                conn_close(w, c, "socket error");
+                continue;
+            }
+            if (events[i].events & EPOLLIN) conn_read(w, c);
+            if (events[i].events & EPOLLOUT) conn_flush(w, c);
+        }
+    }
+
+    for (int i = 0; i < w->count; i++) {
+        Conn *c = &w->conns[i];
+        if (c->state != CONN_CLOSED) close(c->fd);
+        free(c->in.data);
+        free(c->out.data);
+    }
+    return NULL;
+}
+
+// ---------------------------------------------------------------------
+// Main
+// ---------------------------------------------------------------------
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -h host        broker address (default %s)\n"
+            "  -p port        broker port (default %s)\n"
+            "  -S port        subscribers' port, e.g. another cluster node (default: -p)\n"
+            "  -T threads     load generator threads (default %d)\n"
+            "  -P publishers  publishing connections (default %d)\n"
+            "  -t topics      topics, published to round-robin by every publisher (default %d)\n"
+            "  -f fanout      subscribers per topic (default %d)\n"
+            "  -r rate        messages per second per publisher, 0 for unthrottled (default %g)\n"
+            "  -s bytes       payload size, at least %d (default %d)\n"
+            "  -q qos         0 or 1 (default %d)\n"
+            "  -V version     MQTT protocol level, 4 (3.1.1) or 5 (default %d)\n"
+            "  -w seconds     warmup, not measured (default %g)\n"
+            "  -d seconds     measured duration (default %g)\n"
+            "  -o file        write the latency percentile distribution (HdrHistogram format)\n",
+            prog, opt.host, opt.port, opt.threads, opt.publishers, opt.topics, opt.fanout, opt.rate, TIMESTAMP_LEN,
+            opt.payload, opt.qos, opt.version, opt.warmup, opt.duration);
+    exit(EXIT_FAILURE);
+}
+
+static void parse_options(int argc, char **argv) {
+    int ch;
+    while ((ch = getopt(argc, argv, "h:p:S:T:P:t:f:r:s:q:V:w:d:o:")) != -1) {
+        switch (ch) {
+        case 'h': opt.host = optarg; break;
+        case 'p': opt.port = optarg; break;
+        case 'S': opt.sub_port = optarg; break;
+        case 'T': opt.threads = atoi(optarg); break;
+        case 'P': opt.publishers = atoi(optarg); break;
+        case 't': opt.topics = atoi(optarg); break;
+        case 'f': opt.fanout = atoi(optarg); break;
+        case 'r': opt.rate = atof(optarg); break;
+        case 's': opt.payload = atoi(optarg); break;
+        case 'q': opt.qos = atoi(optarg); break;
+        case 'V': opt.version = atoi(optarg); break;
+        case 'w': opt.warmup = atof(optarg); break;
+        case 'd': opt.duration = atof(optarg); break;
+        case 'o': opt.percentiles = optarg; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind != argc || opt.threads < 1 || opt.publishers < 1 || opt.topics < 1 || opt.fanout < 0 ||
+        opt.rate < 0 || opt.payload < TIMESTAMP_LEN || opt.qos < 0 || opt.qos > 1 ||
+        (opt.version != 4 && opt.version != 5) || opt.warmup < 0 || opt.duration <= 0) {
+        usage(argv[0]);
+    }
+}
+
+/* Thousands of sockets need more than the default descriptor limit. */
+static void raise_fd_limit(rlim_t needed) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur >= needed) return;
+    rl.rlim_cur = rl.rlim_max == RLIM_INFINITY || rl.rlim_max > needed ? needed : rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_cur < needed) {
+        fprintf(stderr, "mqtt_bench: descriptor limit %llu is below the %llu connections needed\n",
+                (unsigned long long)rl.rlim_cur, (unsigned long long)needed);
+    }
+}
+
+static void print_report(const Worker *workers, Histogram *hist) {
+    uint64_t published = 0, delivered = 0, acked = 0, errors = 0;
+    for (int i = 0; i < opt.threads; i++) {
+        published += workers[i].published;
+        delivered += workers[i].delivered;
+        acked += workers[i].acked;
+        errors += workers[i].errors;
+        hist_merge(hist, &workers[i].hist);
+    }
+
+    uint64_t expected = published * (uint64_t)opt.fanout;
+    printf("published  %12llu msg %12.0f msg/s", (unsigned long long)published, (double)published / opt.duration);
+    if (opt.qos > 0) printf("   (%llu acked in total)", (unsigned long long)acked);
+    printf("\ndelivered  %12llu msg %12.0f msg/s   (%llu of %llu expected missing)\n", (unsigned long long)delivered,
+           (double)delivered / opt.duration, (unsigned long long)(expected > delivered ? expected - delivered : 0),
+           (unsigned long long)expected);
+    if (errors) printf("errors     %12llu\n", (unsigned long long)errors);
+
+    static const double points[] = { 50, 90, 99, 99.9, 99.99 };
+    printf("\nlatency (us)  %10s", "min");
+    for (size_t i = 0; i < sizeof(points) / sizeof(points[0]); i++) {
+        char label[16];
+        snprintf(label, sizeof(label), "p%g", points[i]);
+        printf(" %10s", label);
+    }
+    printf(" %10s %10s\n              %10.1f", "max", "mean", (double)hist->min / 1000.0);
+    for (size_t i = 0; i < sizeof(points) / sizeof(points[0]); i++) {
+        printf(" %10.1f", (double)hist_percentile(hist, points[i]) / 1000.0);
+    }
+    printf(" %10.1f %10.1f\n", (double)hist->max / 1000.0, hist->total ? hist->sum / (double)hist->total / 1000.0 : 0);
+}
+
+int main(int argc, char **argv) {
+    parse_options(argc, argv);
+
+    int subscribers = opt.topics * opt.fanout;
+    int total = subscribers + opt.publishers;
+    if (opt.threads > total) opt.threads = total;
+    if (opt.rate > 0) interval_ns = (uint64_t)(1e9 / opt.rate);
+
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    int rc = getaddrinfo(opt.host, opt.port, &hints, &broker_addr);
+    if (rc == 0) {
+        sub_addr = broker_addr;
+        if (opt.sub_port) rc = getaddrinfo(opt.host, opt.sub_port, &hints, &sub_addr);
+    }
+    if (rc != 0) {
+        fprintf(stderr, "mqtt_bench: %s: %s\n", opt.host, gai_strerror(rc));
+        return EXIT_FAILURE;
+    }
+    raise_fd_limit((rlim_t)total + 64);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_sigint;
+    sigaction(SIGINT, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    topic_names = calloc((size_t)opt.topics, sizeof(*topic_names));
+    Worker *workers = calloc((size_t)opt.threads, sizeof(*workers));
+    Histogram *hist = calloc(1, sizeof(*hist));
+    if (!topic_names || !workers || !hist) {
+        fprintf(stderr, "mqtt_bench: out of memory\n");
+        return EXIT_FAILURE;
+    }
+    for (int t = 0; t < opt.topics; t++) {
+        if (asprintf(&topic_names[t], "bench/%d", t) < 0) return EXIT_FAILURE;
+    }
+
+    /* connections are dealt to the threads in turn, so each gets a mix of publishers and subscribers */
+    for (int i = 0; i < opt.threads; i++) {
+        workers[i].conns = calloc((size_t)(total / opt.threads + 1), sizeof(Conn));
+        workers[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+        workers[i].timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+        if (!workers[i].conns || workers[i].epfd < 0 || workers[i].timerfd < 0 ||
+            epoll_ctl(workers[i].epfd, EPOLL_CTL_ADD, workers[i].timerfd, &ev) < 0) {
+            fprintf(stderr, "mqtt_bench: cannot set up thread %d: %s\n", i, strerror(errno));
+            return EXIT_FAILURE;
+        }
+    }
+    int pubs = 0, subs = 0;
+    for (int i = 0; i < total; i++) {
+        Worker *w = &workers[i % opt.threads];
+        Conn *c = &w->conns[w->count++];
+        c->fd = -1;
+        c->publisher = (int64_t)i * opt.publishers / total != (int64_t)(i + 1) * opt.publishers / total;
+        c->index = c->publisher ? pubs++ : subs++;
+        c->topic = c->index % opt.topics;
+    }
+
+    printf("mqtt_bench: %s:%s, MQTT %s, QoS %d, %d thread(s)\n", opt.host, opt.port,
+           opt.version == 5 ? "5.0" : "3.1.1", opt.qos, opt.threads);
+    if (opt.sub_port) printf("  subscribers on port %s\n", opt.sub_port);
+    if (opt.rate > 0) {
+        printf("  %d publisher(s) at %g msg/s", opt.publishers, opt.rate);
+    } else {
+        printf("  %d unthrottled publisher(s)", opt.publishers);
+    }
+    printf(", %d topic(s) x %d subscriber(s), %d-byte payloads\n", opt.topics, opt.fanout, opt.payload);
+
+    for (int i = 0; i < opt.threads; i++) {
+        if (pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]) != 0) {
+            fprintf(stderr, "mqtt_bench: failed to start thread %d\n", i);
+            return EXIT_FAILURE;
+        }
+    }
+
+    uint64_t deadline = now_ns() + READY_TIMEOUT_NS;
+    while (atomic_load(&ready_conns) + atomic_load(&failed_conns) < total && !atomic_load(&stopping)) {
+        if (now_ns() > deadline) break;
+        usleep(10000);
+    }
+    int ready = atomic_load(&ready_conns);
+    if (ready < total) {
+        fprintf(stderr, "mqtt_bench: only %d of %d connections ready\n", ready, total);
+        atomic_store(&stopping, true);
+    } else {
+        printf("  %d connection(s) ready, warming up for %gs, measuring for %gs\n\n", total, opt.warmup,
+               opt.duration);
+        uint64_t start = now_ns() + 10000000;
+        measure_from = start + (uint64_t)(opt.warmup * 1e9);
+        measure_to = measure_from + (uint64_t)(opt.duration * 1e9);
+        atomic_store_explicit(&start_ns, start, memory_order_release);
+    }
+
+    for (int i = 0; i < opt.threads; i++) pthread_join(workers[i].thread, NULL);
+    if (ready < total) return EXIT_FAILURE;
+    if (atomic_load(&stopping)) printf("interrupted: rates below assume the full measured duration\n");
+
+    print_report(workers, hist);
+    if (opt.percentiles && hist_write_percentiles(hist, opt.percentiles) != 0) {
+        fprintf(stderr, "mqtt_bench: cannot write %s: %s\n", opt.percentiles, strerror(errno));
+    }
+
+    for (int i = 0; i < opt.threads; i++) {
+        close(workers[i].epfd);
+        close(workers[i].timerfd);
+        free(workers[i].conns);
+    }
+    for (int t = 0; t < opt.topics; t++) free(topic_names[t]);
+    free(topic_names);
+    free(workers);
+    free(hist);
+    if (sub_addr != broker_addr) freeaddrinfo(sub_addr);
+    freeaddrinfo(broker_addr);
+    return EXIT_SUCCESS;
+}
@@ -1,12 +1,18 @@
 #ifndef BROKER_H
 #define BROKER_H
 
+#include <stddef.h>
+
 #include "client.h"
 #include "topic.h"
 #include "mqtt_parser.h"
+#include "mqtt_encoder.h"
 
-void broker_init(void);
+void broker_init(int port);
 void broker_cleanup(void);
-void broker_handle_client(int sock);
+void broker_tick(void);
+int broker_handle_input(Client *c);
+void broker_client_opened(Client *c);
+void broker_client_disconnected(Client *c);
 
 #endif
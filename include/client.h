@@ -1,15 +1,110 @@
 #ifndef CLIENT_H
 #define CLIENT_H
 
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
 #include <netinet/in.h>
 
+#include "ring_buffer.h"
+#include "mqtt_parser.h"
+#include "frame.h"
+#include "inflight.h"
+#include "topic_alias.h"
+
+struct EventLoop;
+struct Topic;
+
+/* One of the client's subscriptions and its slot in the topic's subscriber array. */
+typedef struct {
+    struct Topic *topic;
+    int slot;
+} ClientSubscription;
+
+/* What a full output queue does with one more droppable frame. */
+typedef enum {
+    QUEUE_DROP_OLDEST,
+    QUEUE_DROP_NEWEST,
+    QUEUE_DISCONNECT
+} QueuePolicy;
+
+/* Published for the client when its connection ends without a normal DISCONNECT. */
+typedef struct {
+    size_t topic_len;
+    size_t payload_len;
+    uint8_t qos;
+    bool retain;
+    uint8_t data[];         /* topic, then payload */
+} Will;
+
+/*
+ * Per-connection state. A Client is owned by the event loop thread that
+ * accepted it; only that thread touches the socket and output buffer.
+ * Other threads hold references (refs) and hand data over through the
+ * owner's inbox. A persistent session keeps its Client after the socket
+ * closes; it queues QoS 1/2 messages until the client reconnects.
+ */
 typedef struct Client {
     int sock;
-    char client_id[64];
+    char *client_id;        /* any length the packet allows; fixed once CONNECT is accepted */
     struct sockaddr_in addr;
-    struct Client *next;
+    struct EventLoop *loop;
+    atomic_int refs;
+    bool closed;
+    bool connected;         /* CONNECT accepted */
+    bool kicked;            /* taken over by a newer connection, close after this batch */
+    bool persistent;        /* clean session off: the session outlives the connection */
+    bool peer;              /* a cluster link: another node subscribing on behalf of its clients */
+    uint8_t protocol;       /* MQTT protocol level from CONNECT */
+    uint32_t id_hash;
+    ClientSubscription *subs;   /* guarded by the topic registry lock */
+    int sub_count;
+    int sub_cap;
+    RingBuffer in;
+    MqttDecoder decoder;
+    Inflight inflight;      /* QoS 1/2 state, owner loop only */
+    Timer timer;            /* CONNECT/keep-alive deadline; session expiry once offline */
+    uint64_t last_rx;       /* monotonic ms of the last read */
+    uint32_t keepalive_ms;  /* 1.5x the keep-alive from CONNECT, 0 if disabled */
+    uint32_t session_expiry;    /* seconds kept offline, SESSION_EXPIRY_DEFAULT by default */
+    uint32_t max_packet;    /* largest packet the client accepts (MQTT 5 Maximum Packet Size) */
+    TopicAliases aliases;   /* owner loop only; out_max is fixed at CONNECT */
+    Will *will;
+    Frame **out_queue;      /* circular queue of shared frames */
+    size_t out_head;
+    size_t out_count;
+    size_t out_cap;
+    size_t out_offset;      /* bytes of the head frame already written */
+    size_t out_bytes;       /* bytes still to be written */
+    size_t out_sending;     /* head frames the outstanding io_uring send covers */
+    bool out_blocked;       /* socket buffer full (waiting for EPOLLOUT) or an io_uring send outstanding */
+    bool rx_armed;          /* io_uring: a multishot recv is outstanding */
+    atomic_bool congested;  /* out_blocked or closed, for other threads */
+    atomic_uint backlog;    /* QoS 1/2 messages in flight or queued, for other threads */
+    atomic_uint posted;     /* QoS 1/2 messages on their way through the owner's inbox */
+    atomic_bool watched;    /* a paused publisher waits for the backlog to drain */
+    struct Client *waiting_for; /* subscriber whose backlog keeps this publisher unread */
+    struct Client *paused_next; /* the loop's list of paused publishers */
+    QueuePolicy out_policy;
+    unsigned long out_dropped;
+    bool flush_pending;
+    struct Client *flush_next;
+    struct Client *next;    /* session table chain */
+    struct Client *successor;   /* connection that took this session over */
 } Client;
 
 Client *client_create(int sock, const char *id, struct sockaddr_in addr);
+void client_destroy(Client *c);
+int client_set_id(Client *c, const char *id, size_t len);
+void client_retain(Client *c);
+void client_release(Client *c);
+int client_send(Client *c, const void *buf, size_t len);
+int client_send_frame(Client *c, Frame *f);
+int client_send_publish(Client *c, Frame *msg, uint8_t qos, uint16_t packet_id, bool dup);
+bool client_aliases_topics(const Client *c);
+bool client_backpressured(const Client *c);
+int client_flush(Client *c);
+size_t client_out_iov(const Client *c, struct iovec *iov, size_t max, size_t *frames, size_t *offered);
+void client_sent(Client *c, size_t written);
 
 #endif
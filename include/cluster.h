@@ -0,0 +1,15 @@
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <stdbool.h>
+
+#define CLUSTER_LINK_PREFIX "$cluster/"  /* client id prefix of the links nodes dial to each other */
+
+void cluster_init(int port);
+void cluster_shutdown(void);
+bool cluster_is_link(const char *client_id);
+bool cluster_is_peer(const char *client_id);
+void cluster_interest(const char *filter, bool add);
+void cluster_wake_paused(void);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CODEC_VARINT_MAX 268435455u     /* largest Variable Byte Integer (four bytes) */
+
+int codec_varint_decode(const uint8_t *buf, size_t len, uint32_t *value);
+size_t codec_varint_encode(uint8_t *buf, uint32_t value);
+size_t codec_varint_size(uint32_t value);
+uint16_t codec_load_be16(const uint8_t *p);
+uint32_t codec_load_be32(const uint8_t *p);
+void codec_store_be16(uint8_t *p, uint16_t v);
+void codec_store_be32(uint8_t *p, uint32_t v);
+bool codec_utf8_valid(const uint8_t *s, size_t len);
+bool codec_topic_valid(const uint8_t *s, size_t len);
+bool codec_utf8_valid_scalar(const uint8_t *s, size_t len);
+bool codec_topic_valid_scalar(const uint8_t *s, size_t len);
+
+#endif
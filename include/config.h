@@ -4,11 +4,32 @@
 #include <stdbool.h>
 
 #define DEFAULT_PORT 8000
-#define MAX_PENDING 10
+#define MAX_PENDING 128
+#define EPOLL_MAX_EVENTS 256
+#define IO_BACKEND IO_BACKEND_EPOLL  /* IO_BACKEND_EPOLL or IO_BACKEND_URING */
+#define URING_ENTRIES 1024           /* submission queue slots per worker */
+#define URING_RX_BUFFERS 512         /* provided receive buffers of RX_CHUNK_SIZE per worker, power of two */
+#define URING_CQE_BATCH 16           /* completions other than sends handled per submit */
+#define URING_CQ_ENTRIES 8192        /* completion queue slots, and completions reaped ahead of handling them */
+#define URING_SEND_IOV_MAX 1024      /* iovecs in one io_uring sendmsg (UIO_MAXIOV) */
+#define URING_INBOX_BATCH 256        /* posted deliveries handled per submit */
+#define MAX_WORKERS 64
+#define RX_CHUNK_SIZE 4096
+#define RX_IDLE_BUFFER_SIZE 16384
+#define OUT_QUEUE_MAX_FRAMES 1024
+#define OUT_QUEUE_MAX_BYTES (4 * 1024 * 1024)
+#define OUT_QUEUE_POLICY QUEUE_DROP_OLDEST   /* QUEUE_DROP_OLDEST, QUEUE_DROP_NEWEST or QUEUE_DISCONNECT */
+#define OUT_IOV_MAX 64
 #define MAX_TOPICS 256
+#define TOPIC_TABLE_INITIAL_SIZE 256
+#define INTERN_TABLE_INITIAL_SIZE 256
 #define MAX_CLIENTS 1024
+#define SESSION_TABLE_INITIAL_SIZE 256
 #define MAX_TOPIC_NAME 128
-#define MAX_PAYLOAD_SIZE 1024
+#define TOPIC_INLINE_SUBSCRIBERS 4   /* subscriber slots stored inside the Topic itself */
+#define POOL_SLAB_OBJECTS 64
+#define POOL_CACHE_SIZE 64           /* objects a thread keeps before returning a batch */
+#define POOL_MAX_CACHES 8            /* pools that get a per-thread cache */
 #define DEBUG_ENABLED false
 #define COLOR_RED     "\033[31m"
 #define COLOR_YELLOW  "\033[33m"
@@ -17,6 +38,38 @@
 #define COLOR_RESET   "\033[0m"
 
 #define LOG_FILE "logs/broker.log"
+#define LOG_RING_SIZE 4096          /* records, power of two */
+#define LOG_RECORD_SIZE 256         /* longer messages are truncated */
+#define LOG_BATCH_SIZE (64 * 1024)
+#define LOG_IDLE_WAIT_MS 100
 #define TOPICS_FILE "state/topics_state.json"
+#define TOPICS_SNAPSHOT_INTERVAL 5   /* seconds between JSON snapshots, 0 disables */
+#define METRICS_PORT 9883            /* Prometheus endpoint on 127.0.0.1, 0 disables */
+#define SYS_INTERVAL 10              /* seconds between $SYS/broker/... updates, 0 disables */
+#define STORE_DIR "state/store"
+#define STORE_SEGMENT_SIZE (64 * 1024 * 1024)
+#define STORE_COMPACT_SEGMENTS 4     /* sealed segments that trigger a compaction */
+#define BROKER_TICK_MS 1000
+#define TIMER_WHEEL_SLOTS 512        /* power of two */
+#define TIMER_TICK_MS 100
+#define INFLIGHT_WINDOW 32           /* unacknowledged QoS 1/2 PUBLISHes per client */
+#define INFLIGHT_PENDING_MAX 1024    /* QoS 1/2 messages queued in memory behind a full window */
+#define INFLIGHT_RESUME_BELOW 512    /* backlog under which publishers paused by a subscriber resume */
+#define INFLIGHT_QUEUE_LIMIT 8192    /* QoS 1/2 messages a clean session queues at most; newer ones are dropped */
+#define QOS2_RX_MAX 1024             /* inbound QoS 2 ids awaiting PUBREL per client */
+#define TOPIC_ALIAS_MAX 64           /* MQTT 5 topic aliases a client may set per connection */
+#define TOPIC_ALIAS_OUT_MAX 128      /* cap on the aliases the broker assigns per connection */
+#define SHARE_STRATEGY SHARE_ROUND_ROBIN    /* SHARE_ROUND_ROBIN, SHARE_LEAST_INFLIGHT or SHARE_STICKY */
+#define CONNECT_TIMEOUT_MS 10000     /* a new connection must send CONNECT within this */
+#define SESSION_EXPIRY_NEVER 0xFFFFFFFFu
+#define SESSION_EXPIRY_DEFAULT SESSION_EXPIRY_NEVER  /* seconds an offline persistent session is kept */
+#define QOS_RETRY_MS 10000
+#define CLUSTER_MAX_PEERS 32
+#define CLUSTER_RETRY_MS 1000        /* wait before redialing a peer */
+#define CLUSTER_KEEPALIVE 30         /* seconds, keep-alive of the links this node dials */
+#define CLUSTER_LINK_WINDOW 128      /* QoS 1 messages in flight on a link, both ways */
+#define CLUSTER_LINK_QUEUE_FRAMES 65536      /* output queue limits of a peer's link */
+#define CLUSTER_LINK_QUEUE_BYTES (64 * 1024 * 1024)
+#define CLUSTER_FILTERS_PER_PACKET 64        /* filters per SUBSCRIBE/UNSUBSCRIBE sent to a peer */
 
 #endif
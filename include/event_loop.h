@@ -0,0 +1,54 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "client.h"
+#include "frame.h"
+#include "mpsc_queue.h"
+#include "timer_wheel.h"
+
+/* I/O backends; IO_BACKEND in config.h, BROKER_IO_BACKEND=epoll|io_uring at run time. */
+typedef enum {
+    IO_BACKEND_EPOLL,
+    IO_BACKEND_URING
+} IoBackend;
+
+/*
+ * One reactor per worker thread: its own SO_REUSEPORT listening socket,
+ * its own epoll set or io_uring, and an inbox through which other
+ * workers hand it frames for the clients it owns.
+ */
+typedef struct EventLoop {
+    int id;
+    int epfd;               /* epoll backend, -1 with io_uring */
+    struct Uring *ring;     /* io_uring backend, NULL with epoll */
+    int listenfd;
+    int wakefd;
+    pthread_t thread;
+    MpscQueue inbox;
+    atomic_int wake_pending;
+    bool inbox_backlog;     /* io_uring: deliveries left for the next iteration */
+    Client *flush_list;     /* clients with frames queued this iteration */
+    Client *paused;         /* publishers not read until a subscriber's backlog drains */
+    atomic_bool recheck;    /* some of them may be read again */
+    TimerWheel timers;
+    uint64_t now;           /* monotonic ms at the top of the current iteration */
+} EventLoop;
+
+int event_loop_create(const int *listenfds, int count);
+int event_loop_run(void);
+EventLoop *event_loop_home(const char *client_id);
+void event_loop_join(void);
+void event_loop_stop(void);
+void event_loop_deliver(Client *c, Frame *f, uint8_t qos);
+void event_loop_schedule_flush(Client *c);
+int event_loop_flush(Client *c);
+void event_loop_kick(Client *c);
+void event_loop_pause(Client *c, Client *wait);
+void event_loop_wake_paused(EventLoop *loop);
+
+#endif
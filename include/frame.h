@@ -0,0 +1,33 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * An encoded packet shared by every queue it is sent on. The bytes are
+ * immutable once the frame is handed out; the last release frees it.
+ * A frame may end with bytes borrowed from another one (`tail`), so a
+ * per-client header can go out in front of a shared payload.
+ */
+typedef struct Frame {
+    atomic_int refs;
+    bool droppable;         /* may be discarded by a full output queue */
+    uint32_t topic_hash;    /* PUBLISH: fnv1a_hash() of the topic name, 0 if not computed */
+    size_t len;
+    struct Frame *tail;     /* sent after data, from tail_offset on */
+    size_t tail_offset;
+    unsigned char data[];
+} Frame;
+
+Frame *frame_alloc(size_t capacity);
+Frame *frame_copy(const void *buf, size_t len);
+void frame_retain(Frame *f);
+void frame_release(Frame *f);
+size_t frame_size(const Frame *f);
+int frame_iov(const Frame *f, size_t skip, struct iovec *iov);
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef INFLIGHT_H
+#define INFLIGHT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "frame.h"
+#include "mqtt_parser.h"
+#include "store.h"
+#include "timer_wheel.h"
+
+struct Client;
+
+enum {
+    INFLIGHT_PUBLISH,       /* waiting for PUBACK (QoS 1) or PUBREC (QoS 2) */
+    INFLIGHT_PUBREL         /* QoS 2, PUBREL sent, waiting for PUBCOMP */
+};
+
+/*
+ * One unacknowledged outbound PUBLISH. It keeps a reference to the shared
+ * QoS 0 encoding of the message rather than its own copy; the per-client
+ * header (QoS, packet id, DUP) is rebuilt whenever it is (re)sent.
+ */
+typedef struct {
+    Frame *msg;
+    uint32_t seq;           /* session sequence number, names the message in the store */
+    uint32_t sent_at;       /* low 32 bits of monotonic ms */
+    uint16_t packet_id;
+    uint8_t qos;
+    uint8_t state;
+} InflightEntry;
+
+typedef struct {
+    Frame *msg;
+    uint32_t seq;
+    uint8_t qos;
+} PendingEntry;
+
+/*
+ * Per-session QoS 1/2 state. Everything is allocated on first use and
+ * sized to what is outstanding, so idle sessions cost only this struct.
+ * A persistent session keeps at most INFLIGHT_PENDING_MAX messages in
+ * `pending`; the rest stay in the store until the queue runs low.
+ */
+typedef struct {
+    InflightEntry *slots;   /* in send order, at most `window` */
+    PendingEntry *pending;  /* FIFO of messages waiting for a free slot */
+    uint16_t *rx_ids;       /* inbound QoS 2 ids awaiting PUBREL */
+    uint16_t count;
+    uint16_t cap;
+    uint16_t window;        /* INFLIGHT_WINDOW (CLUSTER_LINK_WINDOW on a cluster link), or less if the client's Receive Maximum is */
+    uint16_t next_id;
+    uint16_t rx_count;
+    uint16_t rx_cap;
+    uint32_t pending_head;
+    uint32_t pending_count;
+    uint32_t pending_cap;
+    uint32_t store_seq;     /* last sequence number handed out */
+    uint32_t spilled;       /* messages after `pending` that are only in the store */
+    StoreCursor spill;      /* where the first of them is */
+    Timer retry;
+} Inflight;
+
+void inflight_init(struct Client *c);
+void inflight_stop(struct Client *c);
+void inflight_free(struct Client *c);
+int inflight_publish(struct Client *c, Frame *msg, uint8_t qos);
+bool inflight_congested(const struct Client *c);
+bool inflight_watch(struct Client *c);
+void inflight_unpost(struct Client *c);
+int inflight_ack(struct Client *c, MqttPacketType type, uint16_t packet_id);
+int inflight_receive(struct Client *c, uint16_t packet_id);
+void inflight_release(struct Client *c, uint16_t packet_id);
+void inflight_move(struct Client *from, struct Client *to);
+int inflight_restore(struct Client *c, uint32_t seq, uint8_t qos, bool released, const uint8_t *frame, size_t len);
+
+#endif
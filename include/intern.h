@@ -0,0 +1,23 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * String interning for topic levels and subscription filters. Every
+ * distinct string gets a small, stable, non-zero id and a precomputed
+ * hash, so tries and the topic registry compare integers instead of
+ * strings; the string itself is stored once, NUL-terminated, at an
+ * address that does not move. Ids are reference counted and recycled
+ * once released. Not synchronised: callers serialise through the topic
+ * registry lock.
+ */
+uint32_t intern_acquire(const char *s, size_t len);
+uint32_t intern_find(const char *s, size_t len);
+void intern_release(uint32_t id);
+const char *intern_str(uint32_t id, size_t *len);
+uint32_t intern_hash(uint32_t id);
+void intern_cleanup(void);
+
+#endif
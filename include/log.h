@@ -0,0 +1,21 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdarg.h>
+
+typedef enum {
+    LOG_ERROR,
+    LOG_WARNING,
+    LOG_INFO,
+    LOG_DEBUG
+} LogLevel;
+
+int log_init(void);
+void log_shutdown(void);
+void log_set_level(LogLevel level);
+LogLevel log_get_level(void);
+unsigned long log_dropped(void);
+void log_message(LogLevel level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+#endif
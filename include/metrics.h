@@ -0,0 +1,42 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+#define METRIC_PACKET_TYPES 16
+
+/* Counters, and gauges kept as sums of +/- deltas. */
+typedef enum {
+    METRIC_CONNECTIONS_OPENED,
+    METRIC_CONNECTIONS_CLOSED,
+    METRIC_CLIENTS_DROPPED,     /* closed by the broker: keep-alive, CONNECT timeout, full queue */
+    METRIC_SESSIONS_EXPIRED,
+    METRIC_BYTES_IN,
+    METRIC_BYTES_OUT,
+    METRIC_MESSAGES_DROPPED,
+    METRIC_PUBLISHERS_PAUSED,   /* times a publisher was not read while a subscriber caught up */
+    METRIC_QUEUED_FRAMES,       /* gauge: frames in output queues */
+    METRIC_QUEUED_BYTES,        /* gauge: bytes in output queues */
+    METRIC_PACKETS_IN,          /* + packet type */
+    METRIC_PACKETS_OUT = METRIC_PACKETS_IN + METRIC_PACKET_TYPES,
+    METRIC_COUNT = METRIC_PACKETS_OUT + METRIC_PACKET_TYPES
+} Metric;
+
+/* Hot-path stages timed into latency histograms. */
+typedef enum {
+    STAGE_PARSE,        /* one packet through the parser */
+    STAGE_MATCH,        /* a PUBLISH's trie walk, fan-out excluded */
+    STAGE_FANOUT,       /* queuing a PUBLISH for every matched subscriber */
+    STAGE_FLUSH,        /* one client_flush() */
+    STAGE_COUNT
+} Stage;
+
+void metrics_init(void);
+void metrics_shutdown(void);
+void metrics_thread(int worker);
+void metrics_add(Metric m, int64_t n);
+uint64_t metrics_clock(void);
+void metrics_record(Stage s, uint64_t ns);
+void metrics_publish_sys(void);
+
+#endif
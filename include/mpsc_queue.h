@@ -0,0 +1,24 @@
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+#include <stdatomic.h>
+
+/*
+ * Intrusive multi-producer/single-consumer queue (Vyukov). Producers never
+ * block or take locks; only the owning thread may pop.
+ */
+typedef struct MpscNode {
+    _Atomic(struct MpscNode *) next;
+} MpscNode;
+
+typedef struct {
+    _Atomic(MpscNode *) head;
+    MpscNode *tail;
+    MpscNode stub;
+} MpscQueue;
+
+void mpsc_init(MpscQueue *q);
+void mpsc_push(MpscQueue *q, MpscNode *n);
+MpscNode *mpsc_pop(MpscQueue *q);
+
+#endif
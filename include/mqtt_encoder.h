@@ -0,0 +1,52 @@
+#ifndef MQTT_ENCODER_H
+#define MQTT_ENCODER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "frame.h"
+#include "mqtt_parser.h"
+
+/*
+ * Everything needed to encode a PUBLISH. `properties` is an already
+ * encoded MQTT 5 property block (without its length prefix) and is only
+ * written for MQTT_PROTOCOL_V5 connections.
+ */
+typedef struct {
+    const char *topic;
+    size_t topic_len;
+    const uint8_t *payload;
+    size_t payload_len;
+    uint8_t qos;
+    bool retain;
+    bool dup;
+    uint16_t packet_id;
+    const uint8_t *properties;
+    size_t properties_len;
+    uint8_t version;
+} MqttPublishSpec;
+
+size_t mqtt_publish_header_size(const MqttPublishSpec *p);
+size_t mqtt_publish_size(const MqttPublishSpec *p);
+int mqtt_encode_publish_header(uint8_t *buf, size_t maxlen, const MqttPublishSpec *p);
+int mqtt_encode_publish(uint8_t *buf, size_t maxlen, const MqttPublishSpec *p);
+int mqtt_publish_topic(const Frame *msg, MqttView *topic);
+Frame *mqtt_publish_reframe(Frame *msg, uint8_t qos, uint16_t packet_id, bool dup, uint8_t version,
+                            uint16_t topic_alias, bool alias_only);
+
+size_t mqtt_put_property_u16(uint8_t *buf, uint8_t id, uint16_t value);
+size_t mqtt_put_property_u32(uint8_t *buf, uint8_t id, uint32_t value);
+size_t mqtt_put_property_string(uint8_t *buf, uint8_t id, const char *s, size_t len);
+
+int mqtt_encode_connack(uint8_t *buf, size_t maxlen, bool session_present, uint8_t reason, uint8_t version,
+                        const uint8_t *properties, size_t properties_len);
+int mqtt_encode_ack(uint8_t *buf, size_t maxlen, MqttPacketType type, uint16_t packet_id,
+                    uint8_t reason, uint8_t version);
+int mqtt_encode_suback(uint8_t *buf, size_t maxlen, uint16_t packet_id,
+                       const uint8_t *codes, size_t count, uint8_t version);
+int mqtt_encode_unsuback(uint8_t *buf, size_t maxlen, uint16_t packet_id,
+                         const uint8_t *codes, size_t count, uint8_t version);
+int mqtt_encode_pingresp(uint8_t *buf, size_t maxlen);
+
+#endif
@@ -1,31 +1,140 @@
 #ifndef MQTT_PARSER_H
 #define MQTT_PARSER_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
+#include "ring_buffer.h"
+
+#define MQTT_MAX_PACKET_SIZE 268435455   /* largest Remaining Length (4 bytes) */
+
+#define MQTT_PROTOCOL_V311 4
+#define MQTT_PROTOCOL_V5   5
+
 typedef enum {
     MQTT_PKT_CONNECT   = 1,
     MQTT_PKT_CONNACK   = 2,
     MQTT_PKT_PUBLISH   = 3,
+    MQTT_PKT_PUBACK    = 4,
+    MQTT_PKT_PUBREC    = 5,
+    MQTT_PKT_PUBREL    = 6,
+    MQTT_PKT_PUBCOMP   = 7,
     MQTT_PKT_SUBSCRIBE = 8,
     MQTT_PKT_SUBACK    = 9,
+    MQTT_PKT_UNSUBSCRIBE = 10,
+    MQTT_PKT_UNSUBACK  = 11,
     MQTT_PKT_PINGREQ   = 12,
     MQTT_PKT_PINGRESP  = 13,
     MQTT_PKT_DISCONNECT= 14
 } MqttPacketType;
 
+/* A byte range inside a received frame; not NUL-terminated. */
+typedef struct {
+    const uint8_t *data;
+    size_t len;
+} MqttView;
+
+/* MQTT 5 property identifiers (§2.2.2.2) the broker reads or writes. */
+enum {
+    MQTT_PROP_PAYLOAD_FORMAT        = 0x01,
+    MQTT_PROP_MESSAGE_EXPIRY        = 0x02,
+    MQTT_PROP_CONTENT_TYPE          = 0x03,
+    MQTT_PROP_RESPONSE_TOPIC        = 0x08,
+    MQTT_PROP_CORRELATION_DATA      = 0x09,
+    MQTT_PROP_SUBSCRIPTION_ID       = 0x0B,
+    MQTT_PROP_SESSION_EXPIRY        = 0x11,
+    MQTT_PROP_ASSIGNED_CLIENT_ID    = 0x12,
+    MQTT_PROP_AUTH_METHOD           = 0x15,
+    MQTT_PROP_AUTH_DATA             = 0x16,
+    MQTT_PROP_REQUEST_PROBLEM_INFO  = 0x17,
+    MQTT_PROP_WILL_DELAY            = 0x18,
+    MQTT_PROP_REQUEST_RESPONSE_INFO = 0x19,
+    MQTT_PROP_REASON_STRING         = 0x1F,
+    MQTT_PROP_RECEIVE_MAXIMUM       = 0x21,
+    MQTT_PROP_TOPIC_ALIAS_MAXIMUM   = 0x22,
+    MQTT_PROP_TOPIC_ALIAS           = 0x23,
+    MQTT_PROP_USER_PROPERTY         = 0x26,
+    MQTT_PROP_MAXIMUM_PACKET_SIZE   = 0x27
+};
+
+/*
+ * The MQTT 5 properties of one packet (or of a CONNECT's will). Only the
+ * ones `present` has a bit for were sent; the others are zero. Strings
+ * and binary data are views into the frame.
+ */
+typedef struct {
+    uint64_t present;               /* bit n: property n was seen */
+    uint32_t payload_format;
+    uint32_t message_expiry;
+    MqttView content_type;
+    MqttView response_topic;
+    MqttView correlation_data;
+    uint32_t subscription_id;
+    uint32_t session_expiry;
+    MqttView auth_method;
+    MqttView auth_data;
+    uint32_t request_problem_info;
+    uint32_t will_delay;
+    uint32_t request_response_info;
+    MqttView reason_string;
+    uint32_t receive_maximum;
+    uint32_t topic_alias_maximum;
+    uint32_t topic_alias;
+    uint32_t user_properties;       /* count; the pairs are not kept */
+    uint32_t maximum_packet_size;
+} MqttProperties;
+
+#define MQTT_HAS_PROPERTY(props, id) ((((props)->present) >> (id)) & 1)
+
+/*
+ * A parsed packet. Views point into the frame passed to the parser (the
+ * connection's receive buffer) and are only valid until it is consumed.
+ */
 typedef struct {
     MqttPacketType type;
-    char topic[128];
-    char payload[1024];
-    char client_id[64];
+    uint8_t flags;
+    uint8_t protocol_level; /* CONNECT only */
+    bool clean_session;     /* CONNECT only (Clean Start in MQTT 5) */
+    uint16_t keepalive;     /* CONNECT only, seconds */
+    uint8_t qos;            /* PUBLISH only */
+    uint16_t packet_id;
+    MqttView topic;
+    MqttView payload;
+    MqttView client_id;
+    MqttProperties props;   /* MQTT 5 CONNECT, PUBLISH, SUBSCRIBE and DISCONNECT */
+    bool will;              /* CONNECT: will message present */
+    uint8_t will_qos;
+    bool will_retain;
+    MqttView will_topic;
+    MqttView will_payload;
+    MqttProperties will_props;
+    bool has_username;      /* CONNECT credentials, passed through unchecked */
+    bool has_password;
+    MqttView username;
+    MqttView password;
+    uint8_t reason;         /* MQTT 5 DISCONNECT reason code */
+    MqttView filters;       /* SUBSCRIBE/UNSUBSCRIBE entries, see mqtt_next_filter() */
+    size_t filter_count;
+    char assigned_id[37];   /* backs client_id when the broker assigns one */
 } MqttPacket;
 
-int mqtt_parse_packet(const uint8_t *buf, size_t len, MqttPacket *pkt);
-int mqtt_encode_connack(uint8_t *buf, size_t maxlen);
-int mqtt_encode_suback(uint8_t *buf, size_t maxlen, uint16_t packet_id);
-int mqtt_encode_publish(uint8_t *buf, size_t maxlen, const char *topic, const char *payload, size_t payload_len);
-int mqtt_encode_pingresp(uint8_t *buf, size_t maxlen);
+enum {
+    MQTT_DEC_HEADER,
+    MQTT_DEC_LENGTH,
+    MQTT_DEC_BODY
+};
+
+/* Resumable framing state for one connection's input stream. */
+typedef struct {
+    uint8_t state;
+    uint8_t length_bytes;
+    uint32_t remaining;
+} MqttDecoder;
+
+void mqtt_decoder_init(MqttDecoder *d);
+int mqtt_decoder_next(MqttDecoder *d, RingBuffer *rb, const uint8_t **frame, size_t *frame_len);
+int mqtt_parse_packet(const uint8_t *buf, size_t len, uint8_t version, MqttPacket *pkt);
+int mqtt_next_filter(MqttView *rest, bool with_options, MqttView *filter, uint8_t *options);
 
 #endif
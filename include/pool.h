@@ -0,0 +1,28 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * Fixed-size object pool. Objects are carved out of slabs of
+ * POOL_SLAB_OBJECTS and recycled through a free list; each thread keeps
+ * a small cache in front of it, so the lock is only taken once per
+ * batch. Slabs are never returned to the system before pool_destroy().
+ */
+typedef struct Pool {
+    const char *name;
+    size_t obj_size;
+    pthread_mutex_t lock;
+    void *free_list;
+    void *slabs;
+    size_t live;            /* objects handed out or sitting in thread caches */
+} Pool;
+
+#define POOL_INITIALIZER(type) { #type, sizeof(type), PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0 }
+
+void *pool_alloc(Pool *p);
+void pool_free(Pool *p, void *obj);
+void pool_destroy(Pool *p);
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/* Growable byte ring; capacity is always a power of two. */
+typedef struct {
+    uint8_t *data;
+    size_t cap;
+    size_t head;
+    size_t len;
+} RingBuffer;
+
+void ring_init(RingBuffer *rb);
+void ring_free(RingBuffer *rb);
+int ring_reserve(RingBuffer *rb, size_t min_free);
+int ring_free_iov(RingBuffer *rb, struct iovec iov[2]);
+void ring_commit(RingBuffer *rb, size_t n);
+uint8_t ring_peek(const RingBuffer *rb, size_t offset);
+const uint8_t *ring_contiguous(RingBuffer *rb, size_t len);
+void ring_consume(RingBuffer *rb, size_t n);
+void ring_shrink(RingBuffer *rb, size_t max_idle_cap);
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "client.h"
+
+/*
+ * Registry of connections by client id (from CONNECT), including offline
+ * persistent sessions. Lookups return a retained client.
+ */
+Client *session_connect(Client *c);
+void session_close(Client *c);
+Client *session_find(const char *client_id);
+void session_cleanup(void);
+
+#endif
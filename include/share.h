@@ -0,0 +1,21 @@
+#ifndef SHARE_H
+#define SHARE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "topic.h"
+
+/* How a shared subscription picks the one member that gets a message. */
+typedef enum {
+    SHARE_ROUND_ROBIN,
+    SHARE_LEAST_INFLIGHT,   /* fewest unacknowledged QoS 1/2 messages */
+    SHARE_STICKY            /* same publisher, same member (rendezvous hash on the client id) */
+} ShareStrategy;
+
+void share_init(void);
+bool share_name(const char *name, const char **filter);
+int share_pick(const Subscriber *members, int count, atomic_uint *cursor, uint32_t sender);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Durable state of persistent (clean-session=false) sessions: their
+ * subscriptions and the QoS 1/2 messages queued for them. Every change is
+ * one record appended to a memory-mapped log segment, so persisting costs
+ * O(record); sealed segments are compacted in the background.
+ */
+
+/* Called by store_open() for every recovered session, in log order. */
+typedef struct {
+    void (*session)(void *arg, const char *client_id);
+    void (*subscription)(void *arg, const char *client_id, const char *filter, uint8_t qos);
+    void (*message)(void *arg, const char *client_id, uint32_t seq, uint8_t qos, bool released,
+                    const uint8_t *frame, size_t len);
+} StoreVisitor;
+
+/*
+ * Where store_load() goes on reading one session's messages. A cursor
+ * into a segment a compaction has since rewritten goes on from the
+ * start of the compacted segment.
+ */
+typedef struct {
+    uint32_t segment;       /* 0 until known */
+    uint32_t generation;    /* compactions that had run when it was taken */
+    size_t offset;
+    uint32_t seq;           /* messages up to this one are already loaded */
+} StoreCursor;
+
+/* Takes one loaded message: 0 for more, 1 to stop after it, -1 to stop without it. */
+typedef int (*StoreLoadFn)(void *arg, uint32_t seq, uint8_t qos, const uint8_t *frame, size_t len);
+
+int store_open(const StoreVisitor *visitor, void *arg);
+void store_close(void);
+void store_sync(void);
+void store_subscribe(const char *client_id, const char *filter, uint8_t qos);
+void store_unsubscribe(const char *client_id, const char *filter);
+void store_end_session(const char *client_id);
+int store_message(const char *client_id, uint32_t seq, uint8_t qos, const uint8_t *frame, size_t len, StoreCursor *at);
+size_t store_load(const char *client_id, StoreCursor *at, StoreLoadFn fn, void *arg);
+void store_release(const char *client_id, uint32_t seq);
+void store_ack(const char *client_id, uint32_t seq);
+
+#endif
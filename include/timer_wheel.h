@@ -0,0 +1,37 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "config.h"
+
+/*
+ * Hashed timing wheel owned by one event loop. Timers are intrusive, so
+ * arming and cancelling is O(1) and never allocates; a timer further out
+ * than one revolution just stays in its slot for the extra rounds.
+ */
+typedef struct Timer {
+    struct Timer *next;
+    struct Timer **pprev;   /* NULL while not armed */
+    uint64_t expires;       /* monotonic ms */
+    void (*fn)(struct Timer *t);
+    void *arg;
+} Timer;
+
+typedef struct {
+    Timer *slots[TIMER_WHEEL_SLOTS];
+    uint64_t tick;          /* last tick processed */
+    size_t count;
+} TimerWheel;
+
+void timer_wheel_init(TimerWheel *w, uint64_t now_ms);
+void timer_wheel_advance(TimerWheel *w, uint64_t now_ms);
+int timer_wheel_timeout(const TimerWheel *w, uint64_t now_ms);
+void timer_init(Timer *t, void (*fn)(Timer *t), void *arg);
+void timer_arm(TimerWheel *w, Timer *t, uint64_t expires_ms);
+void timer_cancel(TimerWheel *w, Timer *t);
+bool timer_armed(const Timer *t);
+
+#endif
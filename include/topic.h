@@ -1,25 +1,55 @@
 #ifndef TOPIC_H
 #define TOPIC_H
 
-#include "client.h"
-
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
+#include "client.h"
+#include "config.h"
+#include "topic_trie.h"
 
-typedef struct Subscriber {
+/* A subscribed client, its granted QoS and the index of this subscription in client->subs. */
+typedef struct {
     Client *client;
-    struct Subscriber *next;
+    int sub_index;
+    uint8_t qos;
 } Subscriber;
 
+/*
+ * A subscription filter (possibly with '+'/'#') and the clients on it.
+ * The subscriber set is a contiguous array: small sets live in the Topic
+ * itself, larger ones move to the heap. Order is not preserved. A shared
+ * subscription ($share/{group}/{filter}) is a Topic of its own, on the
+ * same trie node as the plain filter, whose messages go to one member.
+ * The name is interned: `name` points at the shared copy, and the
+ * registry finds a Topic by comparing `name_id`.
+ */
 typedef struct Topic {
-    char name[128];
+    const char *name;
+    uint32_t name_id;
+    uint32_t hash;
+    TrieNode *node;
+    struct Topic *node_next;    /* other subscription sets on the same filter */
+    bool shared;
+    atomic_uint share_cursor;
+    int subscriber_count;
+    int local_count;        /* subscribers that are not cluster links */
+    int subscriber_cap;
     Subscriber *subscribers;
+    Subscriber inline_subscribers[TOPIC_INLINE_SUBSCRIBERS];
     struct Topic *next;
 } Topic;
 
-void storage_save_topics(const Topic *topics);
-void topic_add_subscriber(const char *topic_name, Client *client);
-void topic_remove_subscriber(const char *topic_name, Client *client);
-void topic_publish(const char *topic_name, const char *payload, int payload_len);
+void topic_init(void);
+void topic_snapshot(void);
+int topic_add_subscriber(const char *topic_name, Client *client, uint8_t qos);
+int topic_remove_subscriber(const char *topic_name, Client *client);
+void topic_remove_client(Client *client);
+void topic_move_subscriptions(Client *from, Client *to);
+void topic_publish(const char *topic_name, size_t topic_len, const uint8_t *payload, size_t payload_len, uint8_t qos,
+                   bool retain, const Client *sender, Client **congested);
+void topic_deliver_retained(const char *filter, Client *client, uint8_t qos);
 void topic_cleanup(void);
 
 #endif
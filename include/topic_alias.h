@@ -0,0 +1,45 @@
+#ifndef TOPIC_ALIAS_H
+#define TOPIC_ALIAS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mqtt_parser.h"
+
+/* A topic name the client bound to an alias (client to broker). */
+typedef struct {
+    char *name;
+    uint16_t len;
+} InboundAlias;
+
+/* A topic name the broker bound to an alias (broker to client). */
+typedef struct {
+    char *name;
+    uint32_t hash;
+    uint16_t len;
+    uint16_t prev;          /* LRU list; 0 is the list head */
+    uint16_t next;
+    uint16_t chain;         /* next alias in the same hash bucket, 0 ends it */
+} OutboundAlias;
+
+/*
+ * MQTT 5 topic aliases of one connection, in both directions. Aliases
+ * are 1-based; tables are allocated on first use.
+ */
+typedef struct {
+    InboundAlias *in;       /* TOPIC_ALIAS_MAX entries, by alias - 1 */
+    OutboundAlias *out;     /* out_max + 1 entries, by alias; out[0] heads the LRU list */
+    uint16_t *buckets;
+    uint16_t out_max;       /* the client's Topic Alias Maximum, capped at TOPIC_ALIAS_OUT_MAX */
+    uint16_t out_used;
+    uint16_t bucket_mask;
+} TopicAliases;
+
+void topic_alias_init(TopicAliases *a, uint16_t out_max);
+void topic_alias_free(TopicAliases *a);
+int topic_alias_inbound(TopicAliases *a, uint16_t alias, MqttView *topic);
+uint16_t topic_alias_outbound(TopicAliases *a, const uint8_t *topic, size_t len, uint32_t hash, bool *known);
+void topic_alias_forget(TopicAliases *a, uint16_t alias);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef TOPIC_TRIE_H
+#define TOPIC_TRIE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Level-segmented trie over topic filters. Each node is one level; exact
+ * children are kept in a sorted array of interned level ids (scanned
+ * without touching the child nodes), while '+' and '#' get dedicated
+ * slots so a match only walks the branches that can apply.
+ */
+typedef struct TrieNode {
+    struct TrieNode *parent;
+    uint32_t level;
+    uint32_t child_count;
+    uint32_t child_cap;
+    uint32_t *child_levels;
+    struct TrieNode **children;
+    struct TrieNode *plus;
+    struct TrieNode *hash;
+    void *value;
+} TrieNode;
+
+typedef struct {
+    TrieNode root;
+} Trie;
+
+typedef void (*TrieMatchFn)(void *value, void *arg);
+
+void trie_init(Trie *trie);
+void trie_destroy(Trie *trie);
+TrieNode *trie_insert(Trie *trie, const char *path, size_t len);
+void trie_prune(Trie *trie, TrieNode *node);
+void trie_match(const Trie *trie, const char *topic, size_t len, TrieMatchFn fn, void *arg);
+void trie_match_filter(const Trie *trie, const char *filter, TrieMatchFn fn, void *arg);
+void trie_visit(const Trie *trie, TrieMatchFn fn, void *arg);
+
+bool topic_filter_valid(const char *filter);
+bool topic_name_valid(const char *name, size_t len);
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+/*
+ * Minimal io_uring over the raw system calls: one ring per event loop,
+ * plus a ring of provided receive buffers (one buffer group) that
+ * multishot recvs pick from. Single-threaded: only the owning loop
+ * touches it.
+ */
+typedef struct Uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sqe_tail;          /* next SQE to hand out; published on submit */
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *ring_mem;
+    size_t ring_len;
+    size_t sqes_len;
+
+    struct io_uring_buf_ring *bufs;
+    uint8_t *buf_mem;
+    unsigned buf_count;
+    unsigned buf_size;
+    uint16_t buf_group;
+    uint16_t buf_tail;
+} Uring;
+
+int uring_init(Uring *r, unsigned entries, unsigned cq_entries);
+int uring_buffers_init(Uring *r, uint16_t group, unsigned count, unsigned size);
+void uring_close(Uring *r);
+
+int uring_accept(Uring *r, int listenfd, uint64_t tag);
+int uring_recv(Uring *r, int fd, uint64_t tag);
+int uring_poll(Uring *r, int fd, uint64_t tag);
+int uring_poll_out(Uring *r, int fd, uint64_t tag);
+int uring_sendmsg(Uring *r, int fd, const struct msghdr *msg, uint64_t tag);
+int uring_cancel(Uring *r, uint64_t target, uint64_t tag);
+
+int uring_wait(Uring *r, int timeout_ms);
+struct io_uring_cqe *uring_peek(Uring *r);
+void uring_seen(Uring *r);
+const uint8_t *uring_buffer(const Uring *r, const struct io_uring_cqe *cqe, uint16_t *bid);
+void uring_buffer_recycle(Uring *r, uint16_t bid);
+
+#endif
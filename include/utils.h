@@ -2,20 +2,13 @@
 #define UTILS_H
 
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 
-typedef enum {
-    LOG_ERROR,
-    LOG_WARNING,
-    LOG_INFO,
-    LOG_DEBUG
-} LogLevel;
+#include "log.h"
 
-void log_message(LogLevel level, const char *fmt, ...);
 void generate_client_uuid(char *buf);
-int is_ascii(const char *s);
-int read_exact(int sock, void *buf, int len);
-int write_exact(int sock, const void *buf, int len);
-int decode_remaining_length(const unsigned char *buf, int *len);
-int encode_remaining_length(unsigned char *buf, int len);
+uint64_t monotonic_ms(void);
+uint32_t fnv1a_hash(const char *s, size_t len);
 
 #endif
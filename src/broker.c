@@ -3,88 +3,625 @@
 #include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "broker.h"
 #include "utils.h"
 #include "config.h"
+#include "session.h"
+#include "store.h"
+#include "event_loop.h"
+#include "metrics.h"
+#include "share.h"
+#include "cluster.h"
 
 static bool broker_running = false;
+static pthread_t housekeeper;
+static bool housekeeper_started = false;
+static pthread_mutex_t housekeeping_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t housekeeping_stop = PTHREAD_COND_INITIALIZER;
+
+static void arm_client_timer(Client *c, uint64_t expires);
+
+/*
+ * A recovered session comes back as an offline Client on its home loop,
+ * exactly as if its connection had just closed.
+ */
+static void restore_session(void *arg, const char *client_id) {
+    (void)arg;
+    struct sockaddr_in none;
+    memset(&none, 0, sizeof(none));
+
+    Client *c = client_create(-1, client_id, none);
+    if (!c) return;
+    c->loop = event_loop_home(client_id);
+    c->closed = true;
+    atomic_store(&c->congested, true);
+    c->connected = true;
+    c->persistent = true;
+
+    Client *prev = session_connect(c);
+    if (prev) client_release(prev);
+    if (c->session_expiry != SESSION_EXPIRY_NEVER) {
+        arm_client_timer(c, monotonic_ms() + (uint64_t)c->session_expiry * 1000);
+    }
+    client_release(c);
+}
+
+static void restore_subscription(void *arg, const char *client_id, const char *filter, uint8_t qos) {
+    (void)arg;
+    Client *c = session_find(client_id);
+    if (!c) return;
+    if (topic_add_subscriber(filter, c, qos) < 0) {
+        log_message(LOG_WARNING, "Could not restore subscription of %s to '%s'", client_id, filter);
+    }
+    client_release(c);
+}
+
+static void restore_message(void *arg, const char *client_id, uint32_t seq, uint8_t qos, bool released,
+                            const uint8_t *frame, size_t len) {
+    (void)arg;
+    Client *c = session_find(client_id);
+    if (!c) return;
+    if (inflight_restore(c, seq, qos, released, frame, len) < 0) {
+        log_message(LOG_WARNING, "Could not restore message %u of %s", seq, client_id);
+    }
+    client_release(c);
+}
+
+/*
+ * File work no event loop should wait for: the topics snapshot, and
+ * pushing the session log towards disk (which also starts compactions).
+ * Runs every BROKER_TICK_MS until broker_cleanup.
+ */
+static void *housekeeping_thread(void *arg) {
+    (void)arg;
+    time_t last_snapshot = 0;
+
+    pthread_mutex_lock(&housekeeping_lock);
+    while (broker_running) {
+        pthread_mutex_unlock(&housekeeping_lock);
+
+        time_t now = time(NULL);
+        if (TOPICS_SNAPSHOT_INTERVAL > 0 && now - last_snapshot >= TOPICS_SNAPSHOT_INTERVAL) {
+            topic_snapshot();
+            last_snapshot = now;
+        }
+        store_sync();
+
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += BROKER_TICK_MS / 1000;
+        until.tv_nsec += (BROKER_TICK_MS % 1000) * 1000000L;
+        if (until.tv_nsec >= 1000000000L) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&housekeeping_lock);
+        if (broker_running) pthread_cond_timedwait(&housekeeping_stop, &housekeeping_lock, &until);
+    }
+    pthread_mutex_unlock(&housekeeping_lock);
+    return NULL;
+}
+
+/*
+ * Runs after the event loops exist (sessions are homed on them) and
+ * before they start. Cluster links start before sessions are restored so
+ * that their subscriptions count towards this node's interest.
+ */
+void broker_init(int port) {
+    static const StoreVisitor restore = { restore_session, restore_subscription, restore_message };
 
-void broker_init(void) {
     broker_running = true;
+    metrics_init();
+    topic_init();
+    share_init();
+    cluster_init(port);
+    if (store_open(&restore, NULL) < 0) {
+        log_message(LOG_WARNING, "Persistent sessions will not survive a restart");
+    }
+    housekeeper_started = pthread_create(&housekeeper, NULL, housekeeping_thread, NULL) == 0;
+    if (!housekeeper_started) {
+        log_message(LOG_ERROR, "Could not start the housekeeping thread: no topics snapshots or store syncs");
+    }
     log_message(LOG_INFO, "Broker initialized");
 }
 
 void broker_cleanup(void) {
+    pthread_mutex_lock(&housekeeping_lock);
     broker_running = false;
+    pthread_cond_signal(&housekeeping_stop);
+    pthread_mutex_unlock(&housekeeping_lock);
+    if (housekeeper_started) pthread_join(housekeeper, NULL);
+    housekeeper_started = false;
+
+    cluster_shutdown();
+    metrics_shutdown();
+    store_close();
     topic_cleanup();
+    session_cleanup();
     log_message(LOG_INFO, "Broker cleaned up");
 }
 
-void broker_handle_client(int sock) {
-    unsigned char buf[2048];
-    ssize_t n;
+/* Periodic work on the first event loop; file I/O belongs to the housekeeping thread. */
+void broker_tick(void) {
+    static time_t last_sys = 0;
+    time_t now = time(NULL);
 
-    log_message(LOG_INFO, "Handling client on socket %d", sock);
+    if (SYS_INTERVAL > 0 && now - last_sys >= SYS_INTERVAL) {
+        metrics_publish_sys();
+        last_sys = now;
+    }
+}
 
-    while (broker_running) {
-        n = read(sock, buf, sizeof(buf));
-        if (n <= 0) {
-            log_message(LOG_INFO, "Client on socket %d disconnected", sock);
-            close(sock);
-            return;
+/* Ends an offline persistent session: its subscriptions, queue and store records go. */
+static void expire_session(Client *c) {
+    log_message(LOG_INFO, "Session of client %s expired", c->client_id);
+    metrics_add(METRIC_SESSIONS_EXPIRED, 1);
+    topic_remove_client(c);
+    store_end_session(c->client_id);
+    c->persistent = false;
+    session_close(c);
+}
+
+/*
+ * One timer per client on its loop's wheel: the CONNECT deadline, then
+ * the keep-alive (1.5x the interval without a packet), then the expiry
+ * of the session once a persistent client is offline. The keep-alive
+ * timer is not moved on every packet; when it fires early it is
+ * re-armed for what is left after the last read. A paused publisher is
+ * not read, so its keep-alive waits until it is.
+ */
+static void client_timer_due(Timer *t) {
+    Client *c = t->arg;
+
+    if (c->closed) {
+        if (c->persistent) expire_session(c);
+        return;
+    }
+    if (!c->connected) {
+        log_message(LOG_WARNING, "No CONNECT on socket %d within %d ms", c->sock, CONNECT_TIMEOUT_MS);
+        metrics_add(METRIC_CLIENTS_DROPPED, 1);
+        event_loop_kick(c);
+        return;
+    }
+
+    uint64_t deadline = (c->waiting_for ? monotonic_ms() : c->last_rx) + c->keepalive_ms;
+    if (deadline > monotonic_ms()) {
+        timer_arm(&c->loop->timers, t, deadline);
+        return;
+    }
+    log_message(LOG_WARNING, "Keep-alive of client %s expired", c->client_id);
+    metrics_add(METRIC_CLIENTS_DROPPED, 1);
+    event_loop_kick(c);
+}
+
+static void arm_client_timer(Client *c, uint64_t expires) {
+    timer_cancel(&c->loop->timers, &c->timer);
+    c->timer.fn = client_timer_due;
+    timer_arm(&c->loop->timers, &c->timer, expires);
+}
+
+/* Called on the loop that owns a new (or newly moved) connection. */
+void broker_client_opened(Client *c) {
+    c->last_rx = monotonic_ms();
+    arm_client_timer(c, c->last_rx + CONNECT_TIMEOUT_MS);
+}
+
+/* Sent when the connection ends for any reason but a normal DISCONNECT. */
+static void publish_will(Client *c) {
+    Will *w = c->will;
+    if (!w) return;
+    c->will = NULL;
+    log_message(LOG_INFO, "Publishing will of client %s to '%.*s'", c->client_id, (int)w->topic_len, w->data);
+    topic_publish((const char *)w->data, w->topic_len, w->data + w->topic_len, w->payload_len, w->qos, w->retain, c,
+                  NULL);
+    free(w);
+}
+
+/* A persistent session keeps its subscriptions and goes on collecting messages until it expires. */
+void broker_client_disconnected(Client *c) {
+    log_message(LOG_INFO, "Closing connection on socket %d", c->sock);
+    if (c->loop) timer_cancel(&c->loop->timers, &c->timer);
+    if (!c->persistent) topic_remove_client(c);
+    session_close(c);
+
+    if (c->persistent && c->session_expiry != SESSION_EXPIRY_NEVER) {
+        arm_client_timer(c, monotonic_ms() + (uint64_t)c->session_expiry * 1000);
+    }
+    publish_will(c);
+}
+
+/* Copies a filter of any length out of the packet, to be freed; NULL if it cannot be a topic filter. */
+static char *filter_string(MqttView v) {
+    if (memchr(v.data, '\0', v.len)) return NULL;
+    return strndup((const char *)v.data, v.len);
+}
+
+/* Returns the SUBACK code for one filter: the granted QoS or failure. */
+static uint8_t handle_subscribe(Client *c, MqttView entry, uint8_t options) {
+    char *filter = filter_string(entry);
+    uint8_t qos = options & 0x03;
+    int granted = filter && qos < 3 ? topic_add_subscriber(filter, c, qos) : -1;
+    if (granted < 0) {
+        log_message(LOG_WARNING, "Subscription to '%.*s' refused", (int)entry.len, entry.data);
+        free(filter);
+        return 0x80;
+    }
+    log_message(LOG_INFO, "SUBSCRIBE to topic '%s' (QoS %d)", filter, granted);
+    if (c->persistent) store_subscribe(c->client_id, filter, (uint8_t)granted);
+    free(filter);
+    return (uint8_t)granted;
+}
+
+/*
+ * After the SUBACK: retained messages for every granted filter, unless
+ * an MQTT 5 subscription asked not to get them (retain handling 2) or it
+ * is a shared subscription, which never gets them.
+ */
+static void send_retained(Client *c, MqttView filters, const uint8_t *codes) {
+    MqttView entry;
+    uint8_t options = 0;
+
+    for (size_t i = 0; mqtt_next_filter(&filters, true, &entry, &options) > 0; i++) {
+        bool skip = c->protocol >= MQTT_PROTOCOL_V5 && ((options >> 4) & 0x03) == 2;
+        if (codes[i] >= 0x80 || skip) continue;
+
+        char *filter = filter_string(entry);
+        const char *unshared;
+        if (filter && !share_name(filter, &unshared)) topic_deliver_retained(filter, c, codes[i]);
+        free(filter);
+    }
+}
+
+/* Returns the MQTT 5 UNSUBACK reason: success or "no subscription existed". */
+static uint8_t handle_unsubscribe(Client *c, MqttView entry) {
+    char *filter = filter_string(entry);
+    if (!filter || topic_remove_subscriber(filter, c) < 0) {
+        free(filter);
+        return 0x11;
+    }
+    log_message(LOG_INFO, "UNSUBSCRIBE from topic '%s'", filter);
+    if (c->persistent) store_unsubscribe(c->client_id, filter);
+    free(filter);
+    return 0x00;
+}
+
+/*
+ * Takes over the session `prev` held under the same client id, after the
+ * CONNACK so resent messages follow it. A persistent session is resumed
+ * unless the new connection asks for a clean one, in which case it is
+ * discarded, store records included; a resumed session only stays in the
+ * store if the new connection is persistent too. The old connection's
+ * will is published unless its session lives on.
+ */
+static void take_over(Client *c, Client *prev, bool resumed) {
+    log_message(LOG_INFO, "Client %s taking over session from socket %d", c->client_id, prev->sock);
+    timer_cancel(&prev->loop->timers, &prev->timer);
+    if (resumed) {
+        topic_move_subscriptions(prev, c);
+        inflight_move(prev, c);
+        free(prev->will);
+        prev->will = NULL;
+    } else {
+        topic_remove_client(prev);
+    }
+    if (prev->persistent && !(resumed && c->persistent)) store_end_session(prev->client_id);
+
+    prev->persistent = false;
+    client_retain(c);
+    prev->successor = c;
+    if (!prev->closed) event_loop_kick(prev);
+    client_release(prev);
+}
+
+/* Answers a CONNECT the broker will not accept; the connection is closed after it. */
+static int refuse_connect(Client *c, uint8_t reason, uint8_t version) {
+    unsigned char reply[8];
+    int len = mqtt_encode_connack(reply, sizeof(reply), false, reason, version, NULL, 0);
+    client_send(c, reply, len);
+    return -1;
+}
+
+/* Keeps the will from CONNECT until the connection ends. */
+static int set_will(Client *c, const MqttPacket *pkt) {
+    Will *w = malloc(sizeof(Will) + pkt->will_topic.len + pkt->will_payload.len);
+    if (!w) return -1;
+    w->topic_len = pkt->will_topic.len;
+    w->payload_len = pkt->will_payload.len;
+    w->qos = pkt->will_qos;
+    w->retain = pkt->will_retain;
+    memcpy(w->data, pkt->will_topic.data, w->topic_len);
+    if (w->payload_len) memcpy(w->data + w->topic_len, pkt->will_payload.data, w->payload_len);
+    free(c->will);
+    c->will = w;
+    return 0;
+}
+
+/*
+ * MQTT 5 limits from CONNECT: Receive Maximum narrows the QoS 1/2 window,
+ * Maximum Packet Size caps what is sent to the client, Topic Alias
+ * Maximum bounds the aliases the broker may assign, Session Expiry
+ * Interval replaces Clean Session as what makes the session persistent.
+ */
+static void apply_connect_properties(Client *c, const MqttProperties *props) {
+    c->session_expiry = props->session_expiry;
+    if (MQTT_HAS_PROPERTY(props, MQTT_PROP_RECEIVE_MAXIMUM) && props->receive_maximum < c->inflight.window) {
+        c->inflight.window = (uint16_t)props->receive_maximum;
+    }
+    if (MQTT_HAS_PROPERTY(props, MQTT_PROP_MAXIMUM_PACKET_SIZE)) c->max_packet = props->maximum_packet_size;
+    topic_alias_init(&c->aliases, (uint16_t)props->topic_alias_maximum);
+}
+
+/* CONNACK, with the MQTT 5 properties the client needs from the broker. */
+static void send_connack(Client *c, bool session_present, bool assigned) {
+    unsigned char props[64], reply[80];
+    size_t n = 0;
+
+    if (c->protocol >= MQTT_PROTOCOL_V5) {
+        n += mqtt_put_property_u16(&props[n], MQTT_PROP_RECEIVE_MAXIMUM, QOS2_RX_MAX);
+        n += mqtt_put_property_u16(&props[n], MQTT_PROP_TOPIC_ALIAS_MAXIMUM, TOPIC_ALIAS_MAX);
+        if (assigned) {
+            n += mqtt_put_property_string(&props[n], MQTT_PROP_ASSIGNED_CLIENT_ID, c->client_id, strlen(c->client_id));
+        }
+    }
+    int len = mqtt_encode_connack(reply, sizeof(reply), session_present, 0x00, c->protocol, props, n);
+    if (len > 0) client_send(c, reply, len);
+}
+
+/*
+ * Binds the connection to its client id, on the loop that is home to the
+ * id (1 asks the caller to move it there first). A session already bound
+ * to the id is taken over. Username and password are parsed but not
+ * checked; there is no authentication.
+ */
+static int handle_connect(Client *c, const MqttPacket *pkt) {
+    uint8_t version = pkt->protocol_level >= MQTT_PROTOCOL_V5 ? MQTT_PROTOCOL_V5 : MQTT_PROTOCOL_V311;
+    bool v5 = version >= MQTT_PROTOCOL_V5;
+
+    if (c->connected) {
+        log_message(LOG_WARNING, "Second CONNECT on socket %d", c->sock);
+        return -1;
+    }
+
+    if (pkt->protocol_level < 3 || pkt->protocol_level > MQTT_PROTOCOL_V5) {
+        log_message(LOG_WARNING, "Unsupported protocol level %d on socket %d", pkt->protocol_level, c->sock);
+        return refuse_connect(c, v5 ? 0x84 : 0x01, version);
+    }
+
+    /* an id the broker assigned names no earlier session */
+    bool assigned = pkt->client_id.data == (const uint8_t *)pkt->assigned_id;
+
+    if (memchr(pkt->client_id.data, '\0', pkt->client_id.len) || (assigned && !v5 && !pkt->clean_session)) {
+        log_message(LOG_WARNING, "Rejecting client id of %zu bytes on socket %d", pkt->client_id.len, c->sock);
+        return refuse_connect(c, v5 ? 0x85 : 0x02, version);
+    }
+    if (v5 && MQTT_HAS_PROPERTY(&pkt->props, MQTT_PROP_AUTH_METHOD)) {
+        log_message(LOG_WARNING, "Unsupported authentication method on socket %d", c->sock);
+        return refuse_connect(c, 0x8C, version);
+    }
+    if (pkt->will && !topic_name_valid((const char *)pkt->will_topic.data, pkt->will_topic.len)) {
+        log_message(LOG_WARNING, "Invalid will topic on socket %d", c->sock);
+        return v5 ? refuse_connect(c, 0x90, version) : -1;
+    }
+
+    if (client_set_id(c, (const char *)pkt->client_id.data, pkt->client_id.len) < 0) {
+        log_message(LOG_ERROR, "Failed to allocate client id on socket %d", c->sock);
+        return -1;
+    }
+    if (cluster_is_link(c->client_id) && !cluster_is_peer(c->client_id)) {
+        log_message(LOG_WARNING, "Refusing cluster link %s from no configured peer on socket %d", c->client_id, c->sock);
+        return refuse_connect(c, v5 ? 0x85 : 0x02, version);
+    }
+
+    if (!assigned && event_loop_home(c->client_id) != c->loop) return 1;
+
+    c->protocol = version;
+    c->connected = true;
+    c->peer = cluster_is_link(c->client_id);
+    if (c->peer) c->inflight.window = CLUSTER_LINK_WINDOW;
+    if (v5) apply_connect_properties(c, &pkt->props);
+    c->persistent = !c->peer && !assigned && (v5 ? c->session_expiry > 0 : !pkt->clean_session);
+    if (pkt->will && set_will(c, pkt) < 0) return -1;
+    c->keepalive_ms = pkt->keepalive * 1500u;
+    if (c->keepalive_ms) {
+        arm_client_timer(c, c->last_rx + c->keepalive_ms);
+    } else {
+        timer_cancel(&c->loop->timers, &c->timer);
+    }
+    log_message(LOG_INFO, "CONNECT received from client %s", c->client_id);
+
+    Client *prev = session_connect(c);
+    bool resumed = prev && !pkt->clean_session && !assigned && prev->persistent;
+
+    send_connack(c, resumed, assigned);
+    if (prev) take_over(c, prev, resumed);
+    return 0;
+}
+
+/*
+ * A normal DISCONNECT discards the will; MQTT 5 can ask for it anyway
+ * (reason 0x04) and change the session expiry on the way out, though not
+ * make a session persistent that was not.
+ */
+static int handle_disconnect(Client *c, const MqttPacket *pkt) {
+    log_message(LOG_INFO, "DISCONNECT from client %s (reason 0x%02X)", c->client_id, pkt->reason);
+    if (pkt->reason != 0x04) {
+        free(c->will);
+        c->will = NULL;
+    }
+
+    if (MQTT_HAS_PROPERTY(&pkt->props, MQTT_PROP_SESSION_EXPIRY)) {
+        uint32_t expiry = pkt->props.session_expiry;
+        if (!c->persistent) {
+            if (expiry > 0) log_message(LOG_WARNING, "Client %s set a session expiry on DISCONNECT", c->client_id);
+        } else if (expiry == 0) {
+            store_end_session(c->client_id);
+            c->persistent = false;
+        } else {
+            c->session_expiry = expiry;
         }
+    }
+    return -1;
+}
+
+/*
+ * QoS 1 is acknowledged after routing. QoS 2 is routed the first time
+ * its packet id is seen and only acknowledged (PUBREC) on retransmission
+ * until the client releases the id with PUBREL. An MQTT 5 topic alias
+ * is bound or resolved first. A QoS 1/2 message that reaches a
+ * subscriber with a full queue stops the client being read until that
+ * subscriber catches up.
+ */
+static int handle_publish(Client *c, const MqttPacket *pkt) {
+    MqttView topic = pkt->topic;
+    if (MQTT_HAS_PROPERTY(&pkt->props, MQTT_PROP_TOPIC_ALIAS) &&
+        topic_alias_inbound(&c->aliases, (uint16_t)pkt->props.topic_alias, &topic) < 0) {
+        log_message(LOG_WARNING, "Invalid topic alias %u from %s", pkt->props.topic_alias, c->client_id);
+        return -1;
+    }
+    log_message(LOG_DEBUG, "PUBLISH to topic '%.*s' with %zu byte payload (QoS %d)",
+                (int)topic.len, topic.data, pkt->payload.len, pkt->qos);
 
-        MqttPacket pkt;
-        if (mqtt_parse_packet(buf, n, &pkt) < 0) {
-            log_message(LOG_ERROR, "Failed to parse MQTT packet");
-            continue;
+    if (pkt->qos > 0 && pkt->packet_id == 0) {
+        log_message(LOG_WARNING, "QoS %d PUBLISH without packet id on socket %d", pkt->qos, c->sock);
+        return -1;
+    }
+
+    bool route = true;
+    if (pkt->qos == 2) {
+        int rc = inflight_receive(c, pkt->packet_id);
+        if (rc < 0) {
+            log_message(LOG_WARNING, "Too many unreleased QoS 2 messages from %s", c->client_id);
+            return -1;
         }
+        route = rc > 0;
+    }
 
-        switch (pkt.type) {
-            case MQTT_PKT_CONNECT: {
-                log_message(LOG_INFO, "CONNECT received from client");
-                unsigned char reply[16];
-                int len = mqtt_encode_connack(reply, sizeof(reply));
-                write_exact(sock, reply, len);
-                break;
-            }
+    Client *congested = NULL;
+    if (route) {
+        topic_publish((const char *)topic.data, topic.len, pkt->payload.data, pkt->payload.len, pkt->qos,
+                      pkt->flags & 0x01, c, pkt->qos > 0 ? &congested : NULL);
+    }
 
-            case MQTT_PKT_SUBSCRIBE: {
-                log_message(LOG_INFO, "SUBSCRIBE to topic '%s'", pkt.topic);
-                Client *c = client_create(sock, pkt.client_id, (struct sockaddr_in){0});
-                topic_add_subscriber(pkt.topic, c);
-                unsigned char reply[16];
-                int len = mqtt_encode_suback(reply, sizeof(reply), 1);
-                write_exact(sock, reply, len);
-                break;
-            }
+    if (pkt->qos > 0) {
+        unsigned char reply[8];
+        MqttPacketType ack = pkt->qos == 1 ? MQTT_PKT_PUBACK : MQTT_PKT_PUBREC;
+        int len = mqtt_encode_ack(reply, sizeof(reply), ack, pkt->packet_id, 0, c->protocol);
+        client_send(c, reply, len);
+    }
+    if (congested) event_loop_pause(c, congested);
+    return 0;
+}
 
-            case MQTT_PKT_PUBLISH: {
-                log_message(LOG_INFO, "PUBLISH to topic '%s' with payload '%s'", pkt.topic, pkt.payload);
-                topic_publish(pkt.topic, pkt.payload, strlen(pkt.payload));
-                break;
-            }
+static int handle_packet(Client *c, const unsigned char *buf, size_t len) {
+    MqttPacket pkt = {0};
+    uint64_t start = metrics_clock();
+    int parsed = mqtt_parse_packet(buf, len, c->protocol, &pkt);
+    metrics_record(STAGE_PARSE, metrics_clock() - start);
+    if (parsed < 0) {
+        log_message(LOG_ERROR, "Malformed packet of type %d on socket %d", buf[0] >> 4, c->sock);
+        return -1;
+    }
+
+    if (!c->connected && pkt.type != MQTT_PKT_CONNECT) {
+        log_message(LOG_WARNING, "Packet type %d before CONNECT on socket %d", pkt.type, c->sock);
+        return -1;
+    }
 
-            case MQTT_PKT_DISCONNECT: {
-                log_message(LOG_INFO, "DISCONNECT from client on socket %d", sock);
-                close(sock);
-                return;
+    switch (pkt.type) {
+        case MQTT_PKT_CONNECT:
+            return handle_connect(c, &pkt);
+
+        case MQTT_PKT_SUBSCRIBE:
+        case MQTT_PKT_UNSUBSCRIBE: {
+            bool subscribe = pkt.type == MQTT_PKT_SUBSCRIBE;
+            uint8_t codes_buf[64];
+            uint8_t *codes = pkt.filter_count <= sizeof(codes_buf) ? codes_buf : malloc(pkt.filter_count);
+            if (!codes) return -1;
+
+            MqttView rest = pkt.filters, entry;
+            uint8_t options = 0;
+            size_t n = 0;
+            while (mqtt_next_filter(&rest, subscribe, &entry, &options) > 0) {
+                codes[n++] = subscribe ? handle_subscribe(c, entry, options) : handle_unsubscribe(c, entry);
             }
 
-            case MQTT_PKT_PINGREQ: {
-                log_message(LOG_INFO, "PINGREQ received");
-                unsigned char reply[8];
-                int len = mqtt_encode_pingresp(reply, sizeof(reply));
-                write_exact(sock, reply, len);
-                break;
+            size_t cap = 16 + n;
+            unsigned char *reply = malloc(cap);
+            int len = -1;
+            if (reply) {
+                len = subscribe ? mqtt_encode_suback(reply, cap, pkt.packet_id, codes, n, c->protocol)
+                                : mqtt_encode_unsuback(reply, cap, pkt.packet_id, codes, n, c->protocol);
             }
+            if (len > 0) client_send(c, reply, len);
+            free(reply);
+            if (subscribe) send_retained(c, pkt.filters, codes);
+            if (codes != codes_buf) free(codes);
+            break;
+        }
+
+        case MQTT_PKT_PUBLISH:
+            return handle_publish(c, &pkt);
+
+        case MQTT_PKT_PUBACK:
+        case MQTT_PKT_PUBREC:
+        case MQTT_PKT_PUBCOMP:
+            return inflight_ack(c, pkt.type, pkt.packet_id);
+
+        case MQTT_PKT_PUBREL: {
+            inflight_release(c, pkt.packet_id);
+            unsigned char reply[8];
+            int len = mqtt_encode_ack(reply, sizeof(reply), MQTT_PKT_PUBCOMP, pkt.packet_id, 0, c->protocol);
+            client_send(c, reply, len);
+            break;
+        }
+
+        case MQTT_PKT_DISCONNECT:
+            return handle_disconnect(c, &pkt);
 
-            default:
-                log_message(LOG_ERROR, "Unhandled MQTT packet type %d", pkt.type);
-                break;
+        case MQTT_PKT_PINGREQ: {
+            log_message(LOG_DEBUG, "PINGREQ received");
+            unsigned char reply[8];
+            int len = mqtt_encode_pingresp(reply, sizeof(reply));
+            client_send(c, reply, len);
+            break;
         }
+
+        default:
+            log_message(LOG_ERROR, "Unhandled MQTT packet type %d", pkt.type);
+            break;
+    }
+
+    return 0;
+}
+
+/*
+ * Processes every complete packet buffered for the client; partial ones
+ * stay in the ring until the rest arrives, and so does everything after a
+ * PUBLISH that paused the client. Returns -1 when the connection must be
+ * closed, 1 when it must move to another event loop (the packet that
+ * asked for it is left in the ring).
+ */
+int broker_handle_input(Client *c) {
+    const uint8_t *frame;
+    size_t frame_len;
+    int rc = 0;
+
+    if (!broker_running) return -1;
+
+    while (!c->waiting_for && (rc = mqtt_decoder_next(&c->decoder, &c->in, &frame, &frame_len)) > 0) {
+        int result = handle_packet(c, frame, frame_len);
+        if (result > 0) return 1;
+        metrics_add(METRIC_PACKETS_IN + (frame[0] >> 4), 1);
+        ring_consume(&c->in, frame_len);
+        if (result < 0) return -1;
     }
 
-    close(sock);
+    if (rc < 0) {
+        log_message(LOG_ERROR, "Malformed packet stream on socket %d", c->sock);
+        return -1;
+    }
+    return 0;
 }
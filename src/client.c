@@ -2,25 +2,381 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 #include "client.h"
+#include "config.h"
+#include "event_loop.h"
+#include "metrics.h"
+#include "mqtt_encoder.h"
 #include "utils.h"
+#include "pool.h"
+
+static Pool client_pool = POOL_INITIALIZER(Client);
 
 Client *client_create(int sock, const char *id, struct sockaddr_in addr) {
-    Client *c = (Client *)malloc(sizeof(Client));
+    Client *c = pool_alloc(&client_pool);
     if (!c) return NULL;
 
+    c->client_id = strdup(id ? id : "");
+    if (!c->client_id) {
+        pool_free(&client_pool, c);
+        return NULL;
+    }
     c->sock = sock;
-    strncpy(c->client_id, id ? id : "", sizeof(c->client_id) - 1);
-    c->client_id[sizeof(c->client_id) - 1] = '\0';
     c->addr = addr;
+    c->loop = NULL;
+    atomic_init(&c->refs, 1);
+    c->closed = false;
+    c->connected = false;
+    c->kicked = false;
+    c->persistent = false;
+    c->peer = false;
+    c->id_hash = 0;
+    c->subs = NULL;
+    c->sub_count = 0;
+    c->sub_cap = 0;
+    ring_init(&c->in);
+    mqtt_decoder_init(&c->decoder);
+    inflight_init(c);
+    timer_init(&c->timer, NULL, c);
+    c->last_rx = 0;
+    c->keepalive_ms = 0;
+    c->session_expiry = SESSION_EXPIRY_DEFAULT;
+    c->max_packet = UINT32_MAX;
+    topic_alias_init(&c->aliases, 0);
+    c->will = NULL;
+    c->protocol = MQTT_PROTOCOL_V311;
+    c->out_queue = NULL;
+    c->out_head = 0;
+    c->out_count = 0;
+    c->out_cap = 0;
+    c->out_offset = 0;
+    c->out_bytes = 0;
+    c->out_sending = 0;
+    c->out_blocked = false;
+    c->rx_armed = false;
+    atomic_init(&c->congested, false);
+    atomic_init(&c->backlog, 0);
+    atomic_init(&c->posted, 0);
+    atomic_init(&c->watched, false);
+    c->waiting_for = NULL;
+    c->paused_next = NULL;
+    c->out_policy = OUT_QUEUE_POLICY;
+    c->out_dropped = 0;
+    c->flush_pending = false;
+    c->flush_next = NULL;
     c->next = NULL;
+    c->successor = NULL;
 
     return c;
 }
 
+/* Replaces the client id with a copy of `len` bytes of `id`. */
+int client_set_id(Client *c, const char *id, size_t len) {
+    char *copy = strndup(id, len);
+    if (!copy) return -1;
+    free(c->client_id);
+    c->client_id = copy;
+    return 0;
+}
+
+/* Called by the owning loop: closes the socket and drops the loop's reference. */
 void client_destroy(Client *c) {
     if (!c) return;
+
+    inflight_stop(c);
+    if (c->sock >= 0) metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+    c->closed = true;
+    atomic_store_explicit(&c->congested, true, memory_order_relaxed);
     close(c->sock);
-    free(c);
+    c->sock = -1;
+    client_release(c);
+}
+
+static void pop_head(Client *c) {
+    Frame *f = c->out_queue[c->out_head];
+    size_t rest = frame_size(f) - c->out_offset;
+    c->out_bytes -= rest;
+    metrics_add(METRIC_QUEUED_FRAMES, -1);
+    metrics_add(METRIC_QUEUED_BYTES, -(int64_t)rest);
+    frame_release(f);
+    c->out_head = (c->out_head + 1) % c->out_cap;
+    c->out_count--;
+    c->out_offset = 0;
+}
+
+void client_retain(Client *c) {
+    atomic_fetch_add_explicit(&c->refs, 1, memory_order_relaxed);
+}
+
+void client_release(Client *c) {
+    if (atomic_fetch_sub_explicit(&c->refs, 1, memory_order_acq_rel) == 1) {
+        ring_free(&c->in);
+        while (c->out_count > 0) {
+            pop_head(c);
+        }
+        free(c->out_queue);
+        free(c->subs);
+        inflight_free(c);
+        free(c->will);
+        topic_alias_free(&c->aliases);
+        free(c->client_id);
+        if (c->successor) client_release(c->successor);
+        pool_free(&client_pool, c);
+    }
+}
+
+/*
+ * Fills up to `max` entries of `iov` from the head of the output queue;
+ * *frames and *offered get how many frames and bytes it covers.
+ */
+size_t client_out_iov(const Client *c, struct iovec *iov, size_t max, size_t *frames, size_t *offered) {
+    size_t iovcnt = 0;
+    size_t i = 0;
+
+    *offered = 0;
+    for (; i < c->out_count && iovcnt + 2 <= max; i++) {
+        Frame *f = c->out_queue[(c->out_head + i) % c->out_cap];
+        int n = frame_iov(f, i == 0 ? c->out_offset : 0, &iov[iovcnt]);
+        for (int j = 0; j < n; j++) *offered += iov[iovcnt + j].iov_len;
+        iovcnt += n;
+    }
+    *frames = i;
+    return iovcnt;
+}
+
+/* Releases what the socket took: whole frames, and the written part of the next one. */
+void client_sent(Client *c, size_t written) {
+    metrics_add(METRIC_BYTES_OUT, (int64_t)written);
+    while (written > 0) {
+        Frame *f = c->out_queue[c->out_head];
+        size_t rest = frame_size(f) - c->out_offset;
+        if (written < rest) {
+            c->out_offset += written;
+            c->out_bytes -= written;
+            metrics_add(METRIC_QUEUED_BYTES, -(int64_t)written);
+            break;
+        }
+        written -= rest;
+        pop_head(c);
+    }
+}
+
+static int flush_queue(Client *c) {
+    while (c->out_count > 0) {
+        struct iovec iov[OUT_IOV_MAX];
+        size_t frames, offered;
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = client_out_iov(c, iov, OUT_IOV_MAX, &frames, &offered);
+
+        ssize_t n = sendmsg(c->sock, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                c->out_blocked = true;
+                atomic_store_explicit(&c->congested, true, memory_order_relaxed);
+                return 0;
+            }
+            return -1;
+        }
+
+        client_sent(c, (size_t)n);
+        if ((size_t)n < offered) {
+            c->out_blocked = true;
+            atomic_store_explicit(&c->congested, true, memory_order_relaxed);
+            return 0;
+        }
+    }
+
+    atomic_store_explicit(&c->congested, false, memory_order_relaxed);
+    return 0;
+}
+
+/*
+ * Writes queued frames with one gathering sendmsg() per OUT_IOV_MAX
+ * iovecs (a frame with a borrowed tail takes two). Stops as soon as the
+ * socket takes less than offered; the event loop calls again on EPOLLOUT.
+ */
+int client_flush(Client *c) {
+    uint64_t start = metrics_clock();
+    int rc = flush_queue(c);
+    metrics_record(STAGE_FLUSH, metrics_clock() - start);
+    return rc;
+}
+
+static int grow_queue(Client *c) {
+    size_t new_cap = c->out_cap ? c->out_cap * 2 : 8;
+    Frame **grown = malloc(new_cap * sizeof(Frame *));
+    if (!grown) return -1;
+    for (size_t i = 0; i < c->out_count; i++) {
+        grown[i] = c->out_queue[(c->out_head + i) % c->out_cap];
+    }
+    free(c->out_queue);
+    c->out_queue = grown;
+    c->out_head = 0;
+    c->out_cap = new_cap;
+    return 0;
+}
+
+/* A cluster link carries the traffic of many clients, so it gets more room. */
+static bool queue_full(const Client *c, size_t extra) {
+    if (c->peer) {
+        return c->out_count + 1 > CLUSTER_LINK_QUEUE_FRAMES || c->out_bytes + extra > CLUSTER_LINK_QUEUE_BYTES;
+    }
+    return c->out_count + 1 > OUT_QUEUE_MAX_FRAMES ||
+           c->out_bytes + extra > OUT_QUEUE_MAX_BYTES;
+}
+
+/* Removes the oldest droppable frame that has not started going out. */
+static bool drop_oldest(Client *c) {
+    size_t first = c->out_offset > 0 ? 1 : 0;
+    if (c->out_sending > first) first = c->out_sending;
+
+    for (size_t i = first; i < c->out_count; i++) {
+        size_t idx = (c->out_head + i) % c->out_cap;
+        Frame *f = c->out_queue[idx];
+        if (!f->droppable) continue;
+
+        for (size_t j = i; j > 0; j--) {
+            c->out_queue[(c->out_head + j) % c->out_cap] =
+                c->out_queue[(c->out_head + j - 1) % c->out_cap];
+        }
+        c->out_head = (c->out_head + 1) % c->out_cap;
+        c->out_count--;
+        c->out_bytes -= frame_size(f);
+        metrics_add(METRIC_QUEUED_FRAMES, -1);
+        metrics_add(METRIC_QUEUED_BYTES, -(int64_t)frame_size(f));
+        frame_release(f);
+        return true;
+    }
+    return false;
+}
+
+static int drop_connection(Client *c) {
+    log_message(LOG_WARNING, "Write to socket %d failed, dropping connection", c->sock);
+    metrics_add(METRIC_CLIENTS_DROPPED, 1);
+    shutdown(c->sock, SHUT_RDWR);
+    return -1;
+}
+
+/*
+ * Queues a reference to a shared frame; the owning event loop writes the
+ * queue out with client_flush() at the end of its current iteration, so
+ * frames queued together leave in one syscall. A full iovec batch is
+ * written right away unless the socket is known to be full. Returns 0 when queued, 1
+ * when the frame was dropped by the overflow policy, -1 on failure.
+ * Frames that are not droppable (protocol replies) are always queued.
+ */
+int client_send_frame(Client *c, Frame *f) {
+    if (c->closed) return -1;
+
+    size_t size = frame_size(f);
+    if (size > c->max_packet) {
+        c->out_dropped++;
+        metrics_add(METRIC_MESSAGES_DROPPED, 1);
+        log_message(LOG_DEBUG, "Frame of %zu bytes is over the packet limit of socket %d, dropped", size, c->sock);
+        return 1;
+    }
+    if (f->droppable && queue_full(c, size)) {
+        switch (c->out_policy) {
+            case QUEUE_DISCONNECT:
+                log_message(LOG_WARNING, "Output queue of socket %d overflowed, disconnecting", c->sock);
+                return drop_connection(c);
+
+            case QUEUE_DROP_OLDEST:
+                while (queue_full(c, size) && drop_oldest(c)) {
+                    c->out_dropped++;
+                    metrics_add(METRIC_MESSAGES_DROPPED, 1);
+                }
+                if (!queue_full(c, size)) break;
+                /* fall through - nothing older could go */
+
+            case QUEUE_DROP_NEWEST:
+                c->out_dropped++;
+                metrics_add(METRIC_MESSAGES_DROPPED, 1);
+                log_message(LOG_DEBUG, "Output queue of socket %d full, dropped frame (%lu so far)",
+                            c->sock, c->out_dropped);
+                return 1;
+        }
+    }
+
+    if (c->out_count == c->out_cap && grow_queue(c) < 0) return -1;
+
+    frame_retain(f);
+    c->out_queue[(c->out_head + c->out_count) % c->out_cap] = f;
+    c->out_count++;
+    c->out_bytes += size;
+    metrics_add(METRIC_QUEUED_FRAMES, 1);
+    metrics_add(METRIC_QUEUED_BYTES, (int64_t)size);
+    metrics_add(METRIC_PACKETS_OUT + (f->data[0] >> 4), 1);
+
+    if (c->out_count >= OUT_IOV_MAX && !c->out_blocked) {
+        if (event_loop_flush(c) < 0) return drop_connection(c);
+    } else {
+        event_loop_schedule_flush(c);
+    }
+    return 0;
+}
+
+/*
+ * True when QoS 0 messages for the client must come as the shared 3.1.1
+ * encoding, to get a header of their own (MQTT 5 with topic aliases).
+ * Fixed once the client is connected, so publishers may read it.
+ */
+bool client_aliases_topics(const Client *c) {
+    return c->protocol >= MQTT_PROTOCOL_V5 && c->aliases.out_max > 0;
+}
+
+/*
+ * Sends `msg`, a shared QoS 0 MQTT 3.1.1 PUBLISH, with this client's own
+ * header in front of its payload. For MQTT 5 the topic goes by alias
+ * where possible; a packet that binds a new alias may not be dropped by
+ * the queue policy, as later ones depend on it. Returns like
+ * client_send_frame().
+ */
+int client_send_publish(Client *c, Frame *msg, uint8_t qos, uint16_t packet_id, bool dup) {
+    if (qos == 0 && c->protocol < MQTT_PROTOCOL_V5) return client_send_frame(c, msg);
+
+    uint16_t alias = 0;
+    bool known = false;
+    MqttView topic;
+    if (client_aliases_topics(c) && mqtt_publish_topic(msg, &topic) == 0) {
+        alias = topic_alias_outbound(&c->aliases, topic.data, topic.len, msg->topic_hash, &known);
+    }
+
+    Frame *f = mqtt_publish_reframe(msg, qos, packet_id, dup, c->protocol, alias, known);
+    if (!f) {
+        if (alias && !known) topic_alias_forget(&c->aliases, alias);
+        return -1;
+    }
+    f->droppable = qos == 0 && msg->droppable && (known || !alias);
+
+    int rc = client_send_frame(c, f);
+    if (rc != 0 && alias && !known) topic_alias_forget(&c->aliases, alias);
+    frame_release(f);
+    return rc;
+}
+
+/*
+ * Whether the client should be passed over by a shared subscription: it
+ * is offline, its socket is full, or its QoS 1/2 window is. Safe from
+ * any thread.
+ */
+bool client_backpressured(const Client *c) {
+    return atomic_load_explicit(&c->congested, memory_order_relaxed) ||
+           atomic_load_explicit(&c->backlog, memory_order_relaxed) >= c->inflight.window;
+}
+
+int client_send(Client *c, const void *buf, size_t len) {
+    Frame *f = frame_copy(buf, len);
+    if (!f) return -1;
+    int rc = client_send_frame(c, f);
+    frame_release(f);
+    return rc;
 }
@@ -0,0 +1,773 @@
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "cluster.h"
+#include "client.h"
+#include "codec.h"
+#include "config.h"
+#include "inflight.h"
+#include "mqtt_encoder.h"
+#include "topic.h"
+#include "utils.h"
+
+/*
+ * Cluster mode: brokers started with BROKER_CLUSTER_PEERS=host:port,...
+ * route publishes to each other. Every node dials one MQTT 5 connection,
+ * its link, to every peer as client "$cluster/<node id>" and subscribes
+ * on it (QoS 1, no retained messages) to the filters its own clients
+ * hold. Both nodes of a pair dial, so a pair is joined by two TCP
+ * connections, each carrying the publishes for the node that dialed it.
+ * A node is known by its entry in the peer list, and accepts a link only
+ * from an id naming one of its own peers. That subscription set is the
+ * node's interest summary, and the peer indexes it in the same filter
+ * trie as any other: a publish leaves a node only for the peers with a
+ * matching subscriber, once per peer however many of its filters match
+ * (topic_publish() remembers the links it has served), and goes out with
+ * the rest of the link's queue in the event loop's batched writes.
+ *
+ * The summary changes on a filter's first and last local subscriber.
+ * Changes are queued here and this module's thread sends them to every
+ * linked peer, several filters per packet; a link that (re)connects gets
+ * the whole set. What a link delivers is published locally but never
+ * onto another link (split horizon), which keeps a full mesh loop-free.
+ */
+
+#define LINK_OPTIONS 0x21       /* QoS 1, retain handling 2: no retained messages on subscribe */
+#define READS_PER_WAKEUP 16     /* RX_CHUNK_SIZE reads from one link before the others get a turn */
+
+typedef enum {
+    PEER_DOWN,          /* waiting to dial */
+    PEER_CONNECTING,    /* TCP connect in progress */
+    PEER_HANDSHAKE,     /* CONNECT sent, waiting for the CONNACK */
+    PEER_UP
+} PeerState;
+
+typedef struct {
+    char name[64];              /* host:port as configured */
+    struct sockaddr_in addr;
+    int fd;
+    PeerState state;
+    RingBuffer in;
+    MqttDecoder decoder;
+    uint8_t *out;               /* bytes not yet written, from out_off to out_len */
+    size_t out_off;
+    size_t out_len;
+    size_t out_cap;
+    uint16_t next_id;
+    uint64_t retry_at;
+    uint64_t last_rx;
+    uint64_t last_tx;
+    Client sender;              /* stands for the peer as the publisher of what its link delivers */
+    Client *waiting_for;        /* local subscriber whose backlog keeps the link unread */
+    char sender_id[80];         /* the peer's link id, backing sender.client_id */
+} Peer;
+
+/*
+ * A filter some local subscription set is on, and how many are. Changes
+ * from different threads can arrive out of order, so the count may dip
+ * below zero for a while; only a positive one is in the set.
+ */
+typedef struct Interest {
+    struct Interest *next;
+    uint32_t hash;
+    int refs;
+    char filter[];
+} Interest;
+
+/* A filter that entered (add) or left the interest set, not yet sent to the peers. */
+typedef struct Change {
+    struct Change *next;
+    bool add;
+    char filter[];
+} Change;
+
+static Peer peers[CLUSTER_MAX_PEERS];
+static int peer_count;
+static char link_id[80];
+static bool enabled;
+static atomic_bool running;
+static int wakefd = -1;
+static pthread_t thread;
+
+static pthread_mutex_t interest_lock = PTHREAD_MUTEX_INITIALIZER;
+static Interest **interest;
+static size_t interest_buckets;
+static size_t interest_count;
+static Change *changes;
+static Change **changes_tail = &changes;
+
+bool cluster_is_link(const char *client_id) {
+    return strncmp(client_id, CLUSTER_LINK_PREFIX, strlen(CLUSTER_LINK_PREFIX)) == 0;
+}
+
+/* A link id naming a configured peer; any other "$cluster/" id is refused. */
+bool cluster_is_peer(const char *client_id) {
+    for (int i = 0; i < peer_count; i++) {
+        if (strcmp(client_id, peers[i].sender.client_id) == 0) return true;
+    }
+    return false;
+}
+
+static void wake(void) {
+    uint64_t one = 1;
+    if (write(wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        log_message(LOG_ERROR, "Could not wake the cluster thread");
+    }
+}
+
+/* A subscriber some link may be waiting for has drained (event_loop_wake_paused). */
+void cluster_wake_paused(void) {
+    if (enabled) wake();
+}
+
+/* Whether the link is read: not while a local subscriber it fed catches up. */
+static bool link_paused(Peer *p) {
+    if (p->waiting_for && !inflight_watch(p->waiting_for)) {
+        client_release(p->waiting_for);
+        p->waiting_for = NULL;
+    }
+    return p->waiting_for != NULL;
+}
+
+// ---------------------------------------------------------------------
+// Interest set
+// ---------------------------------------------------------------------
+
+static Interest **interest_slot(const char *filter, uint32_t hash) {
+    Interest **link = &interest[hash & (interest_buckets - 1)];
+    while (*link && ((*link)->hash != hash || strcmp((*link)->filter, filter) != 0)) link = &(*link)->next;
+    return link;
+}
+
+static void grow_interest(void) {
+    size_t new_count = interest_buckets ? interest_buckets * 2 : TOPIC_TABLE_INITIAL_SIZE;
+    Interest **grown = calloc(new_count, sizeof(Interest *));
+    if (!grown) return;
+
+    for (size_t i = 0; i < interest_buckets; i++) {
+        Interest *e = interest[i];
+        while (e) {
+            Interest *next = e->next;
+            size_t b = e->hash & (new_count - 1);
+            e->next = grown[b];
+            grown[b] = e;
+            e = next;
+        }
+    }
+
+    free(interest);
+    interest = grown;
+    interest_buckets = new_count;
+}
+
+/* Counts one subscription set more (add) or less on the filter; true if it entered or left the set. */
+static bool interest_count_change(const char *filter, bool add) {
+    if (interest_count >= interest_buckets) grow_interest();
+    if (!interest_buckets) return false;
+
+    uint32_t hash = fnv1a_hash(filter, strlen(filter));
+    Interest **link = interest_slot(filter, hash);
+    Interest *e = *link;
+    if (!e) {
+        size_t len = strlen(filter);
+        e = malloc(sizeof(Interest) + len + 1);
+        if (!e) {
+            log_message(LOG_ERROR, "Failed to record cluster interest in '%s'", filter);
+            return false;
+        }
+        e->next = NULL;
+        e->hash = hash;
+        e->refs = 0;
+        memcpy(e->filter, filter, len + 1);
+        *link = e;
+        interest_count++;
+    }
+
+    e->refs += add ? 1 : -1;
+    bool changed = add ? e->refs == 1 : e->refs == 0;
+    if (e->refs == 0) {
+        *link = e->next;
+        free(e);
+        interest_count--;
+    }
+    return changed;
+}
+
+static void queue_change(const char *filter, bool add) {
+    size_t len = strlen(filter);
+    Change *c = malloc(sizeof(Change) + len + 1);
+    if (!c) {
+        log_message(LOG_ERROR, "Failed to queue cluster interest change for '%s'", filter);
+        return;
+    }
+    c->next = NULL;
+    c->add = add;
+    memcpy(c->filter, filter, len + 1);
+    *changes_tail = c;
+    changes_tail = &c->next;
+}
+
+/*
+ * Called by the topic registry, after it drops its lock, when a filter
+ * got its first local subscription set (add) or lost its last. Filters
+ * of "$" topics ($SYS) are per node and stay out of the summary.
+ */
+void cluster_interest(const char *filter, bool add) {
+    if (!enabled || filter[0] == '$') return;
+
+    pthread_mutex_lock(&interest_lock);
+    bool changed = interest_count_change(filter, add);
+    if (changed) queue_change(filter, add);
+    pthread_mutex_unlock(&interest_lock);
+
+    if (changed) wake();
+}
+
+// ---------------------------------------------------------------------
+// Links
+// ---------------------------------------------------------------------
+
+/* Room for `n` more bytes of output; NULL when out of memory. */
+static uint8_t *out_reserve(Peer *p, size_t n) {
+    if (p->out_len + n > p->out_cap) {
+        size_t cap = p->out_cap ? p->out_cap : RX_CHUNK_SIZE;
+        while (cap < p->out_len + n) cap *= 2;
+        uint8_t *grown = realloc(p->out, cap);
+        if (!grown) return NULL;
+        p->out = grown;
+        p->out_cap = cap;
+    }
+    uint8_t *at = p->out + p->out_len;
+    p->out_len += n;
+    return at;
+}
+
+static int out_put(Peer *p, const void *data, size_t n) {
+    uint8_t *at = out_reserve(p, n);
+    if (!at) return -1;
+    memcpy(at, data, n);
+    return 0;
+}
+
+static int flush_out(Peer *p) {
+    while (p->out_off < p->out_len) {
+        ssize_t n = send(p->fd, p->out + p->out_off, p->out_len - p->out_off, MSG_NOSIGNAL);
+        if (n > 0) {
+            p->out_off += (size_t)n;
+            p->last_tx = monotonic_ms();
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+        return -1;
+    }
+    p->out_off = p->out_len = 0;
+    return 0;
+}
+
+static void link_down(Peer *p, const char *why) {
+    if (p->state == PEER_UP) {
+        log_message(LOG_WARNING, "Link to peer %s lost: %s", p->name, why);
+    } else {
+        log_message(LOG_DEBUG, "Could not link to peer %s: %s", p->name, why);
+    }
+    close(p->fd);
+    p->fd = -1;
+    p->state = PEER_DOWN;
+    if (p->waiting_for) client_release(p->waiting_for);
+    p->waiting_for = NULL;
+    ring_free(&p->in);
+    ring_init(&p->in);
+    mqtt_decoder_init(&p->decoder);
+    p->out_off = p->out_len = 0;
+    p->retry_at = monotonic_ms() + CLUSTER_RETRY_MS;
+}
+
+/* MQTT 5 CONNECT with Clean Start and no session expiry: a link keeps no state across connections. */
+static int send_connect(Peer *p) {
+    static const uint8_t protocol[] = { 0, 4, 'M', 'Q', 'T', 'T', MQTT_PROTOCOL_V5, 0x02 };
+    uint8_t props[8];
+    size_t props_len = mqtt_put_property_u16(props, MQTT_PROP_RECEIVE_MAXIMUM, CLUSTER_LINK_WINDOW);
+    size_t id_len = strlen(link_id);
+    size_t body = sizeof(protocol) + 2 + codec_varint_size(props_len) + props_len + 2 + id_len;
+
+    uint8_t *b = out_reserve(p, 1 + codec_varint_size(body) + body);
+    if (!b) return -1;
+    *b++ = MQTT_PKT_CONNECT << 4;
+    b += codec_varint_encode(b, body);
+    memcpy(b, protocol, sizeof(protocol));
+    b += sizeof(protocol);
+    codec_store_be16(b, CLUSTER_KEEPALIVE);
+    b += 2;
+    b += codec_varint_encode(b, props_len);
+    memcpy(b, props, props_len);
+    b += props_len;
+    codec_store_be16(b, (uint16_t)id_len);
+    memcpy(b + 2, link_id, id_len);
+    return 0;
+}
+
+/* One SUBSCRIBE (add) or UNSUBSCRIBE packet for `count` filters. */
+static int send_filters(Peer *p, bool add, const char *const *filters, size_t count) {
+    size_t body = 3;    /* packet id, empty property block */
+    for (size_t i = 0; i < count; i++) body += 2 + strlen(filters[i]) + (add ? 1 : 0);
+
+    uint8_t *b = out_reserve(p, 1 + codec_varint_size(body) + body);
+    if (!b) return -1;
+    *b++ = add ? (MQTT_PKT_SUBSCRIBE << 4 | 0x02) : (MQTT_PKT_UNSUBSCRIBE << 4 | 0x02);
+    b += codec_varint_encode(b, body);
+    if (++p->next_id == 0) p->next_id = 1;
+    codec_store_be16(b, p->next_id);
+    b += 2;
+    *b++ = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t len = strlen(filters[i]);
+        codec_store_be16(b, (uint16_t)len);
+        memcpy(b + 2, filters[i], len);
+        b += 2 + len;
+        if (add) *b++ = LINK_OPTIONS;
+    }
+    return 0;
+}
+
+/* Subscribes a new link to the whole interest set. */
+static int send_interest(Peer *p) {
+    const char *batch[CLUSTER_FILTERS_PER_PACKET];
+    size_t n = 0, count = 0;
+    int rc = 0;
+
+    pthread_mutex_lock(&interest_lock);
+    for (size_t i = 0; i < interest_buckets && rc == 0; i++) {
+        for (const Interest *e = interest[i]; e && rc == 0; e = e->next) {
+            if (e->refs <= 0) continue;
+            batch[n++] = e->filter;
+            count++;
+            if (n == CLUSTER_FILTERS_PER_PACKET) {
+                rc = send_filters(p, true, batch, n);
+                n = 0;
+            }
+        }
+    }
+    if (n > 0 && rc == 0) rc = send_filters(p, true, batch, n);
+    pthread_mutex_unlock(&interest_lock);
+
+    if (rc == 0) log_message(LOG_INFO, "Linked to peer %s, subscribing to %zu filter(s)", p->name, count);
+    return rc;
+}
+
+/*
+ * Sends the queued interest changes to every linked peer, a run of
+ * changes of one kind per packet. A link that came up meanwhile may get
+ * a filter twice; the end state is the same.
+ */
+static void send_changes(void) {
+    pthread_mutex_lock(&interest_lock);
+    Change *list = changes;
+    changes = NULL;
+    changes_tail = &changes;
+    pthread_mutex_unlock(&interest_lock);
+
+    while (list) {
+        const char *batch[CLUSTER_FILTERS_PER_PACKET];
+        bool add = list->add;
+        size_t n = 0;
+        Change *end = list;
+        while (end && end->add == add && n < CLUSTER_FILTERS_PER_PACKET) {
+            batch[n++] = end->filter;
+            end = end->next;
+        }
+
+        for (int i = 0; i < peer_count; i++) {
+            Peer *p = &peers[i];
+            if (p->state == PEER_UP && send_filters(p, add, batch, n) < 0) link_down(p, "out of memory");
+        }
+        while (list != end) {
+            Change *next = list->next;
+            free(list);
+            list = next;
+        }
+    }
+}
+
+static void dial(Peer *p, uint64_t now) {
+    p->retry_at = now + CLUSTER_RETRY_MS;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return;
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    p->fd = fd;
+    p->last_rx = p->last_tx = now;
+    if (connect(fd, (struct sockaddr *)&p->addr, sizeof(p->addr)) == 0 || errno == EINPROGRESS) {
+        p->state = PEER_CONNECTING;
+    } else {
+        link_down(p, strerror(errno));
+    }
+}
+
+static void connected(Peer *p) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) err = errno;
+    if (err) {
+        link_down(p, strerror(err));
+        return;
+    }
+    p->state = PEER_HANDSHAKE;
+    if (send_connect(p) < 0) link_down(p, "out of memory");
+}
+
+/* The bytes after a packet's fixed header. */
+static const uint8_t *packet_body(const uint8_t *frame, size_t len, size_t *body_len) {
+    uint32_t remaining;
+    int n = codec_varint_decode(frame + 1, len - 1, &remaining);
+    if (n <= 0) return NULL;
+    *body_len = remaining;
+    return frame + 1 + n;
+}
+
+static int link_up(Peer *p, const uint8_t *frame, size_t len) {
+    size_t body_len;
+    const uint8_t *body = packet_body(frame, len, &body_len);
+    if (p->state != PEER_HANDSHAKE || !body || body_len < 2) return -1;
+    if (body[1] != 0x00) {
+        log_message(LOG_WARNING, "Peer %s refused the link (reason 0x%02X)", p->name, body[1]);
+        return -1;
+    }
+    p->state = PEER_UP;
+    return send_interest(p);
+}
+
+/* A filter the peer would not take means missing messages, not a broken link. */
+static void check_suback(const Peer *p, const uint8_t *frame, size_t len) {
+    size_t body_len;
+    const uint8_t *body = packet_body(frame, len, &body_len);
+    uint32_t props_len;
+    int n = body && body_len > 2 ? codec_varint_decode(body + 2, body_len - 2, &props_len) : -1;
+    if (n <= 0 || 2 + (size_t)n + props_len > body_len) return;
+
+    size_t refused = 0;
+    for (size_t i = 2 + (size_t)n + props_len; i < body_len; i++) refused += body[i] >= 0x80;
+    if (refused > 0) log_message(LOG_WARNING, "Peer %s refused %zu filter(s)", p->name, refused);
+}
+
+/*
+ * A message the peer routed to this node: published here for local
+ * subscribers only. A subscriber that cannot keep up stops the link
+ * being read, as it would a local publisher (event_loop_pause).
+ */
+static int forwarded(Peer *p, const uint8_t *frame, size_t len) {
+    MqttPacket pkt = {0};
+    Client *congested = NULL;
+    if (mqtt_parse_packet(frame, len, MQTT_PROTOCOL_V5, &pkt) < 0) {
+        log_message(LOG_ERROR, "Malformed PUBLISH from peer %s", p->name);
+        return -1;
+    }
+    topic_publish((const char *)pkt.topic.data, pkt.topic.len, pkt.payload.data, pkt.payload.len, pkt.qos, false,
+                  &p->sender, pkt.qos > 0 ? &congested : NULL);
+    if (congested && !p->waiting_for) p->waiting_for = congested;
+    else if (congested) client_release(congested);
+
+    if (pkt.qos > 0) {
+        uint8_t ack[8];
+        int n = mqtt_encode_ack(ack, sizeof(ack), MQTT_PKT_PUBACK, pkt.packet_id, 0, MQTT_PROTOCOL_V5);
+        if (n < 0 || out_put(p, ack, (size_t)n) < 0) return -1;
+    }
+    return 0;
+}
+
+static int handle_packet(Peer *p, const uint8_t *frame, size_t len) {
+    switch (frame[0] >> 4) {
+        case MQTT_PKT_CONNACK:
+            return link_up(p, frame, len);
+        case MQTT_PKT_PUBLISH:
+            return p->state == PEER_UP ? forwarded(p, frame, len) : -1;
+        case MQTT_PKT_SUBACK:
+            check_suback(p, frame, len);
+            return 0;
+        case MQTT_PKT_UNSUBACK:
+        case MQTT_PKT_PINGRESP:
+            return 0;
+        case MQTT_PKT_DISCONNECT:
+            log_message(LOG_INFO, "Peer %s closed the link", p->name);
+            return -1;
+        default:
+            log_message(LOG_WARNING, "Unexpected packet type %d from peer %s", frame[0] >> 4, p->name);
+            return -1;
+    }
+}
+
+/* Reads and handles what the peer sent; NULL, or why the link has to go. */
+static const char *read_peer(Peer *p) {
+    for (int i = 0; i < READS_PER_WAKEUP; i++) {
+        if (ring_reserve(&p->in, RX_CHUNK_SIZE) < 0) return "out of memory";
+
+        struct iovec iov[2];
+        int iovcnt = ring_free_iov(&p->in, iov);
+        ssize_t n = readv(p->fd, iov, iovcnt);
+        if (n == 0) return "connection closed";
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return strerror(errno);
+            ring_shrink(&p->in, RX_IDLE_BUFFER_SIZE);
+            return NULL;
+        }
+
+        ring_commit(&p->in, (size_t)n);
+        p->last_rx = monotonic_ms();
+
+        const uint8_t *frame;
+        size_t frame_len;
+        int rc;
+        while ((rc = mqtt_decoder_next(&p->decoder, &p->in, &frame, &frame_len)) > 0) {
+            int result = handle_packet(p, frame, frame_len);
+            ring_consume(&p->in, frame_len);
+            if (result < 0) return "protocol error";
+        }
+        if (rc < 0) return "malformed packet stream";
+    }
+    return NULL;
+}
+
+/* Dials a link that is down once its retry is due, and keeps an idle one alive. */
+static void tend(Peer *p, uint64_t now) {
+    uint64_t keepalive = (uint64_t)CLUSTER_KEEPALIVE * 1000;
+
+    if (p->state == PEER_DOWN) {
+        if (now >= p->retry_at) dial(p, now);
+        return;
+    }
+    if (p->waiting_for) p->last_rx = now;      /* not read on purpose */
+    if (now - p->last_rx > (p->state == PEER_UP ? keepalive * 3 / 2 : keepalive)) {
+        link_down(p, "timed out");
+        return;
+    }
+    if (p->state == PEER_UP && now - p->last_tx >= keepalive / 2) {
+        static const uint8_t pingreq[] = { MQTT_PKT_PINGREQ << 4, 0 };
+        if (out_put(p, pingreq, sizeof(pingreq)) < 0) link_down(p, "out of memory");
+        p->last_tx = now;
+    }
+}
+
+static void *cluster_thread(void *arg) {
+    (void)arg;
+    struct pollfd fds[CLUSTER_MAX_PEERS + 1];
+    Peer *polled[CLUSTER_MAX_PEERS];
+
+    while (atomic_load(&running)) {
+        uint64_t now = monotonic_ms();
+        for (int i = 0; i < peer_count; i++) tend(&peers[i], now);
+        send_changes();
+
+        int n = 0;
+        fds[n++] = (struct pollfd){ .fd = wakefd, .events = POLLIN };
+        for (int i = 0; i < peer_count; i++) {
+            Peer *p = &peers[i];
+            if (p->state == PEER_DOWN) continue;
+            if (p->state != PEER_CONNECTING && flush_out(p) < 0) {
+                link_down(p, strerror(errno));
+                continue;
+            }
+            short events = p->state == PEER_CONNECTING ? POLLOUT : link_paused(p) ? 0 : POLLIN;
+            if (p->out_len > p->out_off) events |= POLLOUT;
+            polled[n - 1] = p;
+            fds[n++] = (struct pollfd){ .fd = p->fd, .events = events };
+        }
+
+        if (poll(fds, (nfds_t)n, CLUSTER_RETRY_MS) < 0 && errno != EINTR) {
+            log_message(LOG_ERROR, "Cluster poll failed: %s", strerror(errno));
+            break;
+        }
+        if (fds[0].revents & POLLIN) {
+            uint64_t count;
+            if (read(wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN) break;
+        }
+
+        for (int i = 1; i < n; i++) {
+            Peer *p = polled[i - 1];
+            if (!fds[i].revents || p->state == PEER_DOWN) continue;
+            if (p->waiting_for && !(fds[i].revents & (POLLERR | POLLHUP))) continue;
+            if (p->state == PEER_CONNECTING) {
+                connected(p);
+                continue;
+            }
+            const char *why = read_peer(p);
+            if (why) link_down(p, why);
+        }
+    }
+
+    /* a clean DISCONNECT, so the peers drop the links at once */
+    for (int i = 0; i < peer_count; i++) {
+        static const uint8_t disconnect[] = { MQTT_PKT_DISCONNECT << 4, 0 };
+        Peer *p = &peers[i];
+        if (p->state == PEER_UP && out_put(p, disconnect, sizeof(disconnect)) == 0) flush_out(p);
+    }
+    return NULL;
+}
+
+// ---------------------------------------------------------------------
+// Setup
+// ---------------------------------------------------------------------
+
+static int resolve(const char *host, const char *port, struct sockaddr_in *addr) {
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0) return -1;
+    memcpy(addr, res->ai_addr, sizeof(*addr));
+    freeaddrinfo(res);
+    return 0;
+}
+
+/* This node's own port on an address of one of its interfaces: the node itself, not a peer. */
+static bool is_own_address(const struct sockaddr_in *addr, int port) {
+    if (ntohs(addr->sin_port) != port) return false;
+
+    struct sockaddr_in local = *addr;
+    local.sin_port = 0;
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return false;
+    bool own = bind(fd, (struct sockaddr *)&local, sizeof(local)) == 0;
+    close(fd);
+    return own;
+}
+
+/* Adds a peer, or names this node after its own entry. */
+static void add_peer(char *entry, int port, char *node, size_t node_size) {
+    char *colon = strrchr(entry, ':');
+    if (!colon || colon == entry || !colon[1]) {
+        log_message(LOG_WARNING, "Ignoring cluster peer '%s': expected host:port", entry);
+        return;
+    }
+    *colon = '\0';
+
+    struct sockaddr_in addr;
+    if (resolve(entry, colon + 1, &addr) < 0) {
+        log_message(LOG_WARNING, "Ignoring cluster peer '%s:%s': unknown host", entry, colon + 1);
+        return;
+    }
+    if (is_own_address(&addr, port)) {
+        snprintf(node, node_size, "%.40s:%.8s", entry, colon + 1);
+        return;
+    }
+    if (peer_count == CLUSTER_MAX_PEERS) {
+        log_message(LOG_WARNING, "Ignoring cluster peer '%s:%s': at most %d peers", entry, colon + 1, CLUSTER_MAX_PEERS);
+        return;
+    }
+
+    Peer *p = &peers[peer_count++];
+    memset(p, 0, sizeof(*p));
+    snprintf(p->name, sizeof(p->name), "%.40s:%.8s", entry, colon + 1);
+    p->addr = addr;
+    p->fd = -1;
+    p->state = PEER_DOWN;
+    ring_init(&p->in);
+    mqtt_decoder_init(&p->decoder);
+    snprintf(p->sender_id, sizeof(p->sender_id), "%s%.40s:%.8s", CLUSTER_LINK_PREFIX, entry, colon + 1);
+    p->sender.client_id = p->sender_id;
+    p->sender.peer = true;
+    p->sender.id_hash = fnv1a_hash(p->sender.client_id, strlen(p->sender.client_id));
+}
+
+/*
+ * Reads the peers (BROKER_CLUSTER_PEERS) and starts linking to them.
+ * The node's own address may be listed, so every node can get the same
+ * peer list, and its entry there names it; BROKER_NODE_ID overrides the
+ * name, which must still be how the peers list this node, and a node
+ * missing from the list goes by host:port. Without peers the broker runs
+ * standalone.
+ */
+void cluster_init(int port) {
+    const char *env = getenv("BROKER_CLUSTER_PEERS");
+    if (!env || !*env) return;
+
+    char node[56] = "";
+    char *list = strdup(env);
+    if (!list) return;
+    char *save = NULL;
+    for (char *entry = strtok_r(list, ", ", &save); entry; entry = strtok_r(NULL, ", ", &save)) {
+        add_peer(entry, port, node, sizeof(node));
+    }
+    free(list);
+    if (peer_count == 0) return;
+
+    const char *id = getenv("BROKER_NODE_ID");
+    if (id && *id) {
+        snprintf(node, sizeof(node), "%.48s", id);
+    } else if (!node[0]) {
+        char host[48];
+        if (gethostname(host, sizeof(host)) < 0) strcpy(host, "localhost");
+        host[sizeof(host) - 1] = '\0';
+        snprintf(node, sizeof(node), "%.40s:%d", host, port);
+    }
+    snprintf(link_id, sizeof(link_id), "%s%s", CLUSTER_LINK_PREFIX, node);
+
+    wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakefd < 0) {
+        log_message(LOG_ERROR, "Cluster mode disabled: %s", strerror(errno));
+        return;
+    }
+    enabled = true;
+    atomic_store(&running, true);
+    if (pthread_create(&thread, NULL, cluster_thread, NULL) != 0) {
+        log_message(LOG_ERROR, "Cluster mode disabled: could not start its thread");
+        enabled = false;
+        close(wakefd);
+        wakefd = -1;
+        return;
+    }
+    log_message(LOG_INFO, "Cluster node %s with %d peer(s)", link_id + strlen(CLUSTER_LINK_PREFIX), peer_count);
+}
+
+void cluster_shutdown(void) {
+    if (!enabled) return;
+    atomic_store(&running, false);
+    wake();
+    pthread_join(thread, NULL);
+
+    for (int i = 0; i < peer_count; i++) {
+        Peer *p = &peers[i];
+        if (p->fd >= 0) close(p->fd);
+        if (p->waiting_for) client_release(p->waiting_for);
+        ring_free(&p->in);
+        free(p->out);
+    }
+    peer_count = 0;
+    close(wakefd);
+    wakefd = -1;
+
+    pthread_mutex_lock(&interest_lock);
+    enabled = false;
+    for (size_t i = 0; i < interest_buckets; i++) {
+        Interest *e = interest[i];
+        while (e) {
+            Interest *next = e->next;
+            free(e);
+            e = next;
+        }
+    }
+    free(interest);
+    interest = NULL;
+    interest_buckets = interest_count = 0;
+    while (changes) {
+        Change *next = changes->next;
+        free(changes);
+        changes = next;
+    }
+    changes_tail = &changes;
+    pthread_mutex_unlock(&interest_lock);
+}
@@ -0,0 +1,225 @@
+#include <string.h>
+
+#include "codec.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define CODEC_SSE2 1
+#endif
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define CODEC_AVX2 1
+#endif
+
+/*
+ * Wire-format primitives for the parser and the encoder: MQTT Variable
+ * Byte Integers, big-endian fields at any alignment, and UTF-8 / topic
+ * name validation.
+ *
+ * Validation skips runs of plain ASCII 16 or 32 bytes at a time (SSE2,
+ * or AVX2 where the CPU has it) and only decodes the multi-byte UTF-8
+ * sequences it stops at; the scalar versions do the same a byte at a
+ * time and are what other architectures get.
+ */
+
+/*
+ * Decodes a Variable Byte Integer. Returns the bytes it took, 0 when
+ * `buf` ends inside it, -1 when it runs past four bytes.
+ */
+int codec_varint_decode(const uint8_t *buf, size_t len, uint32_t *value) {
+    /* one and two bytes cover every packet under 16 KiB */
+    if (len > 0 && buf[0] < 0x80) {
+        *value = buf[0];
+        return 1;
+    }
+    if (len > 1 && buf[1] < 0x80) {
+        *value = (buf[0] & 0x7Fu) | (uint32_t)buf[1] << 7;
+        return 2;
+    }
+
+    if (len >= 4) {
+        /* the first byte without a continuation bit ends it; the 7-bit groups are then packed together */
+        uint32_t w = buf[0] | (uint32_t)buf[1] << 8 | (uint32_t)buf[2] << 16 | (uint32_t)buf[3] << 24;
+        uint32_t stops = ~w & 0x80808080u;
+        if (!stops) return -1;
+        int n = __builtin_ctz(stops) / 8 + 1;
+        w &= 0xFFFFFFFFu >> (32 - 8 * n);
+        *value = (w & 0x7F) | (w >> 1 & 0x3F80) | (w >> 2 & 0x1FC000) | (w >> 3 & 0xFE00000);
+        return n;
+    }
+
+    uint32_t v = 0;
+    for (size_t i = 0; i < len; i++) {
+        v |= (uint32_t)(buf[i] & 0x7F) << (7 * i);
+        if (buf[i] < 0x80) {
+            *value = v;
+            return (int)i + 1;
+        }
+    }
+    return 0;
+}
+
+size_t codec_varint_size(uint32_t value) {
+    return 1 + (value >= 0x80) + (value >= 0x4000) + (value >= 0x200000);
+}
+
+/* Writes `value` (at most CODEC_VARINT_MAX); returns the bytes written. */
+size_t codec_varint_encode(uint8_t *buf, uint32_t value) {
+    size_t n = codec_varint_size(value);
+    buf[n - 1] = (uint8_t)(value >> (7 * (n - 1)));
+    switch (n) {
+        case 4: buf[2] = (uint8_t)(value >> 14 | 0x80); /* fall through */
+        case 3: buf[1] = (uint8_t)(value >> 7 | 0x80);  /* fall through */
+        case 2: buf[0] = (uint8_t)(value | 0x80);
+    }
+    return n;
+}
+
+uint16_t codec_load_be16(const uint8_t *p) {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    v = __builtin_bswap16(v);
+#endif
+    return v;
+}
+
+uint32_t codec_load_be32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+void codec_store_be16(uint8_t *p, uint16_t v) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    v = __builtin_bswap16(v);
+#endif
+    memcpy(p, &v, sizeof(v));
+}
+
+void codec_store_be32(uint8_t *p, uint32_t v) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    memcpy(p, &v, sizeof(v));
+}
+
+// ---------------------------------------------------------------------
+// Validation
+// ---------------------------------------------------------------------
+
+/* Leading bytes that are ASCII and none of NUL, c1 or c2. */
+typedef size_t (*AsciiRunFn)(const uint8_t *s, size_t len, uint8_t c1, uint8_t c2);
+
+static size_t ascii_run_scalar(const uint8_t *s, size_t len, uint8_t c1, uint8_t c2) {
+    size_t i = 0;
+    while (i < len && s[i] < 0x80 && s[i] != 0 && s[i] != c1 && s[i] != c2) i++;
+    return i;
+}
+
+#ifdef CODEC_SSE2
+static size_t ascii_run_sse2(const uint8_t *s, size_t len, uint8_t c1, uint8_t c2) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i v1 = _mm_set1_epi8((char)c1);
+    const __m128i v2 = _mm_set1_epi8((char)c2);
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i stop = _mm_or_si128(_mm_cmpeq_epi8(v, zero), _mm_or_si128(_mm_cmpeq_epi8(v, v1), _mm_cmpeq_epi8(v, v2)));
+        unsigned mask = (unsigned)_mm_movemask_epi8(_mm_or_si128(stop, v));    /* v's top bits: non-ASCII */
+        if (mask) return i + (size_t)__builtin_ctz(mask);
+    }
+    return i + ascii_run_scalar(s + i, len - i, c1, c2);
+}
+#endif
+
+#ifdef CODEC_AVX2
+__attribute__((target("avx2")))
+static size_t ascii_run_avx2(const uint8_t *s, size_t len, uint8_t c1, uint8_t c2) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i v1 = _mm256_set1_epi8((char)c1);
+    const __m256i v2 = _mm256_set1_epi8((char)c2);
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+        __m256i stop = _mm256_or_si256(_mm256_cmpeq_epi8(v, zero),
+                                       _mm256_or_si256(_mm256_cmpeq_epi8(v, v1), _mm256_cmpeq_epi8(v, v2)));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(_mm256_or_si256(stop, v));
+        if (mask) return i + (size_t)__builtin_ctz(mask);
+    }
+    return i + ascii_run_scalar(s + i, len - i, c1, c2);
+}
+#endif
+
+static size_t ascii_run(const uint8_t *s, size_t len, uint8_t c1, uint8_t c2) {
+#ifdef CODEC_AVX2
+    if (len >= 32 && __builtin_cpu_supports("avx2")) return ascii_run_avx2(s, len, c1, c2);
+#endif
+#ifdef CODEC_SSE2
+    return ascii_run_sse2(s, len, c1, c2);
+#else
+    return ascii_run_scalar(s, len, c1, c2);
+#endif
+}
+
+/* Length of the well-formed UTF-8 sequence a non-ASCII byte starts, 0 if it is not one (overlong, surrogate, > U+10FFFF). */
+static size_t utf8_sequence(const uint8_t *s, size_t len) {
+    uint8_t lead = s[0], low = 0x80, high = 0xBF;
+    size_t n;
+
+    if (lead >= 0xC2 && lead <= 0xDF) {
+        n = 2;
+    } else if (lead >= 0xE0 && lead <= 0xEF) {
+        n = 3;
+        if (lead == 0xE0) low = 0xA0;
+        if (lead == 0xED) high = 0x9F;
+    } else if (lead >= 0xF0 && lead <= 0xF4) {
+        n = 4;
+        if (lead == 0xF0) low = 0x90;
+        if (lead == 0xF4) high = 0x8F;
+    } else {
+        return 0;
+    }
+
+    if (len < n || s[1] < low || s[1] > high) return 0;
+    for (size_t i = 2; i < n; i++) {
+        if ((s[i] & 0xC0) != 0x80) return 0;
+    }
+    return n;
+}
+
+static bool validate(const uint8_t *s, size_t len, uint8_t c1, uint8_t c2, AsciiRunFn run) {
+    size_t i = 0;
+    while (i < len) {
+        i += run(s + i, len - i, c1, c2);
+        if (i == len) break;
+        if (s[i] < 0x80) return false;
+        size_t n = utf8_sequence(s + i, len - i);
+        if (n == 0) return false;
+        i += n;
+    }
+    return true;
+}
+
+/* Well-formed UTF-8 without U+0000, as MQTT requires of every string. */
+bool codec_utf8_valid(const uint8_t *s, size_t len) {
+    return validate(s, len, 0, 0, ascii_run);
+}
+
+/* A valid MQTT string with no wildcard characters; emptiness is the caller's check. */
+bool codec_topic_valid(const uint8_t *s, size_t len) {
+    return validate(s, len, '+', '#', ascii_run);
+}
+
+bool codec_utf8_valid_scalar(const uint8_t *s, size_t len) {
+    return validate(s, len, 0, 0, ascii_run_scalar);
+}
+
+bool codec_topic_valid_scalar(const uint8_t *s, size_t len) {
+    return validate(s, len, '+', '#', ascii_run_scalar);
+}
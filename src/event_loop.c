@@ -0,0 +1,1001 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sched.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <strings.h>
+
+#include "event_loop.h"
+#include "broker.h"
+#include "client.h"
+#include "cluster.h"
+#include "metrics.h"
+#include "config.h"
+#include "utils.h"
+#include "pool.h"
+#include "uring.h"
+
+/*
+ * Work handed from one worker to the worker that owns the target client:
+ * a frame to send, a request to close the connection, or a connection
+ * that has just moved over to this worker.
+ */
+typedef enum {
+    DELIVERY_FRAME,
+    DELIVERY_KICK,
+    DELIVERY_ADOPT
+} DeliveryKind;
+
+typedef struct Delivery {
+    MpscNode node;
+    Client *client;
+    Frame *frame;
+    uint8_t qos;
+    uint8_t kind;
+} Delivery;
+
+/*
+ * With io_uring, a request's user_data is the object it is for (pool
+ * and slab objects are 16-byte aligned) with the operation in the low
+ * bits. Each outstanding recv, send or POLLOUT holds a reference on its
+ * client.
+ */
+enum {
+    OP_ACCEPT = 1,
+    OP_WAKE,
+    OP_RECV,
+    OP_SEND,
+    OP_WRITABLE,
+    OP_CANCEL
+};
+#define OP_MASK 0xFu
+
+/* A client's sendmsg in flight; the iovecs point into the queued frames. */
+typedef struct {
+    Client *client;
+    struct msghdr msg;
+    size_t frames;
+    size_t offered;
+    struct iovec *iov;              /* iov_inline, or an allocation for a long queue */
+    struct iovec iov_inline[OUT_IOV_MAX];
+} UringSend;
+
+static volatile sig_atomic_t loop_running = 0;
+static EventLoop *loops = NULL;
+static int loop_count = 0;
+static int loops_started = 0;
+static IoBackend backend = IO_BACKEND;
+static _Thread_local EventLoop *current_loop = NULL;
+static Pool delivery_pool = POOL_INITIALIZER(Delivery);
+static Pool send_pool = POOL_INITIALIZER(UringSend);
+
+static uint64_t op_tag(const void *p, int op) {
+    return (uint64_t)(uintptr_t)p | (uint64_t)op;
+}
+
+static void wake_loop(EventLoop *loop) {
+    uint64_t one = 1;
+    ssize_t rc = write(loop->wakefd, &one, sizeof(one));
+    (void)rc;
+}
+
+void event_loop_stop(void) {
+    loop_running = 0;
+    for (int i = 0; i < loop_count; i++) {
+        wake_loop(&loops[i]);
+    }
+}
+
+/*
+ * A session taken over on this loop forwards to the connection that took
+ * it. Whether a QoS 0 frame is ready to go or the shared 3.1.1 encoding to be
+ * re-framed was decided by the client it was addressed to, which may
+ * since have been taken over.
+ */
+static void send_to_client(Client *c, Frame *f, uint8_t qos) {
+    bool reframe = client_aliases_topics(c);
+    while (c->successor) c = c->successor;
+
+    if (qos > 0) {
+        inflight_publish(c, f, qos);
+    } else if (reframe) {
+        client_send_publish(c, f, 0, 0, false);
+    } else {
+        client_send_frame(c, f);
+    }
+}
+
+/*
+ * Passes references through the owner's inbox; the eventfd write is only
+ * paid when the owner is not already due to wake up.
+ */
+static int post(EventLoop *owner, Client *c, Frame *f, uint8_t qos, DeliveryKind kind) {
+    Delivery *d = pool_alloc(&delivery_pool);
+    if (!d) {
+        log_message(LOG_ERROR, "Failed to allocate delivery for socket %d", c->sock);
+        return -1;
+    }
+    client_retain(c);
+    if (f) frame_retain(f);
+    d->client = c;
+    d->frame = f;
+    d->qos = qos;
+    d->kind = kind;
+    if (qos > 0) atomic_fetch_add_explicit(&c->posted, 1, memory_order_relaxed);
+
+    mpsc_push(&owner->inbox, &d->node);
+    if (atomic_exchange_explicit(&owner->wake_pending, 1, memory_order_acq_rel) == 0) {
+        wake_loop(owner);
+    }
+    return 0;
+}
+
+/*
+ * Sends a frame to a client from any worker; with qos > 0 it is a QoS 0
+ * PUBLISH the owner re-frames for QoS delivery. The owner queues it directly;
+ * any other worker posts it to the owner's inbox.
+ */
+void event_loop_deliver(Client *c, Frame *f, uint8_t qos) {
+    EventLoop *owner = c->loop;
+
+    if (owner == current_loop || !owner) {
+        send_to_client(c, f, qos);
+        return;
+    }
+
+    post(owner, c, f, qos, DELIVERY_FRAME);
+}
+
+/*
+ * Closes a client from any worker. The owner does it after its current
+ * batch of events, so no pending event can refer to a freed client.
+ */
+void event_loop_kick(Client *c) {
+    EventLoop *owner = c->loop;
+
+    if (owner == current_loop || !owner) {
+        c->kicked = true;
+        event_loop_schedule_flush(c);
+        return;
+    }
+
+    post(owner, c, NULL, 0, DELIVERY_KICK);
+}
+
+/* Called on the owning loop; the client is flushed once the current batch of events is handled. */
+void event_loop_schedule_flush(Client *c) {
+    EventLoop *loop = c->loop;
+    if (!loop || c->flush_pending) return;
+
+    client_retain(c);
+    c->flush_pending = true;
+    c->flush_next = loop->flush_list;
+    loop->flush_list = c;
+}
+
+static void close_client(EventLoop *loop, Client *c);
+static int read_client(Client *c);
+static void adopt_client(EventLoop *loop, Client *c);
+static void hand_over(EventLoop *loop, Client *c);
+static int watch_client(EventLoop *loop, Client *c);
+
+/*
+ * Publisher backpressure, on the publisher's loop: a QoS 1/2 message
+ * found `wait`, a subscriber with INFLIGHT_PENDING_MAX messages queued,
+ * so `c` is not read again until that backlog falls under
+ * INFLIGHT_RESUME_BELOW or the subscriber goes, and TCP slows it down.
+ * A client with a backlog of its own is never paused (the acks that
+ * drain it arrive on its connection), so waits cannot form a cycle.
+ * Input already read (with io_uring, whatever the recv delivered before
+ * its cancel) stays buffered until it resumes. Takes over the caller's
+ * reference on `wait`.
+ */
+void event_loop_pause(Client *c, Client *wait) {
+    EventLoop *loop = c->loop;
+
+    if (c->waiting_for || c == wait || c->closed || c->kicked ||
+        atomic_load_explicit(&c->backlog, memory_order_relaxed) >= INFLIGHT_RESUME_BELOW || !inflight_watch(wait)) {
+        client_release(wait);
+        return;
+    }
+
+    log_message(LOG_DEBUG, "Pausing client %s until the backlog of %s drains", c->client_id, wait->client_id);
+    metrics_add(METRIC_PUBLISHERS_PAUSED, 1);
+    client_retain(c);
+    c->waiting_for = wait;
+    c->paused_next = loop->paused;
+    loop->paused = c;
+    if (loop->ring && c->rx_armed) uring_cancel(loop->ring, op_tag(c, OP_RECV), op_tag(NULL, OP_CANCEL));
+}
+
+/* Has `loop` (every loop and the cluster links if NULL) look again at its paused publishers. Any thread. */
+void event_loop_wake_paused(EventLoop *loop) {
+    for (int i = 0; i < loop_count; i++) {
+        EventLoop *l = loop ? loop : &loops[i];
+        atomic_store(&l->recheck, true);
+        if (atomic_exchange_explicit(&l->wake_pending, 1, memory_order_acq_rel) == 0) wake_loop(l);
+        if (loop) return;
+    }
+    cluster_wake_paused();
+}
+
+/* Takes a publisher off the paused list, dropping the list's references. */
+static void unpause(EventLoop *loop, Client *c) {
+    for (Client **link = &loop->paused; *link; link = &(*link)->paused_next) {
+        if (*link == c) {
+            *link = c->paused_next;
+            break;
+        }
+    }
+    c->paused_next = NULL;
+    client_release(c->waiting_for);
+    c->waiting_for = NULL;
+    client_release(c);
+}
+
+/* Reads the publishers whose subscriber has drained, or who have a backlog of their own now. */
+static void resume_publishers(EventLoop *loop) {
+    Client *c = loop->paused;
+
+    while (c) {
+        Client *next = c->paused_next;
+        if (atomic_load_explicit(&c->backlog, memory_order_relaxed) < INFLIGHT_RESUME_BELOW &&
+            inflight_watch(c->waiting_for)) {
+            c = next;
+            continue;
+        }
+
+        /* input it had buffered comes first; it can only pause it again, ahead of `next` on the list */
+        client_retain(c);
+        unpause(loop, c);
+        c->last_rx = loop->now;
+        int rc = broker_handle_input(c);
+        if (rc == 0 && loop->ring) {
+            if (!c->rx_armed && !c->waiting_for && watch_client(loop, c) < 0) rc = -1;
+        } else if (rc == 0) {
+            rc = read_client(c);
+        }
+        if (rc < 0) close_client(loop, c);
+        else if (rc > 0) hand_over(loop, c);
+        client_release(c);
+        c = next;
+    }
+}
+
+/*
+ * Hands the client's queue, up to URING_SEND_IOV_MAX iovecs of it, to
+ * the ring as one sendmsg; it goes out with the next wait. Frames queued
+ * meanwhile wait for its completion. Returns 1 when the ring is full
+ * and the client should try again next iteration.
+ */
+static int submit_send(EventLoop *loop, Client *c) {
+    if (c->out_count == 0) return 0;
+
+    UringSend *s = pool_alloc(&send_pool);
+    if (!s) return -1;
+
+    size_t max = c->out_count * 2 < URING_SEND_IOV_MAX ? c->out_count * 2 : URING_SEND_IOV_MAX;
+    s->iov = s->iov_inline;
+    if (max > OUT_IOV_MAX) {
+        s->iov = malloc(max * sizeof(struct iovec));
+        if (!s->iov) {
+            s->iov = s->iov_inline;
+            max = OUT_IOV_MAX;
+        }
+    }
+
+    memset(&s->msg, 0, sizeof(s->msg));
+    s->msg.msg_iov = s->iov;
+    s->msg.msg_iovlen = client_out_iov(c, s->iov, max, &s->frames, &s->offered);
+    if (uring_sendmsg(loop->ring, c->sock, &s->msg, op_tag(s, OP_SEND)) < 0) {
+        if (s->iov != s->iov_inline) free(s->iov);
+        pool_free(&send_pool, s);
+        return 1;
+    }
+
+    client_retain(c);
+    s->client = c;
+    c->out_sending = s->frames;
+    c->out_blocked = true;
+    return 0;
+}
+
+/*
+ * Writes the client's queue out, on its owner loop: in place with epoll,
+ * as a queued sendmsg with io_uring, so the sends of every client
+ * flushed in one iteration are submitted together.
+ */
+int event_loop_flush(Client *c) {
+    if (!c->loop || !c->loop->ring) return client_flush(c);
+
+    int rc = submit_send(c->loop, c);
+    if (rc > 0) event_loop_schedule_flush(c);
+    return rc < 0 ? -1 : 0;
+}
+
+static void flush_clients(EventLoop *loop) {
+    Client *retry = NULL;
+
+    while (loop->flush_list) {
+        Client *c = loop->flush_list;
+        loop->flush_list = c->flush_next;
+        c->flush_next = NULL;
+        c->flush_pending = false;
+
+        if (!c->closed && c->kicked) {
+            log_message(LOG_INFO, "Closing socket %d", c->sock);
+            close_client(loop, c);
+        } else if (!c->closed && !c->out_blocked) {
+            int rc = loop->ring ? submit_send(loop, c) : client_flush(c);
+            if (rc < 0) {
+                close_client(loop, c);
+            } else if (rc > 0) {
+                /* ring full: keep it scheduled, and the reference with it */
+                c->flush_pending = true;
+                c->flush_next = retry;
+                retry = c;
+                continue;
+            }
+        } else if (!c->closed && c->out_blocked) {
+            /* io_uring: frames are waiting behind a send still in flight */
+            atomic_store_explicit(&c->congested, true, memory_order_relaxed);
+        }
+        client_release(c);
+    }
+    loop->flush_list = retry;
+}
+
+/*
+ * Handles posted deliveries. With io_uring a pass stops after
+ * URING_INBOX_BATCH of them: the frames it queues only leave once their
+ * sends complete, so an unbounded pass could overflow a subscriber's
+ * queue that the socket would have taken.
+ */
+static void drain_inbox(EventLoop *loop) {
+    uint64_t count;
+    ssize_t rc = read(loop->wakefd, &count, sizeof(count));
+    (void)rc;
+    atomic_store_explicit(&loop->wake_pending, 0, memory_order_release);
+    if (atomic_load_explicit(&loop->recheck, memory_order_relaxed) && atomic_exchange(&loop->recheck, false)) {
+        resume_publishers(loop);
+    }
+
+    size_t budget = loop->ring ? URING_INBOX_BATCH : SIZE_MAX;
+    loop->inbox_backlog = false;
+
+    MpscNode *n;
+    while ((n = mpsc_pop(&loop->inbox)) != NULL) {
+        Delivery *d = (Delivery *)n;
+        switch (d->kind) {
+            case DELIVERY_FRAME:
+                send_to_client(d->client, d->frame, d->qos);
+                frame_release(d->frame);
+                if (d->qos > 0) inflight_unpost(d->client);
+                break;
+            case DELIVERY_KICK:
+                d->client->kicked = true;
+                event_loop_schedule_flush(d->client);
+                break;
+            case DELIVERY_ADOPT:
+                adopt_client(loop, d->client);
+                break;
+        }
+        client_release(d->client);
+        pool_free(&delivery_pool, d);
+        if (--budget == 0) {
+            loop->inbox_backlog = true;
+            break;
+        }
+    }
+}
+
+/* Starts reading the socket: registers it with epoll, or arms a multishot recv. */
+static int watch_client(EventLoop *loop, Client *c) {
+    if (loop->ring) {
+        if (uring_recv(loop->ring, c->sock, op_tag(c, OP_RECV)) < 0) return -1;
+        client_retain(c);
+        c->rx_armed = true;
+        return 0;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, c->sock, &ev);
+}
+
+static void close_client(EventLoop *loop, Client *c) {
+    /* best effort, so a final CONNACK still reaches a rejected client */
+    if (c->out_count > 0 && !c->out_blocked) client_flush(c);
+    broker_client_disconnected(c);
+    if (c->waiting_for) unpause(loop, c);
+    if (loop->ring) {
+        /* ends the outstanding recv and send, whose completions drop their references */
+        shutdown(c->sock, SHUT_RDWR);
+    } else {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, c->sock, NULL);
+    }
+    client_destroy(c);
+}
+
+static void post_adopt(EventLoop *loop, Client *c) {
+    if (post(c->loop, c, NULL, 0, DELIVERY_ADOPT) < 0) {
+        c->loop = loop;
+        broker_client_disconnected(c);
+        client_destroy(c);
+    }
+}
+
+/*
+ * Moves a connection whose CONNECT (client_id is already copied out of it)
+ * names a session homed on another loop. It has sent nothing yet, so it
+ * is on no flush list; the CONNECT stays in its input buffer for the new
+ * owner to handle. With io_uring the recv is cancelled first, and the
+ * move is posted from its last completion, so any bytes it still
+ * delivers land in the input buffer ahead of the new owner's reads.
+ */
+static void hand_over(EventLoop *loop, Client *c) {
+    EventLoop *home = event_loop_home(c->client_id);
+
+    if (!loop->ring) epoll_ctl(loop->epfd, EPOLL_CTL_DEL, c->sock, NULL);
+    timer_cancel(&loop->timers, &c->timer);
+    c->loop = home;
+    if (loop->ring && c->rx_armed) {
+        uring_cancel(loop->ring, op_tag(c, OP_RECV), op_tag(NULL, OP_CANCEL));
+        return;
+    }
+    post_adopt(loop, c);
+}
+
+static void adopt_client(EventLoop *loop, Client *c) {
+    if (watch_client(loop, c) < 0) {
+        log_message(LOG_ERROR, "Failed to watch sock %d", c->sock);
+        broker_client_disconnected(c);
+        client_destroy(c);
+        return;
+    }
+
+    log_message(LOG_DEBUG, "Socket %d moved to worker %d", c->sock, loop->id);
+    broker_client_opened(c);
+    if (broker_handle_input(c) != 0 || (!loop->ring && read_client(c) != 0)) close_client(loop, c);
+}
+
+static void open_client(EventLoop *loop, int connfd, struct sockaddr_in cliaddr) {
+    int one = 1;
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    Client *c = client_create(connfd, NULL, cliaddr);
+    if (!c) {
+        log_message(LOG_ERROR, "Failed to allocate client for sock %d", connfd);
+        close(connfd);
+        return;
+    }
+    metrics_add(METRIC_CONNECTIONS_OPENED, 1);
+    c->loop = loop;
+
+    if (watch_client(loop, c) < 0) {
+        log_message(LOG_ERROR, "Failed to watch sock %d", connfd);
+        client_destroy(c);
+        return;
+    }
+
+    broker_client_opened(c);
+    log_message(LOG_INFO, "New connection from %s:%d: sock %d (worker %d)",
+            inet_ntoa(cliaddr.sin_addr), ntohs(cliaddr.sin_port), connfd, loop->id);
+}
+
+static void accept_clients(EventLoop *loop) {
+    for (;;) {
+        struct sockaddr_in cliaddr;
+        socklen_t clilen = sizeof(cliaddr);
+
+        int connfd = accept4(loop->listenfd, (struct sockaddr *)&cliaddr, &clilen,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connfd == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_message(LOG_ERROR, "accept failed: %s", strerror(errno));
+            }
+            return;
+        }
+        open_client(loop, connfd, cliaddr);
+    }
+}
+
+/*
+ * Drains the socket (edge-triggered); returns -1 when the client must go,
+ * 1 when it must move to another loop first.
+ */
+static int read_client(Client *c) {
+    for (;;) {
+        /* paused: what is still in the socket waits for resume_publishers() */
+        if (c->waiting_for) return 0;
+        if (ring_reserve(&c->in, RX_CHUNK_SIZE) < 0) {
+            log_message(LOG_ERROR, "Out of memory for socket %d input", c->sock);
+            return -1;
+        }
+
+        struct iovec iov[2];
+        int iovcnt = ring_free_iov(&c->in, iov);
+        ssize_t n = readv(c->sock, iov, iovcnt);
+        if (n > 0) {
+            ring_commit(&c->in, (size_t)n);
+            metrics_add(METRIC_BYTES_IN, n);
+            c->last_rx = c->loop->now;
+            int rc = broker_handle_input(c);
+            if (rc != 0) return rc;
+            continue;
+        }
+        if (n == 0) {
+            log_message(LOG_INFO, "Client on socket %d disconnected", c->sock);
+            return -1;
+        }
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            ring_shrink(&c->in, RX_IDLE_BUFFER_SIZE);
+            return 0;
+        }
+        return -1;
+    }
+}
+
+static void pin_to_core(EventLoop *loop) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpu <= 1) return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(loop->id % ncpu, &set);
+    if (pthread_setaffinity_np(loop->thread, sizeof(set), &set) != 0) {
+        log_message(LOG_WARNING, "Could not pin worker %d to core %ld", loop->id, loop->id % ncpu);
+    }
+}
+
+/* Runs the loop's timers and, on loop 0, the broker tick; returns how long the loop may wait (-1: no limit). */
+static int run_timers(EventLoop *loop, uint64_t *next_tick) {
+    uint64_t now = monotonic_ms();
+    loop->now = now;
+    timer_wheel_advance(&loop->timers, now);
+
+    int timeout = timer_wheel_timeout(&loop->timers, now);
+    if (loop->id == 0) {
+        if (now >= *next_tick) {
+            broker_tick();
+            *next_tick = now + BROKER_TICK_MS;
+        }
+        if (timeout < 0 || (uint64_t)timeout > *next_tick - now) timeout = (int)(*next_tick - now);
+    }
+    return timeout;
+}
+
+static void run_epoll(EventLoop *loop) {
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    uint64_t next_tick = monotonic_ms() + BROKER_TICK_MS;
+
+    while (loop_running) {
+        int timeout = run_timers(loop, &next_tick);
+        flush_clients(loop);
+
+        int n = epoll_wait(loop->epfd, events, EPOLL_MAX_EVENTS, timeout);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            log_message(LOG_ERROR, "epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+        if (n > 0) loop->now = monotonic_ms();
+
+        for (int i = 0; i < n; i++) {
+            void *tag = events[i].data.ptr;
+            uint32_t e = events[i].events;
+
+            if (!tag) {
+                accept_clients(loop);
+                continue;
+            }
+            if (tag == loop) {
+                drain_inbox(loop);
+                continue;
+            }
+
+            Client *c = tag;
+            if (e & (EPOLLIN | EPOLLRDHUP)) {
+                int rc = read_client(c);
+                if (rc < 0) {
+                    close_client(loop, c);
+                    continue;
+                }
+                if (rc > 0) {
+                    hand_over(loop, c);
+                    continue;
+                }
+            }
+
+            if (e & (EPOLLERR | EPOLLHUP)) {
+                close_client(loop, c);
+                continue;
+            }
+
+            if (e & EPOLLOUT) {
+                c->out_blocked = false;
+                if (c->out_count > 0 && client_flush(c) < 0) close_client(loop, c);
+            }
+        }
+
+        flush_clients(loop);
+    }
+}
+
+static void accept_completed(EventLoop *loop, int res) {
+    if (res < 0) {
+        if (res != -EAGAIN && res != -EINTR) log_message(LOG_ERROR, "accept failed: %s", strerror(-res));
+        return;
+    }
+
+    struct sockaddr_in cliaddr;
+    socklen_t clilen = sizeof(cliaddr);
+    memset(&cliaddr, 0, sizeof(cliaddr));
+    getpeername(res, (struct sockaddr *)&cliaddr, &clilen);
+    open_client(loop, res, cliaddr);
+}
+
+/* Appends a received chunk to the input buffer. */
+static int stash_input(Client *c, const uint8_t *data, size_t len) {
+    if (ring_reserve(&c->in, len) < 0) {
+        log_message(LOG_ERROR, "Out of memory for socket %d input", c->sock);
+        return -1;
+    }
+
+    struct iovec iov[2];
+    ring_free_iov(&c->in, iov);
+    size_t first = len < iov[0].iov_len ? len : iov[0].iov_len;
+    memcpy(iov[0].iov_base, data, first);
+    if (len > first) memcpy(iov[1].iov_base, data + first, len - first);
+    ring_commit(&c->in, len);
+    metrics_add(METRIC_BYTES_IN, len);
+    return 0;
+}
+
+/*
+ * One completion of a client's multishot recv. The request holds a
+ * reference until its last completion (no IORING_CQE_F_MORE); it ends
+ * on EOF, errors, a cancel for a hand-over or a pause, or when the
+ * kernel runs out of provided buffers, in which case it is simply armed
+ * again (a paused client is armed when it resumes).
+ */
+static void recv_completed(EventLoop *loop, Client *c, const struct io_uring_cqe *cqe) {
+    bool last = !(cqe->flags & IORING_CQE_F_MORE);
+    int res = cqe->res;
+    int rc = 0;
+
+    uint16_t bid;
+    const uint8_t *data = uring_buffer(loop->ring, cqe, &bid);
+    if (data) {
+        if (res > 0 && !c->closed && stash_input(c, data, (size_t)res) < 0) rc = -1;
+        uring_buffer_recycle(loop->ring, bid);
+    }
+    if (last) c->rx_armed = false;
+
+    if (c->closed) {
+        /* closed meanwhile: the shutdown ends the request */
+    } else if (c->loop != loop) {
+        /* handed over: bytes read so far travel with the client */
+        if (last) post_adopt(loop, c);
+    } else if (rc == 0 && res > 0) {
+        c->last_rx = loop->now;
+        rc = broker_handle_input(c);
+    } else if (rc == 0 && res == 0) {
+        log_message(LOG_INFO, "Client on socket %d disconnected", c->sock);
+        rc = -1;
+    } else if (rc == 0 && res != -ENOBUFS && res != -ECANCELED) {
+        rc = -1;
+    }
+
+    if (!c->closed && c->loop == loop) {
+        if (rc < 0) {
+            close_client(loop, c);
+        } else if (rc > 0) {
+            hand_over(loop, c);
+        } else if (last && !c->waiting_for && watch_client(loop, c) < 0) {
+            log_message(LOG_ERROR, "Failed to rearm recv on sock %d", c->sock);
+            close_client(loop, c);
+        }
+    }
+
+    if (last) client_release(c);
+}
+
+/*
+ * A full socket buffer ends a send short, or with -EAGAIN when nothing
+ * went out; the client then stays blocked until a POLLOUT says there is
+ * room again, and what is left of its queue goes with the next flush.
+ */
+static void send_completed(EventLoop *loop, UringSend *s, int res) {
+    Client *c = s->client;
+
+    c->out_sending = 0;
+    c->out_blocked = false;
+    if (c->closed) {
+        /* the shutdown ended it */
+    } else if (res == -EAGAIN || res == -EINTR) {
+        c->out_blocked = true;
+        atomic_store_explicit(&c->congested, true, memory_order_relaxed);
+        if (uring_poll_out(loop->ring, c->sock, op_tag(c, OP_WRITABLE)) == 0) {
+            client_retain(c);
+        } else {
+            /* ring full: try again next iteration */
+            c->out_blocked = false;
+            event_loop_schedule_flush(c);
+        }
+    } else if (res < 0) {
+        log_message(LOG_DEBUG, "Send on socket %d failed: %s", c->sock, strerror(-res));
+        close_client(loop, c);
+    } else {
+        client_sent(c, (size_t)res);
+        if (c->out_count > 0) event_loop_schedule_flush(c);
+        else atomic_store_explicit(&c->congested, false, memory_order_relaxed);
+    }
+    client_release(c);
+    if (s->iov != s->iov_inline) free(s->iov);
+    pool_free(&send_pool, s);
+}
+
+/* The socket of a client whose send hit a full buffer has room again (or has failed, which the next send reports). */
+static void writable(Client *c) {
+    c->out_blocked = false;
+    if (!c->closed) event_loop_schedule_flush(c);
+    client_release(c);
+}
+
+static void dispatch(EventLoop *loop, const struct io_uring_cqe *cqe) {
+    void *ptr = (void *)(uintptr_t)(cqe->user_data & ~(uint64_t)OP_MASK);
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+
+    switch (cqe->user_data & OP_MASK) {
+        case OP_ACCEPT:
+            accept_completed(loop, cqe->res);
+            if (!more && uring_accept(loop->ring, loop->listenfd, op_tag(NULL, OP_ACCEPT)) < 0) {
+                log_message(LOG_ERROR, "Failed to rearm accept on worker %d", loop->id);
+            }
+            break;
+        case OP_WAKE:
+            drain_inbox(loop);
+            if (!more && uring_poll(loop->ring, loop->wakefd, op_tag(NULL, OP_WAKE)) < 0) {
+                log_message(LOG_ERROR, "Failed to rearm wake fd on worker %d", loop->id);
+            }
+            break;
+        case OP_RECV:
+            recv_completed(loop, ptr, cqe);
+            break;
+        case OP_SEND:
+            send_completed(loop, ptr, cqe->res);
+            break;
+        case OP_WRITABLE:
+            writable(ptr);
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * The io_uring loop: every send and rearm queued during an iteration is
+ * submitted by the one io_uring_enter that also waits for the next
+ * completions.
+ *
+ * Send and POLLOUT completions are handled as soon as they are reaped,
+ * the rest go through a backlog URING_CQE_BATCH at a time. A burst of
+ * input then cannot queue more for a subscriber than its queue holds
+ * while the completion that frees it waits behind that input in the CQ.
+ */
+static void run_uring(EventLoop *loop) {
+    struct io_uring_cqe *backlog = malloc(URING_CQ_ENTRIES * sizeof(*backlog));
+    unsigned head = 0, count = 0;
+    uint64_t next_tick = monotonic_ms() + BROKER_TICK_MS;
+
+    if (!backlog) {
+        log_message(LOG_ERROR, "Out of memory for worker %d completions", loop->id);
+        return;
+    }
+
+    while (loop_running) {
+        int timeout = run_timers(loop, &next_tick);
+        flush_clients(loop);
+
+        bool busy = count > 0 || loop->inbox_backlog || loop->flush_list;
+        if (uring_wait(loop->ring, busy ? 0 : timeout) < 0) {
+            log_message(LOG_ERROR, "io_uring_enter failed: %s", strerror(errno));
+            break;
+        }
+        loop->now = monotonic_ms();
+
+        struct io_uring_cqe *cqe;
+        while (count < URING_CQ_ENTRIES && (cqe = uring_peek(loop->ring)) != NULL) {
+            struct io_uring_cqe done = *cqe;
+            uring_seen(loop->ring);
+            unsigned op = done.user_data & OP_MASK;
+            if (op == OP_SEND || op == OP_WRITABLE) dispatch(loop, &done);
+            else backlog[(head + count++) % URING_CQ_ENTRIES] = done;
+        }
+
+        if (loop->inbox_backlog) drain_inbox(loop);
+        for (int n = 0; n < URING_CQE_BATCH && count > 0; n++) {
+            struct io_uring_cqe done = backlog[head];
+            head = (head + 1) % URING_CQ_ENTRIES;
+            count--;
+            dispatch(loop, &done);
+        }
+
+        flush_clients(loop);
+    }
+    free(backlog);
+}
+
+static void *event_loop_thread(void *arg) {
+    EventLoop *loop = arg;
+
+    current_loop = loop;
+    metrics_thread(loop->id);
+    pin_to_core(loop);
+    log_message(LOG_INFO, "Worker %d running (%s)", loop->id, loop->ring ? "io_uring" : "epoll");
+
+    if (loop->ring) run_uring(loop);
+    else run_epoll(loop);
+    return NULL;
+}
+
+static int uring_setup(EventLoop *loop) {
+    Uring *r = malloc(sizeof(*r));
+    if (!r) return -1;
+    if (uring_init(r, URING_ENTRIES, URING_CQ_ENTRIES) < 0) {
+        free(r);
+        return -1;
+    }
+    if (uring_buffers_init(r, 0, URING_RX_BUFFERS, RX_CHUNK_SIZE) < 0 ||
+        uring_accept(r, loop->listenfd, op_tag(NULL, OP_ACCEPT)) < 0 ||
+        uring_poll(r, loop->wakefd, op_tag(NULL, OP_WAKE)) < 0) {
+        int err = errno;
+        uring_close(r);
+        free(r);
+        errno = err;
+        return -1;
+    }
+    loop->ring = r;
+    return 0;
+}
+
+static int epoll_setup(EventLoop *loop) {
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd == -1) {
+        log_message(LOG_ERROR, "epoll_create1 failed");
+        return -1;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->listenfd, &ev) == -1) {
+        log_message(LOG_ERROR, "epoll_ctl ADD failed for listen socket");
+        return -1;
+    }
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = loop;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ev) == -1) {
+        log_message(LOG_ERROR, "epoll_ctl ADD failed for wake fd");
+        return -1;
+    }
+    return 0;
+}
+
+static int event_loop_init(EventLoop *loop, int id, int listenfd) {
+    loop->id = id;
+    loop->listenfd = listenfd;
+    loop->epfd = -1;
+    loop->ring = NULL;
+    loop->flush_list = NULL;
+    loop->paused = NULL;
+    atomic_init(&loop->recheck, false);
+    loop->now = monotonic_ms();
+    timer_wheel_init(&loop->timers, monotonic_ms());
+    mpsc_init(&loop->inbox);
+    atomic_init(&loop->wake_pending, 0);
+    loop->inbox_backlog = false;
+
+    loop->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loop->wakefd == -1) {
+        log_message(LOG_ERROR, "eventfd failed");
+        return -1;
+    }
+
+    if (backend == IO_BACKEND_URING && uring_setup(loop) < 0) {
+        /* all loops share one backend: only the first may still fall back */
+        if (id > 0) {
+            log_message(LOG_ERROR, "io_uring setup failed for worker %d: %s", id, strerror(errno));
+            return -1;
+        }
+        log_message(LOG_WARNING, "io_uring unavailable (%s), using epoll", strerror(errno));
+        backend = IO_BACKEND_EPOLL;
+    }
+    if (!loop->ring) return epoll_setup(loop);
+    return 0;
+}
+
+/* Sets up one loop per listening socket; nothing runs until event_loop_run(). */
+int event_loop_create(const int *listenfds, int count) {
+    const char *env = getenv("BROKER_IO_BACKEND");
+    if (env && *env) {
+        if (strcasecmp(env, "epoll") == 0) {
+            backend = IO_BACKEND_EPOLL;
+        } else if (strcasecmp(env, "io_uring") == 0 || strcasecmp(env, "uring") == 0) {
+            backend = IO_BACKEND_URING;
+        } else {
+            log_message(LOG_WARNING, "Unknown BROKER_IO_BACKEND '%s', keeping %s", env,
+                        backend == IO_BACKEND_URING ? "io_uring" : "epoll");
+        }
+    }
+
+    loops = calloc(count, sizeof(EventLoop));
+    if (!loops) return -1;
+
+    for (int i = 0; i < count; i++) {
+        if (event_loop_init(&loops[i], i, listenfds[i]) < 0) return -1;
+    }
+    loop_count = count;
+    return 0;
+}
+
+/*
+ * The loop that owns every connection and offline session with this
+ * client id, so takeovers of one session never race across workers.
+ */
+EventLoop *event_loop_home(const char *client_id) {
+    return &loops[fnv1a_hash(client_id, strlen(client_id)) % loop_count];
+}
+
+/* Starts the workers; signals stay with the caller. */
+int event_loop_run(void) {
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGINT);
+    sigaddset(&block, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+
+    loop_running = 1;
+    for (int i = 0; i < loop_count; i++) {
+        if (pthread_create(&loops[i].thread, NULL, event_loop_thread, &loops[i]) != 0) {
+            log_message(LOG_ERROR, "Failed to start worker %d", i);
+            break;
+        }
+        loops_started++;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return loops_started == loop_count ? 0 : -1;
+}
+
+void event_loop_join(void) {
+    for (int i = 0; i < loops_started; i++) {
+        pthread_join(loops[i].thread, NULL);
+    }
+    for (int i = 0; i < loop_count; i++) {
+        close(loops[i].wakefd);
+        if (loops[i].epfd >= 0) close(loops[i].epfd);
+        if (loops[i].ring) {
+            uring_close(loops[i].ring);
+            free(loops[i].ring);
+        }
+    }
+    free(loops);
+    loops = NULL;
+    loop_count = 0;
+    loops_started = 0;
+}
@@ -0,0 +1,61 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "frame.h"
+
+Frame *frame_alloc(size_t capacity) {
+    Frame *f = malloc(sizeof(Frame) + capacity);
+    if (!f) return NULL;
+    atomic_init(&f->refs, 1);
+    f->droppable = false;
+    f->topic_hash = 0;
+    f->len = 0;
+    f->tail = NULL;
+    f->tail_offset = 0;
+    return f;
+}
+
+Frame *frame_copy(const void *buf, size_t len) {
+    Frame *f = frame_alloc(len);
+    if (!f) return NULL;
+    memcpy(f->data, buf, len);
+    f->len = len;
+    return f;
+}
+
+void frame_retain(Frame *f) {
+    atomic_fetch_add_explicit(&f->refs, 1, memory_order_relaxed);
+}
+
+void frame_release(Frame *f) {
+    if (atomic_fetch_sub_explicit(&f->refs, 1, memory_order_acq_rel) == 1) {
+        if (f->tail) frame_release(f->tail);
+        free(f);
+    }
+}
+
+/* Bytes the frame puts on the wire, borrowed tail included. */
+size_t frame_size(const Frame *f) {
+    return f->len + (f->tail ? f->tail->len - f->tail_offset : 0);
+}
+
+/* Fills up to two iovecs with the frame's bytes past `skip`; returns how many. */
+int frame_iov(const Frame *f, size_t skip, struct iovec *iov) {
+    int n = 0;
+
+    if (skip < f->len) {
+        iov[n].iov_base = (void *)(f->data + skip);
+        iov[n].iov_len = f->len - skip;
+        n++;
+        skip = 0;
+    } else {
+        skip -= f->len;
+    }
+
+    if (f->tail && f->tail_offset + skip < f->tail->len) {
+        iov[n].iov_base = (void *)(f->tail->data + f->tail_offset + skip);
+        iov[n].iov_len = f->tail->len - f->tail_offset - skip;
+        n++;
+    }
+    return n;
+}
@@ -0,0 +1,531 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "inflight.h"
+#include "client.h"
+#include "codec.h"
+#include "config.h"
+#include "event_loop.h"
+#include "metrics.h"
+#include "mqtt_encoder.h"
+#include "store.h"
+#include "utils.h"
+
+/*
+ * QoS 1/2 delivery for one client, run on the client's event loop only.
+ * Outbound messages get a packet id and a slot in a window of at most
+ * INFLIGHT_WINDOW (or the client's MQTT 5 Receive Maximum); the rest wait
+ * in a FIFO. A message over the client's Maximum Packet Size is dropped
+ * before it takes a slot; nothing else is. MQTT 3.1.1 clients get
+ * unacknowledged PUBLISH/PUBREL packets resent every QOS_RETRY_MS from
+ * the loop's timer wheel; MQTT 5 forbids resending on a live connection.
+ * Messages of persistent sessions are numbered and written to the store
+ * when queued, and marked there as they are released and acknowledged;
+ * while the session is offline, or past INFLIGHT_PENDING_MAX queued, they
+ * are left in the store alone and loaded back as the queue drains. A
+ * queue that long on any other client pauses the publishers feeding it
+ * instead (event_loop_pause); what reaches it regardless (retained
+ * messages, a resumed session's backlog) stops at INFLIGHT_QUEUE_LIMIT,
+ * past which messages are dropped and counted.
+ */
+
+static void retry_due(Timer *t);
+
+void inflight_init(Client *c) {
+    memset(&c->inflight, 0, sizeof(c->inflight));
+    c->inflight.next_id = 1;
+    c->inflight.window = INFLIGHT_WINDOW;
+    timer_init(&c->inflight.retry, retry_due, c);
+}
+
+/* The connection is gone; a backlog that will never drain no longer holds publishers back. */
+void inflight_stop(Client *c) {
+    if (c->loop) timer_cancel(&c->loop->timers, &c->inflight.retry);
+    if (!c->persistent) {
+        atomic_store(&c->backlog, 0);
+        if (atomic_exchange(&c->watched, false)) event_loop_wake_paused(NULL);
+    }
+}
+
+void inflight_free(Client *c) {
+    Inflight *q = &c->inflight;
+
+    for (uint16_t i = 0; i < q->count; i++) {
+        frame_release(q->slots[i].msg);
+    }
+    for (uint32_t i = 0; i < q->pending_count; i++) {
+        frame_release(q->pending[(q->pending_head + i) % q->pending_cap].msg);
+    }
+    free(q->slots);
+    free(q->pending);
+    free(q->rx_ids);
+    memset(q, 0, sizeof(*q));
+}
+
+static uint32_t now32(void) {
+    return (uint32_t)monotonic_ms();
+}
+
+static void arm_retry(Client *c) {
+    if (c->protocol >= MQTT_PROTOCOL_V5 || !c->loop || timer_armed(&c->inflight.retry)) return;
+    timer_arm(&c->loop->timers, &c->inflight.retry, monotonic_ms() + QOS_RETRY_MS);
+}
+
+static int send_publish(Client *c, const InflightEntry *e, bool dup) {
+    return client_send_publish(c, e->msg, e->qos, e->packet_id, dup) < 0 ? -1 : 0;
+}
+
+static int send_pubrel(Client *c, uint16_t packet_id) {
+    unsigned char reply[8];
+    int len = mqtt_encode_ack(reply, sizeof(reply), MQTT_PKT_PUBREL, packet_id, 0, c->protocol);
+    return len < 0 ? -1 : client_send(c, reply, len);
+}
+
+static bool id_in_use(const Inflight *q, uint16_t id) {
+    for (uint16_t i = 0; i < q->count; i++) {
+        if (q->slots[i].packet_id == id) return true;
+    }
+    return false;
+}
+
+/*
+ * Packet ids follow the sequence number where possible, so a message
+ * restored from the store goes out again under the id it had.
+ */
+static uint16_t allocate_id(Inflight *q, uint32_t seq) {
+    uint16_t id = (seq - 1) % 0xFFFF + 1;
+    if (!id_in_use(q, id)) return id;
+
+    do {
+        id = q->next_id++;
+        if (q->next_id == 0) q->next_id = 1;
+    } while (id_in_use(q, id));
+    return id;
+}
+
+/* A new slot at the end of the window, which must have room. */
+static InflightEntry *add_slot(Inflight *q) {
+    if (q->count == q->cap) {
+        uint16_t new_cap = q->cap ? q->cap * 2 : 4;
+        if (new_cap > q->window) new_cap = q->window;
+        InflightEntry *grown = realloc(q->slots, new_cap * sizeof(InflightEntry));
+        if (!grown) return NULL;
+        q->slots = grown;
+        q->cap = new_cap;
+    }
+    return &q->slots[q->count++];
+}
+
+/* Wakes the publishers waiting for `c` once its backlog, with what is posted to it, has drained. */
+static void wake_watchers(Client *c, unsigned backlog) {
+    if (backlog + atomic_load(&c->posted) < INFLIGHT_RESUME_BELOW && atomic_load(&c->watched) &&
+        atomic_exchange(&c->watched, false)) {
+        event_loop_wake_paused(NULL);
+    }
+}
+
+/*
+ * Publishes the backlog for shared subscriptions and paused publishers,
+ * which read it from other threads. Publishers waiting for it are woken
+ * once it drains; the store comes before the read of `watched`, the
+ * reverse of the order in inflight_watch(), so one side always sees the
+ * other. A paused client is read again once its own backlog builds
+ * up, since the acks that drain it come in on the same connection.
+ */
+static void count_backlog(Client *c) {
+    const Inflight *q = &c->inflight;
+    unsigned n = (unsigned)q->count + q->pending_count + q->spilled;
+
+    atomic_store(&c->backlog, n);
+    wake_watchers(c, n);
+    if (n >= INFLIGHT_RESUME_BELOW && c->waiting_for) event_loop_wake_paused(c->loop);
+}
+
+/* Puts a message into the window (which must have room) and sends it. */
+static int start(Client *c, Frame *msg, uint32_t seq, uint8_t qos) {
+    Inflight *q = &c->inflight;
+    InflightEntry *e = add_slot(q);
+    if (!e) {
+        frame_release(msg);
+        return -1;
+    }
+
+    e->msg = msg;
+    e->seq = seq;
+    e->qos = qos;
+    e->state = INFLIGHT_PUBLISH;
+    e->packet_id = allocate_id(q, seq);
+    e->sent_at = now32();
+    count_backlog(c);
+
+    arm_retry(c);
+    return send_publish(c, e, false);
+}
+
+static int push_pending(Inflight *q, Frame *msg, uint32_t seq, uint8_t qos) {
+    if (q->pending_count == q->pending_cap) {
+        uint32_t new_cap = q->pending_cap ? q->pending_cap * 2 : 8;
+        PendingEntry *grown = malloc(new_cap * sizeof(PendingEntry));
+        if (!grown) return -1;
+        for (uint32_t i = 0; i < q->pending_count; i++) {
+            grown[i] = q->pending[(q->pending_head + i) % q->pending_cap];
+        }
+        free(q->pending);
+        q->pending = grown;
+        q->pending_head = 0;
+        q->pending_cap = new_cap;
+    }
+
+    q->pending[(q->pending_head + q->pending_count) % q->pending_cap] = (PendingEntry){ msg, seq, qos };
+    q->pending_count++;
+    return 0;
+}
+
+typedef struct {
+    Client *client;
+    size_t want;
+} Unspill;
+
+static int unspill_one(void *arg, uint32_t seq, uint8_t qos, const uint8_t *frame, size_t len) {
+    Unspill *u = arg;
+    Inflight *q = &u->client->inflight;
+    Frame *msg = frame_copy(frame, len);
+    if (!msg) return -1;
+    if (push_pending(q, msg, seq, qos) < 0) {
+        frame_release(msg);
+        return -1;
+    }
+    q->spilled--;
+    return --u->want == 0 || q->spilled == 0;
+}
+
+/* Loads up to `want` messages left in the store back into the queue, oldest first. */
+static void unspill(Client *c, size_t want) {
+    Inflight *q = &c->inflight;
+    Unspill u = { c, want };
+
+    if (store_load(c->client_id, &q->spill, unspill_one, &u) == 0 && q->spilled > 0) {
+        log_message(LOG_ERROR, "%u queued message(s) of client %s missing from the store", q->spilled, c->client_id);
+        q->spilled = 0;
+    }
+    count_backlog(c);
+}
+
+/*
+ * Leaves a message of a persistent session in the store only; it is
+ * loaded back once the queue ahead of it has drained. -1 if the store
+ * could not take it.
+ */
+static int spill(Client *c, uint32_t seq, uint8_t qos, const Frame *msg) {
+    Inflight *q = &c->inflight;
+    StoreCursor at = { .seq = seq - 1 };
+
+    if (store_message(c->client_id, seq, qos, msg->data, msg->len, q->spilled == 0 ? &at : NULL) < 0) return -1;
+    if (q->spilled++ == 0) q->spill = at;
+    count_backlog(c);
+    return 0;
+}
+
+/* Moves waiting messages into the window as slots free up, refilling the queue from the store when it runs low. */
+static int pump(Client *c) {
+    Inflight *q = &c->inflight;
+
+    if (q->spilled > 0 && q->pending_count < INFLIGHT_PENDING_MAX / 2 && !c->closed) {
+        unspill(c, INFLIGHT_PENDING_MAX - q->pending_count);
+    }
+    while (q->pending_count > 0 && q->count < q->window && !c->closed) {
+        PendingEntry p = q->pending[q->pending_head];
+        q->pending_head = (q->pending_head + 1) % q->pending_cap;
+        q->pending_count--;
+        if (start(c, p.msg, p.seq, p.qos) < 0) return -1;
+    }
+    return 0;
+}
+
+/* Largest size of `msg` as send_publish() frames it for this client (a new topic alias adds 3 bytes). */
+static size_t publish_size(const Client *c, const Frame *msg, uint8_t qos) {
+    uint32_t remaining;
+    if (codec_varint_decode(&msg->data[1], msg->len - 1, &remaining) <= 0) return SIZE_MAX;
+    size_t n = (size_t)remaining + (qos > 0 ? 2 : 0) + (c->protocol >= MQTT_PROTOCOL_V5 ? 1 : 0);
+    if (client_aliases_topics(c)) n += 3;
+    return 1 + codec_varint_size((uint32_t)n) + n;
+}
+
+/*
+ * Delivers `msg` (a QoS 0 PUBLISH encoding shared with other clients) at
+ * QoS 1 or 2; an offline persistent session leaves it in the store
+ * until it reconnects. Returns 0 when sent or queued, 1 when dropped
+ * because it is too big for the client or its queue is at
+ * INFLIGHT_QUEUE_LIMIT, -1 on failure.
+ */
+int inflight_publish(Client *c, Frame *msg, uint8_t qos) {
+    Inflight *q = &c->inflight;
+    bool direct = !c->closed && q->count < q->window && q->pending_count == 0 && q->spilled == 0;
+
+    if (c->closed && !c->persistent) return -1;
+    if (publish_size(c, msg, qos) > c->max_packet) {
+        c->out_dropped++;
+        metrics_add(METRIC_MESSAGES_DROPPED, 1);
+        log_message(LOG_DEBUG, "Message over the packet limit of client %s, dropped", c->client_id);
+        return 1;
+    }
+
+    if (!c->persistent && q->pending_count >= INFLIGHT_QUEUE_LIMIT) {
+        c->out_dropped++;
+        metrics_add(METRIC_MESSAGES_DROPPED, 1);
+        log_message(LOG_DEBUG, "QoS %d queue of client %s full, message dropped (%lu so far)",
+                    qos, c->client_id, c->out_dropped);
+        return 1;
+    }
+
+    uint32_t seq = ++q->store_seq;
+    if (c->persistent && !direct && (c->closed || q->spilled > 0 || q->pending_count >= INFLIGHT_PENDING_MAX) &&
+        spill(c, seq, qos, msg) == 0) {
+        return 0;
+    }
+
+    frame_retain(msg);
+    if (c->persistent) store_message(c->client_id, seq, qos, msg->data, msg->len, NULL);
+
+    if (direct) return start(c, msg, seq, qos);
+    if (push_pending(q, msg, seq, qos) == 0) {
+        count_backlog(c);
+        return 0;
+    }
+
+    frame_release(msg);
+    if (c->persistent) store_ack(c->client_id, seq);
+    log_message(LOG_ERROR, "Out of memory for the QoS %d queue of client %s, message lost", qos, c->client_id);
+    return -1;
+}
+
+/*
+ * True when `c`, a client without a persistent session, has so many QoS
+ * 1/2 messages queued that publishers should wait for it. Any thread;
+ * what other threads have posted to it and its loop has yet to queue
+ * counts too, or a busy loop would let them run on unchecked.
+ */
+bool inflight_congested(const Client *c) {
+    unsigned n = atomic_load_explicit(&c->backlog, memory_order_relaxed) +
+                 atomic_load_explicit(&c->posted, memory_order_relaxed);
+    return !c->persistent && n >= INFLIGHT_PENDING_MAX;
+}
+
+/*
+ * Asks `c` to wake the paused publishers once its backlog is under
+ * INFLIGHT_RESUME_BELOW; false if it already is. Any thread.
+ */
+bool inflight_watch(Client *c) {
+    atomic_store(&c->watched, true);
+    unsigned backlog = atomic_load(&c->backlog);
+    return backlog + atomic_load(&c->posted) >= INFLIGHT_RESUME_BELOW;
+}
+
+/*
+ * A QoS 1/2 message another loop posted to `c` has been queued (or
+ * dropped) by its own; it moved into the backlog before this, so the
+ * total only ever overstates what is left.
+ */
+void inflight_unpost(Client *c) {
+    atomic_fetch_sub(&c->posted, 1);
+    wake_watchers(c, atomic_load(&c->backlog));
+}
+
+static int find_slot(const Inflight *q, uint16_t packet_id) {
+    for (uint16_t i = 0; i < q->count; i++) {
+        if (q->slots[i].packet_id == packet_id) return i;
+    }
+    return -1;
+}
+
+static void remove_slot(Client *c, int i) {
+    Inflight *q = &c->inflight;
+    if (c->persistent) store_ack(c->client_id, q->slots[i].seq);
+    frame_release(q->slots[i].msg);
+    memmove(&q->slots[i], &q->slots[i + 1], (q->count - i - 1) * sizeof(InflightEntry));
+    q->count--;
+    count_backlog(c);
+}
+
+/*
+ * Handles PUBACK, PUBREC and PUBCOMP from the client. Acks for unknown
+ * ids are ignored (a PUBREC is still answered so the client can finish).
+ * Returns -1 when the connection must be closed.
+ */
+int inflight_ack(Client *c, MqttPacketType type, uint16_t packet_id) {
+    Inflight *q = &c->inflight;
+    int i = find_slot(q, packet_id);
+    InflightEntry *e = i >= 0 ? &q->slots[i] : NULL;
+
+    switch (type) {
+        case MQTT_PKT_PUBACK:
+            if (!e || e->qos != 1) break;
+            remove_slot(c, i);
+            return pump(c);
+
+        case MQTT_PKT_PUBREC:
+            if (e && e->qos == 2 && e->state == INFLIGHT_PUBLISH) {
+                e->state = INFLIGHT_PUBREL;
+                e->sent_at = now32();
+                if (c->persistent) store_release(c->client_id, e->seq);
+            }
+            return send_pubrel(c, packet_id) < 0 ? -1 : 0;
+
+        case MQTT_PKT_PUBCOMP:
+            if (!e || e->state != INFLIGHT_PUBREL) break;
+            remove_slot(c, i);
+            return pump(c);
+
+        default:
+            return -1;
+    }
+
+    log_message(LOG_DEBUG, "Ignoring ack type %d for unknown packet id %u from %s",
+                type, packet_id, c->client_id);
+    return 0;
+}
+
+/*
+ * Records an inbound QoS 2 PUBLISH. Returns 1 the first time an id is
+ * seen (route the message), 0 for a retransmission of one still awaiting
+ * PUBREL, -1 when too many are outstanding.
+ */
+int inflight_receive(Client *c, uint16_t packet_id) {
+    Inflight *q = &c->inflight;
+
+    for (uint16_t i = 0; i < q->rx_count; i++) {
+        if (q->rx_ids[i] == packet_id) return 0;
+    }
+
+    if (q->rx_count == q->rx_cap) {
+        if (q->rx_cap >= QOS2_RX_MAX) return -1;
+        uint16_t new_cap = q->rx_cap ? q->rx_cap * 2 : 4;
+        uint16_t *grown = realloc(q->rx_ids, new_cap * sizeof(uint16_t));
+        if (!grown) return -1;
+        q->rx_ids = grown;
+        q->rx_cap = new_cap;
+    }
+
+    q->rx_ids[q->rx_count++] = packet_id;
+    return 1;
+}
+
+/* PUBREL from the client: the id may be reused for a new message. */
+void inflight_release(Client *c, uint16_t packet_id) {
+    Inflight *q = &c->inflight;
+
+    for (uint16_t i = 0; i < q->rx_count; i++) {
+        if (q->rx_ids[i] == packet_id) {
+            q->rx_ids[i] = q->rx_ids[--q->rx_count];
+            return;
+        }
+    }
+}
+
+/*
+ * Session takeover: `to` (just connected) inherits everything `from` had
+ * outstanding or queued. What was in flight goes out again at once, with
+ * DUP set, as a resumed session requires. If `to` is not persistent the
+ * session is about to leave the store, so what is left there comes out
+ * first, up to INFLIGHT_QUEUE_LIMIT; the rest is dropped.
+ */
+void inflight_move(Client *from, Client *to) {
+    Timer to_retry = to->inflight.retry;
+    Timer from_retry = from->inflight.retry;
+    uint16_t window = to->inflight.window;
+
+    inflight_stop(from);
+    inflight_free(to);
+    to->inflight = from->inflight;
+    to->inflight.retry = to_retry;
+    to->inflight.window = window;
+    memset(&from->inflight, 0, sizeof(from->inflight));
+    from->inflight.retry = from_retry;
+    count_backlog(from);
+    count_backlog(to);
+
+    Inflight *q = &to->inflight;
+    if (q->spilled > 0 && !to->persistent) {
+        if (q->pending_count < INFLIGHT_QUEUE_LIMIT) unspill(to, INFLIGHT_QUEUE_LIMIT - q->pending_count);
+        if (q->spilled > 0) {
+            to->out_dropped += q->spilled;
+            metrics_add(METRIC_MESSAGES_DROPPED, q->spilled);
+            log_message(LOG_WARNING, "%u queued message(s) of client %s over its queue limit, dropped",
+                        q->spilled, to->client_id);
+            q->spilled = 0;
+            count_backlog(to);
+        }
+    }
+    uint32_t now = now32();
+    for (uint16_t i = 0; i < q->count; i++) {
+        InflightEntry *e = &q->slots[i];
+        e->sent_at = now;
+        int rc = e->state == INFLIGHT_PUBREL ? send_pubrel(to, e->packet_id) : send_publish(to, e, true);
+        if (rc < 0) return;
+    }
+    if (q->count > 0) arm_retry(to);
+    pump(to);
+}
+
+/*
+ * Rebuilds one queued message of an offline session from the store. A
+ * QoS 2 message the client already acknowledged with PUBREC only needs
+ * its PUBREL resent, so it takes a window slot; everything else waits in
+ * the queue, in sequence order, and past INFLIGHT_PENDING_MAX stays in
+ * the store to be loaded as the queue drains.
+ */
+int inflight_restore(Client *c, uint32_t seq, uint8_t qos, bool released, const uint8_t *frame, size_t len) {
+    Inflight *q = &c->inflight;
+
+    if (seq > q->store_seq) q->store_seq = seq;
+    if (!released && (q->spilled > 0 || q->pending_count >= INFLIGHT_PENDING_MAX)) {
+        if (q->spilled++ == 0) q->spill = (StoreCursor){ .seq = seq - 1 };
+        count_backlog(c);
+        return 0;
+    }
+
+    Frame *msg = frame_copy(frame, len);
+    if (!msg) return -1;
+
+    if (!released || q->count == q->window) {
+        if (push_pending(q, msg, seq, qos) == 0) {
+            count_backlog(c);
+            return 0;
+        }
+        frame_release(msg);
+        return -1;
+    }
+
+    InflightEntry *e = add_slot(q);
+    if (!e) {
+        frame_release(msg);
+        return -1;
+    }
+    e->msg = msg;
+    e->seq = seq;
+    e->qos = qos;
+    e->state = INFLIGHT_PUBREL;
+    e->packet_id = allocate_id(q, seq);
+    e->sent_at = now32();
+    count_backlog(c);
+    return 0;
+}
+
+/* Resends whatever has waited QOS_RETRY_MS without an acknowledgement. */
+static void retry_due(Timer *t) {
+    Client *c = t->arg;
+    Inflight *q = &c->inflight;
+    uint32_t now = now32();
+
+    for (uint16_t i = 0; i < q->count && !c->closed; i++) {
+        InflightEntry *e = &q->slots[i];
+        if (now - e->sent_at < QOS_RETRY_MS) continue;
+
+        e->sent_at = now;
+        log_message(LOG_DEBUG, "Resending packet id %u to %s", e->packet_id, c->client_id);
+        int rc = e->state == INFLIGHT_PUBREL ? send_pubrel(c, e->packet_id) : send_publish(c, e, true);
+        if (rc < 0) return;
+    }
+
+    if (q->count > 0 && !c->closed) arm_retry(c);
+}
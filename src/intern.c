@@ -0,0 +1,146 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "intern.h"
+#include "config.h"
+#include "utils.h"
+
+typedef struct {
+    char *str;
+    uint32_t len;
+    uint32_t hash;
+    uint32_t refs;
+    uint32_t next;      /* next id in the bucket chain, or next free id */
+} InternEntry;
+
+/* Id 0 is reserved as "not interned". */
+static InternEntry *entries = NULL;
+static uint32_t entry_count = 0;
+static uint32_t entry_cap = 0;
+static uint32_t free_head = 0;
+static uint32_t live_count = 0;
+
+static uint32_t *heads = NULL;
+static uint32_t head_count = 0;
+
+static int grow_heads(void) {
+    uint32_t new_count = head_count ? head_count * 2 : INTERN_TABLE_INITIAL_SIZE;
+    uint32_t *grown = calloc(new_count, sizeof(uint32_t));
+    if (!grown) return -1;
+
+    for (uint32_t id = 1; id < entry_count; id++) {
+        InternEntry *e = &entries[id];
+        if (!e->str) continue;
+        uint32_t b = e->hash & (new_count - 1);
+        e->next = grown[b];
+        grown[b] = id;
+    }
+
+    free(heads);
+    heads = grown;
+    head_count = new_count;
+    return 0;
+}
+
+static uint32_t alloc_entry(void) {
+    if (free_head) {
+        uint32_t id = free_head;
+        free_head = entries[id].next;
+        return id;
+    }
+
+    if (entry_count == 0) entry_count = 1;
+    if (entry_count >= entry_cap) {
+        uint32_t new_cap = entry_cap ? entry_cap * 2 : INTERN_TABLE_INITIAL_SIZE;
+        InternEntry *grown = realloc(entries, new_cap * sizeof(InternEntry));
+        if (!grown) return 0;
+        entries = grown;
+        entry_cap = new_cap;
+    }
+    return entry_count++;
+}
+
+uint32_t intern_find(const char *s, size_t len) {
+    if (!head_count) return 0;
+
+    uint32_t hash = fnv1a_hash(s, len);
+    for (uint32_t id = heads[hash & (head_count - 1)]; id; id = entries[id].next) {
+        InternEntry *e = &entries[id];
+        if (e->hash == hash && e->len == len && memcmp(e->str, s, len) == 0) return id;
+    }
+    return 0;
+}
+
+uint32_t intern_acquire(const char *s, size_t len) {
+    uint32_t id = intern_find(s, len);
+    if (id) {
+        entries[id].refs++;
+        return id;
+    }
+
+    if (live_count >= head_count && grow_heads() < 0) return 0;
+
+    char *copy = malloc(len + 1);
+    if (!copy) return 0;
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+
+    id = alloc_entry();
+    if (!id) {
+        free(copy);
+        return 0;
+    }
+
+    InternEntry *e = &entries[id];
+    e->str = copy;
+    e->len = (uint32_t)len;
+    e->hash = fnv1a_hash(s, len);
+    e->refs = 1;
+
+    uint32_t b = e->hash & (head_count - 1);
+    e->next = heads[b];
+    heads[b] = id;
+    live_count++;
+
+    return id;
+}
+
+void intern_release(uint32_t id) {
+    if (!id || id >= entry_count || !entries[id].str) return;
+
+    InternEntry *e = &entries[id];
+    if (--e->refs > 0) return;
+
+    uint32_t *link = &heads[e->hash & (head_count - 1)];
+    while (*link != id) link = &entries[*link].next;
+    *link = e->next;
+
+    free(e->str);
+    e->str = NULL;
+    e->next = free_head;
+    free_head = id;
+    live_count--;
+}
+
+const char *intern_str(uint32_t id, size_t *len) {
+    if (!id || id >= entry_count || !entries[id].str) return NULL;
+    if (len) *len = entries[id].len;
+    return entries[id].str;
+}
+
+/* fnv1a_hash() of the string, computed once when it was interned. */
+uint32_t intern_hash(uint32_t id) {
+    if (!id || id >= entry_count || !entries[id].str) return 0;
+    return entries[id].hash;
+}
+
+void intern_cleanup(void) {
+    for (uint32_t id = 1; id < entry_count; id++) {
+        free(entries[id].str);
+    }
+    free(entries);
+    free(heads);
+    entries = NULL;
+    heads = NULL;
+    entry_count = entry_cap = free_head = live_count = head_count = 0;
+}
@@ -0,0 +1,283 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "config.h"
+#include "log.h"
+
+/*
+ * Asynchronous logger. Callers format straight into a slot of a bounded
+ * lock-free ring (sequence-numbered slots, one CAS to claim) and return;
+ * a background thread drains the ring in batches, keeps the log file
+ * open and re-renders the timestamp only when the second changes. When
+ * the ring is full the record is dropped and counted instead of making
+ * the caller wait.
+ */
+typedef struct {
+    atomic_size_t seq;
+    LogLevel level;
+    struct timespec ts;
+    char msg[LOG_RECORD_SIZE];
+} LogRecord;
+
+static LogRecord ring[LOG_RING_SIZE];
+static atomic_size_t enqueue_pos;
+static size_t dequeue_pos;
+
+static atomic_int current_level = DEBUG_ENABLED ? LOG_DEBUG : LOG_INFO;
+static atomic_ulong dropped;
+static atomic_bool running;
+static atomic_int writer_sleeping;
+static int wakefd = -1;
+static int log_fd = -1;
+static pthread_t writer;
+
+static const char *level_names[] = { "ERROR", "WARN", "INFO", "DEBUG" };
+static const char *level_colors[] = { COLOR_RED, COLOR_YELLOW, COLOR_GREEN, COLOR_CYAN };
+
+void log_set_level(LogLevel level) {
+    atomic_store_explicit(&current_level, level, memory_order_relaxed);
+}
+
+LogLevel log_get_level(void) {
+    return atomic_load_explicit(&current_level, memory_order_relaxed);
+}
+
+unsigned long log_dropped(void) {
+    return atomic_load_explicit(&dropped, memory_order_relaxed);
+}
+
+static void write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+}
+
+static void append(char *buf, size_t cap, size_t *len, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+
+static void append(char *buf, size_t cap, size_t *len, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buf + *len, cap - *len, fmt, args);
+    va_end(args);
+    if (n < 0) return;
+    *len += (size_t)n < cap - *len ? (size_t)n : cap - *len - 1;
+}
+
+/* Appends one record to the file and console batches. */
+static void render(const LogRecord *r, char *file_buf, size_t *file_len,
+                   char *out_buf, size_t *out_len, size_t cap) {
+    static _Thread_local time_t cached_sec = (time_t)-1;
+    static _Thread_local char timebuf[32];
+
+    if (r->ts.tv_sec != cached_sec) {
+        struct tm t;
+        localtime_r(&r->ts.tv_sec, &t);
+        strftime(timebuf, sizeof(timebuf), "%Y-%m-%d %H:%M:%S", &t);
+        cached_sec = r->ts.tv_sec;
+    }
+
+    append(file_buf, cap, file_len, "[%s] [%s] %s\n", timebuf, level_names[r->level], r->msg);
+    append(out_buf, cap, out_len, "%s[%s] [%s] %s%s\n", level_colors[r->level], timebuf,
+           level_names[r->level], r->msg, COLOR_RESET);
+}
+
+/* Drains whatever is in the ring; returns the number of records written. */
+static size_t drain(void) {
+    static char file_buf[LOG_BATCH_SIZE];
+    static char out_buf[LOG_BATCH_SIZE];
+    static unsigned long reported_drops = 0;
+    size_t file_len = 0, out_len = 0, count = 0;
+
+    for (;;) {
+        LogRecord *r = &ring[dequeue_pos & (LOG_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&r->seq, memory_order_acquire);
+        if (seq != dequeue_pos + 1) break;
+
+        if (file_len + LOG_RECORD_SIZE + 64 > LOG_BATCH_SIZE ||
+            out_len + LOG_RECORD_SIZE + 64 > LOG_BATCH_SIZE) {
+            if (log_fd >= 0) write_all(log_fd, file_buf, file_len);
+            write_all(STDOUT_FILENO, out_buf, out_len);
+            file_len = out_len = 0;
+        }
+
+        render(r, file_buf, &file_len, out_buf, &out_len, LOG_BATCH_SIZE);
+        atomic_store_explicit(&r->seq, dequeue_pos + LOG_RING_SIZE, memory_order_release);
+        dequeue_pos++;
+        count++;
+    }
+
+    unsigned long drops = log_dropped();
+    if (drops != reported_drops) {
+        LogRecord note;
+        note.level = LOG_WARNING;
+        clock_gettime(CLOCK_REALTIME, &note.ts);
+        snprintf(note.msg, sizeof(note.msg), "Log ring overflowed, %lu record(s) dropped so far", drops);
+        render(&note, file_buf, &file_len, out_buf, &out_len, LOG_BATCH_SIZE);
+        reported_drops = drops;
+    }
+
+    if (log_fd >= 0 && file_len) write_all(log_fd, file_buf, file_len);
+    if (out_len) write_all(STDOUT_FILENO, out_buf, out_len);
+    return count;
+}
+
+static void *writer_thread(void *arg) {
+    (void)arg;
+
+    while (atomic_load(&running)) {
+        if (drain() > 0) continue;
+
+        /* Announce the nap, then look once more so no wake-up is lost. */
+        atomic_store(&writer_sleeping, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        if (drain() > 0) {
+            atomic_store(&writer_sleeping, 0);
+            continue;
+        }
+
+        struct pollfd pfd = { .fd = wakefd, .events = POLLIN };
+        if (poll(&pfd, 1, LOG_IDLE_WAIT_MS) > 0) {
+            uint64_t count;
+            ssize_t rc = read(wakefd, &count, sizeof(count));
+            (void)rc;
+        }
+        atomic_store(&writer_sleeping, 0);
+    }
+
+    drain();
+    return NULL;
+}
+
+static LogLevel level_from_env(void) {
+    const char *env = getenv("BROKER_LOG_LEVEL");
+    if (!env) return log_get_level();
+    if (strcasecmp(env, "error") == 0) return LOG_ERROR;
+    if (strcasecmp(env, "warn") == 0 || strcasecmp(env, "warning") == 0) return LOG_WARNING;
+    if (strcasecmp(env, "info") == 0) return LOG_INFO;
+    if (strcasecmp(env, "debug") == 0) return LOG_DEBUG;
+    return log_get_level();
+}
+
+int log_init(void) {
+    for (size_t i = 0; i < LOG_RING_SIZE; i++) {
+        atomic_init(&ring[i].seq, i);
+    }
+    atomic_init(&enqueue_pos, 0);
+    dequeue_pos = 0;
+    log_set_level(level_from_env());
+
+    log_fd = open(LOG_FILE, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log_fd < 0) perror("Error opening log file");
+
+    wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wakefd < 0) return -1;
+
+    atomic_store(&running, true);
+    if (pthread_create(&writer, NULL, writer_thread, NULL) != 0) {
+        atomic_store(&running, false);
+        return -1;
+    }
+    return 0;
+}
+
+void log_shutdown(void) {
+    if (!atomic_exchange(&running, false)) return;
+
+    uint64_t one = 1;
+    ssize_t rc = write(wakefd, &one, sizeof(one));
+    (void)rc;
+    pthread_join(writer, NULL);
+
+    close(wakefd);
+    wakefd = -1;
+    if (log_fd >= 0) close(log_fd);
+    log_fd = -1;
+}
+
+/* Used before log_init and after log_shutdown: format and write in place. */
+static void log_sync(LogLevel level, const char *fmt, va_list args) {
+    LogRecord r;
+    char file_buf[LOG_RECORD_SIZE + 64];
+    char out_buf[LOG_RECORD_SIZE + 64];
+    size_t file_len = 0, out_len = 0;
+
+    r.level = level;
+    clock_gettime(CLOCK_REALTIME, &r.ts);
+    vsnprintf(r.msg, sizeof(r.msg), fmt, args);
+    render(&r, file_buf, &file_len, out_buf, &out_len, sizeof(file_buf));
+
+    write_all(STDOUT_FILENO, out_buf, out_len);
+    int fd = log_fd >= 0 ? log_fd : open(LOG_FILE, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+        write_all(fd, file_buf, file_len);
+        if (fd != log_fd) close(fd);
+    }
+}
+
+void log_message(LogLevel level, const char *fmt, ...) {
+    if ((int)level > atomic_load_explicit(&current_level, memory_order_relaxed)) {
+        return;
+    }
+
+    va_list args;
+    va_start(args, fmt);
+
+    if (!atomic_load_explicit(&running, memory_order_acquire)) {
+        log_sync(level, fmt, args);
+        va_end(args);
+        return;
+    }
+
+    size_t pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+    LogRecord *r;
+    for (;;) {
+        r = &ring[pos & (LOG_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&r->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+            va_end(args);
+            return;
+        } else {
+            pos = atomic_load_explicit(&enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    r->level = level;
+    clock_gettime(CLOCK_REALTIME_COARSE, &r->ts);
+    vsnprintf(r->msg, sizeof(r->msg), fmt, args);
+    va_end(args);
+    atomic_store_explicit(&r->seq, pos + 1, memory_order_release);
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&writer_sleeping, memory_order_relaxed) &&
+        atomic_exchange(&writer_sleeping, 0)) {
+        uint64_t one = 1;
+        ssize_t rc = write(wakefd, &one, sizeof(one));
+        (void)rc;
+    }
+}
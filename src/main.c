@@ -4,12 +4,13 @@
  * Entry point for the MQTT broker implementation (EP1).
  * 
  * Based on the echo server with pipe provided by Prof. Daniel Batista.
- * Adapted to initialize and run a broker MQTT 5.0.
+ * Adapted to initialize and run an MQTT broker (protocol levels 3.1, 3.1.1 and 5.0).
  *
  * Responsibilities of this file:
  *  - Initialize the TCP server socket (bind, listen).
- *  - Accept multiple client connections.
- *  - Create a handler (child process/thread) for each client.
+ *  - Open one SO_REUSEPORT listening socket per worker thread and hand
+ *    them to the event loops, each of which accepts and multiplexes its
+ *    own share of the clients with epoll.
  *  - Delegate MQTT packet processing to broker and mqtt_parser.
  *
  */
@@ -25,40 +26,34 @@
 #include <signal.h>
 
 #include "broker.h"
+#include "event_loop.h"
 #include "utils.h"
 #include "config.h"
 
-int listenfd;
+int listenfds[MAX_WORKERS];
+int num_workers;
 
 void handle_sigint(int sig) {
     (void)sig;
-    log_message(LOG_INFO, "Shutting down broker...");
-    broker_cleanup();
-    if (listenfd > 0) {
-        close(listenfd);
-    }
-    exit(0);
+    event_loop_stop();
 }
 
-int main(int argc, char **argv) {
-    int port;
+/* Every worker gets its own socket on the same port; the kernel shards accepts. */
+static int open_listener(int port) {
+    int fd;
     struct sockaddr_in servaddr;
 
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <Port>\n", argv[0]);
-        fprintf(stderr, "Example: %s 8000\n", argv[0]);
-        exit(EXIT_FAILURE);
+    if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+        log_message(LOG_ERROR, "socket creation failed");
+        return -1;
     }
 
-    port = atoi(argv[1]);
-
-    broker_init();
-
-    signal(SIGINT, handle_sigint);
-
-    if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-        log_message(LOG_ERROR, "socket creation failed");
-        exit(EXIT_FAILURE);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) {
+        log_message(LOG_ERROR, "SO_REUSEPORT not supported");
+        close(fd);
+        return -1;
     }
 
     memset(&servaddr, 0, sizeof(servaddr));
@@ -66,42 +61,75 @@ int main(int argc, char **argv) {
     servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
     servaddr.sin_port        = htons(port);
 
-    if (bind(listenfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) == -1) {
+    if (bind(fd, (struct sockaddr *)&servaddr, sizeof(servaddr)) == -1) {
         log_message(LOG_ERROR, "bind failed");
-        exit(EXIT_FAILURE);
+        close(fd);
+        return -1;
     }
 
-    if (listen(listenfd, MAX_PENDING) == -1) {
+    if (listen(fd, MAX_PENDING) == -1) {
         log_message(LOG_ERROR, "listen failed");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int main(int argc, char **argv) {
+    int port;
+
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "Usage: %s <Port> [Workers]\n", argv[0]);
+        fprintf(stderr, "Example: %s 8000 4\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    log_message(LOG_INFO, "Broker listening on port %d", port);
+    port = atoi(argv[1]);
 
-    for (;;) {
-        int connfd;
-        struct sockaddr_in cliaddr;
-        socklen_t clilen = sizeof(cliaddr);
+    num_workers = argc == 3 ? atoi(argv[2]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_workers < 1) num_workers = 1;
+    if (num_workers > MAX_WORKERS) num_workers = MAX_WORKERS;
 
-        if ((connfd = accept(listenfd, (struct sockaddr *)&cliaddr, &clilen)) == -1) {
-            log_message(LOG_ERROR, "accept failed");
-            continue;
-        }
+    if (log_init() < 0) {
+        fprintf(stderr, "Failed to start the logger\n");
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_sigint;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
 
-        log_message(LOG_INFO, "New connection from %s:%d: sock %d",
-                inet_ntoa(cliaddr.sin_addr), ntohs(cliaddr.sin_port), connfd);
-
-        pid_t pid = fork();
-        if (pid == 0) {
-            close(listenfd);
-            broker_handle_client(connfd);
-            close(connfd);
-            exit(0);
-        } else if (pid < 0){
-            log_message(LOG_ERROR, "fork failed");
-            close(connfd);
+    for (int i = 0; i < num_workers; i++) {
+        if ((listenfds[i] = open_listener(port)) == -1) {
+            exit(EXIT_FAILURE);
         }
     }
 
+    log_message(LOG_INFO, "Broker listening on port %d with %d worker(s)", port, num_workers);
+
+    if (event_loop_create(listenfds, num_workers) < 0) {
+        log_message(LOG_ERROR, "Failed to create workers");
+        exit(EXIT_FAILURE);
+    }
+
+    /* sessions restored from the store are homed on the loops, so they come first */
+    broker_init(port);
+
+    if (event_loop_run() < 0) {
+        log_message(LOG_ERROR, "Failed to start workers");
+        event_loop_stop();
+    }
+    event_loop_join();
+
+    log_message(LOG_INFO, "Shutting down broker...");
+    broker_cleanup();
+    for (int i = 0; i < num_workers; i++) {
+        close(listenfds[i]);
+    }
+    log_shutdown();
+
     return 0;
 }
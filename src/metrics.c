@@ -0,0 +1,378 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "metrics.h"
+#include "config.h"
+#include "log.h"
+#include "topic.h"
+#include "utils.h"
+
+/*
+ * Hot-path counters and latency histograms. Every worker writes its own
+ * cache-aligned shard with relaxed atomic adds, so nothing on the
+ * publish path takes a lock or shares a cache line; threads that are
+ * not workers share one extra shard. Readers (the HTTP endpoint, the
+ * $SYS publisher) sum the shards as they go: totals are exact, though
+ * not a snapshot of a single instant.
+ *
+ * Histograms are log-linear over nanoseconds: HIST_SUB_BUCKETS linear
+ * buckets per power of two (about 6% resolution) up to 2^36 ns.
+ */
+
+#define HIST_PRECISION 5
+#define HIST_SUB_BUCKETS (1 << (HIST_PRECISION - 1))
+#define HIST_MAX_SHIFT 32
+#define HIST_BUCKETS ((HIST_MAX_SHIFT + 2) * HIST_SUB_BUCKETS)
+#define PROM_MIN_BOUND 8            /* first Prometheus bucket: le 2^8 ns */
+#define PROM_MAX_BOUND 35           /* last finite one: le 2^35 ns */
+
+typedef struct {
+    _Alignas(64) _Atomic uint64_t counters[METRIC_COUNT];
+    _Atomic uint64_t hist[STAGE_COUNT][HIST_BUCKETS];
+    _Atomic uint64_t hist_sum[STAGE_COUNT];
+} Shard;
+
+typedef struct {
+    int64_t counters[METRIC_COUNT];
+    uint64_t hist[STAGE_COUNT][HIST_BUCKETS];
+    uint64_t hist_count[STAGE_COUNT];
+    uint64_t hist_sum[STAGE_COUNT];
+} Totals;
+
+static Shard shards[MAX_WORKERS + 1];
+static _Thread_local Shard *shard = &shards[MAX_WORKERS];
+
+static const char *packet_names[METRIC_PACKET_TYPES] = {
+    "reserved", "connect", "connack", "publish", "puback", "pubrec", "pubrel", "pubcomp",
+    "subscribe", "suback", "unsubscribe", "unsuback", "pingreq", "pingresp", "disconnect", "auth"
+};
+static const char *stage_names[STAGE_COUNT] = { "parse", "match", "fanout", "flush" };
+
+static time_t started;
+static int listenfd = -1;
+static pthread_t server;
+static bool server_running;
+
+/* Binds the calling event loop thread to its own shard. */
+void metrics_thread(int worker) {
+    if (worker >= 0 && worker < MAX_WORKERS) shard = &shards[worker];
+}
+
+void metrics_add(Metric m, int64_t n) {
+    atomic_fetch_add_explicit(&shard->counters[m], (uint64_t)n, memory_order_relaxed);
+}
+
+uint64_t metrics_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int hist_index(uint64_t v) {
+    int msb = 63 - __builtin_clzll(v | 1);
+    int shift = msb < HIST_PRECISION ? 0 : msb - HIST_PRECISION + 1;
+    if (shift > HIST_MAX_SHIFT) {
+        shift = HIST_MAX_SHIFT;
+        v = ((1ull << HIST_PRECISION) - 1) << shift;
+    }
+    return shift * HIST_SUB_BUCKETS + (int)(v >> shift);
+}
+
+/* The highest value that lands in bucket `i`. */
+static uint64_t hist_value(int i) {
+    int shift = i < 2 * HIST_SUB_BUCKETS ? 0 : i / HIST_SUB_BUCKETS - 1;
+    uint64_t low = (uint64_t)(i - shift * HIST_SUB_BUCKETS) << shift;
+    return low + (1ull << shift) - 1;
+}
+
+void metrics_record(Stage s, uint64_t ns) {
+    atomic_fetch_add_explicit(&shard->hist[s][hist_index(ns)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&shard->hist_sum[s], ns, memory_order_relaxed);
+}
+
+static void collect(Totals *t) {
+    memset(t, 0, sizeof(*t));
+    for (int i = 0; i <= MAX_WORKERS; i++) {
+        Shard *sh = &shards[i];
+        for (int m = 0; m < METRIC_COUNT; m++) {
+            t->counters[m] += (int64_t)atomic_load_explicit(&sh->counters[m], memory_order_relaxed);
+        }
+        for (int s = 0; s < STAGE_COUNT; s++) {
+            for (int b = 0; b < HIST_BUCKETS; b++) {
+                uint64_t n = atomic_load_explicit(&sh->hist[s][b], memory_order_relaxed);
+                t->hist[s][b] += n;
+                t->hist_count[s] += n;
+            }
+            t->hist_sum[s] += atomic_load_explicit(&sh->hist_sum[s], memory_order_relaxed);
+        }
+    }
+}
+
+static uint64_t percentile(const Totals *t, Stage s, double p) {
+    uint64_t target = (uint64_t)(p / 100.0 * (double)t->hist_count[s] + 0.5), seen = 0;
+    if (target == 0) target = 1;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += t->hist[s][b];
+        if (seen >= target) return hist_value(b);
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------------
+// Prometheus text endpoint
+// ---------------------------------------------------------------------
+
+static void prom_counter(FILE *f, const char *name, const char *help, int64_t value) {
+    fprintf(f, "# HELP %s %s\n# TYPE %s counter\n%s %lld\n", name, help, name, name, (long long)value);
+}
+
+static void prom_gauge(FILE *f, const char *name, const char *help, int64_t value) {
+    fprintf(f, "# HELP %s %s\n# TYPE %s gauge\n%s %lld\n", name, help, name, name, (long long)value);
+}
+
+static void render_prometheus(FILE *f, const Totals *t) {
+    const int64_t *c = t->counters;
+
+    prom_gauge(f, "broker_uptime_seconds", "Seconds since the broker started.", time(NULL) - started);
+    prom_counter(f, "broker_connections_opened_total", "Connections accepted.", c[METRIC_CONNECTIONS_OPENED]);
+    prom_counter(f, "broker_connections_closed_total", "Connections closed.", c[METRIC_CONNECTIONS_CLOSED]);
+    prom_gauge(f, "broker_connections", "Open connections.",
+               c[METRIC_CONNECTIONS_OPENED] - c[METRIC_CONNECTIONS_CLOSED]);
+    prom_counter(f, "broker_clients_dropped_total",
+                 "Connections closed by the broker (keep-alive, CONNECT timeout, full output queue).",
+                 c[METRIC_CLIENTS_DROPPED]);
+    prom_counter(f, "broker_sessions_expired_total", "Offline persistent sessions expired.",
+                 c[METRIC_SESSIONS_EXPIRED]);
+    prom_counter(f, "broker_received_bytes_total", "Bytes read from clients.", c[METRIC_BYTES_IN]);
+    prom_counter(f, "broker_sent_bytes_total", "Bytes written to clients.", c[METRIC_BYTES_OUT]);
+    prom_counter(f, "broker_messages_dropped_total", "Messages dropped by queue limits or packet size limits.",
+                 c[METRIC_MESSAGES_DROPPED]);
+    prom_counter(f, "broker_publishers_paused_total",
+                 "Times a publisher was not read until a subscriber's QoS 1/2 backlog drained.",
+                 c[METRIC_PUBLISHERS_PAUSED]);
+    prom_gauge(f, "broker_queued_frames", "Frames waiting in client output queues.", c[METRIC_QUEUED_FRAMES]);
+    prom_gauge(f, "broker_queued_bytes", "Bytes waiting in client output queues.", c[METRIC_QUEUED_BYTES]);
+    prom_counter(f, "broker_log_dropped_total", "Log records dropped because the log ring was full.",
+                 (int64_t)log_dropped());
+
+    static const struct { const char *name, *help; int base; } packets[] = {
+        { "broker_packets_received_total", "MQTT packets received, by type.", METRIC_PACKETS_IN },
+        { "broker_packets_sent_total", "MQTT packets queued for sending, by type.", METRIC_PACKETS_OUT },
+    };
+    for (size_t i = 0; i < sizeof(packets) / sizeof(packets[0]); i++) {
+        fprintf(f, "# HELP %s %s\n# TYPE %s counter\n", packets[i].name, packets[i].help, packets[i].name);
+        for (int type = 1; type < METRIC_PACKET_TYPES; type++) {
+            fprintf(f, "%s{type=\"%s\"} %lld\n", packets[i].name, packet_names[type],
+                    (long long)c[packets[i].base + type]);
+        }
+    }
+
+    fprintf(f, "# HELP broker_stage_seconds Time spent in each hot-path stage.\n"
+               "# TYPE broker_stage_seconds histogram\n");
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        uint64_t cumulative = 0;
+        int b = 0;
+        for (int bound = PROM_MIN_BOUND; bound <= PROM_MAX_BOUND; bound++) {
+            for (; b < HIST_BUCKETS && hist_value(b) < (1ull << bound); b++) cumulative += t->hist[s][b];
+            fprintf(f, "broker_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n", stage_names[s],
+                    (double)(1ull << bound) / 1e9, (unsigned long long)cumulative);
+        }
+        fprintf(f, "broker_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n", stage_names[s],
+                (unsigned long long)t->hist_count[s]);
+        fprintf(f, "broker_stage_seconds_sum{stage=\"%s\"} %.9f\n", stage_names[s], (double)t->hist_sum[s] / 1e9);
+        fprintf(f, "broker_stage_seconds_count{stage=\"%s\"} %llu\n", stage_names[s],
+                (unsigned long long)t->hist_count[s]);
+    }
+}
+
+static void send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+}
+
+/* One request per connection: GET /metrics, anything else is a 404. */
+static void serve(int fd) {
+    char request[1024];
+    size_t len = 0;
+
+    while (len < sizeof(request) - 1) {
+        ssize_t n = recv(fd, request + len, sizeof(request) - 1 - len, 0);
+        if (n <= 0) break;
+        len += (size_t)n;
+        request[len] = '\0';
+        if (strstr(request, "\r\n\r\n")) break;
+    }
+    request[len] = '\0';
+
+    char *body = NULL;
+    size_t body_len = 0;
+    bool found = strncmp(request, "GET /metrics ", 13) == 0 || strncmp(request, "GET / ", 6) == 0;
+    if (found) {
+        FILE *f = open_memstream(&body, &body_len);
+        if (!f) return;
+        Totals *t = malloc(sizeof(Totals));
+        if (t) {
+            collect(t);
+            render_prometheus(f, t);
+            free(t);
+        }
+        fclose(f);
+    }
+
+    char header[256];
+    int n = snprintf(header, sizeof(header),
+                     "HTTP/1.1 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                     "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+                     found ? "200 OK" : "404 Not Found", body_len);
+    send_all(fd, header, (size_t)n);
+    if (body) send_all(fd, body, body_len);
+    free(body);
+}
+
+static void *server_thread(void *arg) {
+    (void)arg;
+    struct timeval timeout = { 1, 0 };
+
+    for (;;) {
+        int fd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;          /* shut down */
+        }
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        serve(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+static int open_endpoint(int port) {
+    struct sockaddr_in addr;
+    int one = 1;
+
+    listenfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenfd < 0) return -1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenfd, 16) < 0) {
+        close(listenfd);
+        listenfd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Starts the endpoint on 127.0.0.1:METRICS_PORT (BROKER_METRICS_PORT
+ * overrides it; 0 turns it off). Counters work either way.
+ */
+void metrics_init(void) {
+    const char *env = getenv("BROKER_METRICS_PORT");
+    int port = env ? atoi(env) : METRICS_PORT;
+
+    started = time(NULL);
+    if (port <= 0) return;
+
+    if (open_endpoint(port) < 0) {
+        log_message(LOG_WARNING, "Metrics endpoint could not listen on port %d: %s", port, strerror(errno));
+        return;
+    }
+    if (pthread_create(&server, NULL, server_thread, NULL) != 0) {
+        log_message(LOG_WARNING, "Failed to start the metrics endpoint");
+        close(listenfd);
+        listenfd = -1;
+        return;
+    }
+    server_running = true;
+    log_message(LOG_INFO, "Metrics on http://127.0.0.1:%d/metrics", port);
+}
+
+void metrics_shutdown(void) {
+    if (!server_running) return;
+    shutdown(listenfd, SHUT_RDWR);
+    pthread_join(server, NULL);
+    close(listenfd);
+    listenfd = -1;
+    server_running = false;
+}
+
+// ---------------------------------------------------------------------
+// $SYS topics
+// ---------------------------------------------------------------------
+
+static void sys_publish(const char *topic, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void sys_publish(const char *topic, const char *fmt, ...) {
+    char payload[64];
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(payload, sizeof(payload), fmt, args);
+    va_end(args);
+    if (n < 0 || (size_t)n >= sizeof(payload)) return;
+    topic_publish(topic, strlen(topic), (const uint8_t *)payload, (size_t)n, 0, true, NULL, NULL);
+}
+
+/* Retained $SYS/broker/... messages with the current totals; latencies in microseconds. */
+void metrics_publish_sys(void) {
+    Totals *t = malloc(sizeof(Totals));
+    if (!t) return;
+    collect(t);
+
+    const int64_t *c = t->counters;
+    char topic[MAX_TOPIC_NAME];
+
+    sys_publish("$SYS/broker/uptime", "%lld", (long long)(time(NULL) - started));
+    sys_publish("$SYS/broker/clients/connected", "%lld",
+                (long long)(c[METRIC_CONNECTIONS_OPENED] - c[METRIC_CONNECTIONS_CLOSED]));
+    sys_publish("$SYS/broker/clients/dropped", "%lld", (long long)c[METRIC_CLIENTS_DROPPED]);
+    sys_publish("$SYS/broker/connections/opened", "%lld", (long long)c[METRIC_CONNECTIONS_OPENED]);
+    sys_publish("$SYS/broker/connections/closed", "%lld", (long long)c[METRIC_CONNECTIONS_CLOSED]);
+    sys_publish("$SYS/broker/sessions/expired", "%lld", (long long)c[METRIC_SESSIONS_EXPIRED]);
+    sys_publish("$SYS/broker/bytes/received", "%lld", (long long)c[METRIC_BYTES_IN]);
+    sys_publish("$SYS/broker/bytes/sent", "%lld", (long long)c[METRIC_BYTES_OUT]);
+    sys_publish("$SYS/broker/messages/dropped", "%lld", (long long)c[METRIC_MESSAGES_DROPPED]);
+    sys_publish("$SYS/broker/publishers/paused", "%lld", (long long)c[METRIC_PUBLISHERS_PAUSED]);
+    sys_publish("$SYS/broker/queue/frames", "%lld", (long long)c[METRIC_QUEUED_FRAMES]);
+    sys_publish("$SYS/broker/queue/bytes", "%lld", (long long)c[METRIC_QUEUED_BYTES]);
+
+    for (int type = 1; type < METRIC_PACKET_TYPES; type++) {
+        snprintf(topic, sizeof(topic), "$SYS/broker/packets/received/%s", packet_names[type]);
+        sys_publish(topic, "%lld", (long long)c[METRIC_PACKETS_IN + type]);
+        snprintf(topic, sizeof(topic), "$SYS/broker/packets/sent/%s", packet_names[type]);
+        sys_publish(topic, "%lld", (long long)c[METRIC_PACKETS_OUT + type]);
+    }
+
+    static const struct { const char *name; double p; } points[] = {
+        { "p50", 50 }, { "p99", 99 }, { "p999", 99.9 },
+    };
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        for (size_t i = 0; i < sizeof(points) / sizeof(points[0]); i++) {
+            snprintf(topic, sizeof(topic), "$SYS/broker/latency/%s/%s", stage_names[s], points[i].name);
+            sys_publish(topic, "%.3f", (double)percentile(t, s, points[i].p) / 1000.0);
+        }
+    }
+    free(t);
+}
@@ -0,0 +1,46 @@
+#include <stddef.h>
+
+#include "mpsc_queue.h"
+
+void mpsc_init(MpscQueue *q) {
+    atomic_store_explicit(&q->stub.next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&q->head, &q->stub, memory_order_relaxed);
+    q->tail = &q->stub;
+}
+
+void mpsc_push(MpscQueue *q, MpscNode *n) {
+    atomic_store_explicit(&n->next, NULL, memory_order_relaxed);
+    MpscNode *prev = atomic_exchange_explicit(&q->head, n, memory_order_acq_rel);
+    atomic_store_explicit(&prev->next, n, memory_order_release);
+}
+
+/*
+ * Returns NULL when empty, or when a producer is half-way through a push;
+ * that producer wakes the consumer again once its push is complete.
+ */
+MpscNode *mpsc_pop(MpscQueue *q) {
+    MpscNode *tail = q->tail;
+    MpscNode *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == &q->stub) {
+        if (!next) return NULL;
+        q->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    }
+
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+
+    if (tail != atomic_load_explicit(&q->head, memory_order_acquire)) return NULL;
+
+    mpsc_push(q, &q->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
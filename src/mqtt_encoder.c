@@ -0,0 +1,222 @@
+#include <string.h>
+
+#include "codec.h"
+#include "mqtt_encoder.h"
+#include "utils.h"
+
+/*
+ * Every encoder computes the exact frame size first and then writes the
+ * frame front to back in a single pass, so callers can size a slab (or
+ * a Frame) up front and nothing is assembled in a temporary buffer.
+ */
+
+static size_t put_u16(uint8_t *buf, uint16_t v) {
+    codec_store_be16(buf, v);
+    return 2;
+}
+
+static size_t publish_remaining(const MqttPublishSpec *p) {
+    size_t n = 2 + p->topic_len + p->payload_len;
+    if (p->qos > 0) n += 2;
+    if (p->version >= MQTT_PROTOCOL_V5) n += codec_varint_size((uint32_t)p->properties_len) + p->properties_len;
+    return n;
+}
+
+/* Bytes that precede the payload: fixed header, topic, packet id, properties. */
+size_t mqtt_publish_header_size(const MqttPublishSpec *p) {
+    size_t remaining = publish_remaining(p);
+    return 1 + codec_varint_size((uint32_t)remaining) + remaining - p->payload_len;
+}
+
+size_t mqtt_publish_size(const MqttPublishSpec *p) {
+    size_t remaining = publish_remaining(p);
+    return 1 + codec_varint_size((uint32_t)remaining) + remaining;
+}
+
+/*
+ * Writes the PUBLISH up to (not including) the payload, so the payload
+ * can be sent from where it already is (an iovec entry or a shared frame).
+ */
+int mqtt_encode_publish_header(uint8_t *buf, size_t maxlen, const MqttPublishSpec *p) {
+    size_t remaining = publish_remaining(p);
+    if (remaining > MQTT_MAX_PACKET_SIZE || p->topic_len > 0xFFFF || p->qos > 2) return -1;
+    if (mqtt_publish_header_size(p) > maxlen) return -1;
+
+    size_t pos = 0;
+    buf[pos++] = (MQTT_PKT_PUBLISH << 4) | (p->dup ? 0x08 : 0) | (p->qos << 1) | (p->retain ? 0x01 : 0);
+    pos += codec_varint_encode(&buf[pos], (uint32_t)remaining);
+    pos += put_u16(&buf[pos], (uint16_t)p->topic_len);
+    memcpy(&buf[pos], p->topic, p->topic_len);
+    pos += p->topic_len;
+
+    if (p->qos > 0) pos += put_u16(&buf[pos], p->packet_id);
+
+    if (p->version >= MQTT_PROTOCOL_V5) {
+        pos += codec_varint_encode(&buf[pos], (uint32_t)p->properties_len);
+        if (p->properties_len) memcpy(&buf[pos], p->properties, p->properties_len);
+        pos += p->properties_len;
+    }
+
+    return (int)pos;
+}
+
+int mqtt_encode_publish(uint8_t *buf, size_t maxlen, const MqttPublishSpec *p) {
+    if (mqtt_publish_size(p) > maxlen) return -1;
+
+    int pos = mqtt_encode_publish_header(buf, maxlen, p);
+    if (pos < 0) return -1;
+    if (p->payload_len) memcpy(&buf[pos], p->payload, p->payload_len);
+
+    return pos + (int)p->payload_len;
+}
+
+/* The topic name of `msg`, a QoS 0 MQTT 3.1.1 PUBLISH; -1 if the header is unreadable. */
+int mqtt_publish_topic(const Frame *msg, MqttView *topic) {
+    uint32_t remaining;
+    int length_bytes = codec_varint_decode(&msg->data[1], msg->len - 1, &remaining);
+    if (length_bytes <= 0 || (size_t)length_bytes + 3 > msg->len) return -1;
+
+    size_t pos = 1 + length_bytes;
+    topic->len = codec_load_be16(&msg->data[pos]);
+    topic->data = &msg->data[pos + 2];
+    return 0;
+}
+
+/*
+ * A new header (QoS, packet id, DUP, protocol version) in front of the
+ * topic and payload of `msg`, a QoS 0 MQTT 3.1.1 PUBLISH, whose bytes are
+ * borrowed rather than copied. The retain flag is kept. A non-zero
+ * `topic_alias` (MQTT 5) goes into the properties; with `alias_only`
+ * it replaces the topic name.
+ */
+Frame *mqtt_publish_reframe(Frame *msg, uint8_t qos, uint16_t packet_id, bool dup, uint8_t version,
+                            uint16_t topic_alias, bool alias_only) {
+    MqttView topic;
+    if (mqtt_publish_topic(msg, &topic) < 0) return NULL;
+    size_t payload_off = (size_t)(topic.data - msg->data) + topic.len;
+
+    uint8_t props[3];
+    size_t props_len = topic_alias ? mqtt_put_property_u16(props, MQTT_PROP_TOPIC_ALIAS, topic_alias) : 0;
+
+    MqttPublishSpec spec = {
+        .topic = (const char *)topic.data,
+        .topic_len = topic_alias && alias_only ? 0 : topic.len,
+        .payload_len = msg->len - payload_off,
+        .qos = qos,
+        .retain = msg->data[0] & 0x01,
+        .dup = dup,
+        .packet_id = packet_id,
+        .properties = props,
+        .properties_len = props_len,
+        .version = version,
+    };
+
+    size_t header_len = mqtt_publish_header_size(&spec);
+    Frame *f = frame_alloc(header_len);
+    if (!f) return NULL;
+    if (mqtt_encode_publish_header(f->data, header_len, &spec) < 0) {
+        frame_release(f);
+        return NULL;
+    }
+    f->len = header_len;
+    frame_retain(msg);
+    f->tail = msg;
+    f->tail_offset = payload_off;
+    return f;
+}
+
+/* MQTT 5 property writers for the caller's property blocks; each returns the bytes written. */
+size_t mqtt_put_property_u16(uint8_t *buf, uint8_t id, uint16_t value) {
+    buf[0] = id;
+    return 1 + put_u16(&buf[1], value);
+}
+
+size_t mqtt_put_property_u32(uint8_t *buf, uint8_t id, uint32_t value) {
+    buf[0] = id;
+    codec_store_be32(&buf[1], value);
+    return 5;
+}
+
+size_t mqtt_put_property_string(uint8_t *buf, uint8_t id, const char *s, size_t len) {
+    buf[0] = id;
+    put_u16(&buf[1], (uint16_t)len);
+    memcpy(&buf[3], s, len);
+    return 3 + len;
+}
+
+/* `properties` (MQTT 5 only) is an encoded property block without its length prefix. */
+int mqtt_encode_connack(uint8_t *buf, size_t maxlen, bool session_present, uint8_t reason, uint8_t version,
+                        const uint8_t *properties, size_t properties_len) {
+    size_t remaining = 2;
+    if (version >= MQTT_PROTOCOL_V5) remaining += codec_varint_size((uint32_t)properties_len) + properties_len;
+    if (maxlen < 1 + codec_varint_size((uint32_t)remaining) + remaining) return -1;
+
+    size_t pos = 0;
+    buf[pos++] = MQTT_PKT_CONNACK << 4;
+    pos += codec_varint_encode(&buf[pos], (uint32_t)remaining);
+    buf[pos++] = session_present ? 0x01 : 0x00;
+    buf[pos++] = reason;
+    if (version >= MQTT_PROTOCOL_V5) {
+        pos += codec_varint_encode(&buf[pos], (uint32_t)properties_len);
+        if (properties_len) memcpy(&buf[pos], properties, properties_len);
+        pos += properties_len;
+    }
+    return (int)pos;
+}
+
+/*
+ * PUBACK, PUBREC, PUBREL and PUBCOMP. MQTT 5 lets a successful ack omit
+ * its reason code, so only failures carry one (with no properties).
+ */
+int mqtt_encode_ack(uint8_t *buf, size_t maxlen, MqttPacketType type, uint16_t packet_id,
+                    uint8_t reason, uint8_t version) {
+    bool with_reason = version >= MQTT_PROTOCOL_V5 && reason != 0;
+    size_t remaining = with_reason ? 3 : 2;
+    if (maxlen < 2 + remaining) return -1;
+
+    buf[0] = (uint8_t)(type << 4) | (type == MQTT_PKT_PUBREL ? 0x02 : 0x00);
+    buf[1] = (uint8_t)remaining;
+    put_u16(&buf[2], packet_id);
+    if (with_reason) buf[4] = reason;
+    return 2 + (int)remaining;
+}
+
+static int encode_sub_ack(uint8_t *buf, size_t maxlen, MqttPacketType type, uint16_t packet_id,
+                          const uint8_t *codes, size_t count, uint8_t version) {
+    size_t props = version >= MQTT_PROTOCOL_V5 ? 1 : 0;
+    size_t remaining = 2 + props + count;
+    if (remaining > MQTT_MAX_PACKET_SIZE) return -1;
+    if (maxlen < 1 + codec_varint_size((uint32_t)remaining) + remaining) return -1;
+
+    size_t pos = 0;
+    buf[pos++] = (uint8_t)(type << 4);
+    pos += codec_varint_encode(&buf[pos], (uint32_t)remaining);
+    pos += put_u16(&buf[pos], packet_id);
+    if (props) buf[pos++] = 0x00;
+    memcpy(&buf[pos], codes, count);
+    pos += count;
+
+    return (int)pos;
+}
+
+/* One return code per filter, in request order. */
+int mqtt_encode_suback(uint8_t *buf, size_t maxlen, uint16_t packet_id,
+                       const uint8_t *codes, size_t count, uint8_t version) {
+    return encode_sub_ack(buf, maxlen, MQTT_PKT_SUBACK, packet_id, codes, count, version);
+}
+
+/* MQTT 3.1.1 UNSUBACK carries only the packet id; MQTT 5 adds a reason per filter. */
+int mqtt_encode_unsuback(uint8_t *buf, size_t maxlen, uint16_t packet_id,
+                         const uint8_t *codes, size_t count, uint8_t version) {
+    if (version < MQTT_PROTOCOL_V5) {
+        return mqtt_encode_ack(buf, maxlen, MQTT_PKT_UNSUBACK, packet_id, 0, version);
+    }
+    return encode_sub_ack(buf, maxlen, MQTT_PKT_UNSUBACK, packet_id, codes, count, version);
+}
+
+int mqtt_encode_pingresp(uint8_t *buf, size_t maxlen) {
+    if (maxlen < 2) return -1;
+    buf[0] = MQTT_PKT_PINGRESP << 4;
+    buf[1] = 0x00;
+    return 2;
+}
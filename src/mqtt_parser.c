@@ -1,96 +1,355 @@
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "codec.h"
 #include "mqtt_parser.h"
 #include "utils.h"
 
-int mqtt_parse_packet(const uint8_t *buf, size_t len, MqttPacket *pkt) {
-    if (len < 2) return -1;
+void mqtt_decoder_init(MqttDecoder *d) {
+    d->state = MQTT_DEC_HEADER;
+    d->length_bytes = 0;
+    d->remaining = 0;
+}
 
-    uint8_t packet_type = (buf[0] >> 4) & 0x0F;
-    pkt->type = (MqttPacketType)packet_type;
+/*
+ * Frames the byte stream in `rb`. Returns 1 with a whole packet (fixed
+ * header included) in *frame, 0 when more bytes are needed, -1 when the
+ * stream is malformed. The caller must ring_consume() the frame before
+ * asking for the next one. Progress through the fixed header is kept
+ * in the decoder, so partial headers are never re-scanned.
+ */
+int mqtt_decoder_next(MqttDecoder *d, RingBuffer *rb, const uint8_t **frame, size_t *frame_len) {
+    if (d->state == MQTT_DEC_HEADER) {
+        if (rb->len < 1) return 0;
+        if ((ring_peek(rb, 0) >> 4) == 0) return -1;
+        d->state = MQTT_DEC_LENGTH;
+        d->length_bytes = 0;
+        d->remaining = 0;
+    }
 
-    switch (pkt->type) {
-        case MQTT_PKT_CONNECT: {
-            log_message(LOG_DEBUG, "CONNECT packet received (len=%zu)\n", len);
+    if (d->state == MQTT_DEC_LENGTH) {
+        for (;;) {
+            if (rb->len < (size_t)d->length_bytes + 2) return 0;
+
+            uint8_t b = ring_peek(rb, 1 + d->length_bytes);
+            d->remaining |= (uint32_t)(b & 0x7F) << (7 * d->length_bytes);
+            d->length_bytes++;
 
-            int pos = 2;
+            if (!(b & 0x80)) break;
+            if (d->length_bytes == 4) return -1;
+        }
+        if (d->remaining > MQTT_MAX_PACKET_SIZE) return -1;
+        d->state = MQTT_DEC_BODY;
+    }
 
-            int proto_len = (buf[pos] << 8) | buf[pos+1];
-            pos += 2;
-            log_message(LOG_DEBUG, "Protocol Name length=%d\n", proto_len);
+    size_t total = 1 + (size_t)d->length_bytes + d->remaining;
+    if (rb->len < total) {
+        return ring_reserve(rb, total - rb->len) < 0 ? -1 : 0;
+    }
 
-            char proto_name[16] = {0};
-            memcpy(proto_name, &buf[pos], proto_len);
-            proto_name[proto_len] = '\0';
-            pos += proto_len;
-            log_message(LOG_DEBUG, "Protocol Name='%s'\n", proto_name);
+    *frame = ring_contiguous(rb, total);
+    if (!*frame) return -1;
+    *frame_len = total;
+    d->state = MQTT_DEC_HEADER;
+    return 1;
+}
 
-            uint8_t proto_level = buf[pos++];
-            log_message(LOG_DEBUG, "Protocol Level=%d\n", proto_level);
+/* Reads a two-byte length prefixed string as a view; -1 if it overruns the packet. */
+static int read_view(const uint8_t *buf, size_t len, size_t *pos, MqttView *out) {
+    if (*pos + 2 > len) return -1;
+    size_t n = codec_load_be16(&buf[*pos]);
+    if (*pos + 2 + n > len) return -1;
+    out->data = &buf[*pos + 2];
+    out->len = n;
+    *pos += 2 + n;
+    return 0;
+}
 
-            uint8_t flags = buf[pos++];
-            log_message(LOG_DEBUG, "Connect Flags=0x%02X\n", flags);
+/* Reads a two-byte big-endian integer; -1 if it overruns the packet. */
+static int read_u16(const uint8_t *buf, size_t len, size_t *pos, uint16_t *out) {
+    if (*pos + 2 > len) return -1;
+    *out = codec_load_be16(&buf[*pos]);
+    *pos += 2;
+    return 0;
+}
 
-            uint16_t keepalive = (buf[pos] << 8) | buf[pos+1];
-            pos += 2;
-            log_message(LOG_DEBUG, "Keep Alive=%u\n", keepalive);
+/* Reads a Variable Byte Integer (at most four bytes). */
+static int read_varint(const uint8_t *buf, size_t len, size_t *pos, uint32_t *out) {
+    if (*pos >= len) return -1;
+    int n = codec_varint_decode(&buf[*pos], len - *pos, out);
+    if (n <= 0) return -1;
+    *pos += n;
+    return 0;
+}
 
-            int id_len = (buf[pos] << 8) | buf[pos+1];
-            pos += 2;
-            log_message(LOG_DEBUG, "Client ID length=%d\n", id_len);
+/* Where a property may appear; a property seen anywhere else is a protocol error. */
+enum {
+    IN_CONNECT     = 1 << 0,
+    IN_WILL        = 1 << 1,
+    IN_PUBLISH     = 1 << 2,
+    IN_SUBSCRIBE   = 1 << 3,
+    IN_UNSUBSCRIBE = 1 << 4,
+    IN_DISCONNECT  = 1 << 5
+};
+
+enum {
+    PROP_BYTE = 1,
+    PROP_U16,
+    PROP_U32,
+    PROP_VARINT,
+    PROP_STRING,    /* string and binary data are both length-prefixed views */
+    PROP_PAIR       /* user property: only counted */
+};
+
+typedef struct {
+    uint8_t type;
+    uint8_t contexts;
+    uint16_t offset;        /* of the value in MqttProperties */
+} PropertySpec;
+
+#define PROPERTY(id, t, ctx, field) [id] = { t, ctx, offsetof(MqttProperties, field) }
+
+static const PropertySpec property_specs[MQTT_PROP_MAXIMUM_PACKET_SIZE + 1] = {
+    PROPERTY(MQTT_PROP_PAYLOAD_FORMAT, PROP_BYTE, IN_WILL | IN_PUBLISH, payload_format),
+    PROPERTY(MQTT_PROP_MESSAGE_EXPIRY, PROP_U32, IN_WILL | IN_PUBLISH, message_expiry),
+    PROPERTY(MQTT_PROP_CONTENT_TYPE, PROP_STRING, IN_WILL | IN_PUBLISH, content_type),
+    PROPERTY(MQTT_PROP_RESPONSE_TOPIC, PROP_STRING, IN_WILL | IN_PUBLISH, response_topic),
+    PROPERTY(MQTT_PROP_CORRELATION_DATA, PROP_STRING, IN_WILL | IN_PUBLISH, correlation_data),
+    PROPERTY(MQTT_PROP_SUBSCRIPTION_ID, PROP_VARINT, IN_SUBSCRIBE, subscription_id),
+    PROPERTY(MQTT_PROP_SESSION_EXPIRY, PROP_U32, IN_CONNECT | IN_DISCONNECT, session_expiry),
+    PROPERTY(MQTT_PROP_AUTH_METHOD, PROP_STRING, IN_CONNECT, auth_method),
+    PROPERTY(MQTT_PROP_AUTH_DATA, PROP_STRING, IN_CONNECT, auth_data),
+    PROPERTY(MQTT_PROP_REQUEST_PROBLEM_INFO, PROP_BYTE, IN_CONNECT, request_problem_info),
+    PROPERTY(MQTT_PROP_WILL_DELAY, PROP_U32, IN_WILL, will_delay),
+    PROPERTY(MQTT_PROP_REQUEST_RESPONSE_INFO, PROP_BYTE, IN_CONNECT, request_response_info),
+    PROPERTY(MQTT_PROP_REASON_STRING, PROP_STRING, IN_DISCONNECT, reason_string),
+    PROPERTY(MQTT_PROP_RECEIVE_MAXIMUM, PROP_U16, IN_CONNECT, receive_maximum),
+    PROPERTY(MQTT_PROP_TOPIC_ALIAS_MAXIMUM, PROP_U16, IN_CONNECT, topic_alias_maximum),
+    PROPERTY(MQTT_PROP_TOPIC_ALIAS, PROP_U16, IN_PUBLISH, topic_alias),
+    PROPERTY(MQTT_PROP_USER_PROPERTY, PROP_PAIR,
+             IN_CONNECT | IN_WILL | IN_PUBLISH | IN_SUBSCRIBE | IN_UNSUBSCRIBE | IN_DISCONNECT, user_properties),
+    PROPERTY(MQTT_PROP_MAXIMUM_PACKET_SIZE, PROP_U32, IN_CONNECT, maximum_packet_size),
+};
+
+/*
+ * Decodes a property block (variable byte length + properties) into
+ * `props` in one pass, driven by property_specs. Unknown, misplaced and
+ * repeated properties (user properties aside) fail the packet, as do the
+ * values MQTT 5 rules out.
+ */
+static int read_properties(const uint8_t *buf, size_t len, size_t *pos, uint8_t context, MqttProperties *props) {
+    uint32_t block;
+    if (read_varint(buf, len, pos, &block) < 0 || block > len - *pos) return -1;
+    size_t end = *pos + block;
+
+    while (*pos < end) {
+        uint32_t id;
+        if (read_varint(buf, end, pos, &id) < 0) return -1;
+        if (id >= sizeof(property_specs) / sizeof(property_specs[0])) return -1;
+        const PropertySpec *spec = &property_specs[id];
+        if (!spec->type || !(spec->contexts & context)) return -1;
+        if (MQTT_HAS_PROPERTY(props, id) && spec->type != PROP_PAIR) return -1;
+        props->present |= (uint64_t)1 << id;
+
+        void *field = (uint8_t *)props + spec->offset;
+        MqttView key, value;
+        uint16_t v16;
+        switch (spec->type) {
+            case PROP_BYTE:
+                if (*pos >= end) return -1;
+                *(uint32_t *)field = buf[(*pos)++];
+                break;
+            case PROP_U16:
+                if (read_u16(buf, end, pos, &v16) < 0) return -1;
+                *(uint32_t *)field = v16;
+                break;
+            case PROP_U32:
+                if (*pos + 4 > end) return -1;
+                *(uint32_t *)field = codec_load_be32(&buf[*pos]);
+                *pos += 4;
+                break;
+            case PROP_VARINT:
+                if (read_varint(buf, end, pos, (uint32_t *)field) < 0) return -1;
+                break;
+            case PROP_STRING:
+                if (read_view(buf, end, pos, (MqttView *)field) < 0) return -1;
+                break;
+            case PROP_PAIR:
+                if (read_view(buf, end, pos, &key) < 0 || read_view(buf, end, pos, &value) < 0) return -1;
+                (*(uint32_t *)field)++;
+                break;
+        }
+    }
 
-            if (id_len == 0) {
-                generate_client_uuid(pkt->client_id);
-                log_message(LOG_DEBUG, "Empty Client ID, assigned='%s'\n", pkt->client_id);
-            }
+    if (props->payload_format > 1 || props->request_problem_info > 1 || props->request_response_info > 1) return -1;
+    if (MQTT_HAS_PROPERTY(props, MQTT_PROP_RECEIVE_MAXIMUM) && props->receive_maximum == 0) return -1;
+    if (MQTT_HAS_PROPERTY(props, MQTT_PROP_MAXIMUM_PACKET_SIZE) && props->maximum_packet_size == 0) return -1;
+    if (MQTT_HAS_PROPERTY(props, MQTT_PROP_SUBSCRIPTION_ID) && props->subscription_id == 0) return -1;
+    return 0;
+}
 
-            log_message(LOG_DEBUG, "Parsed Client ID='%s'\n", pkt->client_id);
+static bool view_is(MqttView v, const char *s) {
+    return v.len == strlen(s) && memcmp(v.data, s, v.len) == 0;
+}
 
-            break;
-        }
+/*
+ * CONNECT (§3.1): every field is bounds-checked against the packet and
+ * the flag combinations the spec forbids are rejected. An unsupported
+ * protocol level stops the parse early with only protocol_level set, so
+ * the broker can answer it.
+ */
+static int parse_connect(const uint8_t *buf, size_t len, size_t pos, MqttPacket *pkt) {
+    MqttView proto_name;
+    if (pkt->flags != 0) return -1;
+    if (read_view(buf, len, &pos, &proto_name) < 0) return -1;
+    if (pos + 4 > len) return -1;
+
+    uint8_t level = buf[pos++];
+    pkt->protocol_level = level;
+    log_message(LOG_DEBUG, "Protocol Name='%.*s' Level=%d", (int)proto_name.len, proto_name.data, level);
+    if (!view_is(proto_name, "MQTT") && !view_is(proto_name, "MQIsdp")) return -1;
+    if (level < 3 || level > MQTT_PROTOCOL_V5) return 0;
+
+    uint8_t flags = buf[pos++];
+    if (flags & 0x01) return -1;
+    pkt->clean_session = (flags & 0x02) != 0;
+    pkt->will = (flags & 0x04) != 0;
+    pkt->will_qos = (flags >> 3) & 0x03;
+    pkt->will_retain = (flags & 0x20) != 0;
+    pkt->has_password = (flags & 0x40) != 0;
+    pkt->has_username = (flags & 0x80) != 0;
+    if (pkt->will_qos > 2 || (!pkt->will && (pkt->will_qos || pkt->will_retain))) return -1;
+    if (level < MQTT_PROTOCOL_V5 && pkt->has_password && !pkt->has_username) return -1;
+
+    if (read_u16(buf, len, &pos, &pkt->keepalive) < 0) return -1;
+    if (level >= MQTT_PROTOCOL_V5 && read_properties(buf, len, &pos, IN_CONNECT, &pkt->props) < 0) return -1;
+    if (read_view(buf, len, &pos, &pkt->client_id) < 0) return -1;
+
+    if (pkt->will) {
+        if (level >= MQTT_PROTOCOL_V5 && read_properties(buf, len, &pos, IN_WILL, &pkt->will_props) < 0) return -1;
+        if (read_view(buf, len, &pos, &pkt->will_topic) < 0) return -1;
+        if (read_view(buf, len, &pos, &pkt->will_payload) < 0) return -1;
+    }
+    if (pkt->has_username && read_view(buf, len, &pos, &pkt->username) < 0) return -1;
+    if (pkt->has_password && read_view(buf, len, &pos, &pkt->password) < 0) return -1;
+    if (pos != len) return -1;
+
+    if (pkt->client_id.len == 0) {
+        generate_client_uuid(pkt->assigned_id);
+        pkt->client_id.data = (const uint8_t *)pkt->assigned_id;
+        pkt->client_id.len = strlen(pkt->assigned_id);
+        log_message(LOG_DEBUG, "Empty Client ID, assigned='%s'", pkt->assigned_id);
+    }
+    log_message(LOG_DEBUG, "Client ID='%.*s' Flags=0x%02X Keep Alive=%u", (int)pkt->client_id.len,
+                pkt->client_id.data, flags, pkt->keepalive);
+    return 0;
+}
 
-        case MQTT_PKT_SUBSCRIBE: {
-            if (len < 5) return -1;
+/*
+ * Takes the next entry off a SUBSCRIBE (with_options) or UNSUBSCRIBE
+ * filter list. Returns 1 with the entry, 0 at the end, -1 if malformed.
+ */
+int mqtt_next_filter(MqttView *rest, bool with_options, MqttView *filter, uint8_t *options) {
+    if (rest->len == 0) return 0;
+
+    size_t pos = 0;
+    if (read_view(rest->data, rest->len, &pos, filter) < 0) return -1;
+    if (with_options) {
+        if (pos >= rest->len) return -1;
+        if (options) *options = rest->data[pos];
+        pos++;
+    }
+    rest->data += pos;
+    rest->len -= pos;
+    return 1;
+}
 
-            size_t pos = 2;
+/* Checks a filter list once so handlers can iterate it without error paths. */
+static int count_filters(MqttView list, bool with_options, size_t *count) {
+    MqttView filter;
+    int rc;
+    *count = 0;
+    while ((rc = mqtt_next_filter(&list, with_options, &filter, NULL)) > 0) (*count)++;
+    return rc < 0 || *count == 0 ? -1 : 0;
+}
 
-            if (pos + 2 > len) return -1;
-            pos += 2;
+/*
+ * `version` is the protocol level negotiated by the connection's CONNECT;
+ * it decides whether MQTT 5 property blocks are present.
+ */
+int mqtt_parse_packet(const uint8_t *buf, size_t len, uint8_t version, MqttPacket *pkt) {
+    if (len < 2) return -1;
+
+    uint8_t packet_type = (buf[0] >> 4) & 0x0F;
+    pkt->type = (MqttPacketType)packet_type;
+    pkt->flags = buf[0] & 0x0F;
 
-            if (pos + 2 > len) return -1;
-            size_t topic_len = (buf[pos] << 8) | buf[pos+1];
-            pos += 2;
+    uint32_t remaining;
+    int length_bytes = codec_varint_decode(&buf[1], len - 1, &remaining);
+    if (length_bytes <= 0 || (size_t)(1 + length_bytes) + remaining > len) return -1;
+    size_t hdr_len = 1 + length_bytes;
+    len = hdr_len + remaining;
 
-            if (topic_len >= sizeof(pkt->topic)) topic_len = sizeof(pkt->topic)-1;
-            if (pos + topic_len > len) return -1;
-            memcpy(pkt->topic, &buf[pos], topic_len);
-            pkt->topic[topic_len] = '\0';
-            pos += topic_len;
+    switch (pkt->type) {
+        case MQTT_PKT_CONNECT:
+            log_message(LOG_DEBUG, "CONNECT packet received (len=%zu)", len);
+            return parse_connect(buf, len, hdr_len, pkt);
+
+        case MQTT_PKT_SUBSCRIBE:
+        case MQTT_PKT_UNSUBSCRIBE: {
+            size_t pos = hdr_len;
+            bool subscribe = pkt->type == MQTT_PKT_SUBSCRIBE;
+
+            if (pkt->flags != 0x02) return -1;
+            if (read_u16(buf, len, &pos, &pkt->packet_id) < 0) return -1;
+            if (version >= MQTT_PROTOCOL_V5 &&
+                read_properties(buf, len, &pos, subscribe ? IN_SUBSCRIBE : IN_UNSUBSCRIBE, &pkt->props) < 0) {
+                return -1;
+            }
 
-            if (pos >= len) return -1;
+            pkt->filters.data = &buf[pos];
+            pkt->filters.len = len - pos;
+            if (count_filters(pkt->filters, subscribe, &pkt->filter_count) < 0) return -1;
 
             break;
         }
 
-
         case MQTT_PKT_PUBLISH: {
-            if (len < 4) return -1;
-            size_t topic_len = (buf[2] << 8) | buf[3];
-            if (topic_len >= sizeof(pkt->topic)) return -1;
-            memcpy(pkt->topic, &buf[4], topic_len);
-            pkt->topic[topic_len] = '\0';
-
-            size_t payload_offset = 4 + topic_len;
-            size_t payload_len = len - payload_offset;
-            if (payload_len >= sizeof(pkt->payload)) return -1;
-            memcpy(pkt->payload, &buf[payload_offset], payload_len);
-            pkt->payload[payload_len] = '\0';
+            size_t pos = hdr_len;
+            pkt->qos = (pkt->flags >> 1) & 0x03;
+            if (pkt->qos > 2) return -1;
+
+            if (read_view(buf, len, &pos, &pkt->topic) < 0) return -1;
+            if (pkt->qos > 0 && read_u16(buf, len, &pos, &pkt->packet_id) < 0) return -1;
+            if (version >= MQTT_PROTOCOL_V5 && read_properties(buf, len, &pos, IN_PUBLISH, &pkt->props) < 0) return -1;
+
+            pkt->payload.data = &buf[pos];
+            pkt->payload.len = len - pos;
+            break;
+        }
+
+        case MQTT_PKT_PUBACK:
+        case MQTT_PKT_PUBREC:
+        case MQTT_PKT_PUBREL:
+        case MQTT_PKT_PUBCOMP: {
+            size_t pos = hdr_len;
+            if (pkt->flags != (pkt->type == MQTT_PKT_PUBREL ? 0x02 : 0x00)) return -1;
+            if (read_u16(buf, len, &pos, &pkt->packet_id) < 0) return -1;
+            break;
+        }
+
+        case MQTT_PKT_DISCONNECT: {
+            size_t pos = hdr_len;
+            if (pkt->flags != 0) return -1;
+            if (version >= MQTT_PROTOCOL_V5 && pos < len) {
+                pkt->reason = buf[pos++];
+                if (pos < len && read_properties(buf, len, &pos, IN_DISCONNECT, &pkt->props) < 0) return -1;
+            }
             break;
         }
 
-        case MQTT_PKT_DISCONNECT:
         case MQTT_PKT_PINGREQ:
             break;
 
@@ -100,46 +359,3 @@ int mqtt_parse_packet(const uint8_t *buf, size_t len, MqttPacket *pkt) {
 
     return 0;
 }
-
-int mqtt_encode_connack(uint8_t *buf, size_t maxlen) {
-    if (maxlen < 4) return -1;
-    buf[0] = 0x20;
-    buf[1] = 0x02;
-    buf[2] = 0x00;
-    buf[3] = 0x00;
-    return 4;
-}
-
-int mqtt_encode_suback(uint8_t *buf, size_t maxlen, uint16_t packet_id) {
-    if (maxlen < 5) return -1;
-    buf[0] = 0x90;
-    buf[1] = 0x03;
-    buf[2] = (packet_id >> 8) & 0xFF;
-    buf[3] = packet_id & 0xFF;
-    buf[4] = 0x00;
-    return 5;
-}
-
-int mqtt_encode_publish(uint8_t *buf, size_t maxlen,
-                        const char *topic, const char *payload,
-                        size_t payload_len) {
-    size_t topic_len = strlen(topic);
-    size_t remaining_len = 2 + topic_len + payload_len;
-    if (remaining_len + 2 > maxlen) return -1;
-
-    buf[0] = 0x30;
-    buf[1] = remaining_len;
-    buf[2] = (topic_len >> 8) & 0xFF;
-    buf[3] = topic_len & 0xFF;
-    memcpy(&buf[4], topic, topic_len);
-    memcpy(&buf[4 + topic_len], payload, payload_len);
-
-    return 4 + topic_len + payload_len;
-}
-
-int mqtt_encode_pingresp(uint8_t *buf, size_t maxlen) {
-    if (maxlen < 2) return -1;
-    buf[0] = 0xD0;
-    buf[1] = 0x00;
-    return 2;
-}
@@ -0,0 +1,159 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdalign.h>
+
+#include "pool.h"
+#include "config.h"
+#include "utils.h"
+
+typedef struct PoolItem {
+    struct PoolItem *next;
+} PoolItem;
+
+typedef struct {
+    Pool *pool;
+    PoolItem *head;
+    size_t count;
+} PoolCache;
+
+static _Thread_local PoolCache caches[POOL_MAX_CACHES];
+
+#define SLAB_HEADER ((sizeof(void *) + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1))
+
+static size_t object_size(const Pool *p) {
+    size_t size = p->obj_size < sizeof(PoolItem) ? sizeof(PoolItem) : p->obj_size;
+    return (size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+}
+
+/* Finds (or claims) this thread's cache for the pool; NULL if all are taken. */
+static PoolCache *thread_cache(Pool *p) {
+    for (int i = 0; i < POOL_MAX_CACHES; i++) {
+        if (caches[i].pool == p) return &caches[i];
+        if (!caches[i].pool) {
+            caches[i].pool = p;
+            return &caches[i];
+        }
+    }
+    return NULL;
+}
+
+/* Called with the pool locked. */
+static int grow(Pool *p) {
+    size_t size = object_size(p);
+    unsigned char *slab = malloc(SLAB_HEADER + size * POOL_SLAB_OBJECTS);
+    if (!slab) {
+        log_message(LOG_ERROR, "Failed to allocate a slab for pool %s", p->name);
+        return -1;
+    }
+
+    *(void **)slab = p->slabs;
+    p->slabs = slab;
+
+    for (size_t i = POOL_SLAB_OBJECTS; i-- > 0;) {
+        PoolItem *item = (PoolItem *)(slab + SLAB_HEADER + i * size);
+        item->next = p->free_list;
+        p->free_list = item;
+    }
+    return 0;
+}
+
+/* Called with the pool locked: moves up to `n` free objects into the cache. */
+static void refill(Pool *p, PoolCache *cache, size_t n) {
+    while (n-- > 0) {
+        if (!p->free_list && grow(p) < 0) break;
+        PoolItem *item = p->free_list;
+        p->free_list = item->next;
+        item->next = cache->head;
+        cache->head = item;
+        cache->count++;
+        p->live++;
+    }
+}
+
+void *pool_alloc(Pool *p) {
+    PoolCache *cache = thread_cache(p);
+
+    if (cache && !cache->head) {
+        pthread_mutex_lock(&p->lock);
+        refill(p, cache, POOL_CACHE_SIZE / 2);
+        pthread_mutex_unlock(&p->lock);
+    }
+
+    if (cache) {
+        PoolItem *item = cache->head;
+        if (!item) return NULL;
+        cache->head = item->next;
+        cache->count--;
+        return item;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    PoolItem *item = p->free_list;
+    if (!item && grow(p) == 0) item = p->free_list;
+    if (item) {
+        p->free_list = item->next;
+        p->live++;
+    }
+    pthread_mutex_unlock(&p->lock);
+    return item;
+}
+
+/*
+ * Objects may be freed on any thread; a cache that grows past
+ * POOL_CACHE_SIZE hands half of it back to the shared free list.
+ */
+void pool_free(Pool *p, void *obj) {
+    if (!obj) return;
+
+    PoolItem *item = obj;
+    PoolCache *cache = thread_cache(p);
+
+    if (cache) {
+        item->next = cache->head;
+        cache->head = item;
+        if (++cache->count <= POOL_CACHE_SIZE) return;
+
+        pthread_mutex_lock(&p->lock);
+        while (cache->count > POOL_CACHE_SIZE / 2) {
+            item = cache->head;
+            cache->head = item->next;
+            cache->count--;
+            item->next = p->free_list;
+            p->free_list = item;
+            p->live--;
+        }
+        pthread_mutex_unlock(&p->lock);
+        return;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    item->next = p->free_list;
+    p->free_list = item;
+    p->live--;
+    pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * Releases every slab. Only the calling thread's cache is reset, so the
+ * other threads that used the pool must have exited.
+ */
+void pool_destroy(Pool *p) {
+    PoolCache *cache = thread_cache(p);
+    if (cache) {
+        cache->head = NULL;
+        cache->count = 0;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    log_message(LOG_DEBUG, "Pool %s released (%zu objects still out)", p->name, p->live);
+    void *slab = p->slabs;
+    while (slab) {
+        void *next = *(void **)slab;
+        free(slab);
+        slab = next;
+    }
+    p->slabs = NULL;
+    p->free_list = NULL;
+    p->live = 0;
+    pthread_mutex_unlock(&p->lock);
+}
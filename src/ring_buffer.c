@@ -0,0 +1,90 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring_buffer.h"
+
+void ring_init(RingBuffer *rb) {
+    rb->data = NULL;
+    rb->cap = 0;
+    rb->head = 0;
+    rb->len = 0;
+}
+
+void ring_free(RingBuffer *rb) {
+    free(rb->data);
+    ring_init(rb);
+}
+
+/* Moves the stored bytes to a new buffer of `cap` bytes, starting at 0. */
+static int relocate(RingBuffer *rb, size_t cap) {
+    uint8_t *data = malloc(cap);
+    if (!data) return -1;
+
+    size_t first = rb->cap - rb->head;
+    if (first > rb->len) first = rb->len;
+    if (rb->len) {
+        memcpy(data, rb->data + rb->head, first);
+        memcpy(data + first, rb->data, rb->len - first);
+    }
+
+    free(rb->data);
+    rb->data = data;
+    rb->cap = cap;
+    rb->head = 0;
+    return 0;
+}
+
+int ring_reserve(RingBuffer *rb, size_t min_free) {
+    if (rb->cap - rb->len >= min_free) return 0;
+
+    size_t cap = rb->cap ? rb->cap : 1024;
+    while (cap - rb->len < min_free) cap *= 2;
+    return relocate(rb, cap);
+}
+
+/* Describes the free space as at most two segments for readv(). */
+int ring_free_iov(RingBuffer *rb, struct iovec iov[2]) {
+    size_t free_bytes = rb->cap - rb->len;
+    if (free_bytes == 0) return 0;
+
+    size_t tail = (rb->head + rb->len) & (rb->cap - 1);
+    size_t first = rb->cap - tail;
+    if (first > free_bytes) first = free_bytes;
+
+    iov[0].iov_base = rb->data + tail;
+    iov[0].iov_len = first;
+    if (first == free_bytes) return 1;
+
+    iov[1].iov_base = rb->data;
+    iov[1].iov_len = free_bytes - first;
+    return 2;
+}
+
+void ring_commit(RingBuffer *rb, size_t n) {
+    rb->len += n;
+}
+
+uint8_t ring_peek(const RingBuffer *rb, size_t offset) {
+    return rb->data[(rb->head + offset) & (rb->cap - 1)];
+}
+
+/*
+ * Returns the first `len` stored bytes as one contiguous block. Only when
+ * they wrap around the end is the ring rotated so they start at offset 0.
+ */
+const uint8_t *ring_contiguous(RingBuffer *rb, size_t len) {
+    if (len > rb->len) return NULL;
+    if (rb->head + len > rb->cap && relocate(rb, rb->cap) < 0) return NULL;
+    return rb->data + rb->head;
+}
+
+void ring_consume(RingBuffer *rb, size_t n) {
+    rb->head = (rb->head + n) & (rb->cap - 1);
+    rb->len -= n;
+    if (rb->len == 0) rb->head = 0;
+}
+
+/* Gives back memory after a large packet once the ring is empty again. */
+void ring_shrink(RingBuffer *rb, size_t max_idle_cap) {
+    if (rb->len == 0 && rb->cap > max_idle_cap) ring_free(rb);
+}
@@ -0,0 +1,122 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "session.h"
+#include "config.h"
+#include "utils.h"
+
+static Client **by_id = NULL;          /* chained through Client.next */
+static size_t id_buckets = 0;
+static size_t id_count = 0;
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t id_hash(const char *client_id) {
+    return fnv1a_hash(client_id, strlen(client_id));
+}
+
+static Client **id_slot(const char *client_id, uint32_t hash) {
+    Client **link = &by_id[hash & (id_buckets - 1)];
+    while (*link && ((*link)->id_hash != hash || strcmp((*link)->client_id, client_id) != 0)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+static int grow_ids(void) {
+    size_t new_count = id_buckets ? id_buckets * 2 : SESSION_TABLE_INITIAL_SIZE;
+    Client **grown = calloc(new_count, sizeof(Client *));
+    if (!grown) return -1;
+
+    for (size_t i = 0; i < id_buckets; i++) {
+        Client *c = by_id[i];
+        while (c) {
+            Client *next = c->next;
+            size_t b = c->id_hash & (new_count - 1);
+            c->next = grown[b];
+            grown[b] = c;
+            c = next;
+        }
+    }
+
+    free(by_id);
+    by_id = grown;
+    id_buckets = new_count;
+    return 0;
+}
+
+/*
+ * Binds c->client_id to this connection; the table keeps a reference.
+ * The client already holding the id (a live connection or an offline
+ * persistent session) is returned with the table's reference so the
+ * caller can take its session over; it stays open until the caller
+ * closes it.
+ */
+Client *session_connect(Client *c) {
+    Client *prev = NULL;
+    c->id_hash = id_hash(c->client_id);
+
+    pthread_mutex_lock(&sessions_lock);
+
+    if (id_count >= id_buckets && grow_ids() < 0 && id_buckets == 0) {
+        pthread_mutex_unlock(&sessions_lock);
+        log_message(LOG_ERROR, "Failed to allocate session table");
+        return NULL;
+    }
+
+    Client **link = id_slot(c->client_id, c->id_hash);
+    client_retain(c);
+    if (*link) {
+        prev = *link;
+        c->next = prev->next;
+        prev->next = NULL;
+    } else {
+        c->next = NULL;
+        id_count++;
+    }
+    *link = c;
+
+    pthread_mutex_unlock(&sessions_lock);
+    return prev;
+}
+
+/* Drops the id binding unless the session is persistent or a newer connection already owns it. */
+void session_close(Client *c) {
+    bool unlinked = false;
+    pthread_mutex_lock(&sessions_lock);
+
+    if (c->connected && !c->persistent && id_buckets > 0) {
+        Client **link = id_slot(c->client_id, c->id_hash);
+        if (*link == c) {
+            *link = c->next;
+            id_count--;
+            unlinked = true;
+        }
+        c->next = NULL;
+    }
+
+    pthread_mutex_unlock(&sessions_lock);
+    if (unlinked) client_release(c);
+}
+
+Client *session_find(const char *client_id) {
+    Client *c = NULL;
+
+    pthread_mutex_lock(&sessions_lock);
+    if (id_buckets > 0) {
+        c = *id_slot(client_id, id_hash(client_id));
+        if (c) client_retain(c);
+    }
+    pthread_mutex_unlock(&sessions_lock);
+
+    return c;
+}
+
+void session_cleanup(void) {
+    pthread_mutex_lock(&sessions_lock);
+    free(by_id);
+    by_id = NULL;
+    id_buckets = 0;
+    id_count = 0;
+    pthread_mutex_unlock(&sessions_lock);
+}
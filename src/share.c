@@ -0,0 +1,128 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "share.h"
+#include "config.h"
+#include "utils.h"
+
+/*
+ * MQTT 5 shared subscriptions ($share/{group}/{filter}). Each message on
+ * the filter goes to one member of the group, chosen by the strategy in
+ * SHARE_STRATEGY (or BROKER_SHARE_STRATEGY at run time). Strategies run
+ * on the publisher's thread under the registry read lock, so they only
+ * read what the members' owners publish atomically: whether the output
+ * queue is backed up and how many QoS 1/2 messages are outstanding.
+ * Backpressured members are passed over while any other member is not.
+ */
+
+typedef int (*PickFn)(const Subscriber *members, int count, int start, uint32_t sender);
+
+static ShareStrategy strategy = SHARE_STRATEGY;
+
+static bool available(const Client *c) {
+    return !client_backpressured(c);
+}
+
+static int pick_round_robin(const Subscriber *members, int count, int start, uint32_t sender) {
+    (void)sender;
+    for (int n = 0; n < count; n++) {
+        int i = (start + n) % count;
+        if (available(members[i].client)) return i;
+    }
+    return -1;
+}
+
+/* Ties go to the first member from `start`, so idle members still take turns. */
+static int pick_least_inflight(const Subscriber *members, int count, int start, uint32_t sender) {
+    (void)sender;
+    int best = -1;
+    unsigned best_load = 0;
+    for (int n = 0; n < count; n++) {
+        int i = (start + n) % count;
+        const Client *c = members[i].client;
+        if (!available(c)) continue;
+        unsigned load = atomic_load_explicit(&c->backlog, memory_order_relaxed);
+        if (best < 0 || load < best_load) {
+            best = i;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+static uint32_t mix32(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+/*
+ * Highest random weight: each member scores hash(publisher, member) and
+ * the best wins, so a member joining or leaving only moves the
+ * publishers that it wins or held.
+ */
+static int pick_sticky(const Subscriber *members, int count, int start, uint32_t sender) {
+    (void)start;
+    int best = -1;
+    uint32_t best_score = 0;
+    for (int i = 0; i < count; i++) {
+        const Client *c = members[i].client;
+        if (!available(c)) continue;
+        uint32_t score = mix32(sender ^ mix32(c->id_hash));
+        if (best < 0 || score > best_score) {
+            best = i;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+static const PickFn strategies[] = {
+    [SHARE_ROUND_ROBIN] = pick_round_robin,
+    [SHARE_LEAST_INFLIGHT] = pick_least_inflight,
+    [SHARE_STICKY] = pick_sticky,
+};
+
+void share_init(void) {
+    const char *env = getenv("BROKER_SHARE_STRATEGY");
+    if (!env) return;
+    if (strcasecmp(env, "round-robin") == 0) {
+        strategy = SHARE_ROUND_ROBIN;
+    } else if (strcasecmp(env, "least-inflight") == 0) {
+        strategy = SHARE_LEAST_INFLIGHT;
+    } else if (strcasecmp(env, "sticky") == 0) {
+        strategy = SHARE_STICKY;
+    } else {
+        log_message(LOG_WARNING, "Unknown BROKER_SHARE_STRATEGY '%s', keeping the default", env);
+    }
+}
+
+/*
+ * True for a $share/ subscription name; *filter then points at its topic
+ * filter, or is NULL when the group name is missing or has wildcards.
+ */
+bool share_name(const char *name, const char **filter) {
+    if (strncmp(name, "$share/", 7) != 0) {
+        *filter = name;
+        return false;
+    }
+
+    const char *group = name + 7;
+    size_t len = strcspn(group, "/+#");
+    *filter = len > 0 && group[len] == '/' ? group + len + 1 : NULL;
+    return true;
+}
+
+/*
+ * Index of the member that gets the next message. When every member is
+ * backpressured the message still goes to one of them, in turn.
+ */
+int share_pick(const Subscriber *members, int count, atomic_uint *cursor, uint32_t sender) {
+    int start = (int)(atomic_fetch_add_explicit(cursor, 1, memory_order_relaxed) % (unsigned)count);
+    int i = strategies[strategy](members, count, start, sender);
+    return i >= 0 ? i : start;
+}
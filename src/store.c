@@ -0,0 +1,926 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "store.h"
+#include "config.h"
+#include "utils.h"
+
+/*
+ * The log is a numbered series of segment files in STORE_DIR. Each one is
+ * preallocated, mmap'd and filled with records:
+ *
+ *     u32 body length | u32 crc32(type, body) | u8 type | body
+ *
+ * Recovery replays the segments in order and stops a segment at the first
+ * record that fails its checksum (a write torn by a crash). Compaction
+ * folds every sealed segment into one that holds only live state, headed
+ * by a RESET record so a crash halfway through never resurrects state.
+ *
+ * Every segment stays mapped from when it is opened or created until a
+ * compaction retires it, so reading a session's messages back, which
+ * the event loops do, is a walk over memory with no file operations.
+ */
+
+#define SEGMENT_MAGIC "MQSTORE1"
+#define SEGMENT_HEADER 16
+#define RECORD_HEADER 9
+
+enum {
+    REC_SUB = 1,
+    REC_UNSUB,
+    REC_END,
+    REC_MSG,
+    REC_REL,
+    REC_ACK,
+    REC_RESET
+};
+
+typedef struct {
+    uint32_t number;
+    int fd;
+    uint8_t *base;
+    size_t size;            /* of the mapping */
+    size_t used;            /* records end here */
+} Segment;
+
+/* A record body gathered from pieces, so payloads are copied only into the log. */
+typedef struct {
+    struct iovec parts[6];
+    int n;
+    uint8_t scratch[16];
+    size_t scratch_used;
+} Record;
+
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+static Segment active = { 0, -1, NULL, 0, 0 };
+static Segment *sealed = NULL;         /* ascending segment numbers, still mapped */
+static size_t sealed_count = 0;
+static size_t sealed_cap = 0;
+static pthread_rwlock_t layout_lock = PTHREAD_RWLOCK_INITIALIZER;  /* held by readers while segments are unmapped */
+static uint32_t generation = 0;        /* compactions installed, under layout_lock */
+static uint32_t compacted_upto = 0;    /* last segment a compaction rewrote */
+static atomic_bool compacting = false;
+static bool compactor_joinable = false;
+static pthread_t compactor;
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *p, size_t n) {
+    crc = ~crc;
+    while (n--) crc = crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void put_u32(uint8_t *p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+static uint32_t get_u32(const uint8_t *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void rec_bytes(Record *r, const void *p, size_t len) {
+    r->parts[r->n].iov_base = (void *)p;
+    r->parts[r->n].iov_len = len;
+    r->n++;
+}
+
+static void rec_u32(Record *r, uint32_t v) {
+    uint8_t *p = &r->scratch[r->scratch_used];
+    put_u32(p, v);
+    r->scratch_used += 4;
+    rec_bytes(r, p, 4);
+}
+
+static void rec_u8(Record *r, uint8_t v) {
+    uint8_t *p = &r->scratch[r->scratch_used++];
+    *p = v;
+    rec_bytes(r, p, 1);
+}
+
+/* u16 length prefix followed by the bytes. */
+static void rec_str(Record *r, const void *s, size_t len) {
+    uint8_t *p = &r->scratch[r->scratch_used];
+    p[0] = len & 0xFF;
+    p[1] = len >> 8;
+    r->scratch_used += 2;
+    rec_bytes(r, p, 2);
+    rec_bytes(r, s, len);
+}
+
+static size_t record_size(const Record *r) {
+    size_t n = RECORD_HEADER;
+    for (int i = 0; i < r->n; i++) n += r->parts[i].iov_len;
+    return n;
+}
+
+/* The segment must have room. */
+static void write_record(Segment *s, uint8_t type, const Record *r) {
+    uint8_t *p = s->base + s->used;
+    uint8_t *q = p + RECORD_HEADER;
+    uint32_t crc = crc32_update(0, &type, 1);
+
+    for (int i = 0; i < r->n; i++) {
+        memcpy(q, r->parts[i].iov_base, r->parts[i].iov_len);
+        crc = crc32_update(crc, q, r->parts[i].iov_len);
+        q += r->parts[i].iov_len;
+    }
+
+    put_u32(p, (uint32_t)(q - p - RECORD_HEADER));
+    put_u32(p + 4, crc);
+    p[8] = type;
+    s->used = q - s->base;
+}
+
+static void segment_path(char *buf, size_t size, uint32_t number, const char *suffix) {
+    snprintf(buf, size, "%s/%08u.seg%s", STORE_DIR, number, suffix);
+}
+
+static void segment_unmap(Segment *s) {
+    if (s->base) munmap(s->base, s->size);
+    if (s->fd >= 0) close(s->fd);
+    s->base = NULL;
+    s->fd = -1;
+}
+
+static int segment_create(Segment *s, uint32_t number, size_t size, const char *suffix) {
+    char path[256];
+    segment_path(path, sizeof(path), number, suffix);
+
+    s->number = number;
+    s->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (s->fd < 0 || ftruncate(s->fd, size) < 0) {
+        log_message(LOG_ERROR, "Could not create store segment %s: %s", path, strerror(errno));
+        segment_unmap(s);
+        return -1;
+    }
+
+    s->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+    if (s->base == MAP_FAILED) {
+        s->base = NULL;
+        segment_unmap(s);
+        return -1;
+    }
+    s->size = size;
+    memcpy(s->base, SEGMENT_MAGIC, 8);
+    s->used = SEGMENT_HEADER;
+    return 0;
+}
+
+static int segment_map(Segment *s, uint32_t number, bool writable) {
+    char path[256];
+    struct stat st;
+    segment_path(path, sizeof(path), number, "");
+
+    s->number = number;
+    s->fd = open(path, (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    if (s->fd < 0 || fstat(s->fd, &st) < 0 || (size_t)st.st_size < SEGMENT_HEADER) {
+        log_message(LOG_ERROR, "Could not open store segment %s", path);
+        segment_unmap(s);
+        return -1;
+    }
+
+    s->size = st.st_size;
+    s->used = s->size;
+    s->base = mmap(NULL, s->size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, s->fd, 0);
+    if (s->base == MAP_FAILED || memcmp(s->base, SEGMENT_MAGIC, 8) != 0) {
+        if (s->base == MAP_FAILED) s->base = NULL;
+        log_message(LOG_ERROR, "Store segment %s is not valid", path);
+        segment_unmap(s);
+        return -1;
+    }
+    return 0;
+}
+
+/* Called with the lock held; the list takes over the mapping. */
+static int add_sealed(const Segment *s) {
+    if (sealed_count == sealed_cap) {
+        size_t new_cap = sealed_cap ? sealed_cap * 2 : 16;
+        Segment *grown = realloc(sealed, new_cap * sizeof(Segment));
+        if (!grown) return -1;
+        sealed = grown;
+        sealed_cap = new_cap;
+    }
+    sealed[sealed_count++] = *s;
+    return 0;
+}
+
+/*
+ * Called with the lock held: seals the active segment, which stays
+ * mapped for readers (nothing past its records is touched once the file
+ * is trimmed), and opens the next one.
+ */
+static int rotate(size_t need) {
+    uint32_t next = active.number + 1;
+
+    msync(active.base, active.used, MS_ASYNC);
+    if (ftruncate(active.fd, active.used) < 0) {
+        log_message(LOG_WARNING, "Could not trim store segment %u", active.number);
+    }
+    if (add_sealed(&active) < 0) {
+        log_message(LOG_ERROR, "Out of memory sealing store segment %u, its records are lost", active.number);
+        segment_unmap(&active);
+    }
+
+    size_t size = SEGMENT_HEADER + need > STORE_SEGMENT_SIZE ? SEGMENT_HEADER + need : STORE_SEGMENT_SIZE;
+    return segment_create(&active, next, size, "");
+}
+
+/* With `at`, also reports where the record went. */
+static int append(uint8_t type, const Record *r, StoreCursor *at) {
+    size_t need = record_size(r);
+    int rc = -1;
+
+    pthread_mutex_lock(&store_lock);
+    if (active.base && (active.used + need <= active.size || rotate(need) == 0)) {
+        if (at) {
+            at->segment = active.number;
+            at->offset = active.used;
+            at->generation = generation;
+        }
+        write_record(&active, type, r);
+        rc = 0;
+    } else {
+        log_message(LOG_ERROR, "Session store unavailable, record of type %d lost", type);
+    }
+    pthread_mutex_unlock(&store_lock);
+    return rc;
+}
+
+void store_subscribe(const char *client_id, const char *filter, uint8_t qos) {
+    Record r = {0};
+    rec_str(&r, client_id, strlen(client_id));
+    rec_str(&r, filter, strlen(filter));
+    rec_u8(&r, qos);
+    append(REC_SUB, &r, NULL);
+}
+
+void store_unsubscribe(const char *client_id, const char *filter) {
+    Record r = {0};
+    rec_str(&r, client_id, strlen(client_id));
+    rec_str(&r, filter, strlen(filter));
+    append(REC_UNSUB, &r, NULL);
+}
+
+void store_end_session(const char *client_id) {
+    Record r = {0};
+    rec_str(&r, client_id, strlen(client_id));
+    append(REC_END, &r, NULL);
+}
+
+/*
+ * `frame` is the QoS 0 PUBLISH encoding the message is delivered from.
+ * With `at`, a cursor store_load() can start from is set to the record.
+ */
+int store_message(const char *client_id, uint32_t seq, uint8_t qos, const uint8_t *frame, size_t len, StoreCursor *at) {
+    Record r = {0};
+    rec_str(&r, client_id, strlen(client_id));
+    rec_u32(&r, seq);
+    rec_u8(&r, qos);
+    rec_bytes(&r, frame, len);
+    return append(REC_MSG, &r, at);
+}
+
+void store_release(const char *client_id, uint32_t seq) {
+    Record r = {0};
+    rec_str(&r, client_id, strlen(client_id));
+    rec_u32(&r, seq);
+    append(REC_REL, &r, NULL);
+}
+
+void store_ack(const char *client_id, uint32_t seq) {
+    Record r = {0};
+    rec_str(&r, client_id, strlen(client_id));
+    rec_u32(&r, seq);
+    append(REC_ACK, &r, NULL);
+}
+
+/* ---- replay ---- */
+
+typedef struct {
+    uint32_t seq;
+    uint32_t frame_len;
+    const uint8_t *frame;
+    uint8_t qos;
+    bool released;
+    bool live;
+} StoredMessage;
+
+typedef struct {
+    const uint8_t *filter;
+    uint16_t filter_len;
+    uint8_t qos;
+} StoredSub;
+
+typedef struct StoredSession {
+    const uint8_t *id;
+    uint16_t id_len;
+    uint32_t hash;
+    StoredSub *subs;
+    size_t sub_count;
+    size_t sub_cap;
+    StoredMessage *msgs;    /* ascending seq */
+    size_t msg_count;
+    size_t msg_cap;
+    struct StoredSession *next;
+    struct StoredSession *order;
+} StoredSession;
+
+/* Session state rebuilt from the log; it points into the mapped segments it was replayed from. */
+typedef struct {
+    StoredSession **buckets;
+    size_t bucket_count;
+    size_t count;
+    StoredSession *first;
+    StoredSession *last;
+} Replay;
+
+static void replay_clear(Replay *r) {
+    StoredSession *s = r->first;
+    while (s) {
+        StoredSession *next = s->order;
+        free(s->subs);
+        free(s->msgs);
+        free(s);
+        s = next;
+    }
+    free(r->buckets);
+    r->buckets = NULL;
+    r->bucket_count = 0;
+    r->count = 0;
+    r->first = r->last = NULL;
+}
+
+
+static int grow_sessions(Replay *r) {
+    size_t new_count = r->bucket_count ? r->bucket_count * 2 : 1024;
+    StoredSession **grown = calloc(new_count, sizeof(StoredSession *));
+    if (!grown) return -1;
+
+    for (StoredSession *s = r->first; s; s = s->order) {
+        size_t b = s->hash & (new_count - 1);
+        s->next = grown[b];
+        grown[b] = s;
+    }
+    free(r->buckets);
+    r->buckets = grown;
+    r->bucket_count = new_count;
+    return 0;
+}
+
+static StoredSession *replay_session(Replay *r, const uint8_t *id, uint16_t id_len, bool create) {
+    uint32_t hash = fnv1a_hash((const char *)id, id_len);
+
+    if (r->bucket_count > 0) {
+        for (StoredSession *s = r->buckets[hash & (r->bucket_count - 1)]; s; s = s->next) {
+            if (s->hash == hash && s->id_len == id_len && memcmp(s->id, id, id_len) == 0) return s;
+        }
+    }
+    if (!create) return NULL;
+    if (r->count >= r->bucket_count && grow_sessions(r) < 0) return NULL;
+
+    StoredSession *s = calloc(1, sizeof(StoredSession));
+    if (!s) return NULL;
+    s->id = id;
+    s->id_len = id_len;
+    s->hash = hash;
+
+    size_t b = hash & (r->bucket_count - 1);
+    s->next = r->buckets[b];
+    r->buckets[b] = s;
+    if (r->last) r->last->order = s;
+    else r->first = s;
+    r->last = s;
+    r->count++;
+    return s;
+}
+
+/* Index of the first message with seq >= `seq`. */
+static size_t find_message(const StoredSession *s, uint32_t seq) {
+    size_t lo = 0, hi = s->msg_count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (s->msgs[mid].seq < seq) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+static StoredMessage *lookup_message(StoredSession *s, uint32_t seq) {
+    size_t i = find_message(s, seq);
+    return i < s->msg_count && s->msgs[i].seq == seq ? &s->msgs[i] : NULL;
+}
+
+static int add_message(StoredSession *s, uint32_t seq, uint8_t qos, const uint8_t *frame, size_t len) {
+    size_t i = find_message(s, seq);
+    if (i == s->msg_count || s->msgs[i].seq != seq) {
+        if (s->msg_count == s->msg_cap) {
+            size_t new_cap = s->msg_cap ? s->msg_cap * 2 : 8;
+            StoredMessage *grown = realloc(s->msgs, new_cap * sizeof(StoredMessage));
+            if (!grown) return -1;
+            s->msgs = grown;
+            s->msg_cap = new_cap;
+        }
+        memmove(&s->msgs[i + 1], &s->msgs[i], (s->msg_count - i) * sizeof(StoredMessage));
+        s->msg_count++;
+    }
+    s->msgs[i] = (StoredMessage){ seq, (uint32_t)len, frame, qos, false, true };
+    return 0;
+}
+
+static int set_subscription(StoredSession *s, const uint8_t *filter, uint16_t len, int qos) {
+    for (size_t i = 0; i < s->sub_count; i++) {
+        StoredSub *sub = &s->subs[i];
+        if (sub->filter_len != len || memcmp(sub->filter, filter, len) != 0) continue;
+        if (qos >= 0) sub->qos = (uint8_t)qos;
+        else s->subs[i] = s->subs[--s->sub_count];
+        return 0;
+    }
+    if (qos < 0) return 0;
+
+    if (s->sub_count == s->sub_cap) {
+        size_t new_cap = s->sub_cap ? s->sub_cap * 2 : 4;
+        StoredSub *grown = realloc(s->subs, new_cap * sizeof(StoredSub));
+        if (!grown) return -1;
+        s->subs = grown;
+        s->sub_cap = new_cap;
+    }
+    s->subs[s->sub_count++] = (StoredSub){ filter, len, (uint8_t)qos };
+    return 0;
+}
+
+static bool read_str(const uint8_t **p, const uint8_t *end, const uint8_t **s, uint16_t *len) {
+    if (end - *p < 2) return false;
+    *len = (*p)[0] | ((*p)[1] << 8);
+    if (end - *p - 2 < *len) return false;
+    *s = *p + 2;
+    *p += 2 + *len;
+    return true;
+}
+
+static int apply_record(Replay *r, uint8_t type, const uint8_t *body, size_t len) {
+    const uint8_t *p = body, *end = body + len;
+    const uint8_t *id, *str;
+    uint16_t id_len, str_len;
+
+    if (type == REC_RESET) {
+        replay_clear(r);
+        return 0;
+    }
+    if (!read_str(&p, end, &id, &id_len)) return -1;
+
+    StoredSession *s = replay_session(r, id, id_len, type == REC_SUB || type == REC_MSG);
+    if (!s) return type == REC_SUB || type == REC_MSG ? -1 : 0;
+
+    switch (type) {
+        case REC_SUB:
+            if (!read_str(&p, end, &str, &str_len) || p >= end) return -1;
+            return set_subscription(s, str, str_len, *p);
+
+        case REC_UNSUB:
+            if (!read_str(&p, end, &str, &str_len)) return -1;
+            return set_subscription(s, str, str_len, -1);
+
+        case REC_END:
+            s->sub_count = 0;
+            s->msg_count = 0;
+            return 0;
+
+        case REC_MSG:
+            if (end - p < 5) return -1;
+            return add_message(s, get_u32(p), p[4], p + 5, end - p - 5);
+
+        case REC_REL:
+        case REC_ACK: {
+            if (end - p < 4) return -1;
+            StoredMessage *m = lookup_message(s, get_u32(p));
+            if (m && type == REC_REL) m->released = true;
+            if (m && type == REC_ACK) m->live = false;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* Applies every intact record of the segment; returns where the valid data ends. */
+static size_t replay_segment(Replay *r, const Segment *s) {
+    size_t pos = SEGMENT_HEADER;
+    pthread_once(&crc_once, crc_init);
+
+    while (pos + RECORD_HEADER <= s->used) {
+        const uint8_t *p = s->base + pos;
+        uint32_t len = get_u32(p);
+        uint8_t type = p[8];
+        if (type == 0 || len > s->used - pos - RECORD_HEADER) break;
+
+        uint32_t crc = crc32_update(crc32_update(0, &type, 1), p + RECORD_HEADER, len);
+        if (crc != get_u32(p + 4)) {
+            log_message(LOG_WARNING, "Store segment %u: torn record at offset %zu, ignoring the rest",
+                        s->number, pos);
+            break;
+        }
+        if (apply_record(r, type, p + RECORD_HEADER, len) < 0) {
+            log_message(LOG_WARNING, "Store segment %u: bad record at offset %zu", s->number, pos);
+        }
+        pos += RECORD_HEADER + len;
+    }
+    return pos;
+}
+
+/* Writes (or, with s == NULL, measures) the live state as a compacted segment body. */
+static size_t write_live_state(Segment *out, const Replay *r) {
+    size_t total = 0;
+    Record rec = {0};
+
+    total += record_size(&rec);
+    if (out) write_record(out, REC_RESET, &rec);
+
+    for (const StoredSession *s = r->first; s; s = s->order) {
+        for (size_t i = 0; i < s->sub_count; i++) {
+            rec = (Record){0};
+            rec_str(&rec, s->id, s->id_len);
+            rec_str(&rec, s->subs[i].filter, s->subs[i].filter_len);
+            rec_u8(&rec, s->subs[i].qos);
+            total += record_size(&rec);
+            if (out) write_record(out, REC_SUB, &rec);
+        }
+        for (size_t i = 0; i < s->msg_count; i++) {
+            const StoredMessage *m = &s->msgs[i];
+            if (!m->live) continue;
+
+            rec = (Record){0};
+            rec_str(&rec, s->id, s->id_len);
+            rec_u32(&rec, m->seq);
+            rec_u8(&rec, m->qos);
+            rec_bytes(&rec, m->frame, m->frame_len);
+            total += record_size(&rec);
+            if (out) write_record(out, REC_MSG, &rec);
+
+            if (!m->released) continue;
+            rec = (Record){0};
+            rec_str(&rec, s->id, s->id_len);
+            rec_u32(&rec, m->seq);
+            total += record_size(&rec);
+            if (out) write_record(out, REC_REL, &rec);
+        }
+    }
+    return total;
+}
+
+/*
+ * Folds the sealed segments into the last of them. The writer keeps
+ * appending to the active segment meanwhile; it is never touched here.
+ * Readers only hold the layout lock while the segment list is swapped:
+ * the old mappings go once none of them can still be reading one.
+ */
+static void *compact_thread(void *arg) {
+    (void)arg;
+    Replay r = {0};
+
+    pthread_mutex_lock(&store_lock);
+    size_t count = sealed_count;
+    Segment *old = malloc(count * sizeof(Segment));
+    if (old) memcpy(old, sealed, count * sizeof(Segment));
+    pthread_mutex_unlock(&store_lock);
+    if (!old) goto out;
+
+    for (size_t i = 0; i < count; i++) replay_segment(&r, &old[i]);
+
+    uint32_t target = old[count - 1].number;
+    Segment out = { 0, -1, NULL, 0, 0 };
+    if (segment_create(&out, target, SEGMENT_HEADER + write_live_state(NULL, &r), ".tmp") < 0) goto out;
+    write_live_state(&out, &r);
+    msync(out.base, out.used, MS_SYNC);
+
+    char tmp[256], path[256];
+    segment_path(tmp, sizeof(tmp), target, ".tmp");
+    segment_path(path, sizeof(path), target, "");
+    if (rename(tmp, path) < 0) {
+        log_message(LOG_ERROR, "Could not install compacted segment %s", path);
+        segment_unmap(&out);
+        unlink(tmp);
+        goto out;
+    }
+
+    pthread_rwlock_wrlock(&layout_lock);
+    pthread_mutex_lock(&store_lock);
+    memmove(sealed + 1, sealed + count, (sealed_count - count) * sizeof(Segment));
+    sealed[0] = out;
+    sealed_count -= count - 1;
+    pthread_mutex_unlock(&store_lock);
+    generation++;
+    compacted_upto = target;
+    pthread_rwlock_unlock(&layout_lock);
+
+    for (size_t i = 0; i < count; i++) {
+        segment_unmap(&old[i]);
+        segment_path(path, sizeof(path), old[i].number, "");
+        if (i + 1 < count) unlink(path);
+    }
+
+    log_message(LOG_INFO, "Compacted %zu store segment(s) into %u (%zu session(s))", count, target, r.count);
+
+out:
+    replay_clear(&r);
+    free(old);
+    atomic_store(&compacting, false);
+    return NULL;
+}
+
+/* ---- loading queued messages back ---- */
+
+typedef struct {
+    const char *id;
+    size_t id_len;
+    StoreCursor *at;
+    StoreLoadFn fn;
+    void *arg;
+    size_t loaded;
+    bool stop;
+} Load;
+
+static bool record_for(const uint8_t *body, size_t len, const Load *l) {
+    return len >= 2 + l->id_len && (size_t)(body[0] | body[1] << 8) == l->id_len &&
+           memcmp(body + 2, l->id, l->id_len) == 0;
+}
+
+/*
+ * Reads the records in [pos, end) of a segment. Searching (`start`), it
+ * moves the cursor past every RESET and every END of the session, after
+ * which its current messages begin; otherwise it hands over the
+ * session's messages newer than the cursor. Returns where it stopped.
+ */
+static size_t load_segment(Load *l, const Segment *s, size_t pos, size_t end, bool start) {
+    while (!l->stop && pos + RECORD_HEADER <= end) {
+        const uint8_t *p = s->base + pos;
+        uint32_t len = get_u32(p);
+        uint8_t type = p[8];
+        if (type == 0 || len > end - pos - RECORD_HEADER) break;
+
+        const uint8_t *body = p + RECORD_HEADER;
+        size_t next = pos + RECORD_HEADER + len;
+        if (start) {
+            if (type == REC_RESET || (type == REC_END && record_for(body, len, l))) {
+                l->at->segment = s->number;
+                l->at->offset = next;
+            }
+        } else if (type == REC_END && record_for(body, len, l)) {
+            l->stop = true;
+            break;
+        } else if (type == REC_MSG && record_for(body, len, l) && len >= 2 + l->id_len + 5) {
+            const uint8_t *m = body + 2 + l->id_len;
+            uint32_t seq = get_u32(m);
+            if (seq > l->at->seq) {
+                int rc = l->fn(l->arg, seq, m[4], m + 5, len - 2 - l->id_len - 5);
+                if (rc < 0) {
+                    l->stop = true;
+                    break;
+                }
+                l->at->seq = seq;
+                l->loaded++;
+                l->stop = rc > 0;
+            }
+        }
+        pos = next;
+    }
+    return pos;
+}
+
+/* Runs load_segment() over the log from the cursor on. */
+static void load_log(Load *l, const Segment *segs, size_t count, bool start) {
+    for (size_t i = 0; i < count && !l->stop; i++) {
+        if (segs[i].number < l->at->segment) continue;
+
+        size_t from = segs[i].number == l->at->segment ? l->at->offset : SEGMENT_HEADER;
+        size_t pos = load_segment(l, &segs[i], from, segs[i].used, start);
+        if (!start) {
+            l->at->segment = segs[i].number;
+            l->at->offset = pos;
+        }
+    }
+}
+
+/*
+ * Hands `fn` the session's messages newer than the cursor, oldest first,
+ * until it asks to stop or the log ends, and leaves the cursor after the
+ * last one taken. Messages are found by scanning forward from the
+ * cursor, so queueing them and loading them back are both O(log written
+ * since). A cursor into segments a compaction has since rewritten goes
+ * on from the start of the compacted one, which holds only live state;
+ * only a cursor that was never placed searches the log for the
+ * session's start. Returns how many were taken.
+ */
+size_t store_load(const char *client_id, StoreCursor *at, StoreLoadFn fn, void *arg) {
+    Load l = { client_id, strlen(client_id), at, fn, arg, 0, false };
+
+    pthread_rwlock_rdlock(&layout_lock);
+    pthread_mutex_lock(&store_lock);
+    size_t count = sealed_count;
+    Segment *segs = active.base ? malloc((count + 1) * sizeof(Segment)) : NULL;
+    if (segs) {
+        memcpy(segs, sealed, count * sizeof(Segment));
+        segs[count++] = active;
+    }
+    pthread_mutex_unlock(&store_lock);
+
+    if (segs && at->segment == 0) {
+        at->segment = segs[0].number;
+        at->offset = SEGMENT_HEADER;
+        load_log(&l, segs, count, true);
+    } else if (segs && at->generation != generation && at->segment <= compacted_upto) {
+        at->segment = segs[0].number;
+        at->offset = SEGMENT_HEADER;
+    }
+    at->generation = generation;
+    if (segs) load_log(&l, segs, count, false);
+    pthread_rwlock_unlock(&layout_lock);
+
+    if (!segs) log_message(LOG_ERROR, "Could not read the queued messages of %s back from the store", client_id);
+    free(segs);
+    return l.loaded;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int make_dirs(const char *dir) {
+    char path[256];
+    snprintf(path, sizeof(path), "%s", dir);
+    for (char *p = path + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        if (mkdir(path, 0755) < 0 && errno != EEXIST) return -1;
+        *p = '/';
+    }
+    return mkdir(path, 0755) < 0 && errno != EEXIST ? -1 : 0;
+}
+
+/* Sorted numbers of the segments on disk; leftovers of an interrupted compaction are removed. */
+static int list_segments(uint32_t **out, size_t *count) {
+    DIR *d = opendir(STORE_DIR);
+    if (!d) return -1;
+
+    uint32_t *numbers = NULL;
+    size_t n = 0, cap = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        unsigned number;
+        char rest[8];
+        if (sscanf(e->d_name, "%8u.seg%7s", &number, rest) == 2 && strcmp(rest, ".tmp") == 0) {
+            char path[256];
+            segment_path(path, sizeof(path), number, ".tmp");
+            unlink(path);
+            continue;
+        }
+        if (strlen(e->d_name) != 12 || sscanf(e->d_name, "%8u.seg", &number) != 1) continue;
+
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            uint32_t *grown = realloc(numbers, cap * sizeof(uint32_t));
+            if (!grown) break;
+            numbers = grown;
+        }
+        numbers[n++] = number;
+    }
+    closedir(d);
+
+    if (n > 0) qsort(numbers, n, sizeof(uint32_t), cmp_u32);
+    *out = numbers;
+    *count = n;
+    return 0;
+}
+
+/*
+ * Replays the log and reports every session that still has state. The
+ * newest segment becomes the active one; anything after its last intact
+ * record is wiped so a torn write can never be mistaken for data.
+ */
+int store_open(const StoreVisitor *visitor, void *arg) {
+    uint32_t *numbers = NULL;
+    size_t count = 0;
+    Replay r = {0};
+    int rc = -1;
+
+    pthread_once(&crc_once, crc_init);
+    if (make_dirs(STORE_DIR) < 0 || list_segments(&numbers, &count) < 0) {
+        log_message(LOG_ERROR, "Could not open session store %s", STORE_DIR);
+        return -1;
+    }
+
+    uint64_t started = monotonic_ms();
+    pthread_mutex_lock(&store_lock);
+    for (size_t i = 0; i + 1 < count; i++) {
+        Segment s;
+        if (segment_map(&s, numbers[i], false) < 0) continue;
+        s.used = replay_segment(&r, &s);
+        if (add_sealed(&s) < 0) {
+            log_message(LOG_ERROR, "Out of memory opening store segment %u", s.number);
+            segment_unmap(&s);
+            pthread_mutex_unlock(&store_lock);
+            goto out;
+        }
+    }
+
+    if (count > 0 && segment_map(&active, numbers[count - 1], true) == 0) {
+        active.used = replay_segment(&r, &active);
+        memset(active.base + active.used, 0, active.size - active.used);
+    } else if (segment_create(&active, count > 0 ? numbers[count - 1] + 1 : 1, STORE_SEGMENT_SIZE, "") < 0) {
+        pthread_mutex_unlock(&store_lock);
+        goto out;
+    }
+    pthread_mutex_unlock(&store_lock);
+
+    size_t sessions = 0, messages = 0;
+    for (const StoredSession *s = r.first; s; s = s->order) {
+        size_t live = 0;
+        for (size_t i = 0; i < s->msg_count; i++) live += s->msgs[i].live;
+        if (s->sub_count == 0 && live == 0) continue;
+
+        char *id = strndup((const char *)s->id, s->id_len);
+        if (!id) {
+            log_message(LOG_ERROR, "Out of memory restoring a session with %zu queued message(s)", live);
+            continue;
+        }
+        visitor->session(arg, id);
+        sessions++;
+
+        for (size_t i = 0; i < s->sub_count; i++) {
+            char *filter = strndup((const char *)s->subs[i].filter, s->subs[i].filter_len);
+            if (!filter) {
+                log_message(LOG_ERROR, "Out of memory restoring a subscription of %s", id);
+                continue;
+            }
+            visitor->subscription(arg, id, filter, s->subs[i].qos);
+            free(filter);
+        }
+        for (size_t i = 0; i < s->msg_count; i++) {
+            const StoredMessage *m = &s->msgs[i];
+            if (!m->live) continue;
+            visitor->message(arg, id, m->seq, m->qos, m->released, m->frame, m->frame_len);
+            messages++;
+        }
+        free(id);
+    }
+
+    log_message(LOG_INFO, "Recovered %zu session(s) and %zu queued message(s) from %zu segment(s) in %llu ms",
+                sessions, messages, count, (unsigned long long)(monotonic_ms() - started));
+    rc = 0;
+
+out:
+    replay_clear(&r);
+    free(numbers);
+    return rc;
+}
+
+/* Periodic: pushes dirty pages towards disk and starts a compaction when due. */
+void store_sync(void) {
+    pthread_mutex_lock(&store_lock);
+    if (active.base) msync(active.base, active.used, MS_ASYNC);
+    size_t count = sealed_count;
+    pthread_mutex_unlock(&store_lock);
+
+    if (count < STORE_COMPACT_SEGMENTS || atomic_load(&compacting)) return;
+
+    if (compactor_joinable) pthread_join(compactor, NULL);
+    atomic_store(&compacting, true);
+    compactor_joinable = pthread_create(&compactor, NULL, compact_thread, NULL) == 0;
+    if (!compactor_joinable) atomic_store(&compacting, false);
+}
+
+void store_close(void) {
+    if (compactor_joinable) pthread_join(compactor, NULL);
+    compactor_joinable = false;
+
+    pthread_mutex_lock(&store_lock);
+    if (active.base) msync(active.base, active.used, MS_SYNC);
+    segment_unmap(&active);
+    for (size_t i = 0; i < sealed_count; i++) segment_unmap(&sealed[i]);
+    free(sealed);
+    sealed = NULL;
+    sealed_count = sealed_cap = 0;
+    pthread_mutex_unlock(&store_lock);
+}
@@ -0,0 +1,97 @@
+#include <string.h>
+
+#include "timer_wheel.h"
+
+#define SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+/* Rounded up, so a timer never fires before its deadline. */
+static uint64_t tick_of(uint64_t ms) {
+    return (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+}
+
+void timer_wheel_init(TimerWheel *w, uint64_t now_ms) {
+    memset(w->slots, 0, sizeof(w->slots));
+    w->tick = now_ms / TIMER_TICK_MS;
+    w->count = 0;
+}
+
+void timer_init(Timer *t, void (*fn)(Timer *t), void *arg) {
+    t->next = NULL;
+    t->pprev = NULL;
+    t->expires = 0;
+    t->fn = fn;
+    t->arg = arg;
+}
+
+bool timer_armed(const Timer *t) {
+    return t->pprev != NULL;
+}
+
+static void unlink_timer(Timer *t) {
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+/* (Re)arms the timer; a deadline already past fires on the next tick. */
+void timer_arm(TimerWheel *w, Timer *t, uint64_t expires_ms) {
+    if (timer_armed(t)) {
+        unlink_timer(t);
+        w->count--;
+    }
+
+    uint64_t tick = tick_of(expires_ms);
+    if (tick <= w->tick) tick = w->tick + 1;
+
+    Timer **slot = &w->slots[tick & SLOT_MASK];
+    t->expires = expires_ms;
+    t->next = *slot;
+    if (*slot) (*slot)->pprev = &t->next;
+    t->pprev = slot;
+    *slot = t;
+    w->count++;
+}
+
+void timer_cancel(TimerWheel *w, Timer *t) {
+    if (!timer_armed(t)) return;
+    unlink_timer(t);
+    w->count--;
+}
+
+/*
+ * Runs every timer due by `now_ms`. A timer is unlinked before its
+ * callback runs, and the slot is rescanned afterwards, so callbacks may
+ * arm or cancel any timer.
+ */
+void timer_wheel_advance(TimerWheel *w, uint64_t now_ms) {
+    uint64_t now_tick = now_ms / TIMER_TICK_MS;
+    if (now_tick <= w->tick) return;
+
+    uint64_t ticks = now_tick - w->tick;
+    if (ticks > TIMER_WHEEL_SLOTS) ticks = TIMER_WHEEL_SLOTS;
+
+    uint64_t first = w->tick + 1;
+    for (uint64_t k = first; k < first + ticks && w->count > 0; k++) {
+        w->tick = k;
+        Timer *t = w->slots[k & SLOT_MASK];
+        while (t) {
+            if (tick_of(t->expires) > now_tick) {
+                t = t->next;
+                continue;
+            }
+            unlink_timer(t);
+            w->count--;
+            t->fn(t);
+            t = w->slots[k & SLOT_MASK];
+        }
+    }
+    w->tick = now_tick;
+}
+
+/* Milliseconds until the next tick worth waking for, or -1 if nothing is armed. */
+int timer_wheel_timeout(const TimerWheel *w, uint64_t now_ms) {
+    if (w->count == 0) return -1;
+    uint64_t next = (w->tick + 1) * TIMER_TICK_MS;
+    return next > now_ms ? (int)(next - now_ms) : 0;
+}
@@ -1,260 +1,743 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 #include <unistd.h>
 #include <arpa/inet.h> 
+#include <pthread.h>
 
 #include "config.h"
 #include "topic.h"
-#include "mqtt_parser.h"
+#include "mqtt_encoder.h"
 #include "utils.h"
+#include "event_loop.h"
+#include "intern.h"
+#include "metrics.h"
+#include "pool.h"
+#include "share.h"
+#include "cluster.h"
+
+/*
+ * In-memory topic registry: an open hash table (chained through Topic.next)
+ * from filter to its subscriber set, plus a level trie over the same
+ * filters that publishes use for '+'/'#' matching. Publishers only take
+ * the read side of the lock; the JSON file is just a periodic snapshot.
+ * Retained messages live in a second trie, keyed by topic name, that a
+ * new subscription walks with its filter. Shared subscriptions are
+ * registered under their full $share/ name and indexed by their filter.
+ */
+static Trie filters;
+static Trie retained;
+static Topic **buckets = NULL;
+static size_t bucket_count = 0;
+static size_t topic_count = 0;
+static bool snapshot_dirty = false;
+static pthread_rwlock_t topics_lock = PTHREAD_RWLOCK_INITIALIZER;
+static Pool topic_pool = POOL_INITIALIZER(Topic);
+
+void topic_init(void) {
+    pthread_rwlock_wrlock(&topics_lock);
+    if (!buckets) {
+        trie_init(&filters);
+        trie_init(&retained);
+        buckets = calloc(TOPIC_TABLE_INITIAL_SIZE, sizeof(Topic *));
+        bucket_count = buckets ? TOPIC_TABLE_INITIAL_SIZE : 0;
+    }
+    pthread_rwlock_unlock(&topics_lock);
+}
 
-void storage_save_topics(const Topic *topics) {
-    FILE *f = fopen(TOPICS_FILE, "w");
-    if (!f) {
-        log_message(LOG_ERROR, "Error opening JSON status file (%s)", TOPICS_FILE);
+/* A name nothing has interned cannot be a registered filter, so most misses stop at intern_find(). */
+static Topic *find_topic(const char *topic_name) {
+    if (bucket_count == 0) return NULL;
+    uint32_t id = intern_find(topic_name, strlen(topic_name));
+    if (!id) return NULL;
+
+    Topic *t = buckets[intern_hash(id) & (bucket_count - 1)];
+    while (t && t->name_id != id) t = t->next;
+    return t;
+}
+
+static void grow_table(void) {
+    size_t new_count = bucket_count * 2;
+    Topic **grown = calloc(new_count, sizeof(Topic *));
+    if (!grown) return;
+
+    for (size_t i = 0; i < bucket_count; i++) {
+        Topic *t = buckets[i];
+        while (t) {
+            Topic *next = t->next;
+            size_t b = t->hash & (new_count - 1);
+            t->next = grown[b];
+            grown[b] = t;
+            t = next;
+        }
+    }
+
+    free(buckets);
+    buckets = grown;
+    bucket_count = new_count;
+}
+
+/* `filter` is the part of `topic_name` the trie indexes: all of it unless it is a shared subscription. */
+static Topic *find_or_create_topic(const char *topic_name, const char *filter) {
+    Topic *t = find_topic(topic_name);
+    if (t) {
+        log_message(LOG_DEBUG, "Topic '%s' already exists", topic_name);
+        return t;
+    }
+    if (bucket_count == 0) return NULL;
+
+    Topic *new_topic = pool_alloc(&topic_pool);
+    if (!new_topic) {
+        log_message(LOG_ERROR, "Failed to allocate memory for topic '%s'", topic_name);
+        return NULL;
+    }
+    new_topic->name_id = intern_acquire(topic_name, strlen(topic_name));
+    if (!new_topic->name_id) {
+        log_message(LOG_ERROR, "Failed to intern topic '%s'", topic_name);
+        pool_free(&topic_pool, new_topic);
+        return NULL;
+    }
+    new_topic->name = intern_str(new_topic->name_id, NULL);
+    new_topic->hash = intern_hash(new_topic->name_id);
+    new_topic->subscriber_count = 0;
+    new_topic->local_count = 0;
+    new_topic->subscriber_cap = TOPIC_INLINE_SUBSCRIBERS;
+    new_topic->subscribers = new_topic->inline_subscribers;
+    new_topic->shared = filter != topic_name;
+    atomic_init(&new_topic->share_cursor, 0);
+    new_topic->node = trie_insert(&filters, filter, strlen(filter));
+    if (!new_topic->node) {
+        log_message(LOG_ERROR, "Failed to index topic '%s'", topic_name);
+        intern_release(new_topic->name_id);
+        pool_free(&topic_pool, new_topic);
+        return NULL;
+    }
+    new_topic->node_next = new_topic->node->value;
+    new_topic->node->value = new_topic;
+
+    if (topic_count >= bucket_count) grow_table();
+    size_t b = new_topic->hash & (bucket_count - 1);
+    new_topic->next = buckets[b];
+    buckets[b] = new_topic;
+    topic_count++;
+
+    log_message(LOG_INFO, "New topic created: '%s'", topic_name);
+    return new_topic;
+}
+
+static void free_topic(Topic *t) {
+    for (int i = 0; i < t->subscriber_count; i++) {
+        client_release(t->subscribers[i].client);
+    }
+    if (t->subscribers != t->inline_subscribers) free(t->subscribers);
+    intern_release(t->name_id);
+    pool_free(&topic_pool, t);
+}
+
+static void remove_topic(Topic *t) {
+    Topic **link = &buckets[t->hash & (bucket_count - 1)];
+    while (*link != t) link = &(*link)->next;
+    *link = t->next;
+    topic_count--;
+
+    Topic **on_node = (Topic **)&t->node->value;
+    while (*on_node != t) on_node = &(*on_node)->node_next;
+    *on_node = t->node_next;
+    if (!t->node->value) trie_prune(&filters, t->node);
+    log_message(LOG_DEBUG, "Topic '%s' has no subscribers left, removed", t->name);
+    free_topic(t);
+}
+
+static int grow_subscribers(Topic *t) {
+    int new_cap = t->subscriber_cap * 2;
+    Subscriber *grown;
+
+    if (t->subscribers == t->inline_subscribers) {
+        grown = malloc(new_cap * sizeof(Subscriber));
+        if (grown) memcpy(grown, t->subscribers, t->subscriber_count * sizeof(Subscriber));
+    } else {
+        grown = realloc(t->subscribers, new_cap * sizeof(Subscriber));
+    }
+    if (!grown) return -1;
+
+    t->subscribers = grown;
+    t->subscriber_cap = new_cap;
+    return 0;
+}
+
+static int grow_client_subs(Client *c) {
+    int new_cap = c->sub_cap ? c->sub_cap * 2 : 4;
+    ClientSubscription *grown = realloc(c->subs, new_cap * sizeof(ClientSubscription));
+    if (!grown) return -1;
+
+    c->subs = grown;
+    c->sub_cap = new_cap;
+    return 0;
+}
+
+/* A filter that gained its first local subscriber (add) or lost its last, for cluster_interest(). */
+typedef struct InterestChange {
+    struct InterestChange *next;
+    bool add;
+    char filter[];
+} InterestChange;
+
+/* What this thread changed under the write lock, newest first; announce_interest() sends it on. */
+static _Thread_local InterestChange *interest_changes;
+
+/*
+ * Other cluster nodes are told about a filter when it gets its first
+ * subscriber of this node's own and when it loses its last one; the
+ * links of those nodes do not count. Only noted here: queueing the
+ * SUBSCRIBE or UNSUBSCRIBE waits until the lock is released.
+ */
+static void count_local(const Topic *t, int delta) {
+    if (t->local_count != (delta > 0 ? 1 : 0)) return;
+    const char *filter;
+    share_name(t->name, &filter);
+
+    size_t len = strlen(filter);
+    InterestChange *c = malloc(sizeof(InterestChange) + len + 1);
+    if (!c) {
+        log_message(LOG_ERROR, "Failed to note cluster interest change for '%s'", filter);
         return;
     }
+    c->add = delta > 0;
+    memcpy(c->filter, filter, len + 1);
+    c->next = interest_changes;
+    interest_changes = c;
+}
 
-    fprintf(f, "{\n  \"topics\": [\n");
+/* Releases the write lock, then passes this thread's interest changes to the cluster in the order made. */
+static void unlock_and_announce(void) {
+    InterestChange *list = NULL;
 
-    const Topic *t = topics;
-    int first_topic = 1;
-    while (t) {
-        if (!first_topic) fprintf(f, ",\n");
-        first_topic = 0;
+    pthread_rwlock_unlock(&topics_lock);
+    while (interest_changes) {
+        InterestChange *c = interest_changes;
+        interest_changes = c->next;
+        c->next = list;
+        list = c;
+    }
+    while (list) {
+        InterestChange *c = list;
+        list = c->next;
+        cluster_interest(c->filter, c->add);
+        free(c);
+    }
+}
+
+/* Links the client into the topic; both arrays must have room. */
+static void link_subscription(Topic *t, Client *c, uint8_t qos) {
+    if (!c->peer) {
+        t->local_count++;
+        count_local(t, 1);
+    }
+    client_retain(c);
+    t->subscribers[t->subscriber_count] = (Subscriber){ c, c->sub_count, qos };
+    c->subs[c->sub_count] = (ClientSubscription){ t, t->subscriber_count };
+    t->subscriber_count++;
+    c->sub_count++;
+    snapshot_dirty = true;
+}
+
+/*
+ * Removes c->subs[i] from both sides in O(1): each array fills the hole
+ * with its last entry and fixes that entry's back-reference.
+ */
+static void unlink_subscription(Client *c, int i) {
+    Topic *t = c->subs[i].topic;
+    int slot = c->subs[i].slot;
+
+    t->subscribers[slot] = t->subscribers[--t->subscriber_count];
+    if (slot < t->subscriber_count) {
+        const Subscriber *moved = &t->subscribers[slot];
+        moved->client->subs[moved->sub_index].slot = slot;
+    }
 
-        fprintf(f, "    {\n      \"name\": \"%s\",\n      \"subscribers\": [", t->name);
+    c->subs[i] = c->subs[--c->sub_count];
+    if (i < c->sub_count) {
+        const ClientSubscription *moved = &c->subs[i];
+        moved->topic->subscribers[moved->slot].sub_index = i;
+    }
 
-        Subscriber *s = t->subscribers;
-        int first_sub = 1;
-        while (s) {
-            if (!first_sub) fprintf(f, ", ");
-            first_sub = 0;
+    if (!c->peer) {
+        t->local_count--;
+        count_local(t, -1);
+    }
+    snapshot_dirty = true;
+    if (t->subscriber_count == 0) remove_topic(t);
+    client_release(c);
+}
 
-            char ip_str[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &s->client->addr.sin_addr, ip_str, sizeof(ip_str));
+static int find_subscription(const Client *c, const Topic *t) {
+    for (int i = 0; i < c->sub_count; i++) {
+        if (c->subs[i].topic == t) return i;
+    }
+    return -1;
+}
 
-            fprintf(f, "{ \"sock\": %d, \"client_id\": \"%s\", \"ip\": \"%s\", \"port\": %d }",
-                    s->client->sock,
-                    s->client->client_id,
-                    ip_str,
-                    ntohs(s->client->addr.sin_port));
+/*
+ * Subscribes the client, or updates the QoS of its existing subscription.
+ * Returns the granted QoS, or -1 when the filter is not a valid MQTT
+ * topic filter.
+ */
+int topic_add_subscriber(const char *topic_name, Client *client, uint8_t qos) {
+    int rc = -1;
+    const char *filter;
+
+    share_name(topic_name, &filter);
+    if (!filter || !topic_filter_valid(filter)) {
+        log_message(LOG_WARNING, "Rejecting invalid topic filter '%s'", topic_name);
+        return -1;
+    }
 
-            s = s->next;
-        }
+    pthread_rwlock_wrlock(&topics_lock);
 
-        fprintf(f, "]\n    }");
-        t = t->next;
+    Topic *t = find_or_create_topic(topic_name, filter);
+    if (!t) goto out;
+
+    int i = find_subscription(client, t);
+    if (i >= 0) {
+        log_message(LOG_DEBUG, "Customer %s already subscribed to %s", client->client_id, topic_name);
+        t->subscribers[client->subs[i].slot].qos = qos;
+        rc = qos;
+        goto out;
     }
 
-    fprintf(f, "\n  ]\n}\n");
+    if ((t->subscriber_count == t->subscriber_cap && grow_subscribers(t) < 0) ||
+        (client->sub_count == client->sub_cap && grow_client_subs(client) < 0)) {
+        log_message(LOG_ERROR, "Failed to grow subscriber set of '%s'", topic_name);
+        if (t->subscriber_count == 0) remove_topic(t);
+        goto out;
+    }
+    link_subscription(t, client, qos);
+    rc = qos;
+
+    log_message(LOG_INFO, "Customer %s subscribed to the topic %s", client->client_id, topic_name);
 
-    fclose(f);
+out:
+    unlock_and_announce();
+    return rc;
 }
 
-Topic *storage_load_topics(void) {
-    FILE *f = fopen(TOPICS_FILE, "r");
-    if (!f) {
-        log_message(LOG_WARNING, "State file %s not found. No topics loaded.", TOPICS_FILE);
-        return NULL;
+/* Returns -1 if the client was not subscribed to the filter. */
+int topic_remove_subscriber(const char *topic_name, Client *client) {
+    int rc = -1;
+    pthread_rwlock_wrlock(&topics_lock);
+
+    Topic *t = find_topic(topic_name);
+    int i = t ? find_subscription(client, t) : -1;
+    if (i >= 0) {
+        unlink_subscription(client, i);
+        log_message(LOG_INFO, "Customer %s removed from topic %s", client->client_id, topic_name);
+        rc = 0;
     }
 
-    fseek(f, 0, SEEK_END);
-    long size = ftell(f);
-    fseek(f, 0, SEEK_SET);
+    unlock_and_announce();
+    return rc;
+}
 
-    char *buf = malloc(size + 1);
-    if (!buf) {
-        fclose(f);
-        log_message(LOG_ERROR, "Failed to allocate memory for reading the state");
-        return NULL;
+/* Drops every subscription the client holds; cost is proportional to their number. */
+void topic_remove_client(Client *client) {
+    pthread_rwlock_wrlock(&topics_lock);
+
+    int count = client->sub_count;
+    while (client->sub_count > 0) {
+        unlink_subscription(client, client->sub_count - 1);
     }
 
-    fread(buf, 1, size, f);
-    buf[size] = '\0';
-    fclose(f);
-
-    Topic *topics = NULL;
-    char *pos = buf;
-
-    while ((pos = strstr(pos, "\"name\":"))) {
-        pos += 7;
-        while (*pos == ' ' || *pos == '\"' || *pos == ':') pos++;
-        char topic_name[128];
-        sscanf(pos, "%127[^\"]", topic_name);
-
-        Topic *t = malloc(sizeof(Topic));
-        strncpy(t->name, topic_name, sizeof(t->name));
-        t->subscribers = NULL;
-        t->next = topics;
-        topics = t;
-
-        char *subs = strstr(pos, "\"subscribers\"");
-        if (subs) {
-            char *start = strchr(subs, '[');
-            char *end = strchr(subs, ']');
-            if (start && end && end > start) {
-                char subs_buf[4096];
-                strncpy(subs_buf, start + 1, end - start - 1);
-                subs_buf[end - start - 1] = '\0';
-
-                char *token = strtok(subs_buf, "{");
-                while (token) {
-                    if (strchr(token, '}')) {
-                        int sock = 0, port = 0;
-                        char client_id[64] = {0};
-                        char ip[INET_ADDRSTRLEN] = {0};
-
-                        sscanf(token, " \"sock\": %d , \"client_id\": \"%63[^\"]\" , \"ip\": \"%15[^\"]\" , \"port\": %d",
-                               &sock, client_id, ip, &port);
-
-                        Client *c = malloc(sizeof(Client));
-                        if (c) {
-                            c->sock = sock;
-                            strncpy(c->client_id, client_id, sizeof(c->client_id));
-                            c->addr.sin_family = AF_INET;
-                            inet_pton(AF_INET, ip, &c->addr.sin_addr);
-                            c->addr.sin_port = htons(port);
-                            c->next = NULL;
-
-                            Subscriber *s = malloc(sizeof(Subscriber));
-                            if (s) {
-                                s->client = c;
-                                s->next = t->subscribers;
-                                t->subscribers = s;
-                            }
-                        }
-                    }
-                    token = strtok(NULL, "{");
-                }
-            }
+    unlock_and_announce();
+
+    if (count > 0) {
+        log_message(LOG_INFO, "Removed %d subscription(s) of client %s", count, client->client_id);
+    }
+}
+
+/*
+ * Hands every subscription of `from` to `to` in place (session takeover),
+ * so the filters never go unsubscribed in between.
+ */
+void topic_move_subscriptions(Client *from, Client *to) {
+    pthread_rwlock_wrlock(&topics_lock);
+
+    while (from->sub_count > 0) {
+        ClientSubscription *cs = &from->subs[from->sub_count - 1];
+        Topic *t = cs->topic;
+
+        if (find_subscription(to, t) >= 0 ||
+            (to->sub_count == to->sub_cap && grow_client_subs(to) < 0)) {
+            unlink_subscription(from, from->sub_count - 1);
+            continue;
         }
+
+        client_retain(to);
+        t->subscribers[cs->slot].client = to;
+        t->subscribers[cs->slot].sub_index = to->sub_count;
+        to->subs[to->sub_count++] = *cs;
+        from->sub_count--;
+        client_release(from);
     }
+    snapshot_dirty = true;
 
-    free(buf);
-    
-    return topics;
+    unlock_and_announce();
 }
 
-static Topic *find_or_create_topic(const char *topic_name) {
-    Topic *topics = storage_load_topics();
-    Topic *t = topics;
+/* The last retained message of a topic name: a QoS 0 MQTT 3.1.1 PUBLISH with the retain flag set. */
+typedef struct {
+    Frame *msg;
+    uint8_t qos;
+} Retained;
+
+typedef struct {
+    Retained *items;
+    size_t count;
+    size_t cap;
+} RetainedMatches;
+
+/* Replaces the retained message of a topic name; an empty payload clears it. */
+static void retain_message(const char *topic_name, size_t topic_len, const uint8_t *payload, size_t payload_len,
+                           uint8_t qos) {
+    Frame *msg = NULL;
+    if (payload_len > 0) {
+        MqttPublishSpec spec = {
+            .topic = topic_name,
+            .topic_len = topic_len,
+            .payload = payload,
+            .payload_len = payload_len,
+            .retain = true,
+            .version = MQTT_PROTOCOL_V311,
+        };
+        size_t capacity = mqtt_publish_size(&spec);
+        msg = frame_alloc(capacity);
+        if (!msg || mqtt_encode_publish(msg->data, capacity, &spec) < 0) {
+            log_message(LOG_ERROR, "Failed to encode retained message for '%.*s'", (int)topic_len, topic_name);
+            if (msg) frame_release(msg);
+            return;
+        }
+        msg->len = capacity;
+        msg->droppable = true;
+        msg->topic_hash = fnv1a_hash(topic_name, topic_len);
+    }
+
+    pthread_rwlock_wrlock(&topics_lock);
 
-    while (t) {
-        if (strcmp(t->name, topic_name) == 0) {
-            log_message(LOG_DEBUG, "Topic '%s' already exists", topic_name);
-            return topics;
+    TrieNode *node = trie_insert(&retained, topic_name, topic_len);
+    Retained *r = node ? node->value : NULL;
+    if (r) {
+        frame_release(r->msg);
+        if (!msg) {
+            free(r);
+            node->value = NULL;
         }
-        t = t->next;
+    } else if (node && msg) {
+        r = node->value = malloc(sizeof(Retained));
     }
 
-    Topic *new_topic = malloc(sizeof(Topic));
-    if (!new_topic) {
-        log_message(LOG_ERROR, "Failed to allocate memory for topic '%s'", topic_name);
-        return topics;
+    if (msg && r) {
+        r->msg = msg;
+        r->qos = qos;
+    } else if (msg) {
+        log_message(LOG_ERROR, "Failed to retain message for '%.*s'", (int)topic_len, topic_name);
+        frame_release(msg);
     }
-    strncpy(new_topic->name, topic_name, sizeof(new_topic->name) - 1);
-    new_topic->name[sizeof(new_topic->name) - 1] = '\0';
-    new_topic->subscribers = NULL;
-    new_topic->next = topics;
-    topics = new_topic;
+    if (node && !node->value) trie_prune(&retained, node);
 
-    log_message(LOG_INFO, "New topic created: '%s'", topic_name);
-    storage_save_topics(topics);
+    pthread_rwlock_unlock(&topics_lock);
+}
+
+static void collect_retained(void *value, void *arg) {
+    const Retained *r = value;
+    RetainedMatches *m = arg;
+
+    if (m->count == m->cap) {
+        size_t new_cap = m->cap ? m->cap * 2 : 16;
+        Retained *grown = realloc(m->items, new_cap * sizeof(Retained));
+        if (!grown) return;
+        m->items = grown;
+        m->cap = new_cap;
+    }
+    frame_retain(r->msg);
+    m->items[m->count++] = *r;
+}
 
-    return topics;
+/*
+ * Sends the client every retained message its new subscription matches,
+ * at no more than the granted QoS. Only the trie branches the filter can
+ * reach are walked; the messages are sent after the lock is dropped.
+ */
+void topic_deliver_retained(const char *filter, Client *client, uint8_t qos) {
+    RetainedMatches m = { NULL, 0, 0 };
+
+    pthread_rwlock_rdlock(&topics_lock);
+    trie_match_filter(&retained, filter, collect_retained, &m);
+    pthread_rwlock_unlock(&topics_lock);
+
+    for (size_t i = 0; i < m.count; i++) {
+        Frame *msg = m.items[i].msg;
+        uint8_t q = m.items[i].qos < qos ? m.items[i].qos : qos;
+
+        if (q > 0 || client->protocol < MQTT_PROTOCOL_V5 || client_aliases_topics(client)) {
+            event_loop_deliver(client, msg, q);
+        } else {
+            Frame *f = mqtt_publish_reframe(msg, 0, 0, false, client->protocol, 0, false);
+            if (f) {
+                f->droppable = true;
+                event_loop_deliver(client, f, 0);
+                frame_release(f);
+            }
+        }
+        frame_release(msg);
+    }
+
+    if (m.count > 0) {
+        log_message(LOG_DEBUG, "Sent %zu retained message(s) matching '%s' to %s", m.count, filter, client->client_id);
+    }
+    free(m.items);
 }
 
-void topic_add_subscriber(const char *topic_name, Client *client) {
-    Topic *topics = find_or_create_topic(topic_name);
-    Topic *t = topics;
+typedef struct {
+    const char *topic_name;
+    size_t topic_len;
+    const uint8_t *payload;
+    size_t payload_len;
+    uint8_t qos;
+    uint32_t sender;        /* id hash of the publishing client, for sticky shared subscriptions */
+    bool from_peer;         /* forwarded by another cluster node, so not forwarded again */
+    Client **congested;     /* where to report a subscriber the publisher should wait for */
+    int matches;
+    uint64_t fanout_ns;     /* time spent queuing for subscribers, inside the trie walk */
+    Frame *frames[2];       /* MQTT 3.1.1 and MQTT 5 encodings */
+    bool encode_failed[2];
+    const Client *links[CLUSTER_MAX_PEERS]; /* cluster links that already got it */
+    int link_count;
+} PublishContext;
+
+/*
+ * The PUBLISH is encoded once per protocol version, on the first
+ * subscriber that needs it, and shared by every other one.
+ */
+static Frame *publish_frame(PublishContext *ctx, uint8_t version) {
+    int v = version >= MQTT_PROTOCOL_V5;
+    if (ctx->frames[v] || ctx->encode_failed[v]) return ctx->frames[v];
+
+    MqttPublishSpec spec = {
+        .topic = ctx->topic_name,
+        .topic_len = ctx->topic_len,
+        .payload = ctx->payload,
+        .payload_len = ctx->payload_len,
+        .version = version,
+    };
+    size_t capacity = mqtt_publish_size(&spec);
+    Frame *f = frame_alloc(capacity);
+    int len = f ? mqtt_encode_publish(f->data, capacity, &spec) : -1;
+    if (len < 0) {
+        log_message(LOG_ERROR, "Failed to encode PUBLISH packet");
+        if (f) frame_release(f);
+        ctx->encode_failed[v] = true;
+        return NULL;
+    }
 
-    while (t && strcmp(t->name, topic_name) != 0) {
-        t = t->next;
+    f->len = len;
+    f->droppable = true;
+    f->topic_hash = fnv1a_hash(ctx->topic_name, ctx->topic_len);
+    ctx->frames[v] = f;
+    return f;
+}
+
+/*
+ * A peer's link holds one subscription per filter of that node's, and
+ * several can match one topic; the node gets the message once and
+ * matches it against its own subscribers. True if `link` already has it.
+ */
+static bool sent_to_link(PublishContext *ctx, const Client *link) {
+    for (int i = 0; i < ctx->link_count; i++) {
+        if (ctx->links[i] == link) return true;
     }
-    if (!t) return;
+    if (ctx->link_count < CLUSTER_MAX_PEERS) ctx->links[ctx->link_count++] = link;
+    return false;
+}
 
-    Subscriber *s = malloc(sizeof(Subscriber));
-    if (!s) return;
-    s->client = client;
-    s->next = t->subscribers;
-    t->subscribers = s;
+static void deliver_to_subscriber(PublishContext *ctx, const Subscriber *s) {
+    Client *c = s->client;
+    uint8_t qos = s->qos < ctx->qos ? s->qos : ctx->qos;
 
-    log_message(LOG_INFO, "Customer %s subscribed to the topic %s", client->client_id, topic_name);
-    storage_save_topics(topics);
+    if (c->peer && (ctx->from_peer || sent_to_link(ctx, c))) return;
+
+    /* QoS 1/2 and aliased copies are re-framed by the owner around the 3.1.1 encoding */
+    Frame *f = publish_frame(ctx, qos > 0 || client_aliases_topics(c) ? MQTT_PROTOCOL_V311 : c->protocol);
+    if (!f) return;
+    log_message(LOG_DEBUG, "Sending PUBLISH for client %s (socket %d, %zu bytes, QoS %d)",
+                c->client_id, c->sock, f->len, qos);
+    if (qos > 0 && ctx->congested && !*ctx->congested && inflight_congested(c)) {
+        client_retain(c);
+        *ctx->congested = c;
+    }
+    event_loop_deliver(c, f, qos);
 }
 
-void topic_remove_subscriber(const char *topic_name, Client *client) {
-    Topic *topics = storage_load_topics();
-    Topic *t = topics;
-    while (t) {
-        if (strcmp(t->name, topic_name) == 0) {
-            Subscriber **prev = &t->subscribers;
-            Subscriber *s = t->subscribers;
-            while (s) {
-                if (s->client && strcmp(s->client->client_id, client->client_id) == 0) {
-                    *prev = s->next;
-                    free(s);
-                    log_message(LOG_INFO, "Customer %s removed from topic %s", client->client_id, topic_name);
-                    storage_save_topics(topics);
-                    return;
-                }
-                prev = &s->next;
-                s = s->next;
-            }
+/* Every subscription set on a matching trie node: all subscribers of a plain one, one member of a shared one. */
+static void deliver_to_filter(void *value, void *arg) {
+    PublishContext *ctx = arg;
+    uint64_t start = metrics_clock();
+
+    for (Topic *t = value; t; t = t->node_next) {
+        ctx->matches++;
+        log_message(LOG_DEBUG, "Posting to '%.*s' via '%s' for %d subscriber(s)",
+                    (int)ctx->topic_len, ctx->topic_name, t->name, t->subscriber_count);
+
+        if (t->shared) {
+            int i = share_pick(t->subscribers, t->subscriber_count, &t->share_cursor, ctx->sender);
+            deliver_to_subscriber(ctx, &t->subscribers[i]);
+            continue;
+        }
+        for (int i = 0; i < t->subscriber_count; i++) {
+            deliver_to_subscriber(ctx, &t->subscribers[i]);
         }
-        t = t->next;
+    }
+    ctx->fanout_ns += metrics_clock() - start;
+}
+
+/*
+ * Routes a PUBLISH to every matching subscriber; with `retain` it also
+ * becomes the topic's retained message. `sender` is the publishing
+ * client, NULL for messages from the broker itself. What a cluster link
+ * forwarded only goes to this node's own subscribers: every node links
+ * to every other, so it already went to the rest. With `congested`, a
+ * QoS 1/2 subscriber the sender should wait for (inflight_congested) is
+ * reported there, with a reference for the caller.
+ */
+void topic_publish(const char *topic_name, size_t topic_len, const uint8_t *payload, size_t payload_len, uint8_t qos,
+                   bool retain, const Client *sender, Client **congested) {
+    if (!topic_name_valid(topic_name, topic_len)) {
+        log_message(LOG_WARNING, "Dropping PUBLISH to invalid topic name '%.*s'", (int)topic_len, topic_name);
+        return;
+    }
+    if (retain) retain_message(topic_name, topic_len, payload, payload_len, qos);
+
+    PublishContext ctx = { topic_name, topic_len, payload, payload_len, qos, sender ? sender->id_hash : 0,
+                           sender && sender->peer, congested, 0, 0, { NULL, NULL }, { false, false },
+                           { NULL }, 0 };
+
+    uint64_t start = metrics_clock();
+    pthread_rwlock_rdlock(&topics_lock);
+    trie_match(&filters, topic_name, topic_len, deliver_to_filter, &ctx);
+    pthread_rwlock_unlock(&topics_lock);
+    uint64_t walk_ns = metrics_clock() - start;
+    metrics_record(STAGE_MATCH, walk_ns - ctx.fanout_ns);
+    if (ctx.matches > 0) metrics_record(STAGE_FANOUT, ctx.fanout_ns);
+
+    for (int v = 0; v < 2; v++) {
+        if (ctx.frames[v]) frame_release(ctx.frames[v]);
+    }
+
+    /* the broker's own $SYS updates usually have no subscribers */
+    if (ctx.matches == 0 && sender) {
+        log_message(LOG_WARNING, "No matching topics for '%.*s'", (int)topic_len, topic_name);
     }
 }
 
-void topic_publish(const char *topic_name, const char *payload, int payload_len) {
-    Topic *t = storage_load_topics();
-
-    while (t) {
-        if (strcmp(t->name, topic_name) == 0) {
-            Subscriber *s = t->subscribers;
-            int count = 0;
-            while (s) { count++; s = s->next; }
-
-            log_message(LOG_INFO, "Posting to ‘%s’ for %d subscriber(s)", topic_name, count);
-
-            s = t->subscribers;
-            while (s) {
-                unsigned char buf[2048];
-                int len = mqtt_encode_publish(buf, sizeof(buf), topic_name, payload, payload_len);
-
-                if (len > 0) {
-                    log_message(LOG_DEBUG, "Sending PUBLISH for client %s (socket %d, %d bytes)",
-                                s->client->client_id, s->client->sock, len);
-                    write_exact(s->client->sock, buf, len);
-                } else {
-                    log_message(LOG_ERROR, "Failed to encode PUBLISH packet");
-                }
-                s = s->next;
+static void write_topics(FILE *f) {
+    fprintf(f, "{\n  \"topics\": [\n");
+
+    int first_topic = 1;
+    for (size_t i = 0; i < bucket_count; i++) {
+        for (const Topic *t = buckets[i]; t; t = t->next) {
+            if (!first_topic) fprintf(f, ",\n");
+            first_topic = 0;
+
+            fprintf(f, "    {\n      \"name\": \"%s\",\n      \"subscribers\": [", t->name);
+
+            for (int j = 0; j < t->subscriber_count; j++) {
+                fprintf(f, "%s{ \"client_id\": \"%s\" }", j ? ", " : "", t->subscribers[j].client->client_id);
             }
-            return;
+
+            fprintf(f, "]\n    }");
         }
-        t = t->next;
     }
 
-    log_message(LOG_WARNING, "No matching topics for '%s'", topic_name);
+    fprintf(f, "\n  ]\n}\n");
+}
+
+/*
+ * Writes the registry to TOPICS_FILE if it changed since the last call.
+ * Only the rendering into memory holds the lock; the file is written
+ * after, and replaced atomically so readers never see half a snapshot.
+ * Called from the housekeeping thread, never from an event loop.
+ */
+void topic_snapshot(void) {
+    char *json = NULL;
+    size_t len = 0;
+
+    pthread_rwlock_rdlock(&topics_lock);
+    if (!snapshot_dirty) {
+        pthread_rwlock_unlock(&topics_lock);
+        return;
+    }
+    FILE *mem = open_memstream(&json, &len);
+    if (mem) {
+        write_topics(mem);
+        snapshot_dirty = false;
+    }
+    pthread_rwlock_unlock(&topics_lock);
+
+    if (!mem) {
+        log_message(LOG_ERROR, "Could not render the topics snapshot");
+        return;
+    }
+    fclose(mem);
+
+    char tmp_path[256];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", TOPICS_FILE);
+
+    FILE *f = fopen(tmp_path, "w");
+    if (!f) {
+        log_message(LOG_ERROR, "Error opening JSON status file (%s)", tmp_path);
+        free(json);
+        return;
+    }
+    bool written = fwrite(json, 1, len, f) == len;
+    if (fclose(f) != 0) written = false;
+    free(json);
+
+    if (!written) {
+        log_message(LOG_ERROR, "Could not write %s", tmp_path);
+    } else if (rename(tmp_path, TOPICS_FILE) == -1) {
+        log_message(LOG_ERROR, "Could not replace %s", TOPICS_FILE);
+    }
+}
+
+static void free_retained(void *value, void *arg) {
+    (void)arg;
+    Retained *r = value;
+    frame_release(r->msg);
+    free(r);
 }
 
 void topic_cleanup(void) {
-    Topic *topics = storage_load_topics();
-    while (topics) {
-        Topic *next_t = topics->next;
-        Subscriber *s = topics->subscribers;
-        while (s) {
-            Subscriber *next_s = s->next;
-            if (s->client) free(s->client);
-            free(s);
-            s = next_s;
+    pthread_rwlock_wrlock(&topics_lock);
+
+    for (size_t i = 0; i < bucket_count; i++) {
+        Topic *t = buckets[i];
+        while (t) {
+            Topic *next_t = t->next;
+            free_topic(t);
+            t = next_t;
         }
-        free(topics);
-        topics = next_t;
     }
+    free(buckets);
+    buckets = NULL;
+    bucket_count = 0;
+    topic_count = 0;
+    snapshot_dirty = false;
+    trie_destroy(&filters);
+    trie_visit(&retained, free_retained, NULL);
+    trie_destroy(&retained);
+    intern_cleanup();
+    pool_destroy(&topic_pool);
+
+    pthread_rwlock_unlock(&topics_lock);
 
     FILE *f = fopen(TOPICS_FILE, "w");
     if (f) {
@@ -266,4 +749,4 @@ void topic_cleanup(void) {
     }
 
     log_message(LOG_DEBUG, "Temporary memory state released and file cleaned up");
-}
\ No newline at end of file
+}
@@ -0,0 +1,161 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "topic_alias.h"
+#include "config.h"
+#include "utils.h"
+
+/*
+ * Inbound, the client picks the aliases (up to the TOPIC_ALIAS_MAX the
+ * CONNACK announces) and the broker keeps one copy of each name, which
+ * PUBLISH packets then resolve to without copying.
+ *
+ * Outbound, the broker picks them: every topic sent to the client gets
+ * an alias, the least recently used one is rebound once the client's
+ * maximum is reached. A hash on the name finds a topic's alias; an LRU
+ * list threaded through the same entries orders them.
+ */
+
+void topic_alias_init(TopicAliases *a, uint16_t out_max) {
+    memset(a, 0, sizeof(*a));
+    a->out_max = out_max < TOPIC_ALIAS_OUT_MAX ? out_max : TOPIC_ALIAS_OUT_MAX;
+}
+
+void topic_alias_free(TopicAliases *a) {
+    if (a->in) {
+        for (int i = 0; i < TOPIC_ALIAS_MAX; i++) free(a->in[i].name);
+    }
+    if (a->out) {
+        for (uint16_t i = 1; i <= a->out_max; i++) free(a->out[i].name);
+    }
+    free(a->in);
+    free(a->out);
+    free(a->buckets);
+    topic_alias_init(a, a->out_max);
+}
+
+/*
+ * Applies a PUBLISH's Topic Alias: with a topic name it (re)binds the
+ * alias, without one `topic` is pointed at the name the alias stands
+ * for. -1 for an alias out of range or not bound yet.
+ */
+int topic_alias_inbound(TopicAliases *a, uint16_t alias, MqttView *topic) {
+    if (alias == 0 || alias > TOPIC_ALIAS_MAX) return -1;
+    if (!a->in && !(a->in = calloc(TOPIC_ALIAS_MAX, sizeof(*a->in)))) return -1;
+
+    InboundAlias *e = &a->in[alias - 1];
+    if (topic->len == 0) {
+        if (!e->name) return -1;
+        topic->data = (const uint8_t *)e->name;
+        topic->len = e->len;
+        return 0;
+    }
+
+    if (e->name && e->len == topic->len && memcmp(e->name, topic->data, topic->len) == 0) return 0;
+    char *name = realloc(e->name, topic->len);
+    if (!name) return -1;
+    memcpy(name, topic->data, topic->len);
+    e->name = name;
+    e->len = (uint16_t)topic->len;
+    return 0;
+}
+
+static void lru_unlink(OutboundAlias *out, uint16_t i) {
+    out[out[i].prev].next = out[i].next;
+    out[out[i].next].prev = out[i].prev;
+}
+
+static void lru_push_front(OutboundAlias *out, uint16_t i) {
+    out[i].prev = 0;
+    out[i].next = out[0].next;
+    out[out[0].next].prev = i;
+    out[0].next = i;
+}
+
+static void lru_push_back(OutboundAlias *out, uint16_t i) {
+    out[i].next = 0;
+    out[i].prev = out[0].prev;
+    out[out[0].prev].next = i;
+    out[0].prev = i;
+}
+
+static void unchain(TopicAliases *a, uint16_t i) {
+    uint16_t *p = &a->buckets[a->out[i].hash & a->bucket_mask];
+    while (*p != i) p = &a->out[*p].chain;
+    *p = a->out[i].chain;
+}
+
+static int alloc_outbound(TopicAliases *a) {
+    size_t buckets = 1;
+    while (buckets < (size_t)a->out_max * 2) buckets <<= 1;
+
+    a->out = calloc((size_t)a->out_max + 1, sizeof(*a->out));
+    a->buckets = calloc(buckets, sizeof(*a->buckets));
+    if (!a->out || !a->buckets) {
+        free(a->out);
+        free(a->buckets);
+        a->out = NULL;
+        a->buckets = NULL;
+        return -1;
+    }
+    a->bucket_mask = (uint16_t)(buckets - 1);
+    return 0;
+}
+
+/*
+ * The alias to send `topic` under, 0 for none. *known tells whether the
+ * client already has it bound; if not, the packet must carry the topic
+ * name too, and it binds the alias (dropping that packet means calling
+ * topic_alias_forget()). `hash` is the topic's fnv1a_hash() when the
+ * caller already has it (every subscriber of a message shares one),
+ * 0 to compute it here.
+ */
+uint16_t topic_alias_outbound(TopicAliases *a, const uint8_t *topic, size_t len, uint32_t hash, bool *known) {
+    *known = false;
+    if (a->out_max == 0 || len == 0 || len > 0xFFFF) return 0;
+    if (!a->out && alloc_outbound(a) < 0) return 0;
+
+    OutboundAlias *out = a->out;
+    if (!hash) hash = fnv1a_hash((const char *)topic, len);
+    for (uint16_t i = a->buckets[hash & a->bucket_mask]; i; i = out[i].chain) {
+        if (out[i].hash == hash && out[i].len == len && memcmp(out[i].name, topic, len) == 0) {
+            lru_unlink(out, i);
+            lru_push_front(out, i);
+            *known = true;
+            return i;
+        }
+    }
+
+    char *name = malloc(len);
+    if (!name) return 0;
+    memcpy(name, topic, len);
+
+    uint16_t i;
+    if (a->out_used < a->out_max) {
+        i = ++a->out_used;
+    } else {
+        i = out[0].prev;
+        lru_unlink(out, i);
+        if (out[i].name) unchain(a, i);
+        free(out[i].name);
+    }
+
+    out[i].name = name;
+    out[i].len = (uint16_t)len;
+    out[i].hash = hash;
+    out[i].chain = a->buckets[hash & a->bucket_mask];
+    a->buckets[hash & a->bucket_mask] = i;
+    lru_push_front(out, i);
+    return i;
+}
+
+/* Unbinds an alias whose binding packet never went out; it is the next one reused. */
+void topic_alias_forget(TopicAliases *a, uint16_t alias) {
+    if (!a->out || alias == 0 || alias > a->out_used || !a->out[alias].name) return;
+    unchain(a, alias);
+    free(a->out[alias].name);
+    a->out[alias].name = NULL;
+    a->out[alias].len = 0;
+    lru_unlink(a->out, alias);
+    lru_push_back(a->out, alias);
+}
@@ -0,0 +1,282 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "topic_trie.h"
+#include "codec.h"
+#include "intern.h"
+
+#define LINEAR_SCAN_MAX 8
+
+void trie_init(Trie *trie) {
+    memset(trie, 0, sizeof(*trie));
+}
+
+/* Returns the child's index, or -(insert position) - 1 when absent. */
+static int child_index(const TrieNode *node, uint32_t level) {
+    if (node->child_count <= LINEAR_SCAN_MAX) {
+        uint32_t i = 0;
+        while (i < node->child_count && node->child_levels[i] < level) i++;
+        if (i < node->child_count && node->child_levels[i] == level) return (int)i;
+        return -(int)i - 1;
+    }
+
+    int lo = 0, hi = (int)node->child_count - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (node->child_levels[mid] == level) return mid;
+        if (node->child_levels[mid] < level) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    return -lo - 1;
+}
+
+static TrieNode *new_node(TrieNode *parent, uint32_t level) {
+    TrieNode *n = calloc(1, sizeof(TrieNode));
+    if (!n) return NULL;
+    n->parent = parent;
+    n->level = level;
+    return n;
+}
+
+static TrieNode *exact_child(TrieNode *node, const char *seg, size_t len) {
+    uint32_t level = intern_find(seg, len);
+    if (level) {
+        int idx = child_index(node, level);
+        if (idx >= 0) return node->children[idx];
+    }
+
+    level = intern_acquire(seg, len);
+    if (!level) return NULL;
+
+    int pos = -child_index(node, level) - 1;
+    if (node->child_count == node->child_cap) {
+        uint32_t new_cap = node->child_cap ? node->child_cap * 2 : 2;
+        uint32_t *levels = realloc(node->child_levels, new_cap * sizeof(uint32_t));
+        if (levels) node->child_levels = levels;
+        TrieNode **children = realloc(node->children, new_cap * sizeof(TrieNode *));
+        if (children) node->children = children;
+        if (!levels || !children) {
+            intern_release(level);
+            return NULL;
+        }
+        node->child_cap = new_cap;
+    }
+
+    TrieNode *child = new_node(node, level);
+    if (!child) {
+        intern_release(level);
+        return NULL;
+    }
+
+    memmove(&node->child_levels[pos + 1], &node->child_levels[pos],
+            (node->child_count - pos) * sizeof(uint32_t));
+    memmove(&node->children[pos + 1], &node->children[pos],
+            (node->child_count - pos) * sizeof(TrieNode *));
+    node->child_levels[pos] = level;
+    node->children[pos] = child;
+    node->child_count++;
+
+    return child;
+}
+
+/* Walks (creating as needed) the node for a filter of `path_len` bytes; the caller owns node->value. */
+TrieNode *trie_insert(Trie *trie, const char *path, size_t path_len) {
+    TrieNode *node = &trie->root;
+    const char *seg = path;
+    const char *stop = path + path_len;
+
+    for (;;) {
+        const char *end = memchr(seg, '/', (size_t)(stop - seg));
+        size_t len = end ? (size_t)(end - seg) : (size_t)(stop - seg);
+
+        if (len == 1 && seg[0] == '+') {
+            if (!node->plus) node->plus = new_node(node, 0);
+            node = node->plus;
+        } else if (len == 1 && seg[0] == '#') {
+            if (!node->hash) node->hash = new_node(node, 0);
+            node = node->hash;
+        } else {
+            node = exact_child(node, seg, len);
+        }
+
+        if (!node) return NULL;
+        if (!end) return node;
+        seg = end + 1;
+    }
+}
+
+static void free_node(TrieNode *node) {
+    if (node->level) intern_release(node->level);
+    free(node->child_levels);
+    free(node->children);
+    free(node);
+}
+
+/* Removes the node and any ancestors left without values or children. */
+void trie_prune(Trie *trie, TrieNode *node) {
+    while (node && node != &trie->root &&
+           !node->value && !node->child_count && !node->plus && !node->hash) {
+        TrieNode *parent = node->parent;
+
+        if (parent->plus == node) {
+            parent->plus = NULL;
+        } else if (parent->hash == node) {
+            parent->hash = NULL;
+        } else {
+            int idx = child_index(parent, node->level);
+            if (idx >= 0) {
+                memmove(&parent->child_levels[idx], &parent->child_levels[idx + 1],
+                        (parent->child_count - idx - 1) * sizeof(uint32_t));
+                memmove(&parent->children[idx], &parent->children[idx + 1],
+                        (parent->child_count - idx - 1) * sizeof(TrieNode *));
+                parent->child_count--;
+            }
+        }
+
+        free_node(node);
+        node = parent;
+    }
+}
+
+static void destroy_subtree(TrieNode *node) {
+    for (uint32_t i = 0; i < node->child_count; i++) {
+        destroy_subtree(node->children[i]);
+        free_node(node->children[i]);
+    }
+    if (node->plus) {
+        destroy_subtree(node->plus);
+        free_node(node->plus);
+    }
+    if (node->hash) {
+        destroy_subtree(node->hash);
+        free_node(node->hash);
+    }
+}
+
+void trie_destroy(Trie *trie) {
+    destroy_subtree(&trie->root);
+    free(trie->root.child_levels);
+    free(trie->root.children);
+    trie_init(trie);
+}
+
+static void match_level(const TrieNode *node, const char *seg, const char *stop,
+                        int depth, TrieMatchFn fn, void *arg);
+
+/* `end` is the '/' that closed the level just matched, or NULL at the end. */
+static void match_next(const TrieNode *node, const char *end, const char *stop,
+                       int depth, TrieMatchFn fn, void *arg) {
+    if (!end) {
+        if (node->value) fn(node->value, arg);
+        if (node->hash && node->hash->value) fn(node->hash->value, arg);
+        return;
+    }
+    match_level(node, end + 1, stop, depth + 1, fn, arg);
+}
+
+static void match_level(const TrieNode *node, const char *seg, const char *stop,
+                        int depth, TrieMatchFn fn, void *arg) {
+    const char *end = memchr(seg, '/', stop - seg);
+    size_t len = end ? (size_t)(end - seg) : (size_t)(stop - seg);
+
+    /* Wildcards at the first level never match $-prefixed topics. */
+    int wildcards = !(depth == 0 && len > 0 && seg[0] == '$');
+
+    if (wildcards && node->hash && node->hash->value) fn(node->hash->value, arg);
+    if (wildcards && node->plus) match_next(node->plus, end, stop, depth, fn, arg);
+
+    if (node->child_count) {
+        uint32_t level = intern_find(seg, len);
+        if (level) {
+            int idx = child_index(node, level);
+            if (idx >= 0) match_next(node->children[idx], end, stop, depth, fn, arg);
+        }
+    }
+}
+
+/* Calls fn for the value of every stored filter that matches the topic name. */
+void trie_match(const Trie *trie, const char *topic, size_t len, TrieMatchFn fn, void *arg) {
+    match_level(&trie->root, topic, topic + len, 0, fn, arg);
+}
+
+static bool is_system_level(uint32_t level) {
+    size_t len;
+    const char *s = intern_str(level, &len);
+    return s && len > 0 && s[0] == '$';
+}
+
+static void visit_subtree(const TrieNode *node, TrieMatchFn fn, void *arg) {
+    if (node->value) fn(node->value, arg);
+    for (uint32_t i = 0; i < node->child_count; i++) {
+        visit_subtree(node->children[i], fn, arg);
+    }
+}
+
+static void filter_level(const TrieNode *node, const char *seg, int depth, TrieMatchFn fn, void *arg);
+
+static void filter_next(const TrieNode *node, const char *end, int depth, TrieMatchFn fn, void *arg) {
+    if (!end) {
+        if (node->value) fn(node->value, arg);
+        return;
+    }
+    filter_level(node, end + 1, depth + 1, fn, arg);
+}
+
+static void filter_level(const TrieNode *node, const char *seg, int depth, TrieMatchFn fn, void *arg) {
+    const char *end = strchr(seg, '/');
+    size_t len = end ? (size_t)(end - seg) : strlen(seg);
+
+    if (len == 1 && seg[0] == '#') {
+        /* "a/#" also matches "a" itself */
+        if (depth > 0 && node->value) fn(node->value, arg);
+        for (uint32_t i = 0; i < node->child_count; i++) {
+            if (depth == 0 && is_system_level(node->child_levels[i])) continue;
+            visit_subtree(node->children[i], fn, arg);
+        }
+    } else if (len == 1 && seg[0] == '+') {
+        for (uint32_t i = 0; i < node->child_count; i++) {
+            if (depth == 0 && is_system_level(node->child_levels[i])) continue;
+            filter_next(node->children[i], end, depth, fn, arg);
+        }
+    } else if (node->child_count) {
+        uint32_t level = intern_find(seg, len);
+        int idx = level ? child_index(node, level) : -1;
+        if (idx >= 0) filter_next(node->children[idx], end, depth, fn, arg);
+    }
+}
+
+/*
+ * The reverse of trie_match() for a trie of topic names: calls fn for
+ * the value of every stored name the filter matches. Only the branches
+ * the filter can reach are visited.
+ */
+void trie_match_filter(const Trie *trie, const char *filter, TrieMatchFn fn, void *arg) {
+    filter_level(&trie->root, filter, 0, fn, arg);
+}
+
+/* Calls fn for every value in the trie. */
+void trie_visit(const Trie *trie, TrieMatchFn fn, void *arg) {
+    visit_subtree(&trie->root, fn, arg);
+}
+
+bool topic_filter_valid(const char *filter) {
+    if (!filter[0] || !codec_utf8_valid((const uint8_t *)filter, strlen(filter))) return false;
+
+    const char *seg = filter;
+    for (;;) {
+        const char *end = strchr(seg, '/');
+        size_t len = end ? (size_t)(end - seg) : strlen(seg);
+
+        for (size_t i = 0; i < len; i++) {
+            if (seg[i] == '+' && len != 1) return false;
+            if (seg[i] == '#' && (len != 1 || end)) return false;
+        }
+
+        if (!end) return true;
+        seg = end + 1;
+    }
+}
+
+bool topic_name_valid(const char *name, size_t len) {
+    return len > 0 && codec_topic_valid((const uint8_t *)name, len);
+}
@@ -0,0 +1,274 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+/*
+ * The SQ array maps slot i to SQE i once at setup, so submitting is only
+ * publishing the tail. SQEs handed out since the last submit are not
+ * seen by the kernel until uring_wait() (or a full SQ) publishes them,
+ * which is what lets a whole loop iteration go out in one io_uring_enter.
+ */
+
+static int sys_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* A ring of `entries` SQEs and `cq_entries` CQEs (both powers of two, cq_entries >= entries). */
+int uring_init(Uring *r, unsigned entries, unsigned cq_entries) {
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = cq_entries;
+    int fd = sys_setup(entries, &p);
+    if (fd < 0) return -1;
+
+    /* one mapping for both rings, and waits with a timeout argument */
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+        close(fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->ring_len = sq_len > cq_len ? sq_len : cq_len;
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    uint8_t *ring = mmap(NULL, r->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        munmap(ring, r->ring_len);
+        close(fd);
+        return -1;
+    }
+
+    r->fd = fd;
+    r->ring_mem = ring;
+    r->sq_entries = p.sq_entries;
+    r->sq_head = (unsigned *)(ring + p.sq_off.head);
+    r->sq_tail = (unsigned *)(ring + p.sq_off.tail);
+    r->sq_mask = *(unsigned *)(ring + p.sq_off.ring_mask);
+    r->cq_head = (unsigned *)(ring + p.cq_off.head);
+    r->cq_tail = (unsigned *)(ring + p.cq_off.tail);
+    r->cq_mask = *(unsigned *)(ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+
+    unsigned *array = (unsigned *)(ring + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++) array[i] = i;
+    r->sqe_tail = *r->sq_tail;
+    return 0;
+}
+
+/* Registers `count` (a power of two) receive buffers of `size` bytes as buffer group `group`. */
+int uring_buffers_init(Uring *r, uint16_t group, unsigned count, unsigned size) {
+    size_t ring_len = count * sizeof(struct io_uring_buf);
+    void *ring = mmap(NULL, ring_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) return -1;
+
+    r->buf_mem = malloc((size_t)count * size);
+    if (!r->buf_mem) {
+        munmap(ring, ring_len);
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring;
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (sys_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        free(r->buf_mem);
+        r->buf_mem = NULL;
+        munmap(ring, ring_len);
+        return -1;
+    }
+
+    r->bufs = ring;
+    r->buf_count = count;
+    r->buf_size = size;
+    r->buf_group = group;
+    r->buf_tail = 0;
+    for (unsigned i = 0; i < count; i++) uring_buffer_recycle(r, (uint16_t)i);
+    return 0;
+}
+
+void uring_close(Uring *r) {
+    if (r->fd < 0) return;
+    if (r->bufs) munmap(r->bufs, r->buf_count * sizeof(struct io_uring_buf));
+    free(r->buf_mem);
+    munmap(r->sqes, r->sqes_len);
+    munmap(r->ring_mem, r->ring_len);
+    close(r->fd);
+    r->fd = -1;
+}
+
+static unsigned sq_pending(const Uring *r) {
+    return r->sqe_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+}
+
+static int submit(Uring *r) {
+    __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+    int rc;
+    do {
+        rc = sys_enter(r->fd, sq_pending(r), 0, 0, NULL, 0);
+    } while (rc < 0 && errno == EINTR);
+    return rc;
+}
+
+/* A zeroed SQE; a full SQ is submitted first. NULL if that fails. */
+static struct io_uring_sqe *get_sqe(Uring *r) {
+    if (sq_pending(r) >= r->sq_entries && (submit(r) < 0 || sq_pending(r) >= r->sq_entries)) return NULL;
+
+    struct io_uring_sqe *sqe = &r->sqes[r->sqe_tail & r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sqe_tail++;
+    return sqe;
+}
+
+/* Multishot accept: one completion per connection until it ends (no IORING_CQE_F_MORE). */
+int uring_accept(Uring *r, int listenfd, uint64_t tag) {
+    struct io_uring_sqe *sqe = get_sqe(r);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = tag;
+    return 0;
+}
+
+/* Multishot recv into the provided buffers: one completion per chunk received. */
+int uring_recv(Uring *r, int fd, uint64_t tag) {
+    struct io_uring_sqe *sqe = get_sqe(r);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = r->buf_group;
+    sqe->user_data = tag;
+    return 0;
+}
+
+/* Multishot POLLIN. */
+int uring_poll(Uring *r, int fd, uint64_t tag) {
+    struct io_uring_sqe *sqe = get_sqe(r);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = tag;
+    return 0;
+}
+
+/* One-shot POLLOUT: completes once the socket has room to write. */
+int uring_poll_out(Uring *r, int fd, uint64_t tag) {
+    struct io_uring_sqe *sqe = get_sqe(r);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = tag;
+    return 0;
+}
+
+/*
+ * Sends `msg`, which must stay put until the completion. MSG_WAITALL
+ * keeps the kernel sending while the socket has room, but sockets are
+ * non-blocking: once the buffer is full it completes short, or with
+ * -EAGAIN when nothing went out.
+ */
+int uring_sendmsg(Uring *r, int fd, const struct msghdr *msg, uint64_t tag) {
+    struct io_uring_sqe *sqe = get_sqe(r);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = tag;
+    return 0;
+}
+
+/* Cancels the request submitted with `target` as its tag; that request still completes (-ECANCELED). */
+int uring_cancel(Uring *r, uint64_t target, uint64_t tag) {
+    struct io_uring_sqe *sqe = get_sqe(r);
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = tag;
+    return 0;
+}
+
+/*
+ * Submits everything queued and waits up to timeout_ms (-1: no limit)
+ * for a completion, in one system call. Returns at once when there are
+ * completions already.
+ */
+int uring_wait(Uring *r, int timeout_ms) {
+    __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (long long)(timeout_ms % 1000) * 1000000;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+
+    unsigned wait = uring_peek(r) || timeout_ms == 0 ? 0 : 1;
+    int rc = sys_enter(r->fd, sq_pending(r), wait, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    if (rc < 0 && errno != ETIME && errno != EINTR && errno != EBUSY) return -1;
+    return 0;
+}
+
+struct io_uring_cqe *uring_peek(Uring *r) {
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &r->cqes[head & r->cq_mask];
+}
+
+void uring_seen(Uring *r) {
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* The provided buffer a recv completion filled, NULL if it used none. */
+const uint8_t *uring_buffer(const Uring *r, const struct io_uring_cqe *cqe, uint16_t *bid) {
+    if (!(cqe->flags & IORING_CQE_F_BUFFER)) return NULL;
+    *bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    return r->buf_mem + (size_t)*bid * r->buf_size;
+}
+
+/* Gives a buffer back to the kernel once its contents have been copied out. */
+void uring_buffer_recycle(Uring *r, uint16_t bid) {
+    struct io_uring_buf *b = &r->bufs->bufs[r->buf_tail & (r->buf_count - 1)];
+    b->addr = (uint64_t)(uintptr_t)(r->buf_mem + (size_t)bid * r->buf_size);
+    b->len = r->buf_size;
+    b->bid = bid;
+    r->buf_tail++;
+    __atomic_store_n(&r->bufs->tail, r->buf_tail, __ATOMIC_RELEASE);
+}
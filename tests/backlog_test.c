@@ -0,0 +1,193 @@
+/**
+ * backlog_test.c
+ *
+ * QoS 1 subscribers that stop reading while a publisher sends four times
+ * INFLIGHT_PENDING_MAX messages past their window. Every message must
+ * still arrive, once and in order, when they read again:
+ *
+ *  - a clean session's backlog pauses the publisher (its PUBACKs stop
+ *    until the subscriber catches up);
+ *  - a persistent session's backlog goes to the store instead, so the
+ *    publisher is never held back;
+ *  - so does everything queued for an offline persistent session, which
+ *    gets it all after a broker restart (its id and filter are longer
+ *    than the store once restored).
+ *
+ * Retained messages reach a new subscription without a publisher to
+ * pause, so a clean session's queue stops at INFLIGHT_QUEUE_LIMIT.
+ */
+
+#include "mqtt_test.h"
+#include "config.h"
+
+#define MESSAGES (4 * INFLIGHT_PENDING_MAX)
+#define PAYLOAD 64
+#define STALL_MS 1500
+
+static uint8_t *publishes(const char *topic, size_t *len) {
+    uint8_t *buf = malloc((size_t)MESSAGES * (PAYLOAD + strlen(topic) + 16));
+    uint8_t payload[PAYLOAD];
+    size_t n = 0;
+
+    CHECK(buf, "out of memory");
+    memset(payload, 'x', sizeof(payload));
+    for (uint32_t i = 0; i < MESSAGES; i++) {
+        memcpy(payload, &i, sizeof(i));
+        n += test_publish_packet(&buf[n], topic, 1, (uint16_t)(i % 0xFFFF + 1), payload, sizeof(payload));
+    }
+    *len = n;
+    return buf;
+}
+
+/* Reads all MESSAGES publishes, acknowledging each, and checks they come in publishing order. */
+static void receive_all(int fd, const char *what) {
+    uint8_t type, body[PAYLOAD + 256];
+
+    for (uint32_t i = 0; i < MESSAGES; i++) {
+        long len = test_read_packet(fd, &type, body, sizeof(body), 5000);
+        CHECK(len > 0, "%s: message %u of %u never arrived", what, i, MESSAGES);
+        CHECK((type & 0xF6) == 0x32, "%s: packet type 0x%02x instead of a QoS 1 PUBLISH", what, type);
+
+        size_t pos = 2 + (size_t)(body[0] << 8 | body[1]);
+        uint16_t id = (uint16_t)(body[pos] << 8 | body[pos + 1]);
+        uint32_t index;
+        CHECK((size_t)len >= pos + 2 + sizeof(index), "%s: short PUBLISH", what);
+        memcpy(&index, &body[pos + 2], sizeof(index));
+        test_puback(fd, id);
+        CHECK(index == i, "%s: got message %u where %u was due", what, index, i);
+    }
+}
+
+static void clean_subscriber_pauses_publisher(void) {
+    size_t len;
+    uint8_t *data = publishes("backlog/clean", &len);
+    int sub = test_connect("backlog-clean-sub", true, 4096);
+    test_subscribe(sub, "backlog/clean", 1);
+    int pub = test_connect("backlog-clean-pub", true, 0);
+
+    TestPublisher p;
+    test_publisher_start(&p, pub, data, len, MESSAGES);
+    test_sleep_ms(STALL_MS);
+    unsigned acked = atomic_load(&p.acked);
+    CHECK(acked < MESSAGES, "clean session: publisher not held back by a stalled subscriber");
+
+    receive_all(sub, "clean session");
+    test_publisher_join(&p);
+    CHECK(atomic_load(&p.acked) == MESSAGES, "clean session: %u of %u PUBACKs", atomic_load(&p.acked), MESSAGES);
+    printf("clean session: %u of %u acknowledged while stalled, all %u delivered\n", acked, MESSAGES, MESSAGES);
+
+    test_disconnect(pub);
+    test_disconnect(sub);
+    free(data);
+}
+
+static void persistent_subscriber_spills(void) {
+    size_t len;
+    uint8_t *data = publishes("backlog/kept", &len);
+    int sub = test_connect("backlog-kept-sub", false, 4096);
+    test_subscribe(sub, "backlog/kept", 1);
+    int pub = test_connect("backlog-kept-pub", true, 0);
+
+    TestPublisher p;
+    test_publisher_start(&p, pub, data, len, MESSAGES);
+    test_publisher_join(&p);
+    CHECK(atomic_load(&p.acked) == MESSAGES, "persistent session: publisher held back (%u of %u PUBACKs)",
+          atomic_load(&p.acked), MESSAGES);
+
+    receive_all(sub, "persistent session");
+    printf("persistent session: publisher never paused, all %u delivered\n", MESSAGES);
+
+    test_disconnect(pub);
+    test_disconnect(sub);
+    free(data);
+}
+
+static void offline_session_survives_restart(void) {
+    char id[101], topic[161];
+    memset(id, 'i', sizeof(id) - 1);
+    id[sizeof(id) - 1] = '\0';
+    snprintf(topic, sizeof(topic), "backlog/offline/%0144d", 0);
+
+    size_t len;
+    uint8_t *data = publishes(topic, &len);
+    int sub = test_connect(id, false, 0);
+    test_subscribe(sub, topic, 1);
+    test_disconnect(sub);
+    int pub = test_connect("backlog-offline-pub", true, 0);
+
+    TestPublisher p;
+    test_publisher_start(&p, pub, data, len, MESSAGES);
+    test_publisher_join(&p);
+    CHECK(atomic_load(&p.acked) == MESSAGES, "offline session: publisher held back (%u of %u PUBACKs)",
+          atomic_load(&p.acked), MESSAGES);
+    test_disconnect(pub);
+
+    test_broker_stop();
+    test_broker_start();
+    sub = test_connect(id, false, 4096);
+    receive_all(sub, "offline session");
+
+    /* the subscription came back too */
+    uint8_t payload[PAYLOAD], type, body[PAYLOAD + 256];
+    memset(payload, 'y', sizeof(payload));
+    pub = test_connect("backlog-offline-pub", true, 0);
+    len = test_publish_packet(data, topic, 0, 0, payload, sizeof(payload));
+    test_write(pub, data, len);
+    CHECK(test_read_packet(sub, &type, body, sizeof(body), 5000) > 0 && (type & 0xF0) == 0x30,
+          "offline session: subscription lost in the restart");
+    printf("offline session: all %u delivered after a restart\n", MESSAGES);
+
+    test_disconnect(pub);
+    test_disconnect(sub);
+    free(data);
+}
+
+static void clean_queue_is_capped(void) {
+    const unsigned retained = INFLIGHT_WINDOW + INFLIGHT_QUEUE_LIMIT + 100;
+    uint8_t *data = malloc((size_t)retained * 64), payload[8] = "retained";
+    size_t len = 0;
+
+    CHECK(data, "out of memory");
+    for (unsigned i = 0; i < retained; i++) {
+        char topic[32];
+        snprintf(topic, sizeof(topic), "backlog/retained/%u", i);
+        size_t n = test_publish_packet(&data[len], topic, 1, (uint16_t)(i % 0xFFFF + 1), payload, sizeof(payload));
+        data[len] |= 0x01;
+        len += n;
+    }
+    int pub = test_connect("backlog-retained-pub", true, 0);
+    TestPublisher p;
+    test_publisher_start(&p, pub, data, len, retained);
+    test_publisher_join(&p);
+    CHECK(atomic_load(&p.acked) == retained, "retained: %u of %u PUBACKs", atomic_load(&p.acked), retained);
+
+    int sub = test_connect("backlog-retained-sub", true, 0);
+    test_subscribe(sub, "backlog/retained/#", 1);
+    uint8_t type, body[64];
+    unsigned got = 0;
+    long n;
+    while ((n = test_read_packet(sub, &type, body, sizeof(body), 1000)) > 0) {
+        CHECK((type & 0xF7) == 0x33, "retained: packet type 0x%02x instead of a retained QoS 1 PUBLISH", type);
+        size_t pos = 2 + (size_t)(body[0] << 8 | body[1]);
+        test_puback(sub, (uint16_t)(body[pos] << 8 | body[pos + 1]));
+        got++;
+    }
+    CHECK(got == INFLIGHT_WINDOW + INFLIGHT_QUEUE_LIMIT, "retained: %u of %u delivered to a clean session, expected %u",
+          got, retained, INFLIGHT_WINDOW + INFLIGHT_QUEUE_LIMIT);
+    printf("clean session: %u of %u retained messages queued, the rest dropped\n", got, retained);
+
+    test_disconnect(pub);
+    test_disconnect(sub);
+    free(data);
+}
+
+int main(void) {
+    test_broker_start();
+    clean_subscriber_pauses_publisher();
+    persistent_subscriber_spills();
+    offline_session_survives_restart();
+    clean_queue_is_capped();
+    test_broker_stop();
+    printf("backlog_test: OK\n");
+    return 0;
+}
@@ -0,0 +1,83 @@
+/**
+ * cluster_test.c
+ *
+ * Two nodes in a cluster: a publish on one reaches subscribers on the
+ * other exactly once, even when the subscribers' filters overlap (the
+ * link between the nodes then holds a subscription per filter), and a
+ * publish that came over a link is not sent back over it.
+ */
+
+#include "mqtt_test.h"
+
+#define MESSAGES 5
+#define QUIET_MS 500
+
+/* Reads QoS 0 publishes until `fd` stays quiet; returns how many arrived. */
+static int drain(int fd) {
+    uint8_t type, body[256];
+    int count = 0;
+    while (test_read_packet(fd, &type, body, sizeof(body), QUIET_MS) >= 0) {
+        CHECK((type & 0xF0) == 0x30, "packet type 0x%02x instead of a PUBLISH", type);
+        count++;
+    }
+    return count;
+}
+
+int main(void) {
+    uint8_t packet[256], type, body[256];
+
+    test_nodes_start(2);
+
+    test_use_node(1);
+    int wide = test_connect("cluster-sub-wide", true, 0);
+    int narrow = test_connect("cluster-sub-narrow", true, 0);
+    int both = test_connect("cluster-sub-both", true, 0);
+    test_subscribe(wide, "a/#", 0);
+    test_subscribe(narrow, "a/+", 0);
+    test_subscribe(both, "a/#", 0);
+    test_subscribe(both, "a/+", 0);
+
+    test_use_node(0);
+    int local = test_connect("cluster-sub-local", true, 0);
+    test_subscribe(local, "a/#", 0);
+    int pub = test_connect("cluster-pub", true, 0);
+
+    /* Node 1's interest reaches node 0 asynchronously: probe until it has. */
+    size_t len = test_publish_packet(packet, "a/probe", 0, 0, (const uint8_t *)"probe", 5);
+    uint64_t deadline = test_now_ms() + TEST_TIMEOUT_MS;
+    do {
+        CHECK(test_now_ms() < deadline, "node 1 never received a publish from node 0");
+        test_write(pub, packet, len);
+    } while (test_read_packet(wide, &type, body, sizeof(body), 100) < 0);
+    drain(wide);
+    drain(narrow);
+    drain(both);
+    drain(local);
+
+    for (int m = 0; m < MESSAGES; m++) {
+        char payload[16];
+        int n = snprintf(payload, sizeof(payload), "m%d", m);
+        len = test_publish_packet(packet, "a/b", 0, 0, (const uint8_t *)payload, (size_t)n);
+        test_write(pub, packet, len);
+    }
+
+    int got = drain(wide);
+    CHECK(got == MESSAGES, "a/# subscriber on node 1 got %d copies of %d messages", got, MESSAGES);
+    got = drain(narrow);
+    CHECK(got == MESSAGES, "a/+ subscriber on node 1 got %d copies of %d messages", got, MESSAGES);
+    got = drain(both);
+    CHECK(got >= MESSAGES && got <= 2 * MESSAGES,
+          "a/# + a/+ subscriber on node 1 got %d copies of %d messages", got, MESSAGES);
+    got = drain(local);
+    CHECK(got == MESSAGES, "subscriber on node 0 got %d copies of %d messages", got, MESSAGES);
+    printf("cluster: %d messages reached overlapping subscribers on the other node once each\n", MESSAGES);
+
+    test_disconnect(pub);
+    test_disconnect(local);
+    test_disconnect(both);
+    test_disconnect(narrow);
+    test_disconnect(wide);
+    test_broker_stop();
+    printf("cluster_test: OK\n");
+    return 0;
+}
@@ -0,0 +1,362 @@
+/**
+ * mqtt_test.h
+ *
+ * Shared by the programs in tests/: each one starts its own broker, or
+ * a small cluster of them (bin/broker, or the path in BROKER), in
+ * scratch directories on free ports, drives them over plain MQTT 3.1.1
+ * sockets and exits non-zero on the first failed check, which keeps
+ * the directories for a look at the brokers' logs and stores.
+ * BROKER_IO_BACKEND is passed on to the brokers.
+ */
+
+#ifndef MQTT_TEST_H
+#define MQTT_TEST_H
+
+#include <errno.h>
+#include <ftw.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TEST_TIMEOUT_MS 30000
+#define TEST_MAX_NODES 3
+
+/* One broker process, with its own scratch directory and port. */
+typedef struct {
+    char dir[64];
+    int port;
+    pid_t pid;
+} TestNode;
+
+static TestNode test_nodes[TEST_MAX_NODES];
+static int test_node_count;
+static char test_broker_path[PATH_MAX];
+static char test_peers[TEST_MAX_NODES * 24];   /* BROKER_CLUSTER_PEERS of a cluster, empty for one node */
+static int test_port;                          /* the node the helpers below talk to */
+static bool test_failed;
+
+#define CHECK(cond, ...)                                                        \
+    do {                                                                        \
+        if (!(cond)) {                                                          \
+            fprintf(stderr, "FAIL %s:%d: ", __FILE__, __LINE__);                \
+            fprintf(stderr, __VA_ARGS__);                                       \
+            fprintf(stderr, "\n");                                              \
+            test_failed = true;                                                 \
+            test_broker_stop();                                                 \
+            exit(1);                                                            \
+        }                                                                       \
+    } while (0)
+
+static inline uint64_t test_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static inline void test_sleep_ms(int ms) {
+    struct timespec ts = { ms / 1000, (long)(ms % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+}
+
+/* Stops every node that is running; their directories stay for a restart. */
+static inline void test_broker_stop(void) {
+    for (int i = 0; i < test_node_count; i++) {
+        if (test_nodes[i].pid <= 0) continue;
+        kill(test_nodes[i].pid, SIGTERM);
+        waitpid(test_nodes[i].pid, NULL, 0);
+        test_nodes[i].pid = -1;
+    }
+}
+
+static inline int test_remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+/* At exit: stops the nodes and removes their directories, unless a check failed. */
+static inline void test_cleanup(void) {
+    test_broker_stop();
+    for (int i = 0; i < test_node_count; i++) {
+        if (test_failed) fprintf(stderr, "broker directory kept in %s\n", test_nodes[i].dir);
+        else nftw(test_nodes[i].dir, test_remove_entry, 8, FTW_DEPTH | FTW_PHYS);
+    }
+}
+
+/* Points the helpers at node `i`. */
+static inline void test_use_node(int i) {
+    test_port = test_nodes[i].port;
+}
+
+static inline int test_dial(void) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(test_port) };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Starts `count` nodes with two workers each, in scratch directories
+ * that survive restarts (so does each session store), and with more than
+ * one as a cluster of all of them; returns once every node accepts
+ * connections, with the helpers talking to the first. The metrics
+ * endpoint is off, so nodes do not compete for its port.
+ */
+static inline void test_nodes_start(int count) {
+    if (!test_node_count) {
+        const char *path = getenv("BROKER") ? getenv("BROKER") : "bin/broker";
+        CHECK(realpath(path, test_broker_path), "no broker at %s", path);
+        for (int i = 0; i < count; i++) {
+            TestNode *n = &test_nodes[i];
+            snprintf(n->dir, sizeof(n->dir), "/tmp/broker-test-XXXXXX");
+            CHECK(mkdtemp(n->dir), "mkdtemp: %s", strerror(errno));
+            n->port = 20000 + (getpid() * TEST_MAX_NODES + i) % 20000;
+            n->pid = -1;
+            if (count > 1) {
+                size_t len = strlen(test_peers);
+                snprintf(test_peers + len, sizeof(test_peers) - len, "%s127.0.0.1:%d", i ? "," : "", n->port);
+            }
+        }
+        test_node_count = count;
+        atexit(test_cleanup);
+    }
+
+    fflush(stdout);
+    for (int i = 0; i < test_node_count; i++) {
+        TestNode *n = &test_nodes[i];
+        n->pid = fork();
+        CHECK(n->pid >= 0, "fork: %s", strerror(errno));
+        if (n->pid == 0) {
+            char port[16];
+            snprintf(port, sizeof(port), "%d", n->port);
+            if (chdir(n->dir) < 0) _exit(127);
+            mkdir("logs", 0755);
+            mkdir("state", 0755);
+            if (!freopen("/dev/null", "w", stdout)) _exit(127);
+            setenv("BROKER_METRICS_PORT", "0", 1);
+            if (test_peers[0]) setenv("BROKER_CLUSTER_PEERS", test_peers, 1);
+            execl(test_broker_path, test_broker_path, port, "2", (char *)NULL);
+            _exit(127);
+        }
+    }
+
+    for (int i = test_node_count - 1; i >= 0; i--) {
+        test_use_node(i);
+        int fd = -1;
+        for (int tries = 0; tries < 100 && fd < 0; tries++) {
+            fd = test_dial();
+            if (fd < 0) test_sleep_ms(50);
+        }
+        CHECK(fd >= 0, "broker did not start on port %d", test_port);
+        close(fd);
+    }
+}
+
+/* A single broker; called again after test_broker_stop(), it restarts it in the same directory. */
+static inline void test_broker_start(void) {
+    test_nodes_start(1);
+}
+
+static inline void test_write(int fd, const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        CHECK(n > 0, "send: %s", strerror(errno));
+        p += n;
+        len -= (size_t)n;
+    }
+}
+
+static inline bool test_read_exact(int fd, uint8_t *buf, size_t len, uint64_t deadline) {
+    while (len > 0) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        uint64_t now = test_now_ms();
+        if (now >= deadline || poll(&pfd, 1, (int)(deadline - now)) <= 0) return false;
+        ssize_t n = recv(fd, buf, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        buf += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+/* Reads one packet into `buf`; returns its body length, or -1 on timeout, EOF or overflow. */
+static inline long test_read_packet(int fd, uint8_t *type, uint8_t *buf, size_t cap, int timeout_ms) {
+    uint64_t deadline = test_now_ms() + (uint64_t)timeout_ms;
+    uint8_t byte;
+    size_t len = 0;
+
+    if (!test_read_exact(fd, type, 1, deadline)) return -1;
+    for (int shift = 0; shift < 28; shift += 7) {
+        if (!test_read_exact(fd, &byte, 1, deadline)) return -1;
+        len |= (size_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) break;
+    }
+    if (len > cap || !test_read_exact(fd, buf, len, deadline)) return -1;
+    return (long)len;
+}
+
+static inline size_t test_put_length(uint8_t *p, size_t len) {
+    size_t n = 0;
+    do {
+        uint8_t byte = len & 0x7F;
+        len >>= 7;
+        p[n++] = byte | (len ? 0x80 : 0);
+    } while (len);
+    return n;
+}
+
+/* A QoS 0/1 PUBLISH into `out`; returns its size. */
+static inline size_t test_publish_packet(uint8_t *out, const char *topic, uint8_t qos, uint16_t id,
+                                  const uint8_t *payload, size_t len) {
+    size_t topic_len = strlen(topic);
+    size_t n = 0;
+    out[n++] = 0x30 | qos << 1;
+    n += test_put_length(&out[n], 2 + topic_len + (qos ? 2 : 0) + len);
+    out[n++] = (uint8_t)(topic_len >> 8);
+    out[n++] = (uint8_t)topic_len;
+    memcpy(&out[n], topic, topic_len);
+    n += topic_len;
+    if (qos) {
+        out[n++] = (uint8_t)(id >> 8);
+        out[n++] = (uint8_t)id;
+    }
+    memcpy(&out[n], payload, len);
+    return n + len;
+}
+
+/* Connects as `id` (MQTT 3.1.1); `rcvbuf` > 0 shrinks the socket's receive buffer first. */
+static inline int test_connect(const char *id, bool clean, int rcvbuf) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(test_port) };
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    CHECK(fd >= 0, "socket: %s", strerror(errno));
+    if (rcvbuf > 0) setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    CHECK(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0, "connect: %s", strerror(errno));
+
+    uint8_t pkt[256];
+    size_t id_len = strlen(id), n = 0;
+    pkt[n++] = 0x10;
+    n += test_put_length(&pkt[n], 10 + 2 + id_len);
+    memcpy(&pkt[n], "\0\4MQTT\4", 7);
+    n += 7;
+    pkt[n++] = clean ? 0x02 : 0x00;
+    pkt[n++] = 0;               /* keep alive 60 s */
+    pkt[n++] = 60;
+    pkt[n++] = (uint8_t)(id_len >> 8);
+    pkt[n++] = (uint8_t)id_len;
+    memcpy(&pkt[n], id, id_len);
+    test_write(fd, pkt, n + id_len);
+
+    uint8_t type, body[4];
+    long len = test_read_packet(fd, &type, body, sizeof(body), 5000);
+    CHECK(len == 2 && type == 0x20 && body[1] == 0, "CONNECT of %s refused", id);
+    return fd;
+}
+
+static inline void test_subscribe(int fd, const char *filter, uint8_t qos) {
+    uint8_t pkt[256];
+    size_t len = strlen(filter), n = 0;
+    pkt[n++] = 0x82;
+    n += test_put_length(&pkt[n], 2 + 2 + len + 1);
+    pkt[n++] = 0;
+    pkt[n++] = 1;
+    pkt[n++] = (uint8_t)(len >> 8);
+    pkt[n++] = (uint8_t)len;
+    memcpy(&pkt[n], filter, len);
+    n += len;
+    pkt[n++] = qos;
+    test_write(fd, pkt, n);
+
+    uint8_t type, body[8];
+    long got = test_read_packet(fd, &type, body, sizeof(body), 5000);
+    CHECK(got == 3 && type == 0x90 && body[2] == qos, "SUBSCRIBE to %s refused", filter);
+}
+
+static inline void test_puback(int fd, uint16_t id) {
+    uint8_t pkt[4] = { 0x40, 2, (uint8_t)(id >> 8), (uint8_t)id };
+    test_write(fd, pkt, sizeof(pkt));
+}
+
+static inline void test_disconnect(int fd) {
+    uint8_t pkt[2] = { 0xE0, 0 };
+    test_write(fd, pkt, sizeof(pkt));
+    close(fd);
+}
+
+/*
+ * Writes a run of publishes and counts the PUBACKs that come back, on a
+ * thread of its own: a publisher the broker stops reading would block
+ * a single-threaded test.
+ */
+typedef struct {
+    int fd;
+    const uint8_t *data;
+    size_t len;
+    unsigned expected;      /* PUBACKs that end the run */
+    atomic_uint acked;
+    atomic_bool done;
+    pthread_t thread;
+} TestPublisher;
+
+static inline void *test_publisher_thread(void *arg) {
+    TestPublisher *p = arg;
+    uint64_t deadline = test_now_ms() + TEST_TIMEOUT_MS;
+    size_t sent = 0;
+    uint8_t type, body[4];
+
+    while (atomic_load(&p->acked) < p->expected && test_now_ms() < deadline) {
+        struct pollfd pfd = { .fd = p->fd, .events = POLLIN | (sent < p->len ? POLLOUT : 0) };
+        if (poll(&pfd, 1, 100) <= 0) continue;
+        if (pfd.revents & POLLOUT) {
+            ssize_t n = send(p->fd, p->data + sent, p->len - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n > 0) sent += (size_t)n;
+        }
+        if (pfd.revents & POLLIN) {
+            if (test_read_packet(p->fd, &type, body, sizeof(body), 5000) < 0) break;
+            if (type == 0x40) atomic_fetch_add(&p->acked, 1);
+        }
+    }
+    atomic_store(&p->done, true);
+    return NULL;
+}
+
+static inline void test_publisher_start(TestPublisher *p, int fd, const uint8_t *data, size_t len, unsigned expected) {
+    p->fd = fd;
+    p->data = data;
+    p->len = len;
+    p->expected = expected;
+    atomic_init(&p->acked, 0);
+    atomic_init(&p->done, false);
+    CHECK(pthread_create(&p->thread, NULL, test_publisher_thread, p) == 0, "pthread_create");
+}
+
+static inline void test_publisher_join(TestPublisher *p) {
+    pthread_join(p->thread, NULL);
+}
+
+#endif
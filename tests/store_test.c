@@ -0,0 +1,121 @@
+/**
+ * store_test.c
+ *
+ * A persistent session's backlog through the session store: a stalled
+ * QoS 1 subscriber has most of its messages left in the store, enough
+ * other traffic then goes through that the segments holding them are
+ * compacted, and the subscriber reads half of them back from the
+ * compacted log, the rest after a broker restart. Every message must
+ * arrive once, in order.
+ */
+
+#include "mqtt_test.h"
+#include "config.h"
+
+#define MESSAGES (4 * INFLIGHT_PENDING_MAX)
+#define PAYLOAD 64
+#define FILL_PAYLOAD (64 * 1024)
+#define FILL_MESSAGES ((STORE_COMPACT_SEGMENTS + 1) * (STORE_SEGMENT_SIZE / FILL_PAYLOAD) + 64)
+
+/* `count` QoS 1 publishes to `topic`, each payload starting with its index. */
+static uint8_t *publishes(const char *topic, uint32_t count, size_t payload_len, size_t *len) {
+    uint8_t *buf = malloc((size_t)count * (payload_len + strlen(topic) + 16));
+    uint8_t *payload = calloc(1, payload_len);
+    size_t n = 0;
+
+    CHECK(buf && payload, "out of memory");
+    for (uint32_t i = 0; i < count; i++) {
+        memcpy(payload, &i, sizeof(i));
+        n += test_publish_packet(&buf[n], topic, 1, (uint16_t)(i % 0xFFFF + 1), payload, payload_len);
+    }
+    free(payload);
+    *len = n;
+    return buf;
+}
+
+/*
+ * Reads messages [from, to) of a run, acknowledging each, and checks they
+ * come in publishing order. Messages before `from` may come again first:
+ * acks still unread by the broker when the previous connection closed
+ * are lost with it, and QoS 1 is at least once.
+ */
+static void receive(int fd, uint32_t from, uint32_t to, const char *what) {
+    static uint8_t body[FILL_PAYLOAD + 256];
+    uint8_t type;
+
+    for (uint32_t i = from; i < to; i++) {
+        long len = test_read_packet(fd, &type, body, sizeof(body), 5000);
+        CHECK(len > 0, "%s: message %u of %u never arrived", what, i, to);
+        CHECK((type & 0xF0) == 0x30 && (type & 0x06) == 0x02, "%s: packet type 0x%02x instead of a QoS 1 PUBLISH",
+              what, type);
+
+        size_t pos = 2 + (size_t)(body[0] << 8 | body[1]);
+        uint16_t id = (uint16_t)(body[pos] << 8 | body[pos + 1]);
+        uint32_t index;
+        CHECK((size_t)len >= pos + 2 + sizeof(index), "%s: short PUBLISH", what);
+        memcpy(&index, &body[pos + 2], sizeof(index));
+        test_puback(fd, id);
+        if (i == from && index < from) {
+            i--;
+            continue;
+        }
+        CHECK(index == i, "%s: got message %u where %u was due", what, index, i);
+    }
+}
+
+/* Waits for the broker's log to report a compaction. */
+static void wait_for_compaction(void) {
+    char path[128], line[512];
+    snprintf(path, sizeof(path), "%s/logs/broker.log", test_nodes[0].dir);
+
+    for (uint64_t deadline = test_now_ms() + TEST_TIMEOUT_MS; test_now_ms() < deadline; test_sleep_ms(100)) {
+        FILE *f = fopen(path, "r");
+        bool found = false;
+        while (f && !found && fgets(line, sizeof(line), f)) found = strstr(line, "Compacted") != NULL;
+        if (f) fclose(f);
+        if (found) return;
+    }
+    CHECK(false, "the store was never compacted");
+}
+
+int main(void) {
+    size_t len;
+
+    test_broker_start();
+
+    uint8_t *data = publishes("store/kept", MESSAGES, PAYLOAD, &len);
+    int sub = test_connect("store-kept-sub", false, 4096);
+    test_subscribe(sub, "store/kept", 1);
+    int pub = test_connect("store-pub", true, 0);
+    TestPublisher p;
+    test_publisher_start(&p, pub, data, len, MESSAGES);
+    test_publisher_join(&p);
+    CHECK(atomic_load(&p.acked) == MESSAGES, "backlog: %u of %u PUBACKs", atomic_load(&p.acked), MESSAGES);
+    free(data);
+
+    /* push the segments holding the backlog into a compaction */
+    data = publishes("store/fill", FILL_MESSAGES, FILL_PAYLOAD, &len);
+    int fill = test_connect("store-fill-sub", false, 0);
+    test_subscribe(fill, "store/fill", 1);
+    test_publisher_start(&p, pub, data, len, FILL_MESSAGES);
+    receive(fill, 0, FILL_MESSAGES, "fill");
+    test_publisher_join(&p);
+    free(data);
+    wait_for_compaction();
+
+    receive(sub, 0, MESSAGES / 2, "after compaction");
+    test_disconnect(sub);
+    test_disconnect(fill);
+    test_disconnect(pub);
+
+    test_broker_stop();
+    test_broker_start();
+    sub = test_connect("store-kept-sub", false, 4096);
+    receive(sub, MESSAGES / 2, MESSAGES, "after restart");
+    printf("store: %u messages read back across a compaction and a restart, in order\n", MESSAGES);
+
+    test_disconnect(sub);
+    test_broker_stop();
+    printf("store_test: OK\n");
+    return 0;
+}